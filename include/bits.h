@@ -160,6 +160,14 @@ template <> uint clz<uint>(uint v) { return clz_u32(v); }
 template <> uint ctz<uint>(uint v) { return ctz_u32(v); }
 template <> uint popcnt<uint>(uint v) { return popcnt_u32(v); }
 template <> uint ispow2<uint>(uint v) { return ispow2_u32(v); }
+template <> uint clz<long>(long v) { return clz_ulong(v); }
+template <> uint ctz<long>(long v) { return ctz_ulong(v); }
+template <> uint popcnt<long>(long v) { return popcnt_ulong(v); }
+template <> uint ispow2<long>(long v) { return ispow2_ulong(v); }
+template <> uint clz<ulong>(ulong v) { return clz_ulong(v); }
+template <> uint ctz<ulong>(ulong v) { return ctz_ulong(v); }
+template <> uint popcnt<ulong>(ulong v) { return popcnt_ulong(v); }
+template <> uint ispow2<ulong>(ulong v) { return ispow2_ulong(v); }
 template <> uint clz<llong>(llong v) { return clz_u64(v); }
 template <> uint ctz<llong>(llong v) { return ctz_u64(v); }
 template <> uint popcnt<llong>(llong v) { return popcnt_u64(v); }
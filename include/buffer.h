@@ -18,10 +18,16 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 #include <stdatomic.h>
 
+#if defined _WIN32
+#include <malloc.h>
+#endif
+
 #include "bits.h"
 
 typedef unsigned long long ullong;
@@ -47,6 +53,8 @@ typedef io_span (io_read_lock_fn)(io_buffer *io, size_t len);
 typedef io_span (io_write_lock_fn)(io_buffer *io, size_t len);
 typedef int (io_read_commit_fn)(io_buffer *io, io_span ticket);
 typedef int (io_write_commit_fn)(io_buffer *io, io_span ticket);
+typedef size_t (io_read_avail_fn)(io_buffer *io);
+typedef size_t (io_write_avail_fn)(io_buffer *io);
 
 struct io_buffer_ops
 {
@@ -56,6 +64,8 @@ struct io_buffer_ops
     io_write_lock_fn *write_lock;
     io_read_commit_fn *read_commit;
     io_write_commit_fn *write_commit;
+    io_read_avail_fn *read_avail;
+    io_write_avail_fn *write_avail;
 };
 
 struct io_buffer
@@ -93,6 +103,16 @@ static int io_buffer_write_commit(io_buffer *io, io_span ticket)
     return io->ops->write_commit(io, ticket); 
 }
 
+static size_t io_buffer_read_avail(io_buffer *io)
+{
+    return io->ops->read_avail(io);
+}
+
+static size_t io_buffer_write_avail(io_buffer *io)
+{
+    return io->ops->write_avail(io);
+}
+
 /*
  * pipe buffer debug
  */
@@ -107,6 +127,93 @@ static int io_buffer_write_commit(io_buffer *io, io_span ticket)
 #define pb_debugf(fmt,...)
 #endif
 
+/*
+ * ring copy used when resizing
+ *
+ * copies len bytes starting at logical offset src_off in a ring of
+ * capacity src_cap to logical offset dst_off in a ring of capacity
+ * dst_cap, splitting at the wrap point of either ring.
+ */
+
+#define PB_GROW_THRESHOLD 64
+#define PB_GROW_SHORT 4
+#define PB_GROW_CHECKS 1024
+
+static void pb_copy_ring(char *dst, size_t dst_cap, ullong dst_off,
+    const char *src, size_t src_cap, ullong src_off, size_t len)
+{
+    while (len > 0) {
+        size_t so = (size_t)(src_off & (src_cap - 1));
+        size_t d_o = (size_t)(dst_off & (dst_cap - 1));
+        size_t n = len;
+        if (n > src_cap - so) n = src_cap - so;
+        if (n > dst_cap - d_o) n = dst_cap - d_o;
+        memcpy(dst + d_o, src + so, n);
+        src_off += n;
+        dst_off += n;
+        len -= n;
+    }
+}
+
+/*
+ * ring storage
+ *
+ * ring arrays are aligned to PB_DATA_ALIGN, so a span that starts at a
+ * sequence that is a multiple of a power of two element size up to
+ * PB_DATA_ALIGN is aligned to the element size.
+ */
+
+#define PB_DATA_ALIGN 64
+
+static char *pb_data_alloc(size_t capacity)
+{
+#if defined _WIN32
+    return (char*)_aligned_malloc(capacity, PB_DATA_ALIGN);
+#else
+    return (char*)aligned_alloc(PB_DATA_ALIGN,
+        (capacity + PB_DATA_ALIGN - 1) & ~(size_t)(PB_DATA_ALIGN - 1));
+#endif
+}
+
+static void pb_data_free(char *data)
+{
+#if defined _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+/*
+ * two part spans
+ *
+ * the lock_all functions reserve a range that may cross the end of the
+ * ring and describe it with two spans, the head segment up to the end of
+ * the array and the segment wrapped to its start, which is empty when
+ * the range does not wrap. the range is committed as a single ticket.
+ */
+
+static void pb_span_split(io_span span[2], char *data, size_t cap,
+    size_t seq, size_t len)
+{
+    size_t off = seq & (cap - 1);
+    size_t head = len < cap - off ? len : cap - off;
+
+    span[0].buf = data + off;
+    span[0].length = head;
+    span[0].sequence = seq;
+    span[1].buf = data;
+    span[1].length = len - head;
+    span[1].sequence = seq + head;
+}
+
+static io_span pb_span_join(io_span span[2])
+{
+    io_span ticket = { span[0].buf, span[0].length + span[1].length,
+        span[0].sequence };
+    return ticket;
+}
+
 /*
  * single producer single consumer pipe buffer
  *
@@ -125,24 +232,36 @@ struct pbs_buffer
     char *data;
     atomic_pbs_uoffset start;
     atomic_pbs_uoffset end;
+    char *old_data;
+    pbs_uoffset old_end;
+    size_t max_capacity;
+    size_t full_count;
 };
 
-static io_buffer_ops pbs_ops;
+/* the ops table is defined at the end, C++ has no tentative definitions */
+static io_buffer_ops *pbs_buffer_ops(void);
+static int pbs_buffer_full(pbs_buffer *pb, size_t cap);
 
 static void pbs_buffer_init(pbs_buffer *pb, size_t capacity)
 {
     assert(ispow2(capacity));
-    pb->io.ops = &pbs_ops;
+    pb->io.ops = pbs_buffer_ops();
     pb->start = 0;
     pb->end = 0;
     pb->capacity = capacity;
-    pb->data = (char*)malloc(capacity);
+    pb->data = pb_data_alloc(capacity);
+    pb->old_data = NULL;
+    pb->old_end = 0;
+    pb->max_capacity = 0;
+    pb->full_count = 0;
     memset(pb->data, 0, capacity);
 }
 
 static void pbs_buffer_destroy(pbs_buffer *pb)
 {
-    free(pb->data);
+    pb_data_free(pb->old_data);
+    pb_data_free(pb->data);
+    pb->old_data = NULL;
     pb->data = NULL;
 }
 
@@ -154,6 +273,7 @@ static size_t pbs_buffer_capacity(pbs_buffer *pb)
 static size_t pbs_buffer_read(pbs_buffer *pb, char *buf, size_t len)
 {
     pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
+    char *data;
 
     /*                  start                   end                       *
      *                  |       start           |       end               *
@@ -165,12 +285,22 @@ static size_t pbs_buffer_read(pbs_buffer *pb, char *buf, size_t len)
 
     if (len == 0) return 0;
 
-    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+retry:
+    /* capacity is zero while the producer resizes the buffer */
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
     mask = cap - 1;
+    if (cap == 0) return 0;
 
     /* fetch buffer markers */
     start = atomic_load_explicit(&pb->start, memory_order_acquire);
-    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+
+    /* the data pointer matches cap if capacity is unchanged after it */
+    data = pb->data;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&pb->capacity, memory_order_relaxed) != cap) {
+        goto retry;
+    }
 
     /* ensure buffer marker invariants */
     csz = end - start;
@@ -189,12 +319,12 @@ static size_t pbs_buffer_read(pbs_buffer *pb, char *buf, size_t len)
     /* perform copy out, and if we wrap split into two copies
      * while also applying the modulus to the buffer markers. */
     if ((start & ~mask) == ((new_start - 1) & ~mask)) {
-        memcpy(buf, pb->data + (start & mask), io_len);
+        memcpy(buf, data + (start & mask), io_len);
     } else {
         pbs_uoffset o1 = (start & mask);
         pbs_uoffset l1 = (new_start & ~mask) - start;
-        memcpy(buf, pb->data + o1, l1);
-        memcpy(buf + l1, pb->data, io_len - l1);
+        memcpy(buf, data + o1, l1);
+        memcpy(buf + l1, data, io_len - l1);
     }
 
     /* store start <- new_start. */
@@ -217,6 +347,7 @@ static size_t pbs_buffer_write(pbs_buffer *pb, char *buf, size_t len)
 
     if (len == 0) return 0;
 
+retry:
     cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
     mask = cap - 1;
 
@@ -233,6 +364,13 @@ static size_t pbs_buffer_write(pbs_buffer *pb, char *buf, size_t len)
     end = end;
     new_end = end + io_len;
 
+    /* grow the buffer if it stays full */
+    if (io_len < len && pb->max_capacity > cap) {
+        if (pbs_buffer_full(pb, (size_t)cap)) goto retry;
+    } else if (pb->full_count) {
+        pb->full_count--;
+    }
+
     if (io_len == 0) return 0;
 
     pb_debugf("end=%u io_len=%u new_end=%u",
@@ -255,10 +393,24 @@ static size_t pbs_buffer_write(pbs_buffer *pb, char *buf, size_t len)
     return io_len;
 }
 
-static io_span pbs_buffer_read_lock(pbs_buffer *pb, size_t len)
+/*
+ * element aligned locks
+ *
+ * the _elem lock functions return spans that hold whole elements of a
+ * power of two size. when every lock and commit on one side of the ring
+ * moves a multiple of elem bytes, the sequences of that side stay
+ * multiples of elem, the power of two wrap point falls between elements,
+ * and span addresses are aligned to elem up to PB_DATA_ALIGN. vector code can pass the vector
+ * width as elem to get spans it can load with aligned loads. the plain
+ * lock functions are the case elem is 1.
+ */
+
+static io_span pbs_buffer_read_lock_elem(pbs_buffer *pb, size_t len,
+    size_t elem)
 {
     pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
     io_span ticket = { 0, 0, 0 };
+    char *data;
 
     /*                  start                   end                       *
      *                  |       start           |       end               *
@@ -268,14 +420,25 @@ static io_span pbs_buffer_read_lock(pbs_buffer *pb, size_t len)
      *                  |       end+cap         |       start             *
      *  XXXXXXXXXXXXXXXX++++++++________________--------XXXXXXXXXXXXXXXX  */
 
+    assert(ispow2(elem));
     if (len == 0) return ticket;
 
-    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+retry:
+    /* capacity is zero while the producer resizes the buffer */
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
     mask = cap - 1;
+    if (cap == 0) return ticket;
 
     /* fetch buffer markers */
     start = atomic_load_explicit(&pb->start, memory_order_acquire);
-    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+
+    /* the data pointer matches cap if capacity is unchanged after it */
+    data = pb->data;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&pb->capacity, memory_order_relaxed) != cap) {
+        goto retry;
+    }
 
     /* ensure buffer marker invariants */
     csz = end - start;
@@ -291,19 +454,25 @@ static io_span pbs_buffer_read_lock(pbs_buffer *pb, size_t len)
         new_start = start + io_len;
     }
 
+    /* whole elements only, the wrap point falls on an element boundary */
+    assert((start & (elem - 1)) == 0);
+    io_len &= ~(pbs_uoffset)(elem - 1);
+    new_start = start + io_len;
+
     if (io_len == 0) return ticket;
 
     pb_debugf("start=%u io_len=%u new_start=%u",
         start, io_len, new_start);
 
-    ticket.buf = pb->data + (start & mask);
+    ticket.buf = data + (start & mask);
     ticket.length = io_len;
     ticket.sequence = start;
 
     return ticket;
 }
 
-static io_span pbs_buffer_write_lock(pbs_buffer *pb, size_t len)
+static io_span pbs_buffer_write_lock_elem(pbs_buffer *pb, size_t len,
+    size_t elem)
 {
     pbs_uoffset cap, mask, csz, io_len, start, end, new_end;
     io_span ticket = { 0, 0, 0 };
@@ -316,6 +485,7 @@ static io_span pbs_buffer_write_lock(pbs_buffer *pb, size_t len)
      *                  |       end+cap         |       start             *
      *  XXXXXXXXXXXXXXXX++++++++________________--------XXXXXXXXXXXXXXXX  */
 
+    assert(ispow2(elem));
     if (len == 0) return ticket;
 
     cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
@@ -339,6 +509,11 @@ static io_span pbs_buffer_write_lock(pbs_buffer *pb, size_t len)
         new_end = end + io_len;
     }
 
+    /* whole elements only, the wrap point falls on an element boundary */
+    assert((end & (elem - 1)) == 0);
+    io_len &= ~(pbs_uoffset)(elem - 1);
+    new_end = end + io_len;
+
     if (io_len == 0) return ticket;
 
     pb_debugf("end=%u io_len=%u new_end=%u",
@@ -351,6 +526,16 @@ static io_span pbs_buffer_write_lock(pbs_buffer *pb, size_t len)
     return ticket;
 }
 
+static io_span pbs_buffer_read_lock(pbs_buffer *pb, size_t len)
+{
+    return pbs_buffer_read_lock_elem(pb, len, 1);
+}
+
+static io_span pbs_buffer_write_lock(pbs_buffer *pb, size_t len)
+{
+    return pbs_buffer_write_lock_elem(pb, len, 1);
+}
+
 static int pbs_buffer_read_commit(pbs_buffer *pb, io_span ticket)
 {
     pbs_uoffset start, new_start;
@@ -381,6 +566,203 @@ static int pbs_buffer_write_commit(pbs_buffer *pb, io_span ticket)
     return 0;
 }
 
+/*
+ * drain and fill
+ *
+ * pbs_buffer_read_lock_all and pbs_buffer_write_lock_all reserve up to len
+ * bytes, or everything readable or writable when len is SIZE_MAX, across
+ * the wrap point. they return the reserved length, split into two spans,
+ * and the spans are committed together with the matching commit_all.
+ */
+
+static size_t pbs_buffer_read_lock_all(pbs_buffer *pb, io_span span[2],
+    size_t len)
+{
+    pbs_uoffset cap, csz, io_len, start, end;
+    char *data;
+
+    memset(span, 0, sizeof(io_span) * 2);
+    if (len == 0) return 0;
+
+retry:
+    /* capacity is zero while the producer resizes the buffer */
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    if (cap == 0) return 0;
+
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+
+    /* the data pointer matches cap if capacity is unchanged after it */
+    data = pb->data;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&pb->capacity, memory_order_relaxed) != cap) {
+        goto retry;
+    }
+
+    csz = end - start;
+    assert(csz <= cap);
+
+    io_len = len < csz ? (pbs_uoffset)len : csz;
+    if (io_len == 0) return 0;
+
+    pb_span_split(span, data, (size_t)cap, (size_t)start, (size_t)io_len);
+
+    return (size_t)io_len;
+}
+
+static size_t pbs_buffer_write_lock_all(pbs_buffer *pb, io_span span[2],
+    size_t len)
+{
+    pbs_uoffset cap, csz, io_len, start, end;
+
+    memset(span, 0, sizeof(io_span) * 2);
+    if (len == 0) return 0;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+
+    csz = end - start;
+    assert(csz <= cap);
+
+    io_len = len < cap - csz ? (pbs_uoffset)len : cap - csz;
+    if (io_len == 0) return 0;
+
+    pb_span_split(span, pb->data, (size_t)cap, (size_t)end, (size_t)io_len);
+
+    return (size_t)io_len;
+}
+
+static int pbs_buffer_read_commit_all(pbs_buffer *pb, io_span span[2])
+{
+    return pbs_buffer_read_commit(pb, pb_span_join(span));
+}
+
+static int pbs_buffer_write_commit_all(pbs_buffer *pb, io_span span[2])
+{
+    return pbs_buffer_write_commit(pb, pb_span_join(span));
+}
+
+/*
+ * available bytes to read or write. these are a snapshot that may be
+ * stale by the time they return and do not reserve anything.
+ */
+static size_t pbs_buffer_read_avail(pbs_buffer *pb)
+{
+    pbs_uoffset start, end;
+
+    start = atomic_load_explicit(&pb->start, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+
+    return (size_t)(end - start);
+}
+
+static size_t pbs_buffer_write_avail(pbs_buffer *pb)
+{
+    pbs_uoffset cap, start, end;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+
+    return end - start < cap ? (size_t)(cap - (end - start)) : 0;
+}
+
+/*
+ * online resize
+ *
+ * pbs_buffer_resize swaps in a new power of two backing array while the
+ * consumer keeps running. it must be called from the producer thread with
+ * no write ticket outstanding, which makes the producer the only writer
+ * of data and capacity.
+ *
+ * capacity acts as a sequence lock for the data pointer. the producer
+ * stores zero, copies the unread bytes into the new array, then publishes
+ * the new pointer and capacity. the consumer loads capacity, the markers
+ * and the data pointer and retries if capacity changed in between, so it
+ * never pairs a pointer with the wrong mask.
+ *
+ * the old array is not modified after the swap, so read tickets issued
+ * against it stay valid. it is retired once start passes the end marker
+ * at the time of the swap, at which point the consumer has completed an
+ * operation that observed the new array. a further resize fails until
+ * the old array is retired, and the buffer cannot shrink below the
+ * number of unread bytes. both failures return -1.
+ *
+ * pbs_buffer_set_max_capacity enables automatic growth up to a limit.
+ * short writes add PB_GROW_SHORT to a counter and complete writes take
+ * one away, and the capacity is doubled when the counter reaches
+ * PB_GROW_THRESHOLD, so the buffer grows when more than one write in
+ * five stays short. growth happens in pbs_buffer_write only, as the lock
+ * functions may be called with a ticket outstanding.
+ */
+
+static int pbs_buffer_retire(pbs_buffer *pb)
+{
+    pbs_uoffset start;
+
+    if (!pb->old_data) return 0;
+
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    if ((long long)(start - pb->old_end) <= 0) return -1;
+
+    pb_data_free(pb->old_data);
+    pb->old_data = NULL;
+
+    return 0;
+}
+
+static int pbs_buffer_resize(pbs_buffer *pb, size_t capacity)
+{
+    pbs_uoffset cap, start, end;
+    char *data;
+
+    assert(ispow2(capacity));
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    if (capacity == cap) return 0;
+    if (pbs_buffer_retire(pb) < 0) return -1;
+    if (!(data = pb_data_alloc(capacity))) return -1;
+
+    /* close the gate, new reads see an empty buffer until we reopen it */
+    atomic_store_explicit(&pb->capacity, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    if (end - start > capacity) {
+        atomic_store_explicit(&pb->capacity, cap, memory_order_release);
+        pb_data_free(data);
+        return -1;
+    }
+
+    /* the consumer may advance start while we copy, which is harmless
+     * as the old array is not modified. */
+    pb_copy_ring(data, capacity, start, pb->data, cap, start, end - start);
+
+    pb->old_data = pb->data;
+    pb->old_end = end;
+    pb->data = data;
+    atomic_store_explicit(&pb->capacity, capacity, memory_order_release);
+
+    return 0;
+}
+
+static void pbs_buffer_set_max_capacity(pbs_buffer *pb, size_t max_capacity)
+{
+    assert(max_capacity == 0 || ispow2(max_capacity));
+    pb->max_capacity = max_capacity;
+    pb->full_count = 0;
+}
+
+static int pbs_buffer_full(pbs_buffer *pb, size_t cap)
+{
+    pb->full_count += PB_GROW_SHORT;
+    if (pb->full_count < PB_GROW_THRESHOLD) return 0;
+    pb->full_count = 0;
+    return pbs_buffer_resize(pb, cap << 1) == 0;
+}
+
 static io_buffer_ops pbs_ops =
 {
     (io_read_fn *)pbs_buffer_read,
@@ -388,9 +770,16 @@ static io_buffer_ops pbs_ops =
     (io_read_lock_fn *)pbs_buffer_read_lock,
     (io_write_lock_fn *)pbs_buffer_write_lock,
     (io_read_commit_fn *)pbs_buffer_read_commit,
-    (io_write_commit_fn *)pbs_buffer_write_commit
+    (io_write_commit_fn *)pbs_buffer_write_commit,
+    (io_read_avail_fn *)pbs_buffer_read_avail,
+    (io_write_avail_fn *)pbs_buffer_write_avail
 };
 
+static io_buffer_ops *pbs_buffer_ops(void)
+{
+    return &pbs_ops;
+}
+
 /*
  * multiple producer multiple consumer pipe buffer
  *
@@ -416,11 +805,15 @@ struct pbm_buffer
     io_buffer io;
     atomic_size_t capacity;
     char *data;
-    size_t _pad[5];
+    size_t max_capacity;
+    atomic_size_t full_count;
+    size_t _pad[3];
     atomic_ullong pof;
 };
 
-static io_buffer_ops pbm_ops;
+/* the ops table is defined at the end, C++ has no tentative definitions */
+static io_buffer_ops *pbm_buffer_ops(void);
+static int pbm_buffer_full(pbm_buffer *pb, size_t cap);
 
 static ullong pbm_pack_offsets(pbm_offsets pbo)
 {
@@ -448,16 +841,18 @@ static void pbm_buffer_init(pbm_buffer *pb, size_t capacity)
     assert(ispow2(capacity));
     assert(capacity < (1ull << (sizeof(pbm_uoffset) << 3)));
     pbm_offsets pbo = { 0 };
-    pb->io.ops = &pbm_ops;
+    pb->io.ops = pbm_buffer_ops();
     pb->pof = pbm_pack_offsets(pbo);
     pb->capacity = capacity;
-    pb->data = (char*)malloc(capacity);
+    pb->data = pb_data_alloc(capacity);
+    pb->max_capacity = 0;
+    pb->full_count = 0;
     memset(pb->data, 0, capacity);
 }
 
 static void pbm_buffer_destroy(pbm_buffer *pb)
 {
-    free(pb->data);
+    pb_data_free(pb->data);
     pb->data = NULL;
 }
 
@@ -482,19 +877,19 @@ static size_t pbm_buffer_read(pbm_buffer *pb, char *buf, size_t len)
 
     if (len == 0) return 0;
 
-    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
-    mask = cap - 1;
-
 retry:
-    /* fetch buffer markers */
-    pof_val = atomic_load_explicit(&pb->pof, memory_order_relaxed);
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
     pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    mask = cap - 1;
+    if (cap == 0) return 0;
 
-    /* ensure buffer marker invariants */
+    /* ensure buffer marker invariants. markers loaded before a resize
+     * may exceed the new capacity, and the compare swap would fail. */
     csz = pof.end - pof.start;
     fsz = pof.end - pof.start_mark;
-    assert(csz <= cap);
-    assert(fsz <= cap);
+    if (csz > cap || fsz > cap) goto retry;
 
     /* calculate copy length from start_mark to new_start_mark */
     io_len = len < fsz ? (pbm_uoffset)len : fsz;
@@ -543,6 +938,7 @@ static size_t pbm_buffer_write(pbm_buffer *pb, char *buf, size_t len)
     ullong pof_val;
     pbm_offsets pof;
     pbm_uoffset cap, mask, csz, fsz, io_len, end_mark, new_end_mark;
+    size_t fc;
 
     /*                  start                   end                       *
      *                  |       start_mark      |       end_mark          *
@@ -554,25 +950,33 @@ static size_t pbm_buffer_write(pbm_buffer *pb, char *buf, size_t len)
 
     if (len == 0) return 0;
 
-    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
-    mask = cap - 1;
-
 retry:
-    /* fetch buffer markers */
-    pof_val = atomic_load_explicit(&pb->pof, memory_order_relaxed);
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
     pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    mask = cap - 1;
+    if (cap == 0) return 0;
 
-    /* ensure buffer marker invariants */
+    /* ensure buffer marker invariants. markers loaded before a resize
+     * may exceed the new capacity, and the compare swap would fail. */
     csz = pof.end - pof.start;
     fsz = pof.end_mark - pof.start;
-    assert(csz <= cap);
-    assert(fsz <= cap);
+    if (csz > cap || fsz > cap) goto retry;
 
     /* calculate copy length from end_mark to new_end_mark */
     io_len = len < cap - fsz ? (pbm_uoffset)len : cap - fsz;
     end_mark = pof.end_mark;
     new_end_mark = pof.end_mark + io_len;
 
+    /* grow the buffer if it stays full */
+    if (io_len < len && pb->max_capacity > cap) {
+        if (pbm_buffer_full(pb, cap)) goto retry;
+    } else if ((fc = atomic_load_explicit(&pb->full_count,
+        memory_order_relaxed)) != 0) {
+        atomic_store_explicit(&pb->full_count, fc - 1, memory_order_relaxed);
+    }
+
     if (io_len == 0) return 0;
 
     pb_debugf("end_mark=%u io_len=%u new_end_mark=%u",
@@ -610,7 +1014,14 @@ retry:
     return io_len;
 }
 
-static io_span pbm_buffer_read_lock(pbm_buffer *pb, size_t len)
+/*
+ * element aligned locks, as for pbs_buffer. resize renumbers the markers
+ * by the new capacity, which keeps them multiples of any element size no
+ * larger than the capacity.
+ */
+
+static io_span pbm_buffer_read_lock_elem(pbm_buffer *pb, size_t len,
+    size_t elem)
 {
     ullong pof_val;
     pbm_offsets pof;
@@ -625,21 +1036,22 @@ static io_span pbm_buffer_read_lock(pbm_buffer *pb, size_t len)
      *                  |       end_mark+cap    |       start_mark        *
      *  XXXXXXXXXXXXXXXX++++++++________________--------XXXXXXXXXXXXXXXX  */
 
+    assert(ispow2(elem));
     if (len == 0) return ticket;
 
-    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
-    mask = cap - 1;
-
 retry:
-    /* fetch buffer markers */
-    pof_val = atomic_load_explicit(&pb->pof, memory_order_relaxed);
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
     pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    mask = cap - 1;
+    if (cap == 0) return ticket;
 
-    /* ensure buffer marker invariants */
+    /* ensure buffer marker invariants. markers loaded before a resize
+     * may exceed the new capacity, and the compare swap would fail. */
     csz = pof.end - pof.start;
     fsz = pof.end - pof.start_mark;
-    assert(csz <= cap);
-    assert(fsz <= cap);
+    if (csz > cap || fsz > cap) goto retry;
 
     /* calculate copy length from start_mark to new_start_mark */
     io_len = len < fsz ? (pbm_uoffset)len : fsz;
@@ -651,6 +1063,11 @@ retry:
         new_start_mark = start_mark + io_len;
     }
 
+    /* whole elements only, the wrap point falls on an element boundary */
+    assert((start_mark & (elem - 1)) == 0);
+    io_len &= ~(pbm_uoffset)(elem - 1);
+    new_start_mark = start_mark + io_len;
+
     if (io_len == 0) return ticket;
 
     pb_debugf("start_mark=%u io_len=%u new_start_mark=%u",
@@ -669,7 +1086,8 @@ retry:
     return ticket;
 }
 
-static io_span pbm_buffer_write_lock(pbm_buffer *pb, size_t len)
+static io_span pbm_buffer_write_lock_elem(pbm_buffer *pb, size_t len,
+    size_t elem)
 {
     ullong pof_val;
     pbm_offsets pof;
@@ -684,21 +1102,22 @@ static io_span pbm_buffer_write_lock(pbm_buffer *pb, size_t len)
      *                  |       end_mark+cap    |       start_mark        *
      *  XXXXXXXXXXXXXXXX++++++++________________--------XXXXXXXXXXXXXXXX  */
 
+    assert(ispow2(elem));
     if (len == 0) return ticket;
 
-    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
-    mask = cap - 1;
-
 retry:
-    /* fetch buffer markers */
-    pof_val = atomic_load_explicit(&pb->pof, memory_order_relaxed);
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
     pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    mask = cap - 1;
+    if (cap == 0) return ticket;
 
-    /* ensure buffer marker invariants */
+    /* ensure buffer marker invariants. markers loaded before a resize
+     * may exceed the new capacity, and the compare swap would fail. */
     csz = pof.end - pof.start;
     fsz = pof.end_mark - pof.start;
-    assert(csz <= cap);
-    assert(fsz <= cap);
+    if (csz > cap || fsz > cap) goto retry;
 
     /* calculate copy length from end_mark to new_end_mark */
     io_len = len < cap - fsz ? (pbm_uoffset)len : cap - fsz;
@@ -710,6 +1129,11 @@ retry:
         new_end_mark = end_mark + io_len;
     }
 
+    /* whole elements only, the wrap point falls on an element boundary */
+    assert((end_mark & (elem - 1)) == 0);
+    io_len &= ~(pbm_uoffset)(elem - 1);
+    new_end_mark = end_mark + io_len;
+
     if (io_len == 0) return ticket;
 
     pb_debugf("end_mark=%u io_len=%u new_end_mark=%u",
@@ -728,6 +1152,16 @@ retry:
     return ticket;
 }
 
+static io_span pbm_buffer_read_lock(pbm_buffer *pb, size_t len)
+{
+    return pbm_buffer_read_lock_elem(pb, len, 1);
+}
+
+static io_span pbm_buffer_write_lock(pbm_buffer *pb, size_t len)
+{
+    return pbm_buffer_write_lock_elem(pb, len, 1);
+}
+
 static int pbm_buffer_read_commit(pbm_buffer *pb, io_span ticket)
 {
     ullong pof_val;
@@ -780,6 +1214,331 @@ static int pbm_buffer_write_commit(pbm_buffer *pb, io_span ticket)
     return 0;
 }
 
+/*
+ * truncated commit
+ *
+ * pbm_buffer tickets must normally be committed at their locked length.
+ * the truncate functions commit the first len bytes of a ticket and hand
+ * the rest back, which is only possible while no later reservation has
+ * been made. they wait, like a commit, for the tickets before to retire,
+ * and return 0, or -1 without committing if a later reservation exists.
+ */
+
+static int pbm_buffer_truncate(pbm_buffer *pb, io_span ticket, size_t len,
+    int writer)
+{
+    ullong pof_val;
+    pbm_offsets pof;
+    pbm_uoffset seq, used_end, ticket_end;
+
+    assert(len <= ticket.length);
+
+    seq = (pbm_uoffset)ticket.sequence;
+    used_end = (pbm_uoffset)(ticket.sequence + len);
+    ticket_end = (pbm_uoffset)(ticket.sequence + ticket.length);
+
+    for (;;) {
+        pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
+        pof = pbm_unpack_offsets(pof_val);
+        if (writer) {
+            if (pof.end != seq) continue;
+            if (pof.end_mark != ticket_end) return -1;
+            pof.end = pof.end_mark = used_end;
+        } else {
+            if (pof.start != seq) continue;
+            if (pof.start_mark != ticket_end) return -1;
+            pof.start = pof.start_mark = used_end;
+        }
+        if (atomic_compare_exchange_strong(&pb->pof, &pof_val,
+            pbm_pack_offsets(pof))) return 0;
+    }
+}
+
+static int pbm_buffer_read_truncate(pbm_buffer *pb, io_span ticket,
+    size_t len)
+{
+    return pbm_buffer_truncate(pb, ticket, len, 0);
+}
+
+static int pbm_buffer_write_truncate(pbm_buffer *pb, io_span ticket,
+    size_t len)
+{
+    return pbm_buffer_truncate(pb, ticket, len, 1);
+}
+
+/*
+ * the shrink functions hand back the end of a ticket without committing
+ * it, so the first len bytes stay reserved and are committed later at
+ * the shorter length. like truncate, this is only possible while no
+ * later reservation has been made, and they return -1 if one exists.
+ */
+
+static int pbm_buffer_shrink(pbm_buffer *pb, io_span *ticket, size_t len,
+    int writer)
+{
+    ullong pof_val;
+    pbm_offsets pof;
+    pbm_uoffset ticket_end;
+
+    assert(len <= ticket->length);
+
+    ticket_end = (pbm_uoffset)(ticket->sequence + ticket->length);
+
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_relaxed);
+    do {
+        pof = pbm_unpack_offsets(pof_val);
+        if (writer) {
+            if (pof.end_mark != ticket_end) return -1;
+            pof.end_mark = (pbm_uoffset)(ticket->sequence + len);
+        } else {
+            if (pof.start_mark != ticket_end) return -1;
+            pof.start_mark = (pbm_uoffset)(ticket->sequence + len);
+        }
+    } while (!atomic_compare_exchange_weak(&pb->pof, &pof_val,
+        pbm_pack_offsets(pof)));
+
+    ticket->length = len;
+    return 0;
+}
+
+static int pbm_buffer_read_shrink(pbm_buffer *pb, io_span *ticket,
+    size_t len)
+{
+    return pbm_buffer_shrink(pb, ticket, len, 0);
+}
+
+static int pbm_buffer_write_shrink(pbm_buffer *pb, io_span *ticket,
+    size_t len)
+{
+    return pbm_buffer_shrink(pb, ticket, len, 1);
+}
+
+/*
+ * drain and fill
+ *
+ * pbm_buffer_read_lock_all and pbm_buffer_write_lock_all move start_mark
+ * or end_mark past the whole range with one compare swap, where the
+ * plain lock functions need one for each side of the wrap point. the
+ * range is retired by one commit, which spins like any other.
+ */
+
+static size_t pbm_buffer_read_lock_all(pbm_buffer *pb, io_span span[2],
+    size_t len)
+{
+    ullong pof_val;
+    pbm_offsets pof;
+    pbm_uoffset cap, csz, fsz, io_len, start_mark;
+
+    memset(span, 0, sizeof(io_span) * 2);
+    if (len == 0) return 0;
+
+retry:
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
+    pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    if (cap == 0) return 0;
+
+    csz = pof.end - pof.start;
+    fsz = pof.end - pof.start_mark;
+    if (csz > cap || fsz > cap) goto retry;
+
+    io_len = len < fsz ? (pbm_uoffset)len : fsz;
+    if (io_len == 0) return 0;
+
+    start_mark = pof.start_mark;
+    pof.start_mark = start_mark + io_len;
+    if (!atomic_compare_exchange_strong(&pb->pof, &pof_val,
+        pbm_pack_offsets(pof))) goto retry;
+
+    pb_span_split(span, pb->data, cap, start_mark, io_len);
+
+    return io_len;
+}
+
+static size_t pbm_buffer_write_lock_all(pbm_buffer *pb, io_span span[2],
+    size_t len)
+{
+    ullong pof_val;
+    pbm_offsets pof;
+    pbm_uoffset cap, csz, fsz, io_len, end_mark;
+
+    memset(span, 0, sizeof(io_span) * 2);
+    if (len == 0) return 0;
+
+retry:
+    /* fetch buffer markers then capacity, which is zero during a resize */
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
+    pof = pbm_unpack_offsets(pof_val);
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_acquire);
+    if (cap == 0) return 0;
+
+    csz = pof.end - pof.start;
+    fsz = pof.end_mark - pof.start;
+    if (csz > cap || fsz > cap) goto retry;
+
+    io_len = len < (size_t)(cap - fsz) ? (pbm_uoffset)len : cap - fsz;
+    if (io_len == 0) return 0;
+
+    end_mark = pof.end_mark;
+    pof.end_mark = end_mark + io_len;
+    if (!atomic_compare_exchange_strong(&pb->pof, &pof_val,
+        pbm_pack_offsets(pof))) goto retry;
+
+    pb_span_split(span, pb->data, cap, end_mark, io_len);
+
+    return io_len;
+}
+
+static int pbm_buffer_read_commit_all(pbm_buffer *pb, io_span span[2])
+{
+    return pbm_buffer_read_commit(pb, pb_span_join(span));
+}
+
+static int pbm_buffer_write_commit_all(pbm_buffer *pb, io_span span[2])
+{
+    return pbm_buffer_write_commit(pb, pb_span_join(span));
+}
+
+/*
+ * available bytes to read or write excluding in-flight reservations.
+ * these are a snapshot that may be stale by the time they return.
+ */
+static size_t pbm_buffer_read_avail(pbm_buffer *pb)
+{
+    pbm_offsets pof;
+
+    pof = pbm_unpack_offsets(atomic_load_explicit(&pb->pof,
+        memory_order_acquire));
+
+    return (pbm_uoffset)(pof.end - pof.start_mark);
+}
+
+static size_t pbm_buffer_write_avail(pbm_buffer *pb)
+{
+    pbm_offsets pof;
+    pbm_uoffset cap;
+
+    cap = (pbm_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    pof = pbm_unpack_offsets(atomic_load_explicit(&pb->pof,
+        memory_order_acquire));
+
+    if ((pbm_uoffset)(pof.end_mark - pof.start) >= cap) return 0;
+    return (pbm_uoffset)(cap - (pbm_uoffset)(pof.end_mark - pof.start));
+}
+
+/*
+ * online resize
+ *
+ * pbm_buffer_resize swaps in a new power of two backing array while
+ * readers and writers keep running. any thread may call it provided it
+ * holds no tickets on the buffer, as it waits for every ticket to retire
+ * and would wait forever on its own. capacity is limited to 32KiB by the
+ * 16-bit markers.
+ *
+ * the resizer swaps capacity to zero, which excludes other resizers and
+ * makes new reservations return empty. operations load capacity after
+ * the markers, so one that loaded the old capacity still holds markers
+ * that predate the gate. the resizer waits until every reservation is
+ * committed, start == start_mark and end == end_mark, and renumbers the
+ * markers in the same compare swap, adding the new capacity so record
+ * alignment is kept. a reservation prepared with the old capacity then
+ * fails its compare swap and retries against the new one.
+ *
+ * quiescence means no ticket refers to the old array, so it is freed as
+ * soon as the unread bytes are copied out. the buffer cannot shrink
+ * below the number of unread bytes and only one resize runs at a time,
+ * both failures return -1. registered io_uring buffers refer to the
+ * array, so a buffer driven by an iou_stage must not be resized.
+ *
+ * pbm_buffer_set_max_capacity enables automatic growth from
+ * pbm_buffer_write, using the same short write counter as pbs_buffer.
+ * the writer may hold read tickets, or other threads may hold tickets
+ * that wait on it, so growth gives up after PB_GROW_CHECKS checks for
+ * quiescence, reopens the gate at the old capacity and lets the write
+ * stay short.
+ */
+
+static int pbm_buffer_resize_checks(pbm_buffer *pb, size_t capacity,
+    size_t checks)
+{
+    ullong pof_val;
+    pbm_offsets pof, npof;
+    pbm_uoffset delta;
+    size_t cap, n = 0;
+    char *data, *old;
+
+    assert(ispow2(capacity));
+    assert(capacity < (1ull << (sizeof(pbm_uoffset) << 3)));
+
+    if (!(data = pb_data_alloc(capacity))) return -1;
+
+    /* close the gate */
+    cap = atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    do {
+        if (cap == 0 || cap == capacity) {
+            pb_data_free(data);
+            return cap == 0 ? -1 : 0;
+        }
+    } while (!atomic_compare_exchange_weak(&pb->capacity, &cap, 0));
+
+    /* wait for quiescence and renumber the markers */
+    delta = (pbm_uoffset)capacity;
+    pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
+    for (;;) {
+        pof = pbm_unpack_offsets(pof_val);
+        if (pof.start != pof.start_mark || pof.end != pof.end_mark) {
+            if (checks && ++n == checks) {
+                atomic_store_explicit(&pb->capacity, cap,
+                    memory_order_release);
+                pb_data_free(data);
+                return -1;
+            }
+            pof_val = atomic_load_explicit(&pb->pof, memory_order_acquire);
+            continue;
+        }
+        if ((pbm_uoffset)(pof.end - pof.start) > capacity) {
+            atomic_store_explicit(&pb->capacity, cap, memory_order_release);
+            pb_data_free(data);
+            return -1;
+        }
+        npof.start = npof.start_mark = pof.start + delta;
+        npof.end = npof.end_mark = pof.end + delta;
+        if (atomic_compare_exchange_weak(&pb->pof, &pof_val,
+            pbm_pack_offsets(npof))) break;
+    }
+
+    pb_copy_ring(data, capacity, npof.start, pb->data, cap, pof.start,
+        (pbm_uoffset)(pof.end - pof.start));
+
+    old = pb->data;
+    pb->data = data;
+    atomic_store_explicit(&pb->capacity, capacity, memory_order_release);
+    pb_data_free(old);
+
+    return 0;
+}
+
+static int pbm_buffer_resize(pbm_buffer *pb, size_t capacity)
+{
+    return pbm_buffer_resize_checks(pb, capacity, 0);
+}
+
+static void pbm_buffer_set_max_capacity(pbm_buffer *pb, size_t max_capacity)
+{
+    assert(max_capacity == 0 || ispow2(max_capacity));
+    assert(max_capacity < (1ull << (sizeof(pbm_uoffset) << 3)));
+    pb->max_capacity = max_capacity;
+}
+
+static int pbm_buffer_full(pbm_buffer *pb, size_t cap)
+{
+    if (atomic_fetch_add_explicit(&pb->full_count, PB_GROW_SHORT,
+        memory_order_relaxed) + PB_GROW_SHORT < PB_GROW_THRESHOLD) return 0;
+    atomic_store_explicit(&pb->full_count, 0, memory_order_relaxed);
+    return pbm_buffer_resize_checks(pb, cap << 1, PB_GROW_CHECKS) == 0;
+}
+
 static io_buffer_ops pbm_ops =
 {
     (io_read_fn *)pbm_buffer_read,
@@ -787,5 +1546,12 @@ static io_buffer_ops pbm_ops =
     (io_read_lock_fn *)pbm_buffer_read_lock,
     (io_write_lock_fn *)pbm_buffer_write_lock,
     (io_read_commit_fn *)pbm_buffer_read_commit,
-    (io_write_commit_fn *)pbm_buffer_write_commit
+    (io_write_commit_fn *)pbm_buffer_write_commit,
+    (io_read_avail_fn *)pbm_buffer_read_avail,
+    (io_write_avail_fn *)pbm_buffer_write_avail
 };
+
+static io_buffer_ops *pbm_buffer_ops(void)
+{
+    return &pbm_ops;
+}
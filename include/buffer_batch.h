@@ -0,0 +1,207 @@
+/*
+ * pipe buffer commit coalescing
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * batch commit
+ *
+ * each pbm_buffer commit spins until the tickets before it retire and
+ * then moves start or end with a compare swap on the shared offsets word.
+ * pbm_buffer_read_commit_batch and pbm_buffer_write_commit_batch take the
+ * tickets a thread holds, in the order they were locked, and retire each
+ * run of contiguous tickets with a single commit. tickets locked in a row
+ * by one thread are contiguous unless another thread locked in between,
+ * in which case the batch is committed as several runs.
+ */
+
+typedef int (pbm_commit_fn)(pbm_buffer *pb, io_span ticket);
+
+static int pbm_buffer_commit_batch(pbm_buffer *pb, io_span *tickets,
+    size_t n, pbm_commit_fn *commit)
+{
+    io_span run = { 0, 0, 0 };
+
+    for (size_t i = 0; i < n; i++) {
+        if (tickets[i].length == 0) continue;
+        if (run.length && (pbm_uoffset)(run.sequence + run.length) ==
+            (pbm_uoffset)tickets[i].sequence) {
+            run.length += tickets[i].length;
+            continue;
+        }
+        if (run.length) commit(pb, run);
+        run = tickets[i];
+    }
+    if (run.length) commit(pb, run);
+
+    return 0;
+}
+
+static int pbm_buffer_read_commit_batch(pbm_buffer *pb, io_span *tickets,
+    size_t n)
+{
+    return pbm_buffer_commit_batch(pb, tickets, n, pbm_buffer_read_commit);
+}
+
+static int pbm_buffer_write_commit_batch(pbm_buffer *pb, io_span *tickets,
+    size_t n)
+{
+    return pbm_buffer_commit_batch(pb, tickets, n, pbm_buffer_write_commit);
+}
+
+/*
+ * reservation cache
+ *
+ * pbm_cache belongs to one thread. it reserves a chunk of up to chunk_size
+ * bytes with one read or write lock and hands out spans from the chunk
+ * without touching the shared offsets word. each span is committed to the
+ * cache before the next is locked, and the chunk is retired with a single
+ * commit once every byte of it has been committed. like locks at the end
+ * of the ring, a span at the end of a chunk may be shorter than requested.
+ *
+ * a chunk is only visible to the other side once it is retired, and later
+ * chunks of other threads wait for it, so threads should flush when they
+ * go idle. pbm_cache_flush hands back the unused tail of the chunk when
+ * no other thread has reserved after it. otherwise the chunk is kept and
+ * flush returns the number of tail bytes that could not be handed back.
+ * the next pbm_cache_lock hands out the tail, so a reader consumes every
+ * byte it reserved and a writer fills the tail with its next records, and
+ * the chunk retires once the tail is committed. a writer whose records
+ * are framed so zero bytes read as padding may opt in with
+ * pbm_cache_set_pad to have flush zero fill the tail and retire the chunk
+ * at once. fixed size records with a chunk size and capacity that are
+ * multiples of the record size always fill their chunks exactly.
+ */
+
+typedef struct pbm_cache pbm_cache;
+
+struct pbm_cache
+{
+    pbm_buffer *pb;
+    io_span chunk;
+    size_t chunk_size;
+    size_t used;
+    size_t done;
+    int writer;
+    int pad;
+};
+
+static void pbm_cache_init(pbm_cache *c, pbm_buffer *pb, size_t chunk_size,
+    int writer)
+{
+    io_span empty = { 0, 0, 0 };
+
+    c->pb = pb;
+    c->chunk = empty;
+    c->chunk_size = chunk_size;
+    c->used = 0;
+    c->done = 0;
+    c->writer = writer;
+    c->pad = 0;
+}
+
+/* zero fill a writer's tail on flush instead of keeping the chunk */
+static void pbm_cache_set_pad(pbm_cache *c, int pad)
+{
+    assert(c->writer || !pad);
+    c->pad = pad;
+}
+
+static void pbm_cache_reset(pbm_cache *c)
+{
+    io_span empty = { 0, 0, 0 };
+
+    c->chunk = empty;
+    c->used = 0;
+    c->done = 0;
+}
+
+static void pbm_cache_retire(pbm_cache *c)
+{
+    if (c->writer) pbm_buffer_write_commit(c->pb, c->chunk);
+    else pbm_buffer_read_commit(c->pb, c->chunk);
+    pbm_cache_reset(c);
+}
+
+/*
+ * retire the chunk up to the bytes handed out. this waits, like a commit,
+ * for the tickets before the chunk to retire, then hands back the tail if
+ * the chunk is still the last reservation. returns 0 once the chunk is
+ * retired, or the tail bytes that are still held by the cache, or with
+ * padding were retired as zeros.
+ */
+static size_t pbm_cache_flush(pbm_cache *c)
+{
+    size_t tail;
+
+    assert(c->done == c->used);
+    if (c->chunk.length == 0) return 0;
+    if (c->used == c->chunk.length) {
+        pbm_cache_retire(c);
+        return 0;
+    }
+
+    if (pbm_buffer_truncate(c->pb, c->chunk, c->used, c->writer) == 0) {
+        pbm_cache_reset(c);
+        return 0;
+    }
+
+    tail = c->chunk.length - c->used;
+    if (c->pad) {
+        memset(c->chunk.buf + c->used, 0, tail);
+        pbm_cache_retire(c);
+    }
+    return tail;
+}
+
+/*
+ * hand out up to len bytes from the chunk, reserving a new chunk of at
+ * least len bytes when it is empty. returns an empty span if no chunk
+ * could be reserved.
+ */
+static io_span pbm_cache_lock(pbm_cache *c, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    size_t n, size = len > c->chunk_size ? len : c->chunk_size;
+
+    if (len == 0) return ticket;
+    if (c->chunk.length == 0) {
+        c->chunk = c->writer ? pbm_buffer_write_lock(c->pb, size) :
+            pbm_buffer_read_lock(c->pb, size);
+        if (c->chunk.length == 0) return ticket;
+    }
+
+    n = c->chunk.length - c->used < len ? c->chunk.length - c->used : len;
+    ticket.buf = c->chunk.buf + c->used;
+    ticket.length = n;
+    ticket.sequence = c->chunk.sequence + c->used;
+    c->used += n;
+    return ticket;
+}
+
+static int pbm_cache_commit(pbm_cache *c, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    assert(ticket.sequence == c->chunk.sequence + c->done);
+    c->done += ticket.length;
+    if (c->done == c->chunk.length) pbm_cache_retire(c);
+    return 0;
+}
@@ -0,0 +1,502 @@
+/*
+ * broadcast pipe buffer
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include "buffer.h"
+
+/*
+ * single producer multiple consumer broadcast pipe buffer
+ *
+ * broadcast pipe buffer is a power of two sized circular buffer where a
+ * single producer writes each byte once and every registered reader has
+ * its own start cursor, so each reader sees the whole stream. readers
+ * join at the current end and leave at any time. the producer may only
+ * overwrite bytes that every active reader has committed, so its free
+ * space is bounded by the minimum of the active cursors.
+ *
+ * the producer caches the minimum in a gate and only rescans the cursors
+ * when a write does not fit below the cached gate. the scan walks a
+ * bitmap of active cursors with ctz, so its cost scales with the number
+ * of readers and not with PBB_MAX_READERS.
+ *
+ *                  min(start[i])           end                       *
+ *                  |       start[j]        |                         *
+ *  ________________--------XXXXXXXXXXXXXXXX________________________  *
+ *
+ * each reader holds a pbb_reader handle that implements io_buffer, so it
+ * can be passed to anything that reads from an io_buffer. the pbb_buffer
+ * io_buffer implements the producer side only.
+ *
+ * sequence barriers
+ *
+ * a reader may instead join after another reader with pbb_buffer_stage,
+ * making it a pipeline stage whose cursor is limited by the cursor of
+ * the stage before it rather than by end. stages form a chain over a
+ * single buffer: decode, enrich and publish each hold a cursor, each may
+ * modify records in place through the span from read_lock, and the
+ * commit of one stage releases the span to the next. the producer
+ * reuses space only after the last stage has committed it, so records
+ * move through every stage without being copied.
+ *
+ *                  publish         enrich          decode          end
+ *                  |               |               |               |
+ *  ________________XXXXXXXXXXXXXXXX++++++++++++++++~~~~~~~~~~~~~~~~____  *
+ *
+ * pbb_buffer_stage_after joins after a set of stages, and the cursor is
+ * limited by the slowest of them, so stages form a graph: two stages
+ * that both follow decode may run in parallel and a diamond joins them
+ * again in a stage that follows both. the dependencies are a bitmap of
+ * cursor ids, where an empty set means end.
+ *
+ * a stage must leave before the stages it depends on.
+ */
+
+#define PBB_MAX_READERS 64
+
+typedef struct pbb_cursor pbb_cursor;
+typedef struct pbb_buffer pbb_buffer;
+typedef struct pbb_reader pbb_reader;
+
+struct pbb_cursor
+{
+    atomic_pbs_uoffset start;
+    ullong deps;
+    size_t _pad[6];
+};
+
+struct pbb_buffer
+{
+    io_buffer io;
+    atomic_size_t capacity;
+    char *data;
+    pbs_uoffset gate;
+    size_t _pad[4];
+    atomic_pbs_uoffset end;
+    atomic_ullong active;
+    size_t _pad1[6];
+    pbb_cursor cursors[PBB_MAX_READERS];
+};
+
+struct pbb_reader
+{
+    io_buffer io;
+    pbb_buffer *pb;
+    uint id;
+};
+
+static io_buffer_ops pbb_ops;
+static io_buffer_ops pbb_reader_ops;
+
+static void pbb_buffer_init(pbb_buffer *pb, size_t capacity)
+{
+    assert(ispow2(capacity));
+    memset(pb, 0, sizeof(pbb_buffer));
+    pb->io.ops = &pbb_ops;
+    pb->capacity = capacity;
+    pb->data = pb_data_alloc(capacity);
+    memset(pb->data, 0, capacity);
+}
+
+static void pbb_buffer_destroy(pbb_buffer *pb)
+{
+    pb_data_free(pb->data);
+    pb->data = NULL;
+}
+
+static size_t pbb_buffer_capacity(pbb_buffer *pb)
+{
+    return pb->capacity;
+}
+
+/*
+ * the limit of a set of dependencies is end if the set is empty, or else
+ * the cursor of the slowest stage in it. cursors of stages that follow
+ * the same producer are within capacity of each other, so the signed
+ * distance orders them across the overflow of the 64-bit markers. the
+ * acquire pairs with the release in the commit of the producer or the
+ * previous stages, which makes their writes to the span visible.
+ */
+static pbs_uoffset pbb_buffer_limit(pbb_buffer *pb, ullong deps,
+    memory_order order)
+{
+    pbs_uoffset limit, start;
+
+    if (deps == 0) return atomic_load_explicit(&pb->end, order);
+
+    limit = atomic_load_explicit(&pb->cursors[ctz_u64(deps)].start, order);
+    deps &= deps - 1;
+    while (deps) {
+        start = atomic_load_explicit(&pb->cursors[ctz_u64(deps)].start, order);
+        if ((llong)(start - limit) < 0) limit = start;
+        deps &= deps - 1;
+    }
+
+    return limit;
+}
+
+static pbs_uoffset pbb_reader_limit(pbb_buffer *pb, uint id)
+{
+    return pbb_buffer_limit(pb, pb->cursors[id].deps, memory_order_acquire);
+}
+
+/*
+ * join at the current end, or after the stages in deps. the cursor is
+ * published in the active bitmap before its final start is taken from
+ * its limit, so a producer that computed its gate before seeing the new
+ * cursor cannot have a gate above it. returns 0 on success or -1 if all
+ * cursors are in use.
+ */
+static int pbb_buffer_join_after(pbb_buffer *pb, pbb_reader *rd, ullong deps)
+{
+    ullong active, bit;
+    uint id;
+
+    active = atomic_load_explicit(&pb->active, memory_order_relaxed);
+    do {
+        if (~active == 0) return -1;
+        id = ctz_u64(~active);
+        bit = 1ull << id;
+        pb->cursors[id].deps = deps;
+        atomic_store_explicit(&pb->cursors[id].start,
+            pbb_buffer_limit(pb, deps, memory_order_relaxed),
+            memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&pb->active, &active, active | bit));
+
+    atomic_store_explicit(&pb->cursors[id].start,
+        pbb_buffer_limit(pb, deps, memory_order_seq_cst),
+        memory_order_seq_cst);
+
+    rd->io.ops = &pbb_reader_ops;
+    rd->pb = pb;
+    rd->id = id;
+
+    return 0;
+}
+
+static int pbb_buffer_join(pbb_buffer *pb, pbb_reader *rd)
+{
+    return pbb_buffer_join_after(pb, rd, 0);
+}
+
+/* join as a pipeline stage that consumes what prev has committed */
+static int pbb_buffer_stage(pbb_buffer *pb, pbb_reader *rd, pbb_reader *prev)
+{
+    assert(prev->pb == pb);
+    return pbb_buffer_join_after(pb, rd, 1ull << prev->id);
+}
+
+/* join as a stage that consumes what every one of prev has committed */
+static int pbb_buffer_stage_after(pbb_buffer *pb, pbb_reader *rd,
+    pbb_reader **prev, size_t n)
+{
+    ullong deps = 0;
+
+    assert(n > 0);
+    for (size_t i = 0; i < n; i++) {
+        assert(prev[i]->pb == pb);
+        deps |= 1ull << prev[i]->id;
+    }
+    return pbb_buffer_join_after(pb, rd, deps);
+}
+
+static void pbb_buffer_leave(pbb_reader *rd)
+{
+    atomic_fetch_and_explicit(&rd->pb->active, ~(1ull << rd->id),
+        memory_order_release);
+}
+
+/*
+ * minimum start of the active cursors, or end if there are no readers.
+ * the distance from end is used so the minimum is correct across the
+ * graceful overflow of the 64-bit markers. a cursor more than capacity
+ * behind end is a reader that is still joining and is skipped, as its
+ * final start will be taken from the current end.
+ */
+static pbs_uoffset pbb_buffer_min_start(pbb_buffer *pb, pbs_uoffset cap,
+    pbs_uoffset end)
+{
+    ullong active = atomic_load_explicit(&pb->active, memory_order_acquire);
+    pbs_uoffset dist = 0;
+
+    while (active) {
+        uint id = ctz_u64(active);
+        pbs_uoffset start = atomic_load_explicit(&pb->cursors[id].start,
+            memory_order_acquire);
+        if (end - start <= cap && end - start > dist) dist = end - start;
+        active &= active - 1;
+    }
+
+    return end - dist;
+}
+
+/*
+ * free space for the producer. rescans the cursors only if the cached
+ * gate does not leave at least len bytes.
+ */
+static pbs_uoffset pbb_buffer_space(pbb_buffer *pb, pbs_uoffset cap,
+    pbs_uoffset end, size_t len)
+{
+    pbs_uoffset csz = end - pb->gate;
+    if (cap - csz < len) {
+        pb->gate = pbb_buffer_min_start(pb, cap, end);
+        csz = end - pb->gate;
+    }
+    assert(csz <= cap);
+    return cap - csz;
+}
+
+static size_t pbb_buffer_write(pbb_buffer *pb, char *buf, size_t len)
+{
+    pbs_uoffset cap, mask, io_len, space, end, new_end;
+
+    if (len == 0) return 0;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch end marker and the space below the slowest reader */
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    space = pbb_buffer_space(pb, cap, end, len);
+
+    /* calculate copy length from end to new_end */
+    io_len = len < space ? (pbs_uoffset)len : space;
+    new_end = end + io_len;
+
+    if (io_len == 0) return 0;
+
+    /* perform copy in, and if we wrap split into two copies
+     * while also applying the modulus to the buffer markers. */
+    if ((end & ~mask) == ((new_end - 1) & ~mask)) {
+        memcpy(pb->data + (end & mask), buf, io_len);
+    } else {
+        pbs_uoffset o1 = (end & mask);
+        pbs_uoffset l1 = (new_end & ~mask) - end;
+        memcpy(pb->data + o1, buf, l1);
+        memcpy(pb->data, buf + l1, io_len - l1);
+    }
+
+    /* store end <- new_end. */
+    atomic_store_explicit(&pb->end, new_end, memory_order_release);
+
+    return io_len;
+}
+
+static io_span pbb_buffer_write_lock(pbb_buffer *pb, size_t len)
+{
+    pbs_uoffset cap, mask, io_len, space, end, new_end;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch end marker and the space below the slowest reader */
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    space = pbb_buffer_space(pb, cap, end, len);
+
+    /* calculate copy length from end to new_end */
+    io_len = len < space ? (pbs_uoffset)len : space;
+    new_end = end + io_len;
+
+    if ((end & ~mask) != ((new_end - 1) & ~mask)) {
+        io_len = (new_end & ~mask) - end;
+        new_end = end + io_len;
+    }
+
+    if (io_len == 0) return ticket;
+
+    ticket.buf = pb->data + (end & mask);
+    ticket.length = io_len;
+    ticket.sequence = end;
+
+    return ticket;
+}
+
+static int pbb_buffer_write_commit(pbb_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+
+    /* store end <- new_end. */
+    atomic_store_explicit(&pb->end,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+
+    return 0;
+}
+
+static size_t pbb_buffer_write_avail(pbb_buffer *pb)
+{
+    pbs_uoffset cap, end;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+
+    return (size_t)pbb_buffer_space(pb, cap, end, cap);
+}
+
+static size_t pbb_reader_read(pbb_reader *rd, char *buf, size_t len)
+{
+    pbb_buffer *pb = rd->pb;
+    atomic_pbs_uoffset *cursor = &pb->cursors[rd->id].start;
+    pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
+
+    if (len == 0) return 0;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(cursor, memory_order_relaxed);
+    end = pbb_reader_limit(pb, rd->id);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from start to new_start */
+    io_len = len < csz ? (pbs_uoffset)len : csz;
+    new_start = start + io_len;
+
+    if (io_len == 0) return 0;
+
+    /* perform copy out, and if we wrap split into two copies
+     * while also applying the modulus to the buffer markers. */
+    if ((start & ~mask) == ((new_start - 1) & ~mask)) {
+        memcpy(buf, pb->data + (start & mask), io_len);
+    } else {
+        pbs_uoffset o1 = (start & mask);
+        pbs_uoffset l1 = (new_start & ~mask) - start;
+        memcpy(buf, pb->data + o1, l1);
+        memcpy(buf + l1, pb->data, io_len - l1);
+    }
+
+    /* store start[id] <- new_start. */
+    atomic_store_explicit(cursor, new_start, memory_order_release);
+
+    return io_len;
+}
+
+static io_span pbb_reader_read_lock(pbb_reader *rd, size_t len)
+{
+    pbb_buffer *pb = rd->pb;
+    atomic_pbs_uoffset *cursor = &pb->cursors[rd->id].start;
+    pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(cursor, memory_order_relaxed);
+    end = pbb_reader_limit(pb, rd->id);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from start to new_start */
+    io_len = len < csz ? (pbs_uoffset)len : csz;
+    new_start = start + io_len;
+
+    if ((start & ~mask) != ((new_start - 1) & ~mask)) {
+        io_len = (new_start & ~mask) - start;
+        new_start = start + io_len;
+    }
+
+    if (io_len == 0) return ticket;
+
+    ticket.buf = pb->data + (start & mask);
+    ticket.length = io_len;
+    ticket.sequence = start;
+
+    return ticket;
+}
+
+static int pbb_reader_read_commit(pbb_reader *rd, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+
+    /* store start[id] <- new_start. */
+    atomic_store_explicit(&rd->pb->cursors[rd->id].start,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+
+    return 0;
+}
+
+static size_t pbb_reader_read_avail(pbb_reader *rd)
+{
+    pbb_buffer *pb = rd->pb;
+    pbs_uoffset start, end;
+
+    start = atomic_load_explicit(&pb->cursors[rd->id].start,
+        memory_order_relaxed);
+    end = pbb_reader_limit(pb, rd->id);
+
+    return (size_t)(end - start);
+}
+
+/*
+ * the producer and reader handles each implement one side of io_buffer.
+ * the other side performs no IO.
+ */
+static size_t pbb_none_io(io_buffer *io, char *buf, size_t len)
+{
+    return 0;
+}
+
+static io_span pbb_none_lock(io_buffer *io, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    return ticket;
+}
+
+static int pbb_none_commit(io_buffer *io, io_span ticket)
+{
+    return -1;
+}
+
+static size_t pbb_none_avail(io_buffer *io)
+{
+    return 0;
+}
+
+static io_buffer_ops pbb_ops =
+{
+    (io_read_fn *)pbb_none_io,
+    (io_write_fn *)pbb_buffer_write,
+    (io_read_lock_fn *)pbb_none_lock,
+    (io_write_lock_fn *)pbb_buffer_write_lock,
+    (io_read_commit_fn *)pbb_none_commit,
+    (io_write_commit_fn *)pbb_buffer_write_commit,
+    (io_read_avail_fn *)pbb_none_avail,
+    (io_write_avail_fn *)pbb_buffer_write_avail
+};
+
+static io_buffer_ops pbb_reader_ops =
+{
+    (io_read_fn *)pbb_reader_read,
+    (io_write_fn *)pbb_none_io,
+    (io_read_lock_fn *)pbb_reader_read_lock,
+    (io_write_lock_fn *)pbb_none_lock,
+    (io_read_commit_fn *)pbb_reader_read_commit,
+    (io_write_commit_fn *)pbb_none_commit,
+    (io_read_avail_fn *)pbb_reader_read_avail,
+    (io_write_avail_fn *)pbb_none_avail
+};
@@ -0,0 +1,322 @@
+/*
+ * pipe buffer coroutine awaitables
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#if !defined __cplusplus || __cplusplus < 202002L
+#error "buffer_coro.h requires C++23 for coroutines and <stdatomic.h>"
+#endif
+
+#include <version>
+
+#if !defined __cpp_lib_stdatomic_h
+#error "buffer_coro.h requires C++23 for coroutines and <stdatomic.h>"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "buffer.h"
+
+/*
+ * coroutine awaitables
+ *
+ * io_co_channel wraps an io_buffer, such as a pbs_buffer or pbm_buffer,
+ * so coroutines can wait for data or space without blocking a thread:
+ *
+ *   io_span t = co_await ch.read_lock(len);
+ *   ...
+ *   ch.read_commit(t);
+ *
+ * the awaited ticket is never empty and, like io_buffer_read_lock and
+ * io_buffer_write_lock, may be shorter than len. await_ready tries the
+ * lock, so when data or space is available the coroutine continues
+ * without suspending, allocating or taking a lock.
+ *
+ * otherwise the awaiter, which lives in the coroutine frame, is queued on
+ * the channel and the lock is retried, so a commit racing with the
+ * suspension is not missed. commits through the channel wake the first
+ * waiter of the opposite direction by posting it to the executor it was
+ * running on when it suspended. the woken awaiter retries the lock on its
+ * executor and resumes at once with the ticket, or queues itself again.
+ * a ticket is only ever taken by the coroutine that then runs, because
+ * pbm_buffer commits wait for the commits of earlier tickets, and a
+ * ticket held by a queued coroutine could stall every thread of the pool.
+ * for the same reason, coroutines should commit before awaiting again.
+ *
+ * an awaiter that takes a ticket after being woken passes the wakeup on
+ * if more data or space remains, so waiters are released one at a time
+ * without a thundering herd. commits made directly on the io_buffer do
+ * not wake waiters.
+ *
+ * executors derive from io_co_executor and must set io_co_current() on
+ * their threads. io_co_pool is a simple thread pool executor.
+ */
+
+typedef void (io_co_fn)(void *arg);
+
+struct io_co_executor
+{
+    virtual ~io_co_executor() {}
+    virtual void post(io_co_fn *fn, void *arg) = 0;
+
+    void post(std::coroutine_handle<> h)
+    {
+        post(resume, h.address());
+    }
+
+    static void resume(void *arg)
+    {
+        std::coroutine_handle<>::from_address(arg).resume();
+    }
+};
+
+/* the executor running on this thread, which waiters are resumed on */
+inline io_co_executor *&io_co_current()
+{
+    static thread_local io_co_executor *executor;
+    return executor;
+}
+
+struct io_co_pool : io_co_executor
+{
+    struct work { io_co_fn *fn; void *arg; };
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<work> queue;
+    std::vector<std::thread> threads;
+    bool stop = false;
+
+    explicit io_co_pool(size_t nthreads)
+    {
+        for (size_t i = 0; i < nthreads; i++) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    /* drains the queue before the threads exit */
+    ~io_co_pool()
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    void post(io_co_fn *fn, void *arg) override
+    {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            queue.push_back(work{ fn, arg });
+        }
+        cond.notify_one();
+    }
+
+    using io_co_executor::post;
+
+    void run()
+    {
+        io_co_current() = this;
+        for (;;) {
+            work w;
+            {
+                std::unique_lock<std::mutex> g(lock);
+                cond.wait(g, [this] { return stop || !queue.empty(); });
+                if (queue.empty()) break;
+                w = queue.front();
+                queue.pop_front();
+            }
+            w.fn(w.arg);
+        }
+        io_co_current() = nullptr;
+    }
+};
+
+struct io_co_lock;
+struct io_co_channel;
+
+/*
+ * fifo of suspended awaiters. count is read without the lock by commits
+ * and waits counts suspensions for statistics.
+ */
+struct io_co_waitq
+{
+    alignas(64) std::atomic<size_t> count{ 0 };
+    std::mutex lock;
+    io_co_lock *head = nullptr;
+    io_co_lock *tail = nullptr;
+    size_t waits = 0;
+};
+
+enum io_co_dir { io_co_read, io_co_write };
+
+struct io_co_lock
+{
+    io_co_channel *ch;
+    size_t len;
+    io_co_dir dir;
+    io_span ticket;
+    io_co_executor *executor;
+    std::coroutine_handle<> handle;
+    io_co_lock *next;
+
+    io_co_lock(io_co_channel *ch, size_t len, io_co_dir dir)
+        : ch(ch), len(len), dir(dir), ticket{ 0, 0, 0 },
+          executor(nullptr), next(nullptr) {}
+
+    inline io_span try_lock();
+    inline bool wait();
+    static inline void retry(void *arg);
+
+    bool await_ready()
+    {
+        ticket = try_lock();
+        return ticket.length > 0;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        executor = io_co_current();
+        assert(executor);
+        handle = h;
+        return wait();
+    }
+
+    io_span await_resume()
+    {
+        return ticket;
+    }
+};
+
+struct io_co_channel
+{
+    io_buffer *io;
+    io_co_waitq readers;
+    io_co_waitq writers;
+
+    explicit io_co_channel(io_buffer *io) : io(io) {}
+
+    io_co_lock read_lock(size_t len) { return io_co_lock(this, len, io_co_read); }
+    io_co_lock write_lock(size_t len) { return io_co_lock(this, len, io_co_write); }
+
+    int read_commit(io_span ticket)
+    {
+        int r = io_buffer_read_commit(io, ticket);
+        wake(writers);
+        return r;
+    }
+
+    int write_commit(io_span ticket)
+    {
+        int r = io_buffer_write_commit(io, ticket);
+        wake(readers);
+        return r;
+    }
+
+    io_co_waitq &queue(io_co_dir dir)
+    {
+        return dir == io_co_read ? readers : writers;
+    }
+
+    size_t avail(io_co_dir dir)
+    {
+        return dir == io_co_read ? io_buffer_read_avail(io) :
+            io_buffer_write_avail(io);
+    }
+
+    /*
+     * post the first waiter to its executor. the fence orders the commit
+     * before the count load, pairing with the count increment and fence
+     * in io_co_lock::wait, so one side sees the other.
+     */
+    void wake(io_co_waitq &q)
+    {
+        io_co_lock *w;
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (q.count.load(std::memory_order_relaxed) == 0) return;
+        {
+            std::lock_guard<std::mutex> g(q.lock);
+            if ((w = q.head) == nullptr) return;
+            if ((q.head = w->next) == nullptr) q.tail = nullptr;
+            q.count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        w->executor->post(io_co_lock::retry, w);
+    }
+};
+
+io_span io_co_lock::try_lock()
+{
+    return dir == io_co_read ? io_buffer_read_lock(ch->io, len) :
+        io_buffer_write_lock(ch->io, len);
+}
+
+/*
+ * queue the awaiter and retry the lock. returns true if the awaiter stays
+ * queued, after which it must not be touched as it may already be resumed,
+ * or false with the ticket taken and the awaiter dequeued.
+ */
+bool io_co_lock::wait()
+{
+    io_co_waitq &q = ch->queue(dir);
+    std::lock_guard<std::mutex> g(q.lock);
+
+    next = nullptr;
+    if (q.tail) q.tail->next = this;
+    else q.head = this;
+    q.tail = this;
+    q.count.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    ticket = try_lock();
+    if (ticket.length == 0) {
+        q.waits++;
+        return true;
+    }
+
+    /* only the lock holder unlinks, so the awaiter is still the tail */
+    io_co_lock *p = q.head;
+    if (p == this) {
+        q.head = q.tail = nullptr;
+    } else {
+        while (p->next != this) p = p->next;
+        p->next = nullptr;
+        q.tail = p;
+    }
+    q.count.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+}
+
+/* runs on the waiter's executor after a wake */
+void io_co_lock::retry(void *arg)
+{
+    io_co_lock *w = static_cast<io_co_lock*>(arg);
+    io_co_channel *ch = w->ch;
+    io_co_dir dir = w->dir;
+
+    if (w->wait()) return;
+    if (ch->avail(dir) > 0) ch->wake(ch->queue(dir));
+    w->handle.resume();
+}
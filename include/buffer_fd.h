@@ -0,0 +1,320 @@
+/*
+ * pipe buffer file descriptor transfer
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+
+/*
+ * direct file descriptor to buffer transfer
+ *
+ * io_fd_fill reads from a file descriptor directly into the spans
+ * returned by write_lock and io_fd_drain writes directly from the spans
+ * returned by read_lock, so each byte is copied once by the kernel
+ * instead of twice through an intermediate buffer. when the transfer
+ * crosses the end of the circular buffer, both sides of the wrap are
+ * passed in one readv(2) or writev(2) call. pbs_buffer and pbm_buffer
+ * reserve both sides at once with lock_all, other buffers with a second
+ * lock where that returns a new span.
+ *
+ * io_fd_xfer belongs to one thread and holds the buffer, the descriptor
+ * and the direction of the transfer. pbm_buffer tickets must be committed
+ * at their reserved length, so fill sizes its reservation with FIONREAD
+ * where the descriptor supports it. when end of file, an error or a non
+ * blocking descriptor cuts a pbm_buffer transfer short, the rest of the
+ * reservation is handed back if no later reservation was made. otherwise
+ * the transfer keeps the ticket, io_fd_xfer_pending returns the bytes
+ * still to be moved, and the next call finishes the ticket before it
+ * reserves again. a stream that has ended retires a held ticket with
+ * io_fd_xfer_retire, which zero fills the rest of a fill and discards the
+ * rest of a drain. a writer whose records are framed so zero bytes read
+ * as padding may opt in with io_fd_xfer_set_pad to have a fill cut short
+ * by end of file or an error retired that way at once, and the fill then
+ * fails with the error, or EIO at end of file, as the stream is damaged.
+ * other buffers commit the shorter length.
+ *
+ * both return the number of bytes transferred, or -1 with errno set.
+ * fill returns 0 at end of file and fails with ENOSPC when the buffer is
+ * full. drain returns 0 when the buffer is empty. a descriptor in non
+ * blocking mode fails with EAGAIN when no bytes could be transferred.
+ */
+
+typedef struct io_fd_xfer io_fd_xfer;
+
+struct io_fd_xfer
+{
+    io_buffer *io;
+    io_span t[2];
+    size_t done;
+    int fd;
+    int nspan;
+    int writer;
+    int pad;
+};
+
+static void io_fd_xfer_init(io_fd_xfer *x, io_buffer *io, int fd,
+    int writer)
+{
+    io_span empty = { 0, 0, 0 };
+
+    x->io = io;
+    x->t[0] = x->t[1] = empty;
+    x->done = 0;
+    x->fd = fd;
+    x->nspan = 0;
+    x->writer = writer;
+    x->pad = 0;
+}
+
+/* zero fill the rest of a fill cut short instead of keeping the ticket */
+static void io_fd_xfer_set_pad(io_fd_xfer *x, int pad)
+{
+    assert(x->writer || !pad);
+    x->pad = pad;
+}
+
+static void io_fd_xfer_reset(io_fd_xfer *x)
+{
+    io_span empty = { 0, 0, 0 };
+
+    x->t[0] = x->t[1] = empty;
+    x->done = 0;
+    x->nspan = 0;
+}
+
+/* bytes of a held ticket that are still to be transferred */
+static size_t io_fd_xfer_pending(io_fd_xfer *x)
+{
+    return x->nspan ? x->t[0].length + x->t[1].length - x->done : 0;
+}
+
+static int io_fd_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_NONBLOCK);
+}
+
+static int io_fd_poll(int fd, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/*
+ * reserve up to len bytes on both sides of the wrap. pbs_buffer and
+ * pbm_buffer take them with one lock_all. other buffers take a second
+ * ticket, which is only used when locking again returns a new span, as
+ * a buffer without read ahead or write ahead marks returns the same one.
+ */
+static int io_fd_lock2(io_span t[2], io_buffer *io, int writer, size_t len)
+{
+    io_read_lock_fn *lock = writer ? io->ops->write_lock : io->ops->read_lock;
+
+    if (io->ops == pbs_buffer_ops() || io->ops == pbm_buffer_ops()) {
+        if (io->ops == pbs_buffer_ops()) {
+            if (writer) pbs_buffer_write_lock_all((pbs_buffer*)io, t, len);
+            else pbs_buffer_read_lock_all((pbs_buffer*)io, t, len);
+        } else {
+            if (writer) pbm_buffer_write_lock_all((pbm_buffer*)io, t, len);
+            else pbm_buffer_read_lock_all((pbm_buffer*)io, t, len);
+        }
+        return t[0].length == 0 ? 0 : t[1].length == 0 ? 1 : 2;
+    }
+
+    t[0] = lock(io, len);
+    t[1].buf = NULL;
+    t[1].length = t[1].sequence = 0;
+    if (t[0].length == 0) return 0;
+    if (t[0].length == len) return 1;
+    t[1] = lock(io, len - t[0].length);
+    if (t[1].length == 0 || t[1].sequence == t[0].sequence) {
+        t[1].length = 0;
+        return 1;
+    }
+    return 2;
+}
+
+/* point iov at the untransferred part of the spans */
+static int io_fd_iov(io_fd_xfer *x, struct iovec iov[2])
+{
+    int n = 0;
+
+    for (int i = 0; i < x->nspan; i++) {
+        size_t o = x->done > x->t[0].length * i ?
+            x->done - x->t[0].length * i : 0;
+        if (o >= x->t[i].length) continue;
+        iov[n].iov_base = x->t[i].buf + o;
+        iov[n].iov_len = x->t[i].length - o;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * commit the transferred bytes and release the ticket. returns 0, or 1 if
+ * the rest of a pbm_buffer reservation could not be handed back and the
+ * ticket is kept.
+ */
+static int io_fd_commit2(io_fd_xfer *x)
+{
+    io_buffer *io = x->io;
+    io_read_commit_fn *commit = x->writer ? io->ops->write_commit :
+        io->ops->read_commit;
+    io_span ticket = pb_span_join(x->t);
+    size_t done = x->done;
+
+    if (io->ops == pbm_buffer_ops()) {
+        if (done == ticket.length) {
+            commit(io, ticket);
+        } else if (pbm_buffer_truncate((pbm_buffer*)io, ticket, done,
+            x->writer) < 0) {
+            return 1;
+        }
+    } else if (io->ops == pbs_buffer_ops()) {
+        ticket.length = done;
+        commit(io, ticket);
+    } else {
+        for (int i = 0; i < 2; i++) {
+            if (x->t[i].length > done) x->t[i].length = done;
+            done -= x->t[i].length;
+            commit(io, x->t[i]);
+        }
+    }
+
+    io_fd_xfer_reset(x);
+    return 0;
+}
+
+/*
+ * retire a held ticket as it stands, for a stream that has ended. returns
+ * the number of bytes that were zero filled or discarded.
+ */
+static size_t io_fd_xfer_retire(io_fd_xfer *x)
+{
+    size_t tail = io_fd_xfer_pending(x), done = x->done;
+
+    if (x->nspan == 0) return 0;
+    for (int i = 0; x->writer && i < x->nspan; i++) {
+        size_t o = done < x->t[i].length ? done : x->t[i].length;
+        memset(x->t[i].buf + o, 0, x->t[i].length - o);
+        done -= o;
+    }
+    x->done += tail;
+    io_fd_commit2(x);
+    return tail;
+}
+
+/*
+ * fill the buffer from the descriptor. a held ticket is finished first
+ * and len then does not apply. a non blocking descriptor with no bytes
+ * ready is probed with a one byte reservation so end of file is told
+ * apart from EAGAIN.
+ */
+static ssize_t io_fd_fill(io_fd_xfer *x, size_t len)
+{
+    struct iovec iov[2];
+    size_t start = x->done;
+    int avail, again;
+    ssize_t r = 0;
+
+    assert(x->writer);
+
+    if (x->nspan == 0) {
+        if (len == 0) return 0;
+
+        /* size the reservation by the bytes ready on the descriptor. */
+        if (ioctl(x->fd, FIONREAD, &avail) == 0) {
+            if (avail == 0 && !io_fd_nonblock(x->fd)) {
+                if (io_fd_poll(x->fd, POLLIN) < 0) return -1;
+                if (ioctl(x->fd, FIONREAD, &avail) < 0) return -1;
+                if (avail == 0) return 0;
+            }
+            if (avail == 0) avail = 1;
+            if ((size_t)avail < len) len = (size_t)avail;
+        }
+
+        x->nspan = io_fd_lock2(x->t, x->io, 1, len);
+        if (x->nspan == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        start = 0;
+    }
+
+    while (io_fd_xfer_pending(x) > 0) {
+        r = readv(x->fd, iov, io_fd_iov(x, iov));
+        if (r > 0) {
+            x->done += (size_t)r;
+        } else if (r == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    again = r < 0 && errno == EAGAIN;
+    start = x->done - start;
+
+    if (io_fd_commit2(x) > 0 && x->pad && !again) {
+        io_fd_xfer_retire(x);
+        if (r == 0) errno = EIO;
+        return -1;
+    }
+
+    return start || r == 0 ? (ssize_t)start : -1;
+}
+
+/*
+ * drain the buffer to the descriptor. a held ticket is finished first and
+ * len then does not apply.
+ */
+static ssize_t io_fd_drain(io_fd_xfer *x, size_t len)
+{
+    struct iovec iov[2];
+    size_t start = x->done;
+    ssize_t r = 0;
+
+    assert(!x->writer);
+
+    if (x->nspan == 0) {
+        if (len == 0) return 0;
+        x->nspan = io_fd_lock2(x->t, x->io, 0, len);
+        if (x->nspan == 0) return 0;
+        start = 0;
+    }
+
+    while (io_fd_xfer_pending(x) > 0) {
+        r = writev(x->fd, iov, io_fd_iov(x, iov));
+        if (r >= 0) {
+            x->done += (size_t)r;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    start = x->done - start;
+
+    io_fd_commit2(x);
+
+    return start ? (ssize_t)start : -1;
+}
@@ -0,0 +1,364 @@
+/*
+ * pipe buffer flight recorder
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * single producer lossy flight recorder pipe buffer
+ *
+ * flight recorder pipe buffer is a power of two sized circular buffer
+ * where the producer never waits for readers. a write always succeeds
+ * and overwrites the oldest bytes once the buffer is full, so the buffer
+ * holds the most recent capacity bytes of the stream. readers keep their
+ * own cursor in a pbf_reader handle that the producer never looks at, so
+ * any number of readers may attach and detach without registering.
+ *
+ * the producer publishes a mark, the end of the bytes it is about to
+ * write, before it writes them, and end after, as in a sequence lock.
+ * a reader that finds its cursor more than capacity behind the mark has
+ * been lapped and resynchronises to the oldest valid record, which is
+ * the first record boundary at or after mark - capacity. the jump shows
+ * up as a gap in io_span.sequence and the skipped bytes are added to
+ * lost. bytes can be overwritten while a reader holds a span, so the
+ * reader checks the mark again after it has used the span, and
+ * pbf_reader_read_commit returns -1 if the span was overwritten in the
+ * meantime. pbf_reader_read copies and validates each span.
+ *
+ *                  mark-cap        start           end     mark      *
+ *                  |               |               |       |         *
+ *  ~~~~~~~~~~~~~~~~XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX++++++++~~~~~~~~  *
+ *
+ * records are a power of two number of bytes, which keeps them from
+ * straddling the end of the array and lets the oldest valid record be
+ * found by rounding up. the producer writes whole records, and streams
+ * of variable length records can use a record size of one and frame
+ * records so that a reader can find the next boundary after a gap.
+ *
+ * the producer side is an io_buffer whose writes never return short,
+ * and pbf_reader is an io_buffer that implements the reader side.
+ */
+
+typedef struct pbf_buffer pbf_buffer;
+typedef struct pbf_reader pbf_reader;
+
+struct pbf_buffer
+{
+    io_buffer io;
+    size_t capacity;
+    size_t record;
+    char *data;
+    size_t _pad[4];
+    atomic_pbs_uoffset mark;
+    atomic_pbs_uoffset end;
+};
+
+struct pbf_reader
+{
+    io_buffer io;
+    pbf_buffer *pb;
+    pbs_uoffset start;
+    ullong lost;
+};
+
+static io_buffer_ops pbf_ops;
+static io_buffer_ops pbf_reader_ops;
+
+static void pbf_buffer_init(pbf_buffer *pb, size_t capacity, size_t record)
+{
+    assert(ispow2(capacity));
+    assert(ispow2(record) && record <= capacity);
+    memset(pb, 0, sizeof(pbf_buffer));
+    pb->io.ops = &pbf_ops;
+    pb->capacity = capacity;
+    pb->record = record;
+    pb->data = pb_data_alloc(capacity);
+    memset(pb->data, 0, capacity);
+}
+
+static void pbf_buffer_destroy(pbf_buffer *pb)
+{
+    pb_data_free(pb->data);
+    pb->data = NULL;
+}
+
+static size_t pbf_buffer_capacity(pbf_buffer *pb)
+{
+    return pb->capacity;
+}
+
+/*
+ * lock up to len bytes at end, truncated at the end of the array. the
+ * span may hold bytes that readers have not read, which are lost. the
+ * release fence orders the store of the mark before the writes to the
+ * span, which pairs with the acquire fence in the reader's validation.
+ */
+static io_span pbf_buffer_write_lock(pbf_buffer *pb, size_t len)
+{
+    pbs_uoffset cap, mask, io_len, end, new_end;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)pb->capacity;
+    mask = cap - 1;
+
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    io_len = len < cap ? (pbs_uoffset)len : cap;
+    new_end = end + io_len;
+
+    if ((end & ~mask) != ((new_end - 1) & ~mask)) {
+        io_len = (new_end & ~mask) - end;
+        new_end = end + io_len;
+    }
+
+    assert(io_len % pb->record == 0);
+
+    /* store mark <- new_end before the bytes are overwritten */
+    atomic_store_explicit(&pb->mark, new_end, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    ticket.buf = pb->data + (end & mask);
+    ticket.length = io_len;
+    ticket.sequence = end;
+
+    return ticket;
+}
+
+static int pbf_buffer_write_commit(pbf_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+
+    /* store end <- new_end. */
+    atomic_store_explicit(&pb->end,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+
+    return 0;
+}
+
+/* write all of buf, overwriting the oldest bytes if the buffer is full */
+static size_t pbf_buffer_write(pbf_buffer *pb, char *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        io_span t = pbf_buffer_write_lock(pb, len - done);
+        memcpy(t.buf, buf + done, t.length);
+        pbf_buffer_write_commit(pb, t);
+        done += t.length;
+    }
+
+    return len;
+}
+
+/* the producer never waits, so the whole buffer is always writable */
+static size_t pbf_buffer_write_avail(pbf_buffer *pb)
+{
+    return pb->capacity;
+}
+
+/* the oldest record that the producer has not started to overwrite */
+static pbs_uoffset pbf_buffer_oldest(pbf_buffer *pb, pbs_uoffset mark)
+{
+    pbs_uoffset cap = (pbs_uoffset)pb->capacity;
+    pbs_uoffset rec = (pbs_uoffset)pb->record;
+
+    if (mark <= cap) return 0;
+    return (mark - cap + rec - 1) & ~(rec - 1);
+}
+
+/* join at the oldest valid record, so the reader sees the history */
+static void pbf_reader_init(pbf_reader *rd, pbf_buffer *pb)
+{
+    rd->io.ops = &pbf_reader_ops;
+    rd->pb = pb;
+    rd->start = pbf_buffer_oldest(pb,
+        atomic_load_explicit(&pb->mark, memory_order_acquire));
+    rd->lost = 0;
+}
+
+/* skip the bytes ahead of the cursor and follow new writes only */
+static void pbf_reader_seek_end(pbf_reader *rd)
+{
+    rd->start = atomic_load_explicit(&rd->pb->end, memory_order_acquire);
+}
+
+/*
+ * move the cursor to the oldest valid record if the producer has lapped
+ * it. returns 1 if the reader was lapped.
+ */
+static int pbf_reader_resync(pbf_reader *rd, pbs_uoffset mark)
+{
+    pbs_uoffset oldest;
+
+    if (mark - rd->start <= (pbs_uoffset)rd->pb->capacity) return 0;
+    oldest = pbf_buffer_oldest(rd->pb, mark);
+    rd->lost += oldest - rd->start;
+    rd->start = oldest;
+    return 1;
+}
+
+/*
+ * returns 1 if the bytes from sequence onwards have not been overwritten
+ * since they were read, and resynchronises the reader if they have.
+ */
+static int pbf_reader_valid(pbf_reader *rd, pbs_uoffset sequence)
+{
+    pbs_uoffset mark;
+
+    atomic_thread_fence(memory_order_acquire);
+    mark = atomic_load_explicit(&rd->pb->mark, memory_order_relaxed);
+    if (mark - sequence <= (pbs_uoffset)rd->pb->capacity) return 1;
+    rd->start = sequence;
+    pbf_reader_resync(rd, mark);
+    return 0;
+}
+
+static io_span pbf_reader_read_lock(pbf_reader *rd, size_t len)
+{
+    pbf_buffer *pb = rd->pb;
+    pbs_uoffset cap, mask, io_len, start, new_start, end, mark;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)pb->capacity;
+    mask = cap - 1;
+
+    /* fetch buffer markers, resynchronising if we were lapped */
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+    mark = atomic_load_explicit(&pb->mark, memory_order_relaxed);
+    pbf_reader_resync(rd, mark);
+    start = rd->start;
+    if ((llong)(end - start) <= 0) return ticket;
+
+    /* calculate length from start to new_start */
+    io_len = len < end - start ? (pbs_uoffset)len : end - start;
+    new_start = start + io_len;
+
+    if ((start & ~mask) != ((new_start - 1) & ~mask)) {
+        io_len = (new_start & ~mask) - start;
+        new_start = start + io_len;
+    }
+
+    ticket.buf = pb->data + (start & mask);
+    ticket.length = io_len;
+    ticket.sequence = start;
+
+    return ticket;
+}
+
+/*
+ * advance past the span, or return -1 if the producer overwrote it while
+ * it was held, in which case the span contents must be discarded.
+ */
+static int pbf_reader_read_commit(pbf_reader *rd, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    if (!pbf_reader_valid(rd, (pbs_uoffset)ticket.sequence)) return -1;
+    rd->start = (pbs_uoffset)(ticket.sequence + ticket.length);
+    return 0;
+}
+
+/*
+ * copy up to len bytes. a lap while copying ends the read at the gap, or
+ * restarts it from the oldest record if nothing was copied yet.
+ */
+static size_t pbf_reader_read(pbf_reader *rd, char *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        io_span t = pbf_reader_read_lock(rd, len - done);
+        if (t.length == 0) break;
+        memcpy(buf + done, t.buf, t.length);
+        /* bytes already copied are intact, a gap follows them */
+        if (pbf_reader_read_commit(rd, t) < 0) {
+            if (done) break;
+            continue;
+        }
+        done += t.length;
+    }
+
+    return done;
+}
+
+static size_t pbf_reader_read_avail(pbf_reader *rd)
+{
+    pbf_buffer *pb = rd->pb;
+    pbs_uoffset end, mark, start = rd->start;
+
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+    mark = atomic_load_explicit(&pb->mark, memory_order_relaxed);
+    if (mark - start > (pbs_uoffset)pb->capacity) {
+        start = pbf_buffer_oldest(pb, mark);
+    }
+
+    return (llong)(end - start) > 0 ? (size_t)(end - start) : 0;
+}
+
+/*
+ * the producer and reader handles each implement one side of io_buffer.
+ * the other side performs no IO.
+ */
+static size_t pbf_none_io(io_buffer *io, char *buf, size_t len)
+{
+    return 0;
+}
+
+static io_span pbf_none_lock(io_buffer *io, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    return ticket;
+}
+
+static int pbf_none_commit(io_buffer *io, io_span ticket)
+{
+    return -1;
+}
+
+static size_t pbf_none_avail(io_buffer *io)
+{
+    return 0;
+}
+
+static io_buffer_ops pbf_ops =
+{
+    (io_read_fn *)pbf_none_io,
+    (io_write_fn *)pbf_buffer_write,
+    (io_read_lock_fn *)pbf_none_lock,
+    (io_write_lock_fn *)pbf_buffer_write_lock,
+    (io_read_commit_fn *)pbf_none_commit,
+    (io_write_commit_fn *)pbf_buffer_write_commit,
+    (io_read_avail_fn *)pbf_none_avail,
+    (io_write_avail_fn *)pbf_buffer_write_avail
+};
+
+static io_buffer_ops pbf_reader_ops =
+{
+    (io_read_fn *)pbf_reader_read,
+    (io_write_fn *)pbf_none_io,
+    (io_read_lock_fn *)pbf_reader_read_lock,
+    (io_write_lock_fn *)pbf_none_lock,
+    (io_read_commit_fn *)pbf_reader_read_commit,
+    (io_write_commit_fn *)pbf_none_commit,
+    (io_read_avail_fn *)pbf_reader_read_avail,
+    (io_write_avail_fn *)pbf_none_avail
+};
@@ -0,0 +1,641 @@
+/*
+ * pipe buffer binary logger
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#include <x86intrin.h>
+#define IO_LOG_TSC 1
+#elif defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+#include <intrin.h>
+#define IO_LOG_TSC 1
+#else
+#define IO_LOG_TSC 0
+#endif
+
+#if defined __GNUC__
+#define IO_LOG_PRINTF(f,a) __attribute__((format(printf, f, a)))
+#else
+#define IO_LOG_PRINTF(f,a)
+#endif
+
+/*
+ * binary logger with deferred formatting
+ *
+ * each logging thread attaches an io_log_writer, which owns a pbs_buffer
+ * that only that thread writes. io_log writes a compact record into the
+ * ring with write_lock and write_commit: a timestamp, the address of a
+ * static descriptor of the call site, which serves as the format id, and
+ * the raw argument values. formatting is left to a background thread
+ * that drains every ring, merges the records by timestamp, formats them
+ * with the printf format of the call site and writes them to a FILE in
+ * batches of up to IO_LOG_BATCH bytes.
+ *
+ *   io_log lg;
+ *   io_log_writer w;
+ *   io_log_init(&lg, stderr);
+ *   io_log_attach(&lg, &w, 1 << 20);
+ *   io_log_start(&lg);
+ *   io_log(&w, "order %llu filled at %.2f", id, price);
+ *   ...
+ *   io_log_destroy(&lg);
+ *
+ * the format must be a string with static lifetime, normally a literal.
+ * the first call from a site parses it to find the type of each
+ * argument, and later calls copy the arguments with va_arg according to
+ * those types. strings are copied into the record, truncated to
+ * IO_LOG_MAX_STRING bytes, and the other arguments take 8 bytes each.
+ * the * width and precision and long double arguments are not supported.
+ *
+ * records never straddle the end of a ring: when a record does not fit
+ * before the end, the writer fills the rest of the array with a pad
+ * record and writes the record at the start. a call whose record does
+ * not fit in the free space of the ring is dropped and counted, so a
+ * logging thread never waits for the background thread.
+ *
+ * timestamps are read from the time stamp counter on x86, which must be
+ * invariant and synchronised between cores for the merge to order the
+ * records of different threads, and are converted to nanoseconds with a
+ * rate measured against the system clock since io_log_init. the merge
+ * emits records that are at least IO_LOG_GRACE_NS old, which leaves time
+ * for a thread that took its timestamp to commit its record, so records
+ * come out in timestamp order unless a thread stalls for longer than
+ * that between taking the timestamp and committing. writers stay
+ * attached until io_log_destroy, which drains every ring.
+ */
+
+#define IO_LOG_MAX_WRITERS 64
+#define IO_LOG_MAX_ARGS 16
+#define IO_LOG_MAX_STRING 256
+#define IO_LOG_BATCH 65536
+#define IO_LOG_GRACE_NS 1000000
+#define IO_LOG_INTERVAL_NS 1000000
+
+enum {
+    IO_LOG_SITE_NEW, IO_LOG_SITE_BUSY, IO_LOG_SITE_READY
+};
+
+enum {
+    IO_LOG_ARG_INT, IO_LOG_ARG_LONG, IO_LOG_ARG_LLONG, IO_LOG_ARG_SIZE,
+    IO_LOG_ARG_INTMAX, IO_LOG_ARG_PTRDIFF, IO_LOG_ARG_DOUBLE,
+    IO_LOG_ARG_STRING, IO_LOG_ARG_POINTER
+};
+
+typedef struct io_log io_log;
+typedef struct io_log_site io_log_site;
+typedef struct io_log_writer io_log_writer;
+typedef struct io_log_rec io_log_rec;
+
+struct io_log_site
+{
+    atomic_int state;
+    const char *fmt;
+    uint nargs;
+    uint nstrings;
+    uchar types[IO_LOG_MAX_ARGS];
+};
+
+struct io_log_rec
+{
+    uint size;
+    uint pad;
+    ullong time;
+    io_log_site *site;
+};
+
+#define IO_LOG_HDR ((sizeof(io_log_rec) + 7) & ~(size_t)7)
+
+struct io_log_writer
+{
+    pbs_buffer pb;
+    io_log *lg;
+    uint id;
+    atomic_ullong dropped;
+    io_span span;
+    size_t offset;
+};
+
+struct io_log
+{
+    FILE *out;
+    mtx_t mutex;
+    atomic_size_t nwriters;
+    io_log_writer *writers[IO_LOG_MAX_WRITERS];
+    atomic_int stop;
+    int running;
+    thrd_t thread;
+    ullong clock0;
+    llong ns0;
+    double tick;
+    ullong records;
+    size_t len;
+    char batch[IO_LOG_BATCH];
+};
+
+/* logs a record. the first argument after the writer is the format */
+#define io_log(w, ...) do {                                  \
+    static io_log_site io_log_site_;                         \
+    io_log_write((w), &io_log_site_, __VA_ARGS__);           \
+} while (0)
+
+static llong io_log_ns()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static ullong io_log_clock()
+{
+#if IO_LOG_TSC
+    return __rdtsc();
+#else
+    return (ullong)io_log_ns();
+#endif
+}
+
+/* measure the clock rate against the system clock since init */
+static void io_log_calibrate(io_log *lg)
+{
+#if IO_LOG_TSC
+    ullong c = io_log_clock();
+    llong ns = io_log_ns();
+    if (c > lg->clock0 && ns > lg->ns0) {
+        lg->tick = (double)(ns - lg->ns0) / (double)(c - lg->clock0);
+    }
+#else
+    lg->tick = 1.0;
+#endif
+}
+
+static int io_log_init(io_log *lg, FILE *out)
+{
+    memset(lg, 0, sizeof(io_log));
+    if (mtx_init(&lg->mutex, mtx_plain) != thrd_success) return -1;
+    lg->out = out;
+    lg->clock0 = io_log_clock();
+    lg->ns0 = io_log_ns();
+    lg->tick = 1.0;
+    return 0;
+}
+
+/*
+ * attach a writer with a ring of the given capacity. writers may be
+ * attached from any thread while the logger runs. returns the writer id,
+ * which prefixes its lines, or -1 if the logger is full.
+ */
+static int io_log_attach(io_log *lg, io_log_writer *w, size_t capacity)
+{
+    size_t idx;
+
+    mtx_lock(&lg->mutex);
+    idx = atomic_load_explicit(&lg->nwriters, memory_order_relaxed);
+    if (idx == IO_LOG_MAX_WRITERS) {
+        mtx_unlock(&lg->mutex);
+        return -1;
+    }
+    pbs_buffer_init(&w->pb, capacity);
+    w->lg = lg;
+    w->id = (uint)idx;
+    w->dropped = 0;
+    w->span.buf = NULL;
+    w->span.length = 0;
+    w->span.sequence = 0;
+    w->offset = 0;
+    lg->writers[idx] = w;
+    atomic_store_explicit(&lg->nwriters, idx + 1, memory_order_release);
+    mtx_unlock(&lg->mutex);
+
+    return (int)idx;
+}
+
+/*
+ * parse the format of a call site. the first thread to log from the site
+ * parses it while any others wait, which happens once per site.
+ */
+static void io_log_site_init(io_log_site *site, const char *fmt)
+{
+    int state = IO_LOG_SITE_NEW;
+    const char *p = fmt;
+
+    if (!atomic_compare_exchange_strong(&site->state, &state,
+        IO_LOG_SITE_BUSY)) {
+        while (atomic_load_explicit(&site->state, memory_order_acquire)
+            != IO_LOG_SITE_READY) thrd_yield();
+        return;
+    }
+
+    site->fmt = fmt;
+    while ((p = strchr(p, '%')) != NULL) {
+        int type = IO_LOG_ARG_INT;
+        if (*++p == '%') {
+            p++;
+            continue;
+        }
+        while (*p && strchr("-+ #0", *p)) p++;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p == '.') p++;
+        while (*p >= '0' && *p <= '9') p++;
+        assert(*p != '*' && *p != 'L');
+        switch (*p) {
+        case 'h': while (*p == 'h') p++; break;
+        case 'l':
+            if (*++p == 'l') {
+                p++;
+                type = IO_LOG_ARG_LLONG;
+            } else {
+                type = IO_LOG_ARG_LONG;
+            }
+            break;
+        case 'z': p++; type = IO_LOG_ARG_SIZE; break;
+        case 'j': p++; type = IO_LOG_ARG_INTMAX; break;
+        case 't': p++; type = IO_LOG_ARG_PTRDIFF; break;
+        }
+        switch (*p) {
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+            type = IO_LOG_ARG_DOUBLE; break;
+        case 's': type = IO_LOG_ARG_STRING; site->nstrings++; break;
+        case 'p': type = IO_LOG_ARG_POINTER; break;
+        default: assert(*p && strchr("diouxXc", *p)); break;
+        }
+        assert(site->nargs < IO_LOG_MAX_ARGS);
+        site->types[site->nargs++] = (uchar)type;
+        p++;
+    }
+
+    atomic_store_explicit(&site->state, IO_LOG_SITE_READY,
+        memory_order_release);
+}
+
+static size_t io_log_strlen(const char *s)
+{
+    const char *e = (const char*)memchr(s, 0, IO_LOG_MAX_STRING);
+    return e ? (size_t)(e - s) : IO_LOG_MAX_STRING;
+}
+
+/* record size, which walks the arguments only if the site has strings */
+static size_t io_log_size(io_log_site *site, va_list ap)
+{
+    size_t size = IO_LOG_HDR + site->nargs * 8;
+
+    if (site->nstrings == 0) return size;
+    for (uint i = 0; i < site->nargs; i++) {
+        switch (site->types[i]) {
+        case IO_LOG_ARG_INT: (void)va_arg(ap, int); break;
+        case IO_LOG_ARG_LONG: (void)va_arg(ap, long); break;
+        case IO_LOG_ARG_LLONG: (void)va_arg(ap, llong); break;
+        case IO_LOG_ARG_SIZE: (void)va_arg(ap, size_t); break;
+        case IO_LOG_ARG_INTMAX: (void)va_arg(ap, intmax_t); break;
+        case IO_LOG_ARG_PTRDIFF: (void)va_arg(ap, ptrdiff_t); break;
+        case IO_LOG_ARG_DOUBLE: (void)va_arg(ap, double); break;
+        case IO_LOG_ARG_POINTER: (void)va_arg(ap, void*); break;
+        case IO_LOG_ARG_STRING: {
+            const char *s = va_arg(ap, const char*);
+            size += (io_log_strlen(s ? s : "(null)") + 8) & ~(size_t)7;
+            break;
+        }
+        }
+    }
+    return size;
+}
+
+/*
+ * lock space for a record, padding to the end of the array if the record
+ * would straddle it. returns an empty span if the ring has no room.
+ */
+static io_span io_log_lock(io_log_writer *w, size_t size)
+{
+    io_span t = pbs_buffer_write_lock(&w->pb, size), empty = { 0, 0, 0 };
+    io_log_rec *pad;
+
+    if (t.length == size || t.length == 0) return t;
+    if (t.buf + t.length != w->pb.data + w->pb.capacity) return empty;
+    if (pbs_buffer_write_avail(&w->pb) < t.length + size) return empty;
+
+    pad = (io_log_rec*)t.buf;
+    pad->size = (uint)t.length;
+    pad->pad = 1;
+    pbs_buffer_write_commit(&w->pb, t);
+
+    t = pbs_buffer_write_lock(&w->pb, size);
+    assert(t.length == size);
+    return t;
+}
+
+static void io_log_write(io_log_writer *w, io_log_site *site,
+    const char *fmt, ...) IO_LOG_PRINTF(3, 4);
+
+static void io_log_write(io_log_writer *w, io_log_site *site,
+    const char *fmt, ...)
+{
+    va_list ap;
+    size_t size;
+    io_span t;
+    io_log_rec *rec;
+    char *p, *s;
+
+    if (atomic_load_explicit(&site->state, memory_order_acquire)
+        != IO_LOG_SITE_READY) io_log_site_init(site, fmt);
+
+    va_start(ap, fmt);
+    size = io_log_size(site, ap);
+    va_end(ap);
+
+    t = io_log_lock(w, size);
+    if (t.length == 0) {
+        atomic_store_explicit(&w->dropped, atomic_load_explicit(&w->dropped,
+            memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = (io_log_rec*)t.buf;
+    rec->size = (uint)size;
+    rec->pad = 0;
+    rec->time = io_log_clock();
+    rec->site = site;
+
+    /* strings follow the fixed size argument slots */
+    p = t.buf + IO_LOG_HDR;
+    s = p + site->nargs * 8;
+    va_start(ap, fmt);
+    for (uint i = 0; i < site->nargs; i++, p += 8) {
+        switch (site->types[i]) {
+        case IO_LOG_ARG_INT: *(llong*)p = va_arg(ap, int); break;
+        case IO_LOG_ARG_LONG: *(llong*)p = va_arg(ap, long); break;
+        case IO_LOG_ARG_LLONG: *(llong*)p = va_arg(ap, llong); break;
+        case IO_LOG_ARG_SIZE: *(ullong*)p = va_arg(ap, size_t); break;
+        case IO_LOG_ARG_INTMAX: *(llong*)p = va_arg(ap, intmax_t); break;
+        case IO_LOG_ARG_PTRDIFF: *(llong*)p = va_arg(ap, ptrdiff_t); break;
+        case IO_LOG_ARG_DOUBLE: *(double*)p = va_arg(ap, double); break;
+        case IO_LOG_ARG_POINTER:
+            *(ullong*)p = (uintptr_t)va_arg(ap, void*); break;
+        case IO_LOG_ARG_STRING: {
+            const char *str = va_arg(ap, const char*);
+            size_t n = io_log_strlen(str ? str : "(null)");
+            memcpy(s, str ? str : "(null)", n);
+            s[n] = 0;
+            *(ullong*)p = n;
+            s += (n + 8) & ~(size_t)7;
+            break;
+        }
+        }
+    }
+    va_end(ap);
+
+    pbs_buffer_write_commit(&w->pb, t);
+}
+
+static ullong io_log_dropped(io_log_writer *w)
+{
+    return atomic_load_explicit(&w->dropped, memory_order_relaxed);
+}
+
+static void io_log_flush(io_log *lg)
+{
+    if (lg->len == 0) return;
+    fwrite(lg->batch, 1, lg->len, lg->out);
+    fflush(lg->out);
+    lg->len = 0;
+}
+
+/* append to the batch, flushing it first if the text does not fit */
+static void io_log_printf(io_log *lg, const char *fmt, ...) IO_LOG_PRINTF(2, 3);
+
+static void io_log_printf(io_log *lg, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (int retry = 0; retry < 2; retry++) {
+        va_start(ap, fmt);
+        n = vsnprintf(lg->batch + lg->len, IO_LOG_BATCH - lg->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < IO_LOG_BATCH - lg->len) {
+            lg->len += n;
+            return;
+        }
+        io_log_flush(lg);
+    }
+    lg->len = IO_LOG_BATCH - 1;
+}
+
+/* append len bytes of text to the batch */
+static void io_log_put(io_log *lg, const char *text, size_t len)
+{
+    while (len > 0) {
+        size_t n = IO_LOG_BATCH - lg->len < len ? IO_LOG_BATCH - lg->len : len;
+        memcpy(lg->batch + lg->len, text, n);
+        lg->len += n;
+        text += n;
+        len -= n;
+        if (lg->len == IO_LOG_BATCH) io_log_flush(lg);
+    }
+}
+
+/*
+ * format a record. the format is walked again and each conversion is
+ * printed on its own with the value converted back to the type that the
+ * conversion expects.
+ */
+static void io_log_format(io_log *lg, io_log_writer *w, io_log_rec *rec)
+{
+    io_log_site *site = rec->site;
+    const char *f = site->fmt, *q;
+    char *p = (char*)rec + IO_LOG_HDR, *s = p + site->nargs * 8;
+    llong ns = (llong)((double)(rec->time - lg->clock0) * lg->tick);
+    char spec[32], conv;
+    int sign;
+
+    io_log_printf(lg, "%lld.%09lld [%u] ", ns / 1000000000ll,
+        ns % 1000000000ll, w->id);
+
+    for (uint i = 0; *f; ) {
+        if (*f != '%') {
+            for (q = f; *q && *q != '%'; q++);
+            io_log_put(lg, f, q - f);
+            f = q;
+            continue;
+        }
+        if (f[1] == '%') {
+            io_log_put(lg, "%", 1);
+            f += 2;
+            continue;
+        }
+        for (q = f + 1; *q && !strchr("diouxXcfFeEgGaAsp", *q); q++);
+        conv = *q;
+        if (*q) q++;
+        snprintf(spec, sizeof(spec), "%.*s", (int)(q - f), f);
+        sign = conv == 'd' || conv == 'i' || conv == 'c';
+        switch (site->types[i]) {
+        case IO_LOG_ARG_INT:
+            if (sign) io_log_printf(lg, spec, (int)*(llong*)p);
+            else io_log_printf(lg, spec, (uint)*(llong*)p);
+            break;
+        case IO_LOG_ARG_LONG:
+            if (sign) io_log_printf(lg, spec, (long)*(llong*)p);
+            else io_log_printf(lg, spec, (ulong)*(llong*)p);
+            break;
+        case IO_LOG_ARG_LLONG:
+            if (sign) io_log_printf(lg, spec, *(llong*)p);
+            else io_log_printf(lg, spec, *(ullong*)p);
+            break;
+        case IO_LOG_ARG_SIZE:
+            io_log_printf(lg, spec, (size_t)*(ullong*)p);
+            break;
+        case IO_LOG_ARG_INTMAX:
+            io_log_printf(lg, spec, (intmax_t)*(llong*)p);
+            break;
+        case IO_LOG_ARG_PTRDIFF:
+            io_log_printf(lg, spec, (ptrdiff_t)*(llong*)p);
+            break;
+        case IO_LOG_ARG_DOUBLE:
+            io_log_printf(lg, spec, *(double*)p);
+            break;
+        case IO_LOG_ARG_POINTER:
+            io_log_printf(lg, spec, (void*)(uintptr_t)*(ullong*)p);
+            break;
+        case IO_LOG_ARG_STRING:
+            io_log_printf(lg, spec, s);
+            s += (*(ullong*)p + 8) & ~(size_t)7;
+            break;
+        }
+        p += 8;
+        i++;
+        f = q;
+    }
+    io_log_put(lg, "\n", 1);
+    lg->records++;
+}
+
+/*
+ * the next record in a writer's ring, or NULL if it is empty. the span
+ * locked from the ring is committed once every record in it is formatted.
+ */
+static io_log_rec *io_log_head(io_log_writer *w)
+{
+    io_log_rec *rec;
+
+    for (;;) {
+        if (w->offset == w->span.length) {
+            pbs_buffer_read_commit(&w->pb, w->span);
+            w->span = pbs_buffer_read_lock(&w->pb, SIZE_MAX);
+            w->offset = 0;
+            if (w->span.length == 0) return NULL;
+        }
+        rec = (io_log_rec*)(w->span.buf + w->offset);
+        if (!rec->pad) return rec;
+        w->offset += rec->size;
+    }
+}
+
+/*
+ * format the records of every ring in timestamp order and write them.
+ * records newer than IO_LOG_GRACE_NS are left for the next pass unless
+ * final is set. returns the number of records written.
+ */
+static size_t io_log_drain(io_log *lg, int final)
+{
+    size_t n = atomic_load_explicit(&lg->nwriters, memory_order_acquire);
+    size_t count = 0;
+    ullong now, grace, limit;
+
+    io_log_calibrate(lg);
+    now = io_log_clock();
+    grace = (ullong)(IO_LOG_GRACE_NS / lg->tick);
+    limit = final ? ULLONG_MAX : now > grace ? now - grace : 0;
+
+    for (;;) {
+        io_log_writer *best = NULL;
+        io_log_rec *best_rec = NULL;
+        for (size_t i = 0; i < n; i++) {
+            io_log_rec *rec = io_log_head(lg->writers[i]);
+            if (!rec || rec->time > limit) continue;
+            if (!best_rec || rec->time < best_rec->time) {
+                best = lg->writers[i];
+                best_rec = rec;
+            }
+        }
+        if (!best) break;
+        io_log_format(lg, best, best_rec);
+        best->offset += best_rec->size;
+        count++;
+    }
+
+    /* release the formatted records of partly consumed spans */
+    for (size_t i = 0; i < n; i++) {
+        io_log_writer *w = lg->writers[i];
+        io_span t = { w->span.buf, w->offset, w->span.sequence };
+        pbs_buffer_read_commit(&w->pb, t);
+        w->span.length = 0;
+        w->offset = 0;
+    }
+    io_log_flush(lg);
+
+    return count;
+}
+
+static int io_log_thread(void *arg)
+{
+    io_log *lg = (io_log*)arg;
+    struct timespec d = { 0, IO_LOG_INTERVAL_NS };
+
+    while (!atomic_load_explicit(&lg->stop, memory_order_acquire)) {
+        if (io_log_drain(lg, 0) == 0) thrd_sleep(&d, NULL);
+    }
+
+    return 0;
+}
+
+static int io_log_start(io_log *lg)
+{
+    assert(!lg->running);
+    atomic_store_explicit(&lg->stop, 0, memory_order_relaxed);
+    if (thrd_create(&lg->thread, io_log_thread, lg) != thrd_success) {
+        return -1;
+    }
+    lg->running = 1;
+    return 0;
+}
+
+/* stop the background thread, drain every ring and free the rings */
+static void io_log_destroy(io_log *lg)
+{
+    size_t n = atomic_load_explicit(&lg->nwriters, memory_order_acquire);
+    int res;
+
+    if (lg->running) {
+        atomic_store_explicit(&lg->stop, 1, memory_order_release);
+        thrd_join(lg->thread, &res);
+        lg->running = 0;
+    }
+    io_log_drain(lg, 1);
+    for (size_t i = 0; i < n; i++) pbs_buffer_destroy(&lg->writers[i]->pb);
+    mtx_destroy(&lg->mutex);
+}
@@ -0,0 +1,264 @@
+/*
+ * pipe buffer conflating last value channel
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * conflating last value channel
+ *
+ * io_lvc holds the latest value of each of nkeys keys in a slot of its
+ * own, instead of queueing every update. a writer overwrites the slot of
+ * a key and readers copy out a consistent snapshot of it, so a burst of
+ * updates to one key costs readers a single read of the last value.
+ *
+ * each slot is published with a sequence lock. a writer makes the slot
+ * sequence odd with a compare swap, which also excludes other writers
+ * of the same key, copies the value in and makes the sequence even
+ * again. a reader copies the value out between two loads of the
+ * sequence and retries if it was odd or changed, so readers never
+ * block writers and only retry while a write to the same key is in
+ * progress. slots are padded to a multiple of the cache line so writers
+ * of different keys do not share lines.
+ *
+ *   io_lvc_write(&ch, key, &quote);
+ *   io_lvc_poll(&rd, on_quote, NULL);
+ *
+ * readers join with an io_lvc_reader, which has a change bitmap with a
+ * bit per key. after publishing, a writer sets the key's bit in the
+ * bitmap of every joined reader, skipping the atomic or when the bit is
+ * already set, which is the common case during a burst. io_lvc_poll
+ * takes the set bits of each word with an exchange and calls back with a
+ * snapshot of each changed key, skipping keys whose sequence the reader
+ * has already seen, so readers skip keys that did not move. a reader
+ * that joins sees every key written before it joined as changed.
+ */
+
+#define IO_LVC_MAX_READERS 8
+#define IO_LVC_LINE 64
+
+typedef struct io_lvc io_lvc;
+typedef struct io_lvc_reader io_lvc_reader;
+
+typedef void (io_lvc_fn)(void *arg, size_t key, const void *value, uint seq);
+
+struct io_lvc
+{
+    size_t nkeys;
+    size_t value_size;
+    size_t stride;
+    size_t nwords;
+    char *slots;
+    atomic_uint active;
+    atomic_ullong *changed[IO_LVC_MAX_READERS];
+};
+
+struct io_lvc_reader
+{
+    io_lvc *ch;
+    uint id;
+    uint *seen;
+    char *value;
+};
+
+static atomic_uint *io_lvc_seq(io_lvc *ch, size_t key)
+{
+    return (atomic_uint*)(ch->slots + key * ch->stride);
+}
+
+static char *io_lvc_value(io_lvc *ch, size_t key)
+{
+    return ch->slots + key * ch->stride + sizeof(ullong);
+}
+
+static int io_lvc_init(io_lvc *ch, size_t nkeys, size_t value_size)
+{
+    memset(ch, 0, sizeof(io_lvc));
+    ch->nkeys = nkeys;
+    ch->value_size = value_size;
+    ch->stride = (sizeof(ullong) + value_size + IO_LVC_LINE - 1) &
+        ~(size_t)(IO_LVC_LINE - 1);
+    ch->nwords = (nkeys + 63) >> 6;
+    if (!(ch->slots = pb_data_alloc(nkeys * ch->stride))) return -1;
+    memset(ch->slots, 0, nkeys * ch->stride);
+    for (size_t i = 0; i < IO_LVC_MAX_READERS; i++) {
+        ch->changed[i] = (atomic_ullong*)calloc(ch->nwords,
+            sizeof(atomic_ullong));
+        if (!ch->changed[i]) return -1;
+    }
+    return 0;
+}
+
+static void io_lvc_destroy(io_lvc *ch)
+{
+    for (size_t i = 0; i < IO_LVC_MAX_READERS; i++) free(ch->changed[i]);
+    pb_data_free(ch->slots);
+    ch->slots = NULL;
+}
+
+/* publish value as the latest value of key */
+static void io_lvc_write(io_lvc *ch, size_t key, const void *value)
+{
+    atomic_uint *seq = io_lvc_seq(ch, key);
+    ullong bit = 1ull << (key & 63);
+    uint s, active;
+
+    assert(key < ch->nkeys);
+
+    /* make the sequence odd, waiting for a writer of the same key */
+    s = atomic_load_explicit(seq, memory_order_relaxed);
+    for (;;) {
+        if (s & 1) {
+            s = atomic_load_explicit(seq, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(seq, &s, s + 1,
+            memory_order_acquire, memory_order_relaxed)) break;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(io_lvc_value(ch, key), value, ch->value_size);
+
+    atomic_store_explicit(seq, s + 2, memory_order_release);
+
+    /* flag the key in the bitmap of every reader. the fence orders the
+     * sequence store before the loads of active and the bits, pairing
+     * with the fences in io_lvc_poll and io_lvc_join, so a reader that
+     * cleared the bit or joined before the check sees the new sequence */
+    atomic_thread_fence(memory_order_seq_cst);
+    active = atomic_load_explicit(&ch->active, memory_order_acquire);
+    while (active) {
+        atomic_ullong *word = &ch->changed[ctz_u32(active)][key >> 6];
+        if (!(atomic_load_explicit(word, memory_order_relaxed) & bit)) {
+            atomic_fetch_or_explicit(word, bit, memory_order_release);
+        }
+        active &= active - 1;
+    }
+}
+
+/*
+ * copy a consistent snapshot of key into value. returns its sequence,
+ * which is zero if the key was never written.
+ */
+static uint io_lvc_read(io_lvc *ch, size_t key, void *value)
+{
+    atomic_uint *seq = io_lvc_seq(ch, key);
+    uint s1, s2;
+
+    assert(key < ch->nkeys);
+
+    for (;;) {
+        s1 = atomic_load_explicit(seq, memory_order_acquire);
+        if (s1 & 1) continue;
+        memcpy(value, io_lvc_value(ch, key), ch->value_size);
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(seq, memory_order_relaxed);
+        if (s1 == s2) return s1;
+    }
+}
+
+static void io_lvc_leave(io_lvc_reader *rd)
+{
+    io_lvc *ch = rd->ch;
+
+    atomic_fetch_and_explicit(&ch->active, ~(1u << rd->id),
+        memory_order_release);
+    /* writers that loaded the old mask may still set bits, which the
+     * next reader to take this slot sees as spurious changes */
+    for (size_t w = 0; w < ch->nwords; w++) {
+        atomic_store_explicit(&ch->changed[rd->id][w], 0, memory_order_relaxed);
+    }
+    free(rd->seen);
+    free(rd->value);
+}
+
+/*
+ * join as a reader. keys that were already written are flagged as
+ * changed. returns 0, or -1 if every reader slot is in use or the
+ * reader state could not be allocated.
+ */
+static int io_lvc_join(io_lvc *ch, io_lvc_reader *rd)
+{
+    uint active = atomic_load_explicit(&ch->active, memory_order_relaxed);
+    uint id;
+
+    do {
+        if (active == (1u << IO_LVC_MAX_READERS) - 1) return -1;
+        id = ctz_u32(~active);
+    } while (!atomic_compare_exchange_weak(&ch->active, &active,
+        active | (1u << id)));
+
+    rd->ch = ch;
+    rd->id = id;
+    rd->seen = (uint*)calloc(ch->nkeys, sizeof(uint));
+    rd->value = (char*)malloc(ch->value_size);
+    if (!rd->seen || !rd->value) {
+        io_lvc_leave(rd);
+        return -1;
+    }
+
+    /* writes from here on set bits, earlier ones are found by sequence.
+     * the fence orders the active update before the sequence loads,
+     * pairing with the fence in io_lvc_write */
+    atomic_thread_fence(memory_order_seq_cst);
+    for (size_t w = 0; w < ch->nwords; w++) {
+        ullong bits = 0;
+        for (size_t k = w << 6; k < ch->nkeys && k < (w + 1) << 6; k++) {
+            if (atomic_load_explicit(io_lvc_seq(ch, k), memory_order_relaxed)) {
+                bits |= 1ull << (k & 63);
+            }
+        }
+        atomic_fetch_or_explicit(&ch->changed[id][w], bits,
+            memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+/*
+ * call fn with a snapshot of each key that changed since the last poll.
+ * returns the number of keys visited.
+ */
+static size_t io_lvc_poll(io_lvc_reader *rd, io_lvc_fn *fn, void *arg)
+{
+    io_lvc *ch = rd->ch;
+    atomic_ullong *changed = ch->changed[rd->id];
+    size_t count = 0;
+
+    for (size_t w = 0; w < ch->nwords; w++) {
+        ullong bits;
+        if (!atomic_load_explicit(&changed[w], memory_order_relaxed)) continue;
+        bits = atomic_exchange_explicit(&changed[w], 0, memory_order_acquire);
+        /* order the clear before the sequence loads, pairing with the
+         * fence in io_lvc_write */
+        atomic_thread_fence(memory_order_seq_cst);
+        while (bits) {
+            size_t key = (w << 6) + ctz_u64(bits);
+            uint seq = io_lvc_read(ch, key, rd->value);
+            bits &= bits - 1;
+            if (seq == rd->seen[key]) continue;
+            rd->seen[key] = seq;
+            fn(arg, key, rd->value, seq);
+            count++;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,222 @@
+/*
+ * pipe buffer readiness notification
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "buffer.h"
+
+/*
+ * eventfd readiness notification
+ *
+ * io_notify wraps any io_buffer with a pair of eventfds so that threads
+ * waiting in epoll, poll or select can wait for a pipe buffer. the read
+ * eventfd becomes readable on an empty to non-empty transition and the
+ * write eventfd becomes readable on a full to has-space transition.
+ *
+ * notifications are edge triggered by an armed flag. a consumer that
+ * finds the buffer empty calls io_notify_arm_read before it waits, and
+ * the first commit that follows clears the flag and signals the eventfd.
+ * commits that find the flag clear perform no system call, so a busy
+ * stream pays one fence and one load per commit and nothing more.
+ *
+ *   for (;;) {
+ *       io_span t = io_buffer_read_lock(&n.io, len);
+ *       if (t.length == 0) {
+ *           if (io_notify_arm_read(&n) == 0) epoll_wait(...);
+ *           io_notify_ack_read(&n);
+ *           continue;
+ *       }
+ *       ...
+ *       io_buffer_read_commit(&n.io, t);
+ *   }
+ *
+ * wakeups may be spurious, for example when a commit races with arming,
+ * so waiters always retry the operation after waking.
+ */
+
+typedef struct io_notify io_notify;
+
+struct io_notify
+{
+    io_buffer io;
+    io_buffer *inner;
+    int read_fd;
+    int write_fd;
+    size_t _pad[5];
+    atomic_uint read_armed;
+    uint _pad1[15];
+    atomic_uint write_armed;
+    uint _pad2[15];
+};
+
+static io_buffer_ops io_notify_ops;
+
+static int io_notify_init(io_notify *n, io_buffer *inner)
+{
+    n->io.ops = &io_notify_ops;
+    n->inner = inner;
+    n->read_armed = 0;
+    n->write_armed = 0;
+    n->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    n->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (n->read_fd < 0 || n->write_fd < 0) {
+        if (n->read_fd >= 0) close(n->read_fd);
+        if (n->write_fd >= 0) close(n->write_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void io_notify_destroy(io_notify *n)
+{
+    close(n->read_fd);
+    close(n->write_fd);
+    n->read_fd = n->write_fd = -1;
+}
+
+static int io_notify_read_fd(io_notify *n)
+{
+    return n->read_fd;
+}
+
+static int io_notify_write_fd(io_notify *n)
+{
+    return n->write_fd;
+}
+
+static void io_notify_signal(atomic_uint *armed, int fd)
+{
+    /* the fence orders the marker store in the commit before the load
+     * of the armed flag, pairing with the fence in io_notify_arm. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(armed, memory_order_relaxed) &&
+        atomic_exchange_explicit(armed, 0, memory_order_relaxed)) {
+        ullong one = 1;
+        ssize_t r = write(fd, &one, sizeof(one));
+        (void)r;
+    }
+}
+
+static int io_notify_arm(atomic_uint *armed, io_buffer *inner,
+    io_read_avail_fn *avail)
+{
+    atomic_store_explicit(armed, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (avail(inner) > 0) {
+        atomic_store_explicit(armed, 0, memory_order_relaxed);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * arm the read or write notification. returns 0 if armed, in which case
+ * the caller may wait on the eventfd, or 1 if the buffer is already
+ * readable or writable, in which case the caller should retry now.
+ */
+static int io_notify_arm_read(io_notify *n)
+{
+    return io_notify_arm(&n->read_armed, n->inner,
+        n->inner->ops->read_avail);
+}
+
+static int io_notify_arm_write(io_notify *n)
+{
+    return io_notify_arm(&n->write_armed, n->inner,
+        n->inner->ops->write_avail);
+}
+
+/* consume a signalled eventfd after waking so it can be signalled again */
+static void io_notify_ack(int fd)
+{
+    ullong val;
+    ssize_t r = read(fd, &val, sizeof(val));
+    (void)r;
+}
+
+static void io_notify_ack_read(io_notify *n)
+{
+    io_notify_ack(n->read_fd);
+}
+
+static void io_notify_ack_write(io_notify *n)
+{
+    io_notify_ack(n->write_fd);
+}
+
+static size_t io_notify_read(io_notify *n, char *buf, size_t len)
+{
+    size_t r = io_buffer_read(n->inner, buf, len);
+    if (r) io_notify_signal(&n->write_armed, n->write_fd);
+    return r;
+}
+
+static size_t io_notify_write(io_notify *n, char *buf, size_t len)
+{
+    size_t r = io_buffer_write(n->inner, buf, len);
+    if (r) io_notify_signal(&n->read_armed, n->read_fd);
+    return r;
+}
+
+static io_span io_notify_read_lock(io_notify *n, size_t len)
+{
+    return io_buffer_read_lock(n->inner, len);
+}
+
+static io_span io_notify_write_lock(io_notify *n, size_t len)
+{
+    return io_buffer_write_lock(n->inner, len);
+}
+
+static int io_notify_read_commit(io_notify *n, io_span ticket)
+{
+    int r = io_buffer_read_commit(n->inner, ticket);
+    if (ticket.length) io_notify_signal(&n->write_armed, n->write_fd);
+    return r;
+}
+
+static int io_notify_write_commit(io_notify *n, io_span ticket)
+{
+    int r = io_buffer_write_commit(n->inner, ticket);
+    if (ticket.length) io_notify_signal(&n->read_armed, n->read_fd);
+    return r;
+}
+
+static size_t io_notify_read_avail(io_notify *n)
+{
+    return io_buffer_read_avail(n->inner);
+}
+
+static size_t io_notify_write_avail(io_notify *n)
+{
+    return io_buffer_write_avail(n->inner);
+}
+
+static io_buffer_ops io_notify_ops =
+{
+    (io_read_fn *)io_notify_read,
+    (io_write_fn *)io_notify_write,
+    (io_read_lock_fn *)io_notify_read_lock,
+    (io_write_lock_fn *)io_notify_write_lock,
+    (io_read_commit_fn *)io_notify_read_commit,
+    (io_write_commit_fn *)io_notify_write_commit,
+    (io_read_avail_fn *)io_notify_read_avail,
+    (io_write_avail_fn *)io_notify_write_avail
+};
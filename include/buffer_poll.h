@@ -0,0 +1,280 @@
+/*
+ * pipe buffer fan-in poll set
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <threads.h>
+
+#include "buffer.h"
+#include "futex.h"
+
+/*
+ * fan-in poll set
+ *
+ * io_poll lets one consumer service up to IO_POLL_MAX_RINGS pbs_buffer
+ * rings, each with its own producer, so producers never contend with
+ * each other. producers write through io_poll_write or io_poll_write_lock
+ * and io_poll_write_commit, which set the ring's bit in a shared ready
+ * bitmap when it is clear. the bit is only clear after the consumer has
+ * found the ring empty, so a busy producer loads the bitmap and nothing
+ * more, and the read-modify-write happens on empty to non-empty
+ * transitions.
+ *
+ * the consumer reads through the poll set's own io_buffer interface. it
+ * scans the bitmap with ctz starting after the last ring it served, so
+ * ready rings are drained round robin, clears the bit of a ring it finds
+ * empty and rechecks the ring so a racing write is not missed. when all
+ * rings are empty the consumer may block in io_poll_wait, which sleeps on
+ * a futex that producers only wake when a waiter is announced.
+ *
+ *   for (;;) {
+ *       io_span t = io_buffer_read_lock(&ps.io, len);
+ *       if (t.length == 0) {
+ *           io_poll_wait(&ps, NULL);
+ *           continue;
+ *       }
+ *       ...
+ *       io_buffer_read_commit(&ps.io, t);
+ *   }
+ *
+ * only the consumer may use the read interface. writes through the
+ * io_buffer interface are not supported because the ring must be named.
+ */
+
+#define IO_POLL_MAX_RINGS 64
+#define IO_POLL_SPIN 64
+
+typedef struct io_poll io_poll;
+
+struct io_poll
+{
+    io_buffer io;
+    size_t nrings;
+    uint cursor;
+    uint current;
+    size_t _pad[4];
+    atomic_ullong ready;
+    atomic_uint wait_seq;
+    atomic_uint waiters;
+    size_t _pad1[6];
+    pbs_buffer *rings[IO_POLL_MAX_RINGS];
+};
+
+static io_buffer_ops io_poll_ops;
+
+static void io_poll_init(io_poll *ps)
+{
+    ps->io.ops = &io_poll_ops;
+    ps->nrings = 0;
+    ps->cursor = 0;
+    ps->current = 0;
+    ps->ready = 0;
+    ps->wait_seq = 0;
+    ps->waiters = 0;
+}
+
+/* register a ring before use. returns its index or -1 if the set is full */
+static int io_poll_add(io_poll *ps, pbs_buffer *pb)
+{
+    if (ps->nrings == IO_POLL_MAX_RINGS) return -1;
+    ps->rings[ps->nrings] = pb;
+    return (int)ps->nrings++;
+}
+
+/*
+ * mark a ring ready after a commit. the fence orders the end marker
+ * store before the bitmap load, pairing with the fence in io_poll_unmark,
+ * and the second fence orders the bitmap update before the waiter load,
+ * pairing with the waiter increment in io_poll_wait.
+ */
+static void io_poll_mark(io_poll *ps, uint idx)
+{
+    ullong bit = 1ull << idx;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ps->ready, memory_order_relaxed) & bit) return;
+    atomic_fetch_or_explicit(&ps->ready, bit, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ps->waiters, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&ps->wait_seq, 1, memory_order_release);
+#if HAS_FUTEX
+        futex_wake(&ps->wait_seq, 1, 0);
+#endif
+    }
+}
+
+/* clear an empty ring's bit, restoring it if a write raced with us */
+static void io_poll_unmark(io_poll *ps, uint idx)
+{
+    ullong bit = 1ull << idx;
+
+    atomic_fetch_and(&ps->ready, ~bit);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pbs_buffer_read_avail(ps->rings[idx]) > 0) {
+        atomic_fetch_or(&ps->ready, bit);
+    }
+}
+
+/* pick the next ready ring at or after the cursor, wrapping around */
+static uint io_poll_select(io_poll *ps, ullong bits)
+{
+    ullong after = ps->cursor < 64 ? bits & (~0ull << ps->cursor) : 0;
+    return ctz(after ? after : bits);
+}
+
+static size_t io_poll_write(io_poll *ps, uint idx, char *buf, size_t len)
+{
+    size_t r = pbs_buffer_write(ps->rings[idx], buf, len);
+    if (r) io_poll_mark(ps, idx);
+    return r;
+}
+
+static io_span io_poll_write_lock(io_poll *ps, uint idx, size_t len)
+{
+    return pbs_buffer_write_lock(ps->rings[idx], len);
+}
+
+static int io_poll_write_commit(io_poll *ps, uint idx, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    pbs_buffer_write_commit(ps->rings[idx], ticket);
+    io_poll_mark(ps, idx);
+    return 0;
+}
+
+static size_t io_poll_read(io_poll *ps, char *buf, size_t len)
+{
+    ullong bits;
+    uint idx;
+    size_t r;
+
+    while ((bits = atomic_load_explicit(&ps->ready,
+        memory_order_acquire)) != 0) {
+        idx = io_poll_select(ps, bits);
+        ps->cursor = idx + 1;
+        if ((r = pbs_buffer_read(ps->rings[idx], buf, len)) > 0) return r;
+        io_poll_unmark(ps, idx);
+    }
+
+    return 0;
+}
+
+/* the ring of the last lock is remembered for the commit */
+static io_span io_poll_read_lock(io_poll *ps, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    ullong bits;
+    uint idx;
+
+    while ((bits = atomic_load_explicit(&ps->ready,
+        memory_order_acquire)) != 0) {
+        idx = io_poll_select(ps, bits);
+        ps->cursor = idx + 1;
+        ticket = pbs_buffer_read_lock(ps->rings[idx], len);
+        if (ticket.length > 0) {
+            ps->current = idx;
+            return ticket;
+        }
+        io_poll_unmark(ps, idx);
+    }
+
+    return ticket;
+}
+
+static int io_poll_read_commit(io_poll *ps, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    return pbs_buffer_read_commit(ps->rings[ps->current], ticket);
+}
+
+static size_t io_poll_read_avail(io_poll *ps)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < ps->nrings; i++) {
+        n += pbs_buffer_read_avail(ps->rings[i]);
+    }
+    return n;
+}
+
+/*
+ * wait until a ring is marked ready. returns 0 when a ring may be ready
+ * and -1 if the optional CLOCK_MONOTONIC deadline expired. yields briefly
+ * before announcing itself as a waiter, as producers that are mid-write
+ * are cheaper to wait for than a sleep and wake. the sequence is sampled
+ * before the bitmap is rechecked so a mark that races with the recheck
+ * makes futex_wait return early. wakeups may be spurious.
+ */
+static int io_poll_wait(io_poll *ps, const struct timespec *deadline)
+{
+    uint val;
+    int r = 0;
+
+    for (int i = 0; i < IO_POLL_SPIN; i++) {
+        if (atomic_load_explicit(&ps->ready, memory_order_acquire)) return 0;
+        thrd_yield();
+    }
+
+    val = atomic_load_explicit(&ps->wait_seq, memory_order_acquire);
+    atomic_fetch_add_explicit(&ps->waiters, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&ps->ready, memory_order_seq_cst) == 0) {
+#if HAS_FUTEX
+        r = futex_wait(&ps->wait_seq, val, deadline, 0);
+#else
+        (void)val;
+        (void)deadline;
+        thrd_yield();
+#endif
+    }
+    atomic_fetch_sub_explicit(&ps->waiters, 1, memory_order_relaxed);
+
+    return r;
+}
+
+static size_t io_poll_none_write(io_poll *ps, char *buf, size_t len)
+{
+    return 0;
+}
+
+static io_span io_poll_none_write_lock(io_poll *ps, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    return ticket;
+}
+
+static int io_poll_none_write_commit(io_poll *ps, io_span ticket)
+{
+    return -1;
+}
+
+static size_t io_poll_none_write_avail(io_poll *ps)
+{
+    return 0;
+}
+
+static io_buffer_ops io_poll_ops =
+{
+    (io_read_fn *)io_poll_read,
+    (io_write_fn *)io_poll_none_write,
+    (io_read_lock_fn *)io_poll_read_lock,
+    (io_write_lock_fn *)io_poll_none_write_lock,
+    (io_read_commit_fn *)io_poll_read_commit,
+    (io_write_commit_fn *)io_poll_none_write_commit,
+    (io_read_avail_fn *)io_poll_read_avail,
+    (io_write_avail_fn *)io_poll_none_write_avail
+};
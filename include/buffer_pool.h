@@ -0,0 +1,321 @@
+/*
+ * pipe buffer parallel span operations
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <threads.h>
+
+#include "buffer.h"
+
+/*
+ * parallel map and reduce over locked spans
+ *
+ * io_span_parallel_for and io_span_parallel_reduce split a span returned
+ * by read_lock or write_lock into chunks and run them on an io_pool. the
+ * calling thread takes part in the work and returns only after every
+ * chunk is complete, so the span can be committed as soon as the call
+ * returns.
+ *
+ *   io_span t = io_buffer_read_lock(io, 32768);
+ *   io_span_parallel_reduce(&pool, t, 4096, sum_fn, add_fn, NULL,
+ *       &zero, &sum, sizeof(sum));
+ *   io_buffer_read_commit(io, t);
+ *
+ * chunk boundaries fall on cache line boundaries, so chunks processed on
+ * different cores never share a line, and chunk sizes are rounded up to
+ * a multiple of the cache line. records up to the size of a cache line
+ * are not split provided the span is aligned to the record size.
+ *
+ * each participant starts with an equal range of chunk indices packed
+ * into one 64-bit word. it takes chunks from the low end of its own range
+ * and when that is empty steals the upper half of another participant's
+ * range, so both sides of a steal are a single compare and swap. work is
+ * only ever moved, never created, so a participant finishes when its own
+ * range and every range it scans are empty.
+ *
+ * reductions keep one accumulator per participant, initialized from the
+ * identity value, and combine them into result after the join. stealing
+ * reorders chunks, so the combine function must be associative and
+ * commutative.
+ */
+
+#define IO_POOL_MAX_THREADS 64
+#define IO_POOL_LINE 64
+#define IO_POOL_ACC_SIZE 64
+
+typedef void (io_span_for_fn)(void *arg, char *buf, size_t len);
+typedef void (io_span_reduce_fn)(void *arg, const char *buf, size_t len,
+    void *acc);
+typedef void (io_span_combine_fn)(void *arg, void *acc, const void *other);
+
+typedef struct io_pool io_pool;
+typedef struct io_pool_slot io_pool_slot;
+typedef struct io_pool_job io_pool_job;
+typedef struct io_pool_worker io_pool_worker;
+
+struct io_pool_slot
+{
+    atomic_ullong range;
+    char _pad[IO_POOL_LINE - sizeof(atomic_ullong)];
+    char acc[IO_POOL_ACC_SIZE];
+};
+
+struct io_pool_job
+{
+    char *buf;
+    char *end;
+    uintptr_t base;
+    size_t chunk;
+    io_span_for_fn *for_fn;
+    io_span_reduce_fn *reduce_fn;
+    void *arg;
+};
+
+struct io_pool_worker
+{
+    io_pool *pool;
+    size_t id;
+};
+
+struct io_pool
+{
+    size_t nthreads;
+    io_pool_job job;
+    mtx_t mutex;
+    cnd_t cond;
+    uint epoch;
+    int stop;
+    atomic_size_t pending;
+    thrd_t threads[IO_POOL_MAX_THREADS];
+    io_pool_worker workers[IO_POOL_MAX_THREADS];
+    io_pool_slot slots[IO_POOL_MAX_THREADS];
+};
+
+static ullong io_pool_pack(uint lo, uint hi)
+{
+    return (ullong)lo | ((ullong)hi << 32);
+}
+
+static uint io_pool_lo(ullong range) { return (uint)range; }
+static uint io_pool_hi(ullong range) { return (uint)(range >> 32); }
+
+/* take the next chunk from the low end of our own range */
+static int io_pool_take(io_pool_slot *slot, uint *idx)
+{
+    ullong range = atomic_load_explicit(&slot->range, memory_order_relaxed);
+    do {
+        if (io_pool_lo(range) >= io_pool_hi(range)) return 0;
+        *idx = io_pool_lo(range);
+    } while (!atomic_compare_exchange_weak_explicit(&slot->range, &range,
+        io_pool_pack(io_pool_lo(range) + 1, io_pool_hi(range)),
+        memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+
+/*
+ * steal the upper half of a victim's range. the first stolen chunk is
+ * returned and the rest become our range, which is empty when we steal
+ * so no other participant can be modifying it.
+ */
+static int io_pool_steal(io_pool *pool, size_t id, uint *idx)
+{
+    size_t n = pool->nthreads;
+
+    for (size_t i = 1; i < n; i++) {
+        io_pool_slot *victim = &pool->slots[(id + i) % n];
+        ullong range = atomic_load_explicit(&victim->range,
+            memory_order_relaxed);
+        uint lo, hi, k;
+        do {
+            lo = io_pool_lo(range);
+            hi = io_pool_hi(range);
+            if (lo >= hi) break;
+            k = (hi - lo + 1) >> 1;
+        } while (!atomic_compare_exchange_weak_explicit(&victim->range,
+            &range, io_pool_pack(lo, hi - k),
+            memory_order_relaxed, memory_order_relaxed));
+        if (lo >= hi) continue;
+        *idx = hi - k;
+        atomic_store_explicit(&pool->slots[id].range,
+            io_pool_pack(hi - k + 1, hi), memory_order_relaxed);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void io_pool_chunk(io_pool *pool, size_t id, uint idx)
+{
+    io_pool_job *job = &pool->job;
+    char *buf = (char*)(job->base + (uintptr_t)idx * job->chunk);
+    char *end = buf + job->chunk;
+
+    if (buf < job->buf) buf = job->buf;
+    if (end > job->end) end = job->end;
+
+    if (job->reduce_fn) {
+        job->reduce_fn(job->arg, buf, end - buf, pool->slots[id].acc);
+    } else {
+        job->for_fn(job->arg, buf, end - buf);
+    }
+}
+
+static void io_pool_run(io_pool *pool, size_t id)
+{
+    uint idx;
+
+    for (;;) {
+        while (io_pool_take(&pool->slots[id], &idx)) {
+            io_pool_chunk(pool, id, idx);
+        }
+        if (!io_pool_steal(pool, id, &idx)) break;
+        io_pool_chunk(pool, id, idx);
+    }
+}
+
+static int io_pool_thread(void *arg)
+{
+    io_pool_worker *w = (io_pool_worker*)arg;
+    io_pool *pool = w->pool;
+    uint epoch = 0;
+
+    for (;;) {
+        mtx_lock(&pool->mutex);
+        while (pool->epoch == epoch && !pool->stop) {
+            cnd_wait(&pool->cond, &pool->mutex);
+        }
+        epoch = pool->epoch;
+        if (pool->stop) {
+            mtx_unlock(&pool->mutex);
+            break;
+        }
+        mtx_unlock(&pool->mutex);
+
+        io_pool_run(pool, w->id);
+        atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_release);
+    }
+
+    return 0;
+}
+
+/*
+ * create a pool of nthreads participants. the calling thread is one of
+ * them, so nthreads - 1 worker threads are started.
+ */
+static int io_pool_init(io_pool *pool, size_t nthreads)
+{
+    assert(nthreads > 0 && nthreads <= IO_POOL_MAX_THREADS);
+    memset(pool, 0, sizeof(io_pool));
+    if (mtx_init(&pool->mutex, mtx_plain) != thrd_success) return -1;
+    if (cnd_init(&pool->cond) != thrd_success) return -1;
+    for (pool->nthreads = 1; pool->nthreads < nthreads; pool->nthreads++) {
+        io_pool_worker *w = &pool->workers[pool->nthreads];
+        w->pool = pool;
+        w->id = pool->nthreads;
+        if (thrd_create(&pool->threads[pool->nthreads], io_pool_thread, w)
+            != thrd_success) return -1;
+    }
+    return 0;
+}
+
+static void io_pool_destroy(io_pool *pool)
+{
+    int res;
+
+    mtx_lock(&pool->mutex);
+    pool->stop = 1;
+    cnd_broadcast(&pool->cond);
+    mtx_unlock(&pool->mutex);
+    for (size_t i = 1; i < pool->nthreads; i++) {
+        thrd_join(pool->threads[i], &res);
+    }
+    cnd_destroy(&pool->cond);
+    mtx_destroy(&pool->mutex);
+}
+
+static size_t io_pool_threads(io_pool *pool)
+{
+    return pool->nthreads;
+}
+
+static void io_pool_dispatch(io_pool *pool, io_span span, size_t chunk)
+{
+    io_pool_job *job = &pool->job;
+    size_t n = pool->nthreads;
+    uint nchunks;
+
+    chunk = (chunk + IO_POOL_LINE - 1) & ~(size_t)(IO_POOL_LINE - 1);
+    if (chunk == 0) chunk = IO_POOL_LINE;
+    job->buf = span.buf;
+    job->end = span.buf + span.length;
+    job->base = (uintptr_t)span.buf & ~(uintptr_t)(IO_POOL_LINE - 1);
+    job->chunk = chunk;
+    nchunks = (uint)(((uintptr_t)job->end - job->base + chunk - 1) / chunk);
+
+    for (size_t i = 0; i < n; i++) {
+        atomic_store_explicit(&pool->slots[i].range, io_pool_pack(
+            (uint)(nchunks * i / n), (uint)(nchunks * (i + 1) / n)),
+            memory_order_relaxed);
+    }
+
+    /* the mutex publishes the job and ranges to the workers */
+    if (n > 1) {
+        mtx_lock(&pool->mutex);
+        atomic_store_explicit(&pool->pending, n - 1, memory_order_relaxed);
+        pool->epoch++;
+        cnd_broadcast(&pool->cond);
+        mtx_unlock(&pool->mutex);
+    }
+
+    io_pool_run(pool, 0);
+
+    while (atomic_load_explicit(&pool->pending, memory_order_acquire) > 0) {
+        thrd_yield();
+    }
+}
+
+static void io_span_parallel_for(io_pool *pool, io_span span, size_t chunk,
+    io_span_for_fn *fn, void *arg)
+{
+    if (span.length == 0) return;
+    pool->job.for_fn = fn;
+    pool->job.reduce_fn = NULL;
+    pool->job.arg = arg;
+    io_pool_dispatch(pool, span, chunk);
+}
+
+static void io_span_parallel_reduce(io_pool *pool, io_span span,
+    size_t chunk, io_span_reduce_fn *fn, io_span_combine_fn *combine,
+    void *arg, const void *identity, void *result, size_t size)
+{
+    assert(size <= IO_POOL_ACC_SIZE);
+    memcpy(result, identity, size);
+    if (span.length == 0) return;
+    for (size_t i = 0; i < pool->nthreads; i++) {
+        memcpy(pool->slots[i].acc, identity, size);
+    }
+    pool->job.for_fn = NULL;
+    pool->job.reduce_fn = fn;
+    pool->job.arg = arg;
+    io_pool_dispatch(pool, span, chunk);
+    memcpy(result, pool->slots[0].acc, size);
+    for (size_t i = 1; i < pool->nthreads; i++) {
+        combine(arg, result, pool->slots[i].acc);
+    }
+}
@@ -0,0 +1,267 @@
+/*
+ * pipe buffer priority lanes
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * prioritized channel
+ *
+ * io_prio holds up to IO_PRIO_MAX_LANES pbm_buffer lanes, lane 0 being
+ * the highest priority. producers write to a lane explicitly and the
+ * channel's own io_buffer interface reads from the highest priority
+ * non-empty lane, so consumers use the normal read_lock and read_commit.
+ * writes through the io_buffer interface go to the default lane, which
+ * is the lowest priority lane unless changed.
+ *
+ * lane selection scans a bitmap of non-empty lanes with ctz. writers set
+ * a lane's bit after committing, skipping the atomic if it is already
+ * set, and readers clear it when they find the lane empty and then check
+ * the lane again, so a write that raced with the clear is not missed.
+ *
+ * lanes with weight zero are strict priority. lanes with a weight share
+ * the remaining reads by credit: each read from a weighted lane spends a
+ * credit, a lane with no credit is skipped while another non-empty lane
+ * has credit, and all credits are refilled when no non-empty weighted
+ * lane has any left. weighted lanes therefore receive weight reads in
+ * turn and cannot starve each other, while lanes are still compared in
+ * priority order, so a strict lane below a busy weighted lane waits.
+ *
+ * tickets carry the lane in the bits of sequence above
+ * IO_PRIO_LANE_SHIFT, so commits go to the lane that issued them.
+ */
+
+#define IO_PRIO_MAX_LANES 8
+#define IO_PRIO_LANE_SHIFT 24
+
+typedef struct io_prio io_prio;
+
+struct io_prio
+{
+    io_buffer io;
+    uint nlanes;
+    uint write_lane;
+    uint strict;
+    atomic_uint nonempty;
+    atomic_uint credit;
+    uint weight[IO_PRIO_MAX_LANES];
+    atomic_uint remain[IO_PRIO_MAX_LANES];
+    pbm_buffer lanes[IO_PRIO_MAX_LANES];
+};
+
+static io_buffer_ops io_prio_ops;
+
+static void io_prio_init(io_prio *pr, uint nlanes, size_t capacity)
+{
+    assert(nlanes > 0 && nlanes <= IO_PRIO_MAX_LANES);
+    pr->io.ops = &io_prio_ops;
+    pr->nlanes = nlanes;
+    pr->write_lane = nlanes - 1;
+    pr->strict = (1u << nlanes) - 1;
+    pr->nonempty = 0;
+    pr->credit = 0;
+    for (uint i = 0; i < nlanes; i++) {
+        pr->weight[i] = 0;
+        pr->remain[i] = 0;
+        pbm_buffer_init(&pr->lanes[i], capacity);
+    }
+}
+
+static void io_prio_destroy(io_prio *pr)
+{
+    for (uint i = 0; i < pr->nlanes; i++) {
+        pbm_buffer_destroy(&pr->lanes[i]);
+    }
+}
+
+/* weight zero makes a lane strict priority. call before use. */
+static void io_prio_set_weight(io_prio *pr, uint lane, uint weight)
+{
+    assert(lane < pr->nlanes);
+    pr->weight[lane] = weight;
+    if (weight) pr->strict &= ~(1u << lane);
+    else pr->strict |= 1u << lane;
+}
+
+static void io_prio_set_write_lane(io_prio *pr, uint lane)
+{
+    assert(lane < pr->nlanes);
+    pr->write_lane = lane;
+}
+
+static void io_prio_mark(io_prio *pr, uint lane)
+{
+    uint bit = 1u << lane;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!(atomic_load_explicit(&pr->nonempty, memory_order_relaxed) & bit)) {
+        atomic_fetch_or_explicit(&pr->nonempty, bit, memory_order_release);
+    }
+}
+
+/* clear an empty lane's bit, restoring it if a write raced with us */
+static void io_prio_unmark(io_prio *pr, uint lane)
+{
+    uint bit = 1u << lane;
+
+    atomic_fetch_and(&pr->nonempty, ~bit);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pbm_buffer_read_avail(&pr->lanes[lane]) > 0) {
+        atomic_fetch_or(&pr->nonempty, bit);
+    }
+}
+
+static uint io_prio_select(io_prio *pr, uint bits)
+{
+    uint credit = atomic_load_explicit(&pr->credit, memory_order_relaxed);
+    uint weighted = bits & ~pr->strict, lane;
+
+    if (weighted && !(weighted & credit)) {
+        credit = 0;
+        for (uint i = 0; i < pr->nlanes; i++) {
+            atomic_store_explicit(&pr->remain[i], pr->weight[i],
+                memory_order_relaxed);
+            if (pr->weight[i]) credit |= 1u << i;
+        }
+        atomic_store_explicit(&pr->credit, credit, memory_order_relaxed);
+    }
+
+    lane = ctz(bits & (pr->strict | credit));
+    if (!(pr->strict & (1u << lane)) && atomic_fetch_sub_explicit(
+        &pr->remain[lane], 1, memory_order_relaxed) <= 1) {
+        atomic_fetch_and_explicit(&pr->credit, ~(1u << lane),
+            memory_order_relaxed);
+    }
+
+    return lane;
+}
+
+static io_span io_prio_tag(io_span t, uint lane)
+{
+    t.sequence |= (size_t)lane << IO_PRIO_LANE_SHIFT;
+    return t;
+}
+
+static io_span io_prio_untag(io_span t, uint *lane)
+{
+    *lane = (uint)(t.sequence >> IO_PRIO_LANE_SHIFT);
+    t.sequence &= ((size_t)1 << IO_PRIO_LANE_SHIFT) - 1;
+    return t;
+}
+
+static size_t io_prio_write(io_prio *pr, uint lane, char *buf, size_t len)
+{
+    size_t r = pbm_buffer_write(&pr->lanes[lane], buf, len);
+    if (r) io_prio_mark(pr, lane);
+    return r;
+}
+
+static io_span io_prio_write_lock(io_prio *pr, uint lane, size_t len)
+{
+    return io_prio_tag(pbm_buffer_write_lock(&pr->lanes[lane], len), lane);
+}
+
+static int io_prio_write_commit(io_prio *pr, io_span ticket)
+{
+    uint lane;
+
+    if (ticket.length == 0) return 0;
+    ticket = io_prio_untag(ticket, &lane);
+    pbm_buffer_write_commit(&pr->lanes[lane], ticket);
+    io_prio_mark(pr, lane);
+    return 0;
+}
+
+static size_t io_prio_read(io_prio *pr, char *buf, size_t len)
+{
+    uint bits, lane;
+    size_t r;
+
+    while ((bits = atomic_load_explicit(&pr->nonempty,
+        memory_order_acquire)) != 0) {
+        lane = io_prio_select(pr, bits);
+        if ((r = pbm_buffer_read(&pr->lanes[lane], buf, len)) > 0) return r;
+        io_prio_unmark(pr, lane);
+    }
+
+    return 0;
+}
+
+static io_span io_prio_read_lock(io_prio *pr, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    uint bits, lane;
+
+    while ((bits = atomic_load_explicit(&pr->nonempty,
+        memory_order_acquire)) != 0) {
+        lane = io_prio_select(pr, bits);
+        ticket = pbm_buffer_read_lock(&pr->lanes[lane], len);
+        if (ticket.length > 0) return io_prio_tag(ticket, lane);
+        io_prio_unmark(pr, lane);
+    }
+
+    return ticket;
+}
+
+static int io_prio_read_commit(io_prio *pr, io_span ticket)
+{
+    uint lane;
+
+    if (ticket.length == 0) return 0;
+    ticket = io_prio_untag(ticket, &lane);
+    return pbm_buffer_read_commit(&pr->lanes[lane], ticket);
+}
+
+static size_t io_prio_default_write(io_prio *pr, char *buf, size_t len)
+{
+    return io_prio_write(pr, pr->write_lane, buf, len);
+}
+
+static io_span io_prio_default_write_lock(io_prio *pr, size_t len)
+{
+    return io_prio_write_lock(pr, pr->write_lane, len);
+}
+
+static size_t io_prio_read_avail(io_prio *pr)
+{
+    size_t n = 0;
+
+    for (uint i = 0; i < pr->nlanes; i++) {
+        n += pbm_buffer_read_avail(&pr->lanes[i]);
+    }
+    return n;
+}
+
+static size_t io_prio_write_avail(io_prio *pr)
+{
+    return pbm_buffer_write_avail(&pr->lanes[pr->write_lane]);
+}
+
+static io_buffer_ops io_prio_ops =
+{
+    (io_read_fn *)io_prio_read,
+    (io_write_fn *)io_prio_default_write,
+    (io_read_lock_fn *)io_prio_read_lock,
+    (io_write_lock_fn *)io_prio_default_write_lock,
+    (io_read_commit_fn *)io_prio_read_commit,
+    (io_write_commit_fn *)io_prio_write_commit,
+    (io_read_avail_fn *)io_prio_read_avail,
+    (io_write_avail_fn *)io_prio_write_avail
+};
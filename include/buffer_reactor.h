@@ -0,0 +1,437 @@
+/*
+ * pipe buffer reactor
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <threads.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "buffer.h"
+#include "buffer_timed.h"
+#include "futex.h"
+
+/*
+ * multi-buffer reactor
+ *
+ * io_reactor lets one thread serve up to IO_REACTOR_MAX buffers, such as
+ * pbs_buffer or pbm_buffer, and sleep until any of them is ready. each
+ * source is registered with an interest and a callback:
+ *
+ * - IO_REACTOR_READ sources are drained. the callback is passed spans
+ *   from read_lock, which the reactor commits when the callback returns.
+ * - IO_REACTOR_WRITE sources are filled. the callback must fill the whole
+ *   span from write_lock, which the reactor then commits.
+ *
+ * the peers of the reactor, the producers of a read source and consumers
+ * of a write source, use the source's own io_buffer interface returned by
+ * io_reactor_io. it forwards to the buffer and signals the reactor after
+ * commits, but only when the reactor has armed the source before going
+ * to sleep, so a busy peer pays a fence and a load per commit.
+ *
+ * io_reactor_poll dispatches up to IO_REACTOR_BATCH spans from each ready
+ * source in turn. when no source is ready it yields for IO_REACTOR_SPIN
+ * rounds, then arms every source, rechecks them, and sleeps:
+ *
+ * - IO_REACTOR_FUTEX waits with futex_waitv on a 32-bit sequence word
+ *   per source, which armed commits bump and wake. the buffer markers are
+ *   64-bit, and futex_waitv only supports 32-bit words.
+ * - IO_REACTOR_EPOLL waits in epoll on an eventfd per source, for kernels
+ *   before 5.16 that lack futex_waitv.
+ *
+ *   io_reactor_init(&r, IO_REACTOR_AUTO);
+ *   idx = io_reactor_add(&r, &pb.io, IO_REACTOR_READ, 4096, drain, arg);
+ *   ... producer writes to io_reactor_io(&r, idx) ...
+ *   io_reactor_run(&r);
+ *
+ * io_reactor_stop may be called from any thread to end io_reactor_run.
+ */
+
+#define IO_REACTOR_MAX 64
+#define IO_REACTOR_BATCH 16
+#define IO_REACTOR_SPIN 64
+
+enum { IO_REACTOR_READ = 1, IO_REACTOR_WRITE = 2 };
+enum { IO_REACTOR_AUTO, IO_REACTOR_FUTEX, IO_REACTOR_EPOLL };
+
+typedef struct io_reactor io_reactor;
+typedef struct io_reactor_src io_reactor_src;
+
+typedef void (io_reactor_fn)(void *arg, io_span span);
+
+struct io_reactor_src
+{
+    io_buffer io;
+    io_buffer *inner;
+    io_reactor *r;
+    io_reactor_fn *fn;
+    void *arg;
+    size_t len;
+    int events;
+    int fd;
+    atomic_uint seq;
+    atomic_uint armed;
+    size_t _pad[8];
+};
+
+struct io_reactor
+{
+    int backend;
+    int epfd;
+    int stop_fd;
+    atomic_uint stop;
+    atomic_uint stop_seq;
+    size_t nsrcs;
+    size_t sleeps;
+    io_reactor_src srcs[IO_REACTOR_MAX];
+#if HAS_FUTEX_WAITV
+    struct futex_waitv wv[IO_REACTOR_MAX + 1];
+#endif
+};
+
+static io_buffer_ops io_reactor_src_ops;
+
+static int io_reactor_epoll_add(io_reactor *r, int fd, uint idx)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = idx;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* returns 0, or -1 if the backend is unavailable or its setup failed */
+static int io_reactor_init(io_reactor *r, int backend)
+{
+    int has_waitv = 0;
+
+#if HAS_FUTEX_WAITV
+    has_waitv = futex_waitv_supported();
+#endif
+    if (backend == IO_REACTOR_AUTO) {
+        backend = has_waitv ? IO_REACTOR_FUTEX : IO_REACTOR_EPOLL;
+    }
+    if (backend == IO_REACTOR_FUTEX && !has_waitv) return -1;
+
+    r->backend = backend;
+    r->epfd = r->stop_fd = -1;
+    r->stop = 0;
+    r->stop_seq = 0;
+    r->nsrcs = 0;
+    r->sleeps = 0;
+
+    if (backend == IO_REACTOR_EPOLL) {
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        r->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->epfd < 0 || r->stop_fd < 0 ||
+            io_reactor_epoll_add(r, r->stop_fd, IO_REACTOR_MAX) < 0) {
+            if (r->epfd >= 0) close(r->epfd);
+            if (r->stop_fd >= 0) close(r->stop_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void io_reactor_destroy(io_reactor *r)
+{
+    if (r->backend != IO_REACTOR_EPOLL) return;
+    for (size_t i = 0; i < r->nsrcs; i++) close(r->srcs[i].fd);
+    close(r->stop_fd);
+    close(r->epfd);
+}
+
+/*
+ * register a buffer for IO_REACTOR_READ or IO_REACTOR_WRITE. callbacks are
+ * passed spans of at most len bytes. returns the source index or -1.
+ */
+static int io_reactor_add(io_reactor *r, io_buffer *inner, int events,
+    size_t len, io_reactor_fn *fn, void *arg)
+{
+    io_reactor_src *s;
+    uint idx = (uint)r->nsrcs;
+
+    assert(events == IO_REACTOR_READ || events == IO_REACTOR_WRITE);
+    if (idx == IO_REACTOR_MAX) return -1;
+
+    s = &r->srcs[idx];
+    s->io.ops = &io_reactor_src_ops;
+    s->inner = inner;
+    s->r = r;
+    s->fn = fn;
+    s->arg = arg;
+    s->len = len;
+    s->events = events;
+    s->fd = -1;
+    s->seq = 0;
+    s->armed = 0;
+
+    if (r->backend == IO_REACTOR_EPOLL) {
+        s->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s->fd < 0) return -1;
+        if (io_reactor_epoll_add(r, s->fd, idx) < 0) {
+            close(s->fd);
+            return -1;
+        }
+    }
+#if HAS_FUTEX_WAITV
+    futex_waitv_set(&r->wv[idx], &s->seq, 0, 0);
+#endif
+
+    r->nsrcs++;
+    return (int)idx;
+}
+
+/* the interface for the peers of source idx */
+static io_buffer *io_reactor_io(io_reactor *r, size_t idx)
+{
+    assert(idx < r->nsrcs);
+    return &r->srcs[idx].io;
+}
+
+static void io_reactor_kick(io_reactor *r, atomic_uint *seq, int fd)
+{
+    atomic_fetch_add_explicit(seq, 1, memory_order_release);
+    if (r->backend == IO_REACTOR_FUTEX) {
+#if HAS_FUTEX
+        futex_wake(seq, 1, 0);
+#endif
+    } else {
+        ullong one = 1;
+        ssize_t n = write(fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+/*
+ * wake the reactor if it armed the source. the fence orders the marker
+ * store in the commit before the load of the armed flag, pairing with the
+ * fence in io_reactor_sleep.
+ */
+static void io_reactor_signal(io_reactor_src *s)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&s->armed, memory_order_relaxed) &&
+        atomic_exchange_explicit(&s->armed, 0, memory_order_relaxed)) {
+        io_reactor_kick(s->r, &s->seq, s->fd);
+    }
+}
+
+/* end io_reactor_run, waking the reactor if it is asleep */
+static void io_reactor_stop(io_reactor *r)
+{
+    atomic_store_explicit(&r->stop, 1, memory_order_seq_cst);
+    io_reactor_kick(r, &r->stop_seq, r->stop_fd);
+}
+
+static int io_reactor_ready(io_reactor_src *s)
+{
+    return (s->events == IO_REACTOR_READ ? io_buffer_read_avail(s->inner) :
+        io_buffer_write_avail(s->inner)) > 0;
+}
+
+/* pass up to IO_REACTOR_BATCH spans to the callback, returning the bytes */
+static size_t io_reactor_dispatch(io_reactor_src *s)
+{
+    size_t n = 0;
+
+    for (int i = 0; i < IO_REACTOR_BATCH; i++) {
+        io_span t;
+        if (s->events == IO_REACTOR_READ) {
+            t = io_buffer_read_lock(s->inner, s->len);
+            if (t.length == 0) break;
+            s->fn(s->arg, t);
+            io_buffer_read_commit(s->inner, t);
+        } else {
+            t = io_buffer_write_lock(s->inner, s->len);
+            if (t.length == 0) break;
+            s->fn(s->arg, t);
+            io_buffer_write_commit(s->inner, t);
+        }
+        n += t.length;
+    }
+    return n;
+}
+
+static int io_reactor_any_ready(io_reactor *r)
+{
+    for (size_t i = 0; i < r->nsrcs; i++) {
+        if (io_reactor_ready(&r->srcs[i])) return 1;
+    }
+    return atomic_load_explicit(&r->stop, memory_order_relaxed) != 0;
+}
+
+static void io_reactor_disarm(io_reactor *r)
+{
+    for (size_t i = 0; i < r->nsrcs; i++) {
+        atomic_store_explicit(&r->srcs[i].armed, 0, memory_order_relaxed);
+    }
+}
+
+static void io_reactor_ack(int fd)
+{
+    ullong val;
+    ssize_t n = read(fd, &val, sizeof(val));
+    (void)n;
+}
+
+/*
+ * arm every source, recheck, and sleep until a source is signalled or the
+ * deadline passes. the sequence words are sampled before arming so that a
+ * signal racing with the recheck makes the futex wait return at once.
+ * returns -1 if the deadline expired, otherwise 0. wakeups may be spurious.
+ */
+static int io_reactor_sleep(io_reactor *r, const struct timespec *deadline)
+{
+    int ret = 0;
+
+#if HAS_FUTEX_WAITV
+    if (r->backend == IO_REACTOR_FUTEX) {
+        for (size_t i = 0; i < r->nsrcs; i++) {
+            r->wv[i].val = atomic_load_explicit(&r->srcs[i].seq,
+                memory_order_acquire);
+        }
+        futex_waitv_set(&r->wv[r->nsrcs], &r->stop_seq,
+            atomic_load_explicit(&r->stop_seq, memory_order_acquire), 0);
+    }
+#endif
+    for (size_t i = 0; i < r->nsrcs; i++) {
+        atomic_store_explicit(&r->srcs[i].armed, 1, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (io_reactor_any_ready(r)) {
+        io_reactor_disarm(r);
+        return 0;
+    }
+
+    r->sleeps++;
+    if (r->backend == IO_REACTOR_FUTEX) {
+#if HAS_FUTEX_WAITV
+        ret = futex_wait_any(r->wv, (uint)r->nsrcs + 1, deadline) < 0 ? -1 : 0;
+#endif
+    } else {
+        struct epoll_event ev[IO_REACTOR_MAX + 1];
+        llong left = io_deadline_left(deadline);
+        int timeout = left == LLONG_MAX ? -1 : left <= 0 ? 0 :
+            (int)((left + 999999) / 1000000);
+        int n = epoll_wait(r->epfd, ev, IO_REACTOR_MAX + 1, timeout);
+        for (int i = 0; i < n; i++) {
+            uint idx = ev[i].data.u32;
+            io_reactor_ack(idx == IO_REACTOR_MAX ? r->stop_fd :
+                r->srcs[idx].fd);
+        }
+        if (n == 0) ret = -1;
+    }
+    io_reactor_disarm(r);
+
+    return ret;
+}
+
+/*
+ * dispatch ready sources, waiting for one to become ready if none are.
+ * returns the bytes dispatched, which is 0 if the optional deadline passed
+ * or the reactor was stopped or woken spuriously.
+ */
+static size_t io_reactor_poll(io_reactor *r, const struct timespec *deadline)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < r->nsrcs; i++) {
+        n += io_reactor_dispatch(&r->srcs[i]);
+    }
+    if (n > 0) return n;
+
+    for (int i = 0; i < IO_REACTOR_SPIN; i++) {
+        if (io_reactor_any_ready(r)) return 0;
+        thrd_yield();
+    }
+
+    io_reactor_sleep(r, deadline);
+    return 0;
+}
+
+/* dispatch until io_reactor_stop is called */
+static void io_reactor_run(io_reactor *r)
+{
+    while (!atomic_load_explicit(&r->stop, memory_order_acquire)) {
+        io_reactor_poll(r, NULL);
+    }
+}
+
+static size_t io_reactor_src_read(io_reactor_src *s, char *buf, size_t len)
+{
+    size_t r = io_buffer_read(s->inner, buf, len);
+    if (r && s->events == IO_REACTOR_WRITE) io_reactor_signal(s);
+    return r;
+}
+
+static size_t io_reactor_src_write(io_reactor_src *s, char *buf, size_t len)
+{
+    size_t r = io_buffer_write(s->inner, buf, len);
+    if (r && s->events == IO_REACTOR_READ) io_reactor_signal(s);
+    return r;
+}
+
+static io_span io_reactor_src_read_lock(io_reactor_src *s, size_t len)
+{
+    return io_buffer_read_lock(s->inner, len);
+}
+
+static io_span io_reactor_src_write_lock(io_reactor_src *s, size_t len)
+{
+    return io_buffer_write_lock(s->inner, len);
+}
+
+static int io_reactor_src_read_commit(io_reactor_src *s, io_span ticket)
+{
+    int r = io_buffer_read_commit(s->inner, ticket);
+    if (ticket.length && s->events == IO_REACTOR_WRITE) io_reactor_signal(s);
+    return r;
+}
+
+static int io_reactor_src_write_commit(io_reactor_src *s, io_span ticket)
+{
+    int r = io_buffer_write_commit(s->inner, ticket);
+    if (ticket.length && s->events == IO_REACTOR_READ) io_reactor_signal(s);
+    return r;
+}
+
+static size_t io_reactor_src_read_avail(io_reactor_src *s)
+{
+    return io_buffer_read_avail(s->inner);
+}
+
+static size_t io_reactor_src_write_avail(io_reactor_src *s)
+{
+    return io_buffer_write_avail(s->inner);
+}
+
+static io_buffer_ops io_reactor_src_ops =
+{
+    (io_read_fn *)io_reactor_src_read,
+    (io_write_fn *)io_reactor_src_write,
+    (io_read_lock_fn *)io_reactor_src_read_lock,
+    (io_write_lock_fn *)io_reactor_src_write_lock,
+    (io_read_commit_fn *)io_reactor_src_read_commit,
+    (io_write_commit_fn *)io_reactor_src_write_commit,
+    (io_read_avail_fn *)io_reactor_src_read_avail,
+    (io_write_avail_fn *)io_reactor_src_write_avail
+};
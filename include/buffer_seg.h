@@ -0,0 +1,350 @@
+/*
+ * unbounded segmented pipe buffer
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+/*
+ * single producer single consumer unbounded pipe buffer
+ *
+ * pbu_buffer is a queue of power of two sized ring segments. start and
+ * end are 64-bit logical offsets as in pbs_buffer, and each segment is a
+ * circular region holding a contiguous range of them. while the consumer
+ * keeps up the producer wraps within one segment, and when the segment
+ * fills the producer links a new one and moves on, so writes never fail
+ * for lack of space.
+ *
+ *   first                        last
+ *   |  segment 0 (full, draining) |  segment 1 (tail, open)
+ *   ...XXXXXXXXXXXXXXXXXXXXXXXXXXXX+++++++++++++++++++________
+ *      start                                        end
+ *
+ * a segment records the offset at which the producer entered it and the
+ * offset at which it left. the producer links the next segment before it
+ * stores last, so a consumer that reaches last always finds the next
+ * segment. drained segments are pushed to a lock-free free list and the
+ * producer pops from it before allocating, so a steady stream allocates
+ * nothing. only the producer pops, so a segment cannot be popped and
+ * pushed back between the load and the compare swap of a pop, and the
+ * list needs no ABA tag.
+ *
+ * read_lock and write_lock return spans within one segment and stop at
+ * its wrap point. as with pbs_buffer, locking twice without a commit
+ * returns the same sequence. write_avail is unbounded and returns
+ * SIZE_MAX.
+ */
+
+#define PBU_OPEN ((pbs_uoffset)-1)
+#define PBU_LINE 64
+
+typedef struct pbu_segment pbu_segment;
+typedef struct pbu_buffer pbu_buffer;
+
+struct pbu_segment
+{
+    atomic_uintptr_t next;
+    atomic_pbs_uoffset last;
+    pbs_uoffset first;
+    char *data;
+    char _pad[PBU_LINE - sizeof(atomic_uintptr_t) -
+        sizeof(atomic_pbs_uoffset) - sizeof(pbs_uoffset) - sizeof(char*)];
+};
+
+struct pbu_buffer
+{
+    io_buffer io;
+    size_t seg_size;
+    atomic_size_t nsegs;
+    atomic_uintptr_t pool;
+    char _pad0[PBU_LINE - sizeof(io_buffer) - sizeof(size_t) -
+        sizeof(atomic_size_t) - sizeof(atomic_uintptr_t)];
+    pbu_segment *tail;
+    atomic_pbs_uoffset end;
+    char _pad1[PBU_LINE - sizeof(pbu_segment*) - sizeof(atomic_pbs_uoffset)];
+    pbu_segment *head;
+    atomic_pbs_uoffset start;
+};
+
+static io_buffer_ops pbu_ops;
+
+/* pop a recycled segment or allocate one. producer only. */
+static pbu_segment *pbu_segment_get(pbu_buffer *pb, pbs_uoffset first)
+{
+    uintptr_t top = atomic_load_explicit(&pb->pool, memory_order_acquire);
+    pbu_segment *seg;
+
+    while (top && !atomic_compare_exchange_weak_explicit(&pb->pool, &top,
+        atomic_load_explicit(&((pbu_segment*)top)->next, memory_order_relaxed),
+        memory_order_acquire, memory_order_acquire));
+
+    if (top) {
+        seg = (pbu_segment*)top;
+    } else {
+        seg = (pbu_segment*)malloc(sizeof(pbu_segment) + pb->seg_size);
+        if (!seg) return NULL;
+        seg->data = (char*)(seg + 1);
+        atomic_fetch_add_explicit(&pb->nsegs, 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&seg->next, 0, memory_order_relaxed);
+    atomic_store_explicit(&seg->last, PBU_OPEN, memory_order_relaxed);
+    seg->first = first;
+
+    return seg;
+}
+
+/* push a drained segment to the free list. consumer only. */
+static void pbu_segment_put(pbu_buffer *pb, pbu_segment *seg)
+{
+    uintptr_t top = atomic_load_explicit(&pb->pool, memory_order_relaxed);
+
+    do {
+        atomic_store_explicit(&seg->next, top, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pb->pool, &top,
+        (uintptr_t)seg, memory_order_release, memory_order_relaxed));
+}
+
+static int pbu_buffer_init(pbu_buffer *pb, size_t seg_size)
+{
+    assert(ispow2(seg_size));
+    pb->io.ops = &pbu_ops;
+    pb->seg_size = seg_size;
+    pb->nsegs = 0;
+    pb->pool = 0;
+    pb->start = 0;
+    pb->end = 0;
+    pb->tail = pb->head = pbu_segment_get(pb, 0);
+    return pb->tail ? 0 : -1;
+}
+
+static void pbu_buffer_destroy(pbu_buffer *pb)
+{
+    uintptr_t seg, next;
+
+    for (seg = (uintptr_t)pb->head; seg; seg = next) {
+        next = atomic_load(&((pbu_segment*)seg)->next);
+        free((void*)seg);
+    }
+    for (seg = pb->pool; seg; seg = next) {
+        next = atomic_load(&((pbu_segment*)seg)->next);
+        free((void*)seg);
+    }
+    pb->head = pb->tail = NULL;
+    pb->pool = 0;
+}
+
+/* preallocate segments into the free list. producer only. */
+static int pbu_buffer_reserve(pbu_buffer *pb, size_t nsegs)
+{
+    for (size_t i = 0; i < nsegs; i++) {
+        pbu_segment *seg = (pbu_segment*)malloc(sizeof(pbu_segment) +
+            pb->seg_size);
+        if (!seg) return -1;
+        seg->data = (char*)(seg + 1);
+        atomic_fetch_add_explicit(&pb->nsegs, 1, memory_order_relaxed);
+        pbu_segment_put(pb, seg);
+    }
+    return 0;
+}
+
+/* free the recycled segments. producer only. */
+static void pbu_buffer_trim(pbu_buffer *pb)
+{
+    pbu_segment *seg;
+
+    while (atomic_load_explicit(&pb->pool, memory_order_relaxed)) {
+        seg = pbu_segment_get(pb, 0);
+        atomic_fetch_sub_explicit(&pb->nsegs, 1, memory_order_relaxed);
+        free(seg);
+    }
+}
+
+/* bytes of segment memory currently allocated, live or recycled */
+static size_t pbu_buffer_footprint(pbu_buffer *pb)
+{
+    return atomic_load_explicit(&pb->nsegs, memory_order_relaxed) *
+        (sizeof(pbu_segment) + pb->seg_size);
+}
+
+static io_span pbu_buffer_read_lock(pbu_buffer *pb, size_t len)
+{
+    pbs_uoffset mask, io_len, start, new_start, end, last;
+    pbu_segment *head = pb->head, *next;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    mask = (pbs_uoffset)pb->seg_size - 1;
+
+    /* fetch end before last so an open segment bounds the read */
+    start = atomic_load_explicit(&pb->start, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+    last = atomic_load_explicit(&head->last, memory_order_acquire);
+
+    /* move to the next segment once this one is drained */
+    while (start == last) {
+        next = (pbu_segment*)atomic_load_explicit(&head->next,
+            memory_order_acquire);
+        pb->head = next;
+        pbu_segment_put(pb, head);
+        head = next;
+        last = atomic_load_explicit(&head->last, memory_order_acquire);
+    }
+    if (last != PBU_OPEN) end = last;
+
+    /* calculate copy length from start to new_start */
+    io_len = len < end - start ? (pbs_uoffset)len : end - start;
+    new_start = start + io_len;
+
+    if ((start & ~mask) != ((new_start - 1) & ~mask)) {
+        io_len = (new_start & ~mask) - start;
+        new_start = start + io_len;
+    }
+
+    if (io_len == 0) return ticket;
+
+    ticket.buf = head->data + (start & mask);
+    ticket.length = io_len;
+    ticket.sequence = start;
+
+    return ticket;
+}
+
+static io_span pbu_buffer_write_lock(pbu_buffer *pb, size_t len)
+{
+    pbs_uoffset cap, mask, used, io_len, start, end, new_end;
+    pbu_segment *tail = pb->tail, *seg;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)pb->seg_size;
+    mask = cap - 1;
+
+    /* the consumer may still be in an earlier segment */
+    start = atomic_load_explicit(&pb->start, memory_order_acquire);
+    end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+    used = (long long)(start - tail->first) > 0 ? end - start : end - tail->first;
+
+    /* link a new segment when the tail is full */
+    if (used == cap) {
+        if (!(seg = pbu_segment_get(pb, end))) return ticket;
+        atomic_store_explicit(&tail->next, (uintptr_t)seg, memory_order_release);
+        atomic_store_explicit(&tail->last, end, memory_order_release);
+        pb->tail = tail = seg;
+        used = 0;
+    }
+
+    /* calculate copy length from end to new_end */
+    io_len = len < cap - used ? (pbs_uoffset)len : cap - used;
+    new_end = end + io_len;
+
+    if ((end & ~mask) != ((new_end - 1) & ~mask)) {
+        io_len = (new_end & ~mask) - end;
+        new_end = end + io_len;
+    }
+
+    ticket.buf = tail->data + (end & mask);
+    ticket.length = io_len;
+    ticket.sequence = end;
+
+    return ticket;
+}
+
+static int pbu_buffer_read_commit(pbu_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+
+    /* store start <- new_start. */
+    atomic_store_explicit(&pb->start,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+
+    return 0;
+}
+
+static int pbu_buffer_write_commit(pbu_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+
+    /* store end <- new_end. */
+    atomic_store_explicit(&pb->end,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+
+    return 0;
+}
+
+static size_t pbu_buffer_read(pbu_buffer *pb, char *buf, size_t len)
+{
+    size_t o = 0;
+
+    while (o < len) {
+        io_span t = pbu_buffer_read_lock(pb, len - o);
+        if (t.length == 0) break;
+        memcpy(buf + o, t.buf, t.length);
+        pbu_buffer_read_commit(pb, t);
+        o += t.length;
+    }
+
+    return o;
+}
+
+/* writes are only short if a segment cannot be allocated */
+static size_t pbu_buffer_write(pbu_buffer *pb, char *buf, size_t len)
+{
+    size_t o = 0;
+
+    while (o < len) {
+        io_span t = pbu_buffer_write_lock(pb, len - o);
+        if (t.length == 0) break;
+        memcpy(t.buf, buf + o, t.length);
+        pbu_buffer_write_commit(pb, t);
+        o += t.length;
+    }
+
+    return o;
+}
+
+static size_t pbu_buffer_read_avail(pbu_buffer *pb)
+{
+    pbs_uoffset start, end;
+
+    start = atomic_load_explicit(&pb->start, memory_order_relaxed);
+    end = atomic_load_explicit(&pb->end, memory_order_acquire);
+
+    return (size_t)(end - start);
+}
+
+static size_t pbu_buffer_write_avail(pbu_buffer *pb)
+{
+    return SIZE_MAX;
+}
+
+static io_buffer_ops pbu_ops =
+{
+    (io_read_fn *)pbu_buffer_read,
+    (io_write_fn *)pbu_buffer_write,
+    (io_read_lock_fn *)pbu_buffer_read_lock,
+    (io_write_lock_fn *)pbu_buffer_write_lock,
+    (io_read_commit_fn *)pbu_buffer_read_commit,
+    (io_write_commit_fn *)pbu_buffer_write_commit,
+    (io_read_avail_fn *)pbu_buffer_read_avail,
+    (io_write_avail_fn *)pbu_buffer_write_avail
+};
@@ -0,0 +1,291 @@
+/*
+ * pipe buffer sharded dispatcher
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * sharded fan-out dispatcher
+ *
+ * io_shard owns up to IO_SHARD_MAX_RINGS pbs_buffer rings, one for each
+ * consumer, and one producer dispatches records across them, so no ring
+ * is shared by more than one reader or writer. consumers read their own
+ * ring through the io_buffer returned by io_shard_ring.
+ *
+ * records are never split across rings. a write either stores the whole
+ * record in one ring or returns 0, so a retry cannot reorder a record
+ * against itself. the policy chooses the ring:
+ *
+ * - IO_SHARD_HASH sends each key to one ring, keeping per-key order.
+ * - IO_SHARD_ROUND_ROBIN takes rings in turn, passing over full rings.
+ * - IO_SHARD_SHORTEST joins the shortest queue, comparing the occupancy
+ *   of each ring from its markers, with ties taken in turn.
+ *
+ * io_shard_write_lock reserves a record in place, so the record must fit
+ * between the end of the ring and the wrap. routing for a reservation
+ * only considers rings with that much contiguous space, and reserved
+ * records must be a power of two no larger than the ring capacity, other
+ * lengths get an empty ticket. when
+ * every record written to a ring has the same size, its end stays
+ * aligned and a ring with room for a record always has it contiguous.
+ *
+ * io_shard_write and io_shard_write_lock take the key explicitly. writes
+ * through the io_buffer interface key on the leading size_t of the
+ * record, which is only consulted by the hash policy. the hash policy
+ * cannot see the key before a record is reserved, so a write_lock
+ * through the io_buffer interface returns an empty ticket.
+ */
+
+#define IO_SHARD_MAX_RINGS 64
+
+enum io_shard_policy
+{
+    IO_SHARD_HASH,
+    IO_SHARD_ROUND_ROBIN,
+    IO_SHARD_SHORTEST
+};
+
+typedef struct io_shard io_shard;
+
+struct io_shard
+{
+    io_buffer io;
+    enum io_shard_policy policy;
+    size_t nrings;
+    size_t cursor;
+    size_t current;
+    pbs_buffer rings[IO_SHARD_MAX_RINGS];
+};
+
+static io_buffer_ops io_shard_ops;
+
+static void io_shard_init(io_shard *sh, size_t nrings, size_t capacity,
+    enum io_shard_policy policy)
+{
+    assert(nrings > 0 && nrings <= IO_SHARD_MAX_RINGS);
+    sh->io.ops = &io_shard_ops;
+    sh->policy = policy;
+    sh->nrings = nrings;
+    sh->cursor = 0;
+    sh->current = 0;
+    for (size_t i = 0; i < nrings; i++) {
+        pbs_buffer_init(&sh->rings[i], capacity);
+    }
+}
+
+static void io_shard_destroy(io_shard *sh)
+{
+    for (size_t i = 0; i < sh->nrings; i++) {
+        pbs_buffer_destroy(&sh->rings[i]);
+    }
+}
+
+/* the ring read by consumer idx */
+static io_buffer *io_shard_ring(io_shard *sh, size_t idx)
+{
+    assert(idx < sh->nrings);
+    return &sh->rings[idx].io;
+}
+
+static size_t io_shard_hash(size_t key)
+{
+    ullong h = (ullong)key;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+/* occupancy from the ring markers, the producer's own end is current */
+static size_t io_shard_used(pbs_buffer *pb)
+{
+    return (size_t)(atomic_load_explicit(&pb->end, memory_order_relaxed) -
+        atomic_load_explicit(&pb->start, memory_order_relaxed));
+}
+
+/* free bytes from the end of the ring up to the wrap */
+static size_t io_shard_contig(pbs_buffer *pb)
+{
+    size_t cap = pbs_buffer_capacity(pb);
+    size_t end = (size_t)atomic_load_explicit(&pb->end, memory_order_relaxed);
+    size_t avail = pbs_buffer_write_avail(pb);
+    size_t contig = cap - (end & (cap - 1));
+
+    return avail < contig ? avail : contig;
+}
+
+/* room for len bytes, contiguous if the record is reserved in place */
+static int io_shard_fits(pbs_buffer *pb, size_t len, int contig)
+{
+    return (contig ? io_shard_contig(pb) : pbs_buffer_write_avail(pb)) >= len;
+}
+
+/*
+ * choose a ring with room for len bytes, or return nrings if there is
+ * none. only the producer calls this so free space can only grow.
+ */
+static size_t io_shard_route(io_shard *sh, size_t key, size_t len,
+    int contig)
+{
+    size_t n = sh->nrings, idx, best = n, best_used = SIZE_MAX;
+
+    switch (sh->policy) {
+    case IO_SHARD_HASH:
+        idx = io_shard_hash(key) % n;
+        return io_shard_fits(&sh->rings[idx], len, contig) ? idx : n;
+    case IO_SHARD_ROUND_ROBIN:
+        for (size_t i = 0; i < n; i++) {
+            idx = sh->cursor + i < n ? sh->cursor + i : sh->cursor + i - n;
+            if (io_shard_fits(&sh->rings[idx], len, contig)) {
+                sh->cursor = idx + 1 < n ? idx + 1 : 0;
+                return idx;
+            }
+        }
+        return n;
+    case IO_SHARD_SHORTEST:
+        for (size_t i = 0; i < n; i++) {
+            size_t used;
+            idx = sh->cursor + i < n ? sh->cursor + i : sh->cursor + i - n;
+            used = io_shard_used(&sh->rings[idx]);
+            if (used < best_used) {
+                best = idx;
+                best_used = used;
+            }
+        }
+        if (best == n || !io_shard_fits(&sh->rings[best], len, contig)) {
+            return n;
+        }
+        sh->cursor = best + 1 < n ? best + 1 : 0;
+        return best;
+    }
+    return n;
+}
+
+/* write a whole record, returning len, or 0 if no chosen ring has room */
+static size_t io_shard_write(io_shard *sh, size_t key, char *buf, size_t len)
+{
+    size_t idx = io_shard_route(sh, key, len, 0);
+
+    if (idx == sh->nrings) return 0;
+    return pbs_buffer_write(&sh->rings[idx], buf, len);
+}
+
+/*
+ * reserve len contiguous bytes for a record. the ticket is empty if no
+ * chosen ring has len contiguous bytes free, and the ring of the last
+ * reservation is remembered for the commit.
+ */
+static io_span io_shard_write_lock(io_shard *sh, size_t key, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    size_t idx;
+
+    if (len == 0 || !ispow2(len)) return ticket;
+    if (len > pbs_buffer_capacity(&sh->rings[0])) return ticket;
+    idx = io_shard_route(sh, key, len, 1);
+    if (idx == sh->nrings) return ticket;
+    ticket = pbs_buffer_write_lock(&sh->rings[idx], len);
+    assert(ticket.length == len);
+    sh->current = idx;
+    return ticket;
+}
+
+static int io_shard_write_commit(io_shard *sh, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    return pbs_buffer_write_commit(&sh->rings[sh->current], ticket);
+}
+
+static size_t io_shard_record_key(char *buf, size_t len)
+{
+    size_t key = 0;
+
+    memcpy(&key, buf, len < sizeof(key) ? len : sizeof(key));
+    return key;
+}
+
+static size_t io_shard_io_write(io_shard *sh, char *buf, size_t len)
+{
+    if (len == 0) return 0;
+    return io_shard_write(sh, io_shard_record_key(buf, len), buf, len);
+}
+
+/* the hash policy cannot see the key before the record is written */
+static io_span io_shard_io_write_lock(io_shard *sh, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+
+    if (sh->policy == IO_SHARD_HASH) return ticket;
+    return io_shard_write_lock(sh, 0, len);
+}
+
+/* the largest record that can currently be written */
+static size_t io_shard_write_avail(io_shard *sh)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < sh->nrings; i++) {
+        size_t avail = pbs_buffer_write_avail(&sh->rings[i]);
+        if (avail > n) n = avail;
+    }
+    return n;
+}
+
+static size_t io_shard_read_avail(io_shard *sh)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < sh->nrings; i++) {
+        n += pbs_buffer_read_avail(&sh->rings[i]);
+    }
+    return n;
+}
+
+static size_t io_shard_none_read(io_shard *sh, char *buf, size_t len)
+{
+    return 0;
+}
+
+static io_span io_shard_none_read_lock(io_shard *sh, size_t len)
+{
+    io_span ticket = { 0, 0, 0 };
+    return ticket;
+}
+
+static int io_shard_none_read_commit(io_shard *sh, io_span ticket)
+{
+    return -1;
+}
+
+static io_buffer_ops io_shard_ops =
+{
+    (io_read_fn *)io_shard_none_read,
+    (io_write_fn *)io_shard_io_write,
+    (io_read_lock_fn *)io_shard_none_read_lock,
+    (io_write_lock_fn *)io_shard_io_write_lock,
+    (io_read_commit_fn *)io_shard_none_read_commit,
+    (io_write_commit_fn *)io_shard_write_commit,
+    (io_read_avail_fn *)io_shard_read_avail,
+    (io_write_avail_fn *)io_shard_write_avail
+};
@@ -0,0 +1,909 @@
+/*
+ * process shared pipe buffer
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "buffer.h"
+#include "futex.h"
+#include "buffer_timed.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/*
+ * process shared single producer single consumer pipe buffer
+ *
+ * pipe buffer is a power of two sized circular buffer that lives in a
+ * shared memory region so that a producer and a consumer may run in
+ * different processes. the shared region contains no pointers, only
+ * the buffer markers and the offset from the region base to the data,
+ * so each process may map it at a different address. the process local
+ * pbp_buffer handle holds the mapping along with the io_buffer ops.
+ *
+ * the region is a memfd when created without a name, which is inherited
+ * across fork or may be passed over a unix socket, or a POSIX shared
+ * memory object when created with a name. blocking waits use process
+ * shared futexes on sequence words that are bumped by commits only when
+ * the peer has announced that it is waiting.
+ *
+ * pbpm_buffer, further below, is the multiple producer multiple consumer
+ * variant. it shares the region layout and the waits, and keeps the
+ * packed pbm_buffer markers in the header instead of start and end.
+ */
+
+#define PBP_MAGIC 0x70627062u
+#define PBP_VERSION 2u
+#define PBP_SPIN 256
+#define PBP_MPMC 1u
+
+typedef struct pbp_header pbp_header;
+typedef struct pbp_buffer pbp_buffer;
+typedef struct pbpm_buffer pbpm_buffer;
+
+struct pbp_header
+{
+    uint magic;
+    uint version;
+    ullong capacity;
+    ullong data_offset;
+    ullong map_size;
+    uint flags;
+    uint _pad0[7];
+    atomic_pbs_uoffset start;
+    atomic_uint start_seq;
+    atomic_uint start_waiters;
+    atomic_ullong pof;
+    ullong _pad1[5];
+    atomic_pbs_uoffset end;
+    atomic_uint end_seq;
+    atomic_uint end_waiters;
+    ullong _pad2[6];
+};
+
+struct pbp_buffer
+{
+    io_buffer io;
+    atomic_size_t capacity;
+    char *data;
+    pbp_header *hdr;
+    size_t map_size;
+    int fd;
+};
+
+/* the ops tables are defined at the end, C++ has no tentative definitions */
+static io_buffer_ops *pbp_buffer_ops(void);
+static io_buffer_ops *pbpm_buffer_ops(void);
+
+static int pbp_map(pbp_buffer *pb, int fd, uint flags, io_buffer_ops *ops)
+{
+    struct stat st;
+    pbp_header *hdr;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pbp_header)) {
+        return -1;
+    }
+
+    hdr = (pbp_header*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) return -1;
+
+    if (hdr->magic != PBP_MAGIC || hdr->version != PBP_VERSION ||
+        hdr->flags != flags || hdr->map_size != (ullong)st.st_size ||
+        !ispow2(hdr->capacity) ||
+        hdr->data_offset + hdr->capacity > hdr->map_size) {
+        munmap(hdr, st.st_size);
+        return -1;
+    }
+
+    pb->io.ops = ops;
+    pb->capacity = (size_t)hdr->capacity;
+    pb->data = (char*)hdr + hdr->data_offset;
+    pb->hdr = hdr;
+    pb->map_size = (size_t)st.st_size;
+    pb->fd = fd;
+
+    return 0;
+}
+
+static int pbp_create(pbp_buffer *pb, const char *name, size_t capacity,
+    uint flags, io_buffer_ops *ops)
+{
+    size_t data_offset = sizeof(pbp_header);
+    size_t map_size = data_offset + capacity;
+    pbp_header *hdr;
+    int fd;
+
+    assert(ispow2(capacity));
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    } else {
+        fd = (int)syscall(SYS_memfd_create, "cpipe", MFD_CLOEXEC);
+    }
+    if (fd < 0) return -1;
+
+    if (ftruncate(fd, map_size) < 0) goto err;
+
+    hdr = (pbp_header*)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) goto err;
+
+    memset(hdr, 0, sizeof(pbp_header));
+    hdr->version = PBP_VERSION;
+    hdr->capacity = capacity;
+    hdr->data_offset = data_offset;
+    hdr->map_size = map_size;
+    hdr->flags = flags;
+    atomic_store_explicit(&hdr->start, 0, memory_order_relaxed);
+    atomic_store_explicit(&hdr->end, 0, memory_order_relaxed);
+
+    /* publish the magic last so attach never sees a partial header */
+    atomic_thread_fence(memory_order_release);
+    hdr->magic = PBP_MAGIC;
+    munmap(hdr, map_size);
+
+    if (pbp_map(pb, fd, flags, ops) < 0) goto err;
+
+    return 0;
+
+err:
+    close(fd);
+    if (name) shm_unlink(name);
+    return -1;
+}
+
+static int pbp_open(pbp_buffer *pb, const char *name, uint flags,
+    io_buffer_ops *ops)
+{
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) return -1;
+    if (pbp_map(pb, fd, flags, ops) < 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * create a new shared region. name is NULL for an anonymous memfd or a
+ * POSIX shared memory object name such as "/cpipe-0". returns 0 on
+ * success or -1 and errno on failure.
+ */
+static int pbp_buffer_create(pbp_buffer *pb, const char *name, size_t capacity)
+{
+    return pbp_create(pb, name, capacity, 0, pbp_buffer_ops());
+}
+
+/*
+ * attach to an existing shared region from a file descriptor that was
+ * inherited, passed over a unix socket, or opened by name. the handle
+ * takes ownership of the descriptor. a region created as pbpm_buffer
+ * is refused.
+ */
+static int pbp_buffer_attach(pbp_buffer *pb, int fd)
+{
+    return pbp_map(pb, fd, 0, pbp_buffer_ops());
+}
+
+static int pbp_buffer_open(pbp_buffer *pb, const char *name)
+{
+    return pbp_open(pb, name, 0, pbp_buffer_ops());
+}
+
+static int pbp_buffer_unlink(const char *name)
+{
+    return shm_unlink(name);
+}
+
+static void pbp_buffer_destroy(pbp_buffer *pb)
+{
+    munmap(pb->hdr, pb->map_size);
+    close(pb->fd);
+    pb->hdr = NULL;
+    pb->data = NULL;
+    pb->fd = -1;
+}
+
+static int pbp_buffer_fd(pbp_buffer *pb)
+{
+    return pb->fd;
+}
+
+static size_t pbp_buffer_capacity(pbp_buffer *pb)
+{
+    return pb->capacity;
+}
+
+/*
+ * wake a peer after a commit if it has announced that it is waiting.
+ * the fence orders the marker store before the waiter load, pairing
+ * with the waiter increment before its marker reload in pbp_wait.
+ */
+static void pbp_wake(atomic_uint *seq, atomic_uint *waiters)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(seq, 1, memory_order_release);
+        futex_wake(seq, INT_MAX, 1);
+    }
+}
+
+static size_t pbp_buffer_read(pbp_buffer *pb, char *buf, size_t len)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
+
+    if (len == 0) return 0;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(&hdr->start, memory_order_relaxed);
+    end = atomic_load_explicit(&hdr->end, memory_order_acquire);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from start to new_start */
+    io_len = len < csz ? (pbs_uoffset)len : csz;
+    new_start = start + io_len;
+
+    if (io_len == 0) return 0;
+
+    /* perform copy out, and if we wrap split into two copies
+     * while also applying the modulus to the buffer markers. */
+    if ((start & ~mask) == ((new_start - 1) & ~mask)) {
+        memcpy(buf, pb->data + (start & mask), io_len);
+    } else {
+        pbs_uoffset o1 = (start & mask);
+        pbs_uoffset l1 = (new_start & ~mask) - start;
+        memcpy(buf, pb->data + o1, l1);
+        memcpy(buf + l1, pb->data, io_len - l1);
+    }
+
+    /* store start <- new_start and wake a waiting writer. */
+    atomic_store_explicit(&hdr->start, new_start, memory_order_release);
+    pbp_wake(&hdr->start_seq, &hdr->start_waiters);
+
+    return io_len;
+}
+
+static size_t pbp_buffer_write(pbp_buffer *pb, char *buf, size_t len)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset cap, mask, csz, io_len, start, end, new_end;
+
+    if (len == 0) return 0;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(&hdr->start, memory_order_acquire);
+    end = atomic_load_explicit(&hdr->end, memory_order_relaxed);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from end to new_end */
+    io_len = len < cap - csz ? (pbs_uoffset)len : cap - csz;
+    new_end = end + io_len;
+
+    if (io_len == 0) return 0;
+
+    /* perform copy in, and if we wrap split into two copies
+     * while also applying the modulus to the buffer markers. */
+    if ((end & ~mask) == ((new_end - 1) & ~mask)) {
+        memcpy(pb->data + (end & mask), buf, io_len);
+    } else {
+        pbs_uoffset o1 = (end & mask);
+        pbs_uoffset l1 = (new_end & ~mask) - end;
+        memcpy(pb->data + o1, buf, l1);
+        memcpy(pb->data, buf + l1, io_len - l1);
+    }
+
+    /* store end <- new_end and wake a waiting reader. */
+    atomic_store_explicit(&hdr->end, new_end, memory_order_release);
+    pbp_wake(&hdr->end_seq, &hdr->end_waiters);
+
+    return io_len;
+}
+
+static io_span pbp_buffer_read_lock(pbp_buffer *pb, size_t len)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset cap, mask, csz, io_len, start, new_start, end;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(&hdr->start, memory_order_relaxed);
+    end = atomic_load_explicit(&hdr->end, memory_order_acquire);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from start to new_start */
+    io_len = len < csz ? (pbs_uoffset)len : csz;
+    new_start = start + io_len;
+
+    if ((start & ~mask) != ((new_start - 1) & ~mask)) {
+        io_len = (new_start & ~mask) - start;
+        new_start = start + io_len;
+    }
+
+    if (io_len == 0) return ticket;
+
+    ticket.buf = pb->data + (start & mask);
+    ticket.length = io_len;
+    ticket.sequence = start;
+
+    return ticket;
+}
+
+static io_span pbp_buffer_write_lock(pbp_buffer *pb, size_t len)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset cap, mask, csz, io_len, start, end, new_end;
+    io_span ticket = { 0, 0, 0 };
+
+    if (len == 0) return ticket;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    mask = cap - 1;
+
+    /* fetch buffer markers */
+    start = atomic_load_explicit(&hdr->start, memory_order_acquire);
+    end = atomic_load_explicit(&hdr->end, memory_order_relaxed);
+
+    /* ensure buffer marker invariants */
+    csz = end - start;
+    assert(csz <= cap);
+
+    /* calculate copy length from end to new_end */
+    io_len = len < cap - csz ? (pbs_uoffset)len : cap - csz;
+    new_end = end + io_len;
+
+    if ((end & ~mask) != ((new_end - 1) & ~mask)) {
+        io_len = (new_end & ~mask) - end;
+        new_end = end + io_len;
+    }
+
+    if (io_len == 0) return ticket;
+
+    ticket.buf = pb->data + (end & mask);
+    ticket.length = io_len;
+    ticket.sequence = end;
+
+    return ticket;
+}
+
+static int pbp_buffer_read_commit(pbp_buffer *pb, io_span ticket)
+{
+    pbp_header *hdr = pb->hdr;
+
+    if (ticket.length == 0) return 0;
+
+    /* store start <- new_start and wake a waiting writer. */
+    atomic_store_explicit(&hdr->start,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+    pbp_wake(&hdr->start_seq, &hdr->start_waiters);
+
+    return 0;
+}
+
+static int pbp_buffer_write_commit(pbp_buffer *pb, io_span ticket)
+{
+    pbp_header *hdr = pb->hdr;
+
+    if (ticket.length == 0) return 0;
+
+    /* store end <- new_end and wake a waiting reader. */
+    atomic_store_explicit(&hdr->end,
+        (pbs_uoffset)(ticket.sequence + ticket.length), memory_order_release);
+    pbp_wake(&hdr->end_seq, &hdr->end_waiters);
+
+    return 0;
+}
+
+/*
+ * readers are blocked while end - start == 0 and writers while end - start
+ * == capacity. the multiple producer variant counts reservations, so its
+ * readers are blocked while end == start_mark and its writers while
+ * end_mark - start == capacity.
+ */
+static int pbp_blocked(pbp_buffer *pb, int writer)
+{
+    pbp_header *hdr = pb->hdr;
+    pbm_offsets pof;
+
+    if (hdr->flags & PBP_MPMC) {
+        pof = pbm_unpack_offsets(atomic_load_explicit(&hdr->pof,
+            memory_order_seq_cst));
+        if (writer) return (pbm_uoffset)(pof.end_mark - pof.start) ==
+            (pbm_uoffset)pb->capacity;
+        return pof.end == pof.start_mark;
+    }
+
+    return atomic_load_explicit(&hdr->end, memory_order_seq_cst) -
+        atomic_load_explicit(&hdr->start, memory_order_seq_cst) ==
+        (writer ? (pbs_uoffset)pb->capacity : 0);
+}
+
+/*
+ * wait until the peer has moved the marker that limits us. spins briefly
+ * before announcing itself as a waiter and sleeping on the sequence word.
+ * the sequence is sampled before the marker is rechecked so a commit that
+ * races with the recheck makes futex_wait return early.
+ *
+ * returns 0, or -1 if the optional CLOCK_MONOTONIC deadline expired. the
+ * futex sleeps until the deadline itself, so a wait that times out may
+ * overshoot it by the kernel timer slack.
+ */
+static int pbp_wait_until(pbp_buffer *pb, int writer,
+    const struct timespec *deadline)
+{
+    pbp_header *hdr = pb->hdr;
+    atomic_uint *seq = writer ? &hdr->start_seq : &hdr->end_seq;
+    atomic_uint *waiters = writer ? &hdr->start_waiters : &hdr->end_waiters;
+    uint val;
+
+    for (int i = 0; i < PBP_SPIN; i++) {
+        if (!pbp_blocked(pb, writer)) return 0;
+    }
+
+    for (;;) {
+        val = atomic_load_explicit(seq, memory_order_acquire);
+        atomic_fetch_add_explicit(waiters, 1, memory_order_seq_cst);
+        if (!pbp_blocked(pb, writer)) {
+            atomic_fetch_sub_explicit(waiters, 1, memory_order_relaxed);
+            return 0;
+        }
+        futex_wait(seq, val, deadline, 1);
+        atomic_fetch_sub_explicit(waiters, 1, memory_order_relaxed);
+        if (deadline && io_deadline_left(deadline) <= 0) {
+            return pbp_blocked(pb, writer) ? -1 : 0;
+        }
+    }
+}
+
+static void pbp_wait(pbp_buffer *pb, int writer)
+{
+    pbp_wait_until(pb, writer, NULL);
+}
+
+/*
+ * blocking read returns once at least one byte has been read, and
+ * blocking write returns once all bytes have been written, matching
+ * the semantics of read(2) and write(2) on a blocking pipe.
+ */
+static size_t pbp_buffer_read_wait(pbp_buffer *pb, char *buf, size_t len)
+{
+    size_t r;
+
+    if (len == 0) return 0;
+
+    while ((r = pbp_buffer_read(pb, buf, len)) == 0) {
+        pbp_wait(pb, 0);
+    }
+
+    return r;
+}
+
+static size_t pbp_buffer_write_wait(pbp_buffer *pb, char *buf, size_t len)
+{
+    size_t w = 0;
+
+    while (w < len) {
+        size_t r = pbp_buffer_write(pb, buf + w, len - w);
+        if (r == 0) pbp_wait(pb, 1);
+        w += r;
+    }
+
+    return w;
+}
+
+/*
+ * timed variants return once the blocking variant would, or when the
+ * absolute CLOCK_MONOTONIC deadline expires, in which case read returns
+ * 0 and write returns the bytes written so far. the futex wait sleeps
+ * until the peer's commit or the deadline so there is no polling.
+ */
+static size_t pbp_buffer_read_timed(pbp_buffer *pb, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    size_t r;
+
+    if (len == 0) return 0;
+
+    while ((r = pbp_buffer_read(pb, buf, len)) == 0) {
+        if (pbp_wait_until(pb, 0, deadline) < 0) {
+            return pbp_buffer_read(pb, buf, len);
+        }
+    }
+
+    return r;
+}
+
+static size_t pbp_buffer_write_timed(pbp_buffer *pb, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    size_t w = 0;
+
+    while (w < len) {
+        size_t r = pbp_buffer_write(pb, buf + w, len - w);
+        if (r == 0 && pbp_wait_until(pb, 1, deadline) < 0) {
+            return w + pbp_buffer_write(pb, buf + w, len - w);
+        }
+        w += r;
+    }
+
+    return w;
+}
+
+static size_t pbp_buffer_read_avail(pbp_buffer *pb)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset start, end;
+
+    start = atomic_load_explicit(&hdr->start, memory_order_relaxed);
+    end = atomic_load_explicit(&hdr->end, memory_order_acquire);
+
+    return (size_t)(end - start);
+}
+
+static size_t pbp_buffer_write_avail(pbp_buffer *pb)
+{
+    pbp_header *hdr = pb->hdr;
+    pbs_uoffset cap, start, end;
+
+    cap = (pbs_uoffset)atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+    start = atomic_load_explicit(&hdr->start, memory_order_acquire);
+    end = atomic_load_explicit(&hdr->end, memory_order_relaxed);
+
+    return (size_t)(cap - (end - start));
+}
+
+static io_buffer_ops pbp_ops =
+{
+    (io_read_fn *)pbp_buffer_read,
+    (io_write_fn *)pbp_buffer_write,
+    (io_read_lock_fn *)pbp_buffer_read_lock,
+    (io_write_lock_fn *)pbp_buffer_write_lock,
+    (io_read_commit_fn *)pbp_buffer_read_commit,
+    (io_write_commit_fn *)pbp_buffer_write_commit,
+    (io_read_avail_fn *)pbp_buffer_read_avail,
+    (io_write_avail_fn *)pbp_buffer_write_avail
+};
+
+static io_buffer_ops *pbp_buffer_ops(void)
+{
+    return &pbp_ops;
+}
+
+/*
+ * process shared multiple producer multiple consumer pipe buffer
+ *
+ * pbpm_buffer keeps the packed start, start_mark, end and end_mark
+ * markers of pbm_buffer in the pof word of the shared header, so any
+ * number of producer and consumer processes may attach to one region.
+ * locks move start_mark or end_mark with a compare swap and commits
+ * wait for the tickets before them to retire, as for pbm_buffer, so a
+ * process must not exit while it holds a ticket. capacity is limited
+ * to 32KiB by the 16-bit markers and the region does not resize.
+ */
+
+struct pbpm_buffer
+{
+    pbp_buffer pb;
+};
+
+static int pbpm_buffer_create(pbpm_buffer *pb, const char *name,
+    size_t capacity)
+{
+    assert(capacity < (1ull << (sizeof(pbm_uoffset) << 3)));
+    return pbp_create(&pb->pb, name, capacity, PBP_MPMC, pbpm_buffer_ops());
+}
+
+static int pbpm_buffer_attach(pbpm_buffer *pb, int fd)
+{
+    return pbp_map(&pb->pb, fd, PBP_MPMC, pbpm_buffer_ops());
+}
+
+static int pbpm_buffer_open(pbpm_buffer *pb, const char *name)
+{
+    return pbp_open(&pb->pb, name, PBP_MPMC, pbpm_buffer_ops());
+}
+
+static void pbpm_buffer_destroy(pbpm_buffer *pb)
+{
+    pbp_buffer_destroy(&pb->pb);
+}
+
+static int pbpm_buffer_fd(pbpm_buffer *pb)
+{
+    return pb->pb.fd;
+}
+
+static size_t pbpm_buffer_capacity(pbpm_buffer *pb)
+{
+    return pb->pb.capacity;
+}
+
+/*
+ * move start_mark or end_mark past up to len bytes, stopping at the wrap
+ * point unless wrap is set. returns the reserved length and the marker
+ * it started at in mark.
+ */
+static pbm_uoffset pbpm_reserve(pbpm_buffer *pb, int writer, size_t len,
+    int wrap, pbm_uoffset *mark)
+{
+    pbp_header *hdr = pb->pb.hdr;
+    pbm_uoffset cap = (pbm_uoffset)pb->pb.capacity, mask = cap - 1;
+    pbm_uoffset avail, io_len, m;
+    ullong pof_val;
+    pbm_offsets pof;
+
+    pof_val = atomic_load_explicit(&hdr->pof, memory_order_acquire);
+    do {
+        pof = pbm_unpack_offsets(pof_val);
+        m = writer ? pof.end_mark : pof.start_mark;
+        avail = writer ? (pbm_uoffset)(cap - (pbm_uoffset)(pof.end_mark -
+            pof.start)) : (pbm_uoffset)(pof.end - pof.start_mark);
+        io_len = len < avail ? (pbm_uoffset)len : avail;
+        if (!wrap && (m & mask) + io_len > cap) io_len = cap - (m & mask);
+        if (io_len == 0) return 0;
+        if (writer) pof.end_mark = m + io_len;
+        else pof.start_mark = m + io_len;
+    } while (!atomic_compare_exchange_weak(&hdr->pof, &pof_val,
+        pbm_pack_offsets(pof)));
+
+    *mark = m;
+    return io_len;
+}
+
+/*
+ * wait until start or end reaches mark for the tickets before us to
+ * retire, then move it past our ticket and wake a waiting peer. yields
+ * now and then, as the ticket before us may belong to a process that
+ * is not running.
+ */
+static void pbpm_retire(pbpm_buffer *pb, int writer, pbm_uoffset mark,
+    pbm_uoffset len)
+{
+    pbp_header *hdr = pb->pb.hdr;
+    ullong pof_val;
+    pbm_offsets pof;
+
+    for (int i = 1;; i++) {
+        pof_val = atomic_load_explicit(&hdr->pof, memory_order_acquire);
+        pof = pbm_unpack_offsets(pof_val);
+        if (writer) pof.end = mark;
+        else pof.start = mark;
+        pof_val = pbm_pack_offsets(pof);
+        if (writer) pof.end = mark + len;
+        else pof.start = mark + len;
+        if (atomic_compare_exchange_strong(&hdr->pof, &pof_val,
+            pbm_pack_offsets(pof))) break;
+        if (i % PBP_SPIN == 0) thrd_yield();
+    }
+
+    if (writer) pbp_wake(&hdr->end_seq, &hdr->end_waiters);
+    else pbp_wake(&hdr->start_seq, &hdr->start_waiters);
+}
+
+static size_t pbpm_buffer_read(pbpm_buffer *pb, char *buf, size_t len)
+{
+    pbm_uoffset cap = (pbm_uoffset)pb->pb.capacity, mask = cap - 1;
+    pbm_uoffset mark = 0, io_len, o1;
+
+    if ((io_len = pbpm_reserve(pb, 0, len, 1, &mark)) == 0) return 0;
+
+    /* perform copy out, and if we wrap split into two copies */
+    o1 = mark & mask;
+    if (o1 + io_len <= cap) {
+        memcpy(buf, pb->pb.data + o1, io_len);
+    } else {
+        memcpy(buf, pb->pb.data + o1, cap - o1);
+        memcpy(buf + (cap - o1), pb->pb.data, io_len - (cap - o1));
+    }
+
+    pbpm_retire(pb, 0, mark, io_len);
+
+    return io_len;
+}
+
+static size_t pbpm_buffer_write(pbpm_buffer *pb, char *buf, size_t len)
+{
+    pbm_uoffset cap = (pbm_uoffset)pb->pb.capacity, mask = cap - 1;
+    pbm_uoffset mark = 0, io_len, o1;
+
+    if ((io_len = pbpm_reserve(pb, 1, len, 1, &mark)) == 0) return 0;
+
+    /* perform copy in, and if we wrap split into two copies */
+    o1 = mark & mask;
+    if (o1 + io_len <= cap) {
+        memcpy(pb->pb.data + o1, buf, io_len);
+    } else {
+        memcpy(pb->pb.data + o1, buf, cap - o1);
+        memcpy(pb->pb.data, buf + (cap - o1), io_len - (cap - o1));
+    }
+
+    pbpm_retire(pb, 1, mark, io_len);
+
+    return io_len;
+}
+
+static io_span pbpm_buffer_read_lock(pbpm_buffer *pb, size_t len)
+{
+    pbm_uoffset mask = (pbm_uoffset)pb->pb.capacity - 1, mark = 0;
+    io_span ticket = { 0, 0, 0 };
+
+    if ((ticket.length = pbpm_reserve(pb, 0, len, 0, &mark)) == 0) {
+        return ticket;
+    }
+    ticket.buf = pb->pb.data + (mark & mask);
+    ticket.sequence = mark;
+
+    return ticket;
+}
+
+static io_span pbpm_buffer_write_lock(pbpm_buffer *pb, size_t len)
+{
+    pbm_uoffset mask = (pbm_uoffset)pb->pb.capacity - 1, mark = 0;
+    io_span ticket = { 0, 0, 0 };
+
+    if ((ticket.length = pbpm_reserve(pb, 1, len, 0, &mark)) == 0) {
+        return ticket;
+    }
+    ticket.buf = pb->pb.data + (mark & mask);
+    ticket.sequence = mark;
+
+    return ticket;
+}
+
+static int pbpm_buffer_read_commit(pbpm_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    pbpm_retire(pb, 0, (pbm_uoffset)ticket.sequence,
+        (pbm_uoffset)ticket.length);
+    return 0;
+}
+
+static int pbpm_buffer_write_commit(pbpm_buffer *pb, io_span ticket)
+{
+    if (ticket.length == 0) return 0;
+    pbpm_retire(pb, 1, (pbm_uoffset)ticket.sequence,
+        (pbm_uoffset)ticket.length);
+    return 0;
+}
+
+static size_t pbpm_buffer_read_avail(pbpm_buffer *pb)
+{
+    pbm_offsets pof;
+
+    pof = pbm_unpack_offsets(atomic_load_explicit(&pb->pb.hdr->pof,
+        memory_order_acquire));
+
+    return (pbm_uoffset)(pof.end - pof.start_mark);
+}
+
+static size_t pbpm_buffer_write_avail(pbpm_buffer *pb)
+{
+    pbm_uoffset cap = (pbm_uoffset)pb->pb.capacity;
+    pbm_offsets pof;
+
+    pof = pbm_unpack_offsets(atomic_load_explicit(&pb->pb.hdr->pof,
+        memory_order_acquire));
+
+    return (pbm_uoffset)(cap - (pbm_uoffset)(pof.end_mark - pof.start));
+}
+
+/*
+ * blocking and timed variants, with the semantics of the pbp_buffer ones.
+ * a reader woken by a commit may find that another reader took the data
+ * first, in which case it waits again.
+ */
+static size_t pbpm_buffer_read_wait(pbpm_buffer *pb, char *buf, size_t len)
+{
+    size_t r;
+
+    if (len == 0) return 0;
+
+    while ((r = pbpm_buffer_read(pb, buf, len)) == 0) {
+        pbp_wait(&pb->pb, 0);
+    }
+
+    return r;
+}
+
+static size_t pbpm_buffer_write_wait(pbpm_buffer *pb, char *buf, size_t len)
+{
+    size_t w = 0;
+
+    while (w < len) {
+        size_t r = pbpm_buffer_write(pb, buf + w, len - w);
+        if (r == 0) pbp_wait(&pb->pb, 1);
+        w += r;
+    }
+
+    return w;
+}
+
+static size_t pbpm_buffer_read_timed(pbpm_buffer *pb, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    size_t r;
+
+    if (len == 0) return 0;
+
+    while ((r = pbpm_buffer_read(pb, buf, len)) == 0) {
+        if (pbp_wait_until(&pb->pb, 0, deadline) < 0) {
+            return pbpm_buffer_read(pb, buf, len);
+        }
+    }
+
+    return r;
+}
+
+static size_t pbpm_buffer_write_timed(pbpm_buffer *pb, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    size_t w = 0;
+
+    while (w < len) {
+        size_t r = pbpm_buffer_write(pb, buf + w, len - w);
+        if (r == 0 && pbp_wait_until(&pb->pb, 1, deadline) < 0) {
+            return w + pbpm_buffer_write(pb, buf + w, len - w);
+        }
+        w += r;
+    }
+
+    return w;
+}
+
+static io_buffer_ops pbpm_ops =
+{
+    (io_read_fn *)pbpm_buffer_read,
+    (io_write_fn *)pbpm_buffer_write,
+    (io_read_lock_fn *)pbpm_buffer_read_lock,
+    (io_write_lock_fn *)pbpm_buffer_write_lock,
+    (io_read_commit_fn *)pbpm_buffer_read_commit,
+    (io_write_commit_fn *)pbpm_buffer_write_commit,
+    (io_read_avail_fn *)pbpm_buffer_read_avail,
+    (io_write_avail_fn *)pbpm_buffer_write_avail
+};
+
+static io_buffer_ops *pbpm_buffer_ops(void)
+{
+    return &pbpm_ops;
+}
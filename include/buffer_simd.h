@@ -0,0 +1,907 @@
+/*
+ * pipe buffer span compute kernels
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <float.h>
+
+#include "buffer.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define IO_SIMD_X86 1
+#include <immintrin.h>
+#define IO_SIMD_TARGET(x) __attribute__((target(x)))
+#else
+#define IO_SIMD_X86 0
+#endif
+
+/*
+ * span compute kernels
+ *
+ * vectorised kernels that operate on the spans returned by read_lock and
+ * write_lock. each kernel takes an array of one or two spans, so the two
+ * sides of a ticket that crosses the end of the buffer can be passed
+ * together, and returns or updates a result for the whole stream:
+ *
+ *   - sum and min/max reductions over u32, u64 and f32
+ *   - in place byte swapping of 16, 32 and 64-bit elements
+ *   - in place delta encode and decode of u32 and u64 streams
+ *   - crc32c
+ *
+ * an element that is split across the two spans is gathered into a small
+ * carry buffer, processed in stream order and, for in place kernels,
+ * scattered back. vector loops use unaligned loads and stores, so spans
+ * need not be aligned to the vector or element size. bytes of a trailing
+ * partial element are ignored.
+ *
+ * the implementation is chosen at runtime from scalar, SSE2 and AVX2 on
+ * x86 with GCC or Clang, and crc32c uses the SSE4.2 crc32 instruction.
+ * other targets use the scalar kernels. io_simd_set_features restricts
+ * the features used, for testing and benchmarking.
+ *
+ * float sums accumulate in double precision lanes so the result does not
+ * depend on the order of accumulation beyond rounding of the final sum.
+ * float min/max ignore NaNs.
+ */
+
+#define IO_SIMD_SSE2 1
+#define IO_SIMD_SSE42 2
+#define IO_SIMD_AVX2 4
+
+typedef void (io_simd_fn)(char *p, size_t n, void *state);
+
+typedef struct io_simd_minmax_u32 io_simd_minmax_u32;
+typedef struct io_simd_minmax_u64 io_simd_minmax_u64;
+typedef struct io_simd_minmax_f32 io_simd_minmax_f32;
+
+struct io_simd_minmax_u32 { uint min, max; };
+struct io_simd_minmax_u64 { ullong min, max; };
+struct io_simd_minmax_f32 { float min, max; };
+
+static uint io_simd_mask = ~0u;
+
+static uint io_simd_detect()
+{
+    static int features = -1;
+    if (features < 0) {
+#if IO_SIMD_X86
+        __builtin_cpu_init();
+        features = (__builtin_cpu_supports("sse2") ? IO_SIMD_SSE2 : 0) |
+            (__builtin_cpu_supports("sse4.2") ? IO_SIMD_SSE42 : 0) |
+            (__builtin_cpu_supports("avx2") ? IO_SIMD_AVX2 : 0);
+#else
+        features = 0;
+#endif
+    }
+    return (uint)features;
+}
+
+static uint io_simd_features()
+{
+    return io_simd_detect() & io_simd_mask;
+}
+
+/* restrict the features used, ~0u for all supported features */
+static void io_simd_set_features(uint mask)
+{
+    io_simd_mask = mask;
+}
+
+#if IO_SIMD_X86
+#define io_simd_select(f, name) ((f) & IO_SIMD_AVX2 ? name##_avx2 : \
+    (f) & IO_SIMD_SSE2 ? name##_sse2 : name##_scalar)
+#else
+#define io_simd_select(f, name) name##_scalar
+#endif
+
+/*
+ * call fn on each run of whole elements in stream order. an element that
+ * is split between spans is processed from the carry buffer and, if the
+ * kernel is in place, written back. returns the number of elements.
+ */
+static size_t io_simd_walk(io_span *t, size_t nspan, size_t esize,
+    int inplace, io_simd_fn *fn, void *state)
+{
+    char carry[8], *src[8];
+    size_t c = 0, count = 0;
+
+    assert(esize <= sizeof(carry));
+
+    for (size_t s = 0; s < nspan; s++) {
+        char *p = t[s].buf;
+        size_t len = t[s].length, k, n;
+
+        /* complete an element carried from the previous span */
+        k = c == 0 ? 0 : esize - c < len ? esize - c : len;
+        for (size_t i = 0; i < k; i++, c++) {
+            src[c & 7] = p + i;
+            carry[c & 7] = p[i];
+        }
+        p += k;
+        len -= k;
+        if (c > 0 && c == esize) {
+            fn(carry, 1, state);
+            if (inplace) {
+                for (size_t i = 0; i < esize; i++) *src[i] = carry[i];
+            }
+            count++;
+            c = 0;
+        }
+
+        n = c == 0 ? len / esize : 0;
+        if (n > 0) fn(p, n, state);
+        p += n * esize;
+        len -= n * esize;
+        count += n;
+
+        /* carry a trailing partial element to the next span */
+        for (size_t i = 0; i < len; i++, c++) {
+            src[c & 7] = p + i;
+            carry[c & 7] = p[i];
+        }
+    }
+
+    return count;
+}
+
+static uint io_simd_ld_u32(const char *p) { uint v; memcpy(&v, p, 4); return v; }
+static ullong io_simd_ld_u64(const char *p) { ullong v; memcpy(&v, p, 8); return v; }
+static float io_simd_ld_f32(const char *p) { float v; memcpy(&v, p, 4); return v; }
+static void io_simd_st_u32(char *p, uint v) { memcpy(p, &v, 4); }
+static void io_simd_st_u64(char *p, ullong v) { memcpy(p, &v, 8); }
+
+static ushort io_simd_bswap16(ushort v)
+{
+    return (ushort)((v << 8) | (v >> 8));
+}
+
+static uint io_simd_bswap32(uint v)
+{
+    v = (v << 16) | (v >> 16);
+    return ((v & 0x00ff00ffu) << 8) | ((v >> 8) & 0x00ff00ffu);
+}
+
+static ullong io_simd_bswap64(ullong v)
+{
+    return ((ullong)io_simd_bswap32((uint)v) << 32) |
+        io_simd_bswap32((uint)(v >> 32));
+}
+
+/*
+ * sum
+ */
+
+static void io_simd_sum_u32_scalar(char *p, size_t n, void *state)
+{
+    ullong sum = 0;
+    for (size_t i = 0; i < n; i++) sum += io_simd_ld_u32(p + i * 4);
+    *(ullong*)state += sum;
+}
+
+static void io_simd_sum_u64_scalar(char *p, size_t n, void *state)
+{
+    ullong sum = 0;
+    for (size_t i = 0; i < n; i++) sum += io_simd_ld_u64(p + i * 8);
+    *(ullong*)state += sum;
+}
+
+static void io_simd_sum_f32_scalar(char *p, size_t n, void *state)
+{
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += io_simd_ld_f32(p + i * 4);
+    *(double*)state += sum;
+}
+
+#if IO_SIMD_X86
+IO_SIMD_TARGET("sse2")
+static void io_simd_sum_u32_sse2(char *p, size_t n, void *state)
+{
+    __m128i acc = _mm_setzero_si128(), z = _mm_setzero_si128();
+    ullong lane[2];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i * 4));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, z));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, z));
+    }
+    _mm_storeu_si128((__m128i*)lane, acc);
+    *(ullong*)state += lane[0] + lane[1];
+    io_simd_sum_u32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_sum_u32_avx2(char *p, size_t n, void *state)
+{
+    __m256i acc = _mm256_setzero_si256();
+    ullong lane[4];
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i * 4));
+        acc = _mm256_add_epi64(acc,
+            _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+        acc = _mm256_add_epi64(acc,
+            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    _mm256_storeu_si256((__m256i*)lane, acc);
+    *(ullong*)state += lane[0] + lane[1] + lane[2] + lane[3];
+    io_simd_sum_u32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_sum_u64_sse2(char *p, size_t n, void *state)
+{
+    __m128i acc = _mm_setzero_si128();
+    ullong lane[2];
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(p + i * 8)));
+    }
+    _mm_storeu_si128((__m128i*)lane, acc);
+    *(ullong*)state += lane[0] + lane[1];
+    io_simd_sum_u64_scalar(p + i * 8, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_sum_u64_avx2(char *p, size_t n, void *state)
+{
+    __m256i acc = _mm256_setzero_si256();
+    ullong lane[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc,
+            _mm256_loadu_si256((const __m256i*)(p + i * 8)));
+    }
+    _mm256_storeu_si256((__m256i*)lane, acc);
+    *(ullong*)state += lane[0] + lane[1] + lane[2] + lane[3];
+    io_simd_sum_u64_scalar(p + i * 8, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_sum_f32_sse2(char *p, size_t n, void *state)
+{
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    double lane[2];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps((const float*)(p + i * 4));
+        acc0 = _mm_add_pd(acc0, _mm_cvtps_pd(v));
+        acc1 = _mm_add_pd(acc1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    _mm_storeu_pd(lane, _mm_add_pd(acc0, acc1));
+    *(double*)state += lane[0] + lane[1];
+    io_simd_sum_f32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_sum_f32_avx2(char *p, size_t n, void *state)
+{
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    double lane[4];
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps((const float*)(p + i * 4));
+        acc0 = _mm256_add_pd(acc0, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+        acc1 = _mm256_add_pd(acc1, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    }
+    _mm256_storeu_pd(lane, _mm256_add_pd(acc0, acc1));
+    *(double*)state += lane[0] + lane[1] + lane[2] + lane[3];
+    io_simd_sum_f32_scalar(p + i * 4, n - i, state);
+}
+#endif
+
+/* sum of unsigned 32-bit elements, accumulated in 64 bits */
+static ullong io_span_sum_u32(io_span *t, size_t nspan)
+{
+    ullong sum = 0;
+    uint f = io_simd_features();
+    io_simd_walk(t, nspan, 4, 0, io_simd_select(f, io_simd_sum_u32), &sum);
+    return sum;
+}
+
+/* sum of unsigned 64-bit elements, modulo 2^64 */
+static ullong io_span_sum_u64(io_span *t, size_t nspan)
+{
+    ullong sum = 0;
+    uint f = io_simd_features();
+    io_simd_walk(t, nspan, 8, 0, io_simd_select(f, io_simd_sum_u64), &sum);
+    return sum;
+}
+
+static double io_span_sum_f32(io_span *t, size_t nspan)
+{
+    double sum = 0;
+    uint f = io_simd_features();
+    io_simd_walk(t, nspan, 4, 0, io_simd_select(f, io_simd_sum_f32), &sum);
+    return sum;
+}
+
+/*
+ * min/max
+ */
+
+static void io_simd_minmax_u32_scalar(char *p, size_t n, void *state)
+{
+    io_simd_minmax_u32 *m = (io_simd_minmax_u32*)state;
+    for (size_t i = 0; i < n; i++) {
+        uint v = io_simd_ld_u32(p + i * 4);
+        if (v < m->min) m->min = v;
+        if (v > m->max) m->max = v;
+    }
+}
+
+static void io_simd_minmax_u64_scalar(char *p, size_t n, void *state)
+{
+    io_simd_minmax_u64 *m = (io_simd_minmax_u64*)state;
+    for (size_t i = 0; i < n; i++) {
+        ullong v = io_simd_ld_u64(p + i * 8);
+        if (v < m->min) m->min = v;
+        if (v > m->max) m->max = v;
+    }
+}
+
+static void io_simd_minmax_f32_scalar(char *p, size_t n, void *state)
+{
+    io_simd_minmax_f32 *m = (io_simd_minmax_f32*)state;
+    for (size_t i = 0; i < n; i++) {
+        float v = io_simd_ld_f32(p + i * 4);
+        if (v < m->min) m->min = v;
+        if (v > m->max) m->max = v;
+    }
+}
+
+#if IO_SIMD_X86
+/* SSE2 has only signed compares so values are biased by the sign bit */
+IO_SIMD_TARGET("sse2")
+static void io_simd_minmax_u32_sse2(char *p, size_t n, void *state)
+{
+    io_simd_minmax_u32 *m = (io_simd_minmax_u32*)state;
+    __m128i bias = _mm_set1_epi32((int)0x80000000);
+    __m128i vmin = _mm_xor_si128(_mm_set1_epi32((int)m->min), bias);
+    __m128i vmax = _mm_xor_si128(_mm_set1_epi32((int)m->max), bias);
+    uint lmin[4], lmax[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i*)(p + i * 4)), bias);
+        __m128i lt = _mm_cmpgt_epi32(vmin, v);
+        __m128i gt = _mm_cmpgt_epi32(v, vmax);
+        vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+        vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+    }
+    _mm_storeu_si128((__m128i*)lmin, _mm_xor_si128(vmin, bias));
+    _mm_storeu_si128((__m128i*)lmax, _mm_xor_si128(vmax, bias));
+    for (int j = 0; j < 4; j++) {
+        if (lmin[j] < m->min) m->min = lmin[j];
+        if (lmax[j] > m->max) m->max = lmax[j];
+    }
+    io_simd_minmax_u32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_minmax_u32_avx2(char *p, size_t n, void *state)
+{
+    io_simd_minmax_u32 *m = (io_simd_minmax_u32*)state;
+    __m256i vmin = _mm256_set1_epi32((int)m->min);
+    __m256i vmax = _mm256_set1_epi32((int)m->max);
+    uint lmin[8], lmax[8];
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i * 4));
+        vmin = _mm256_min_epu32(vmin, v);
+        vmax = _mm256_max_epu32(vmax, v);
+    }
+    _mm256_storeu_si256((__m256i*)lmin, vmin);
+    _mm256_storeu_si256((__m256i*)lmax, vmax);
+    for (int j = 0; j < 8; j++) {
+        if (lmin[j] < m->min) m->min = lmin[j];
+        if (lmax[j] > m->max) m->max = lmax[j];
+    }
+    io_simd_minmax_u32_scalar(p + i * 4, n - i, state);
+}
+
+/* 64-bit compares need SSE4.2 so the SSE2 kernel is scalar */
+#define io_simd_minmax_u64_sse2 io_simd_minmax_u64_scalar
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_minmax_u64_avx2(char *p, size_t n, void *state)
+{
+    io_simd_minmax_u64 *m = (io_simd_minmax_u64*)state;
+    __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+    __m256i vmin = _mm256_xor_si256(_mm256_set1_epi64x((long long)m->min), bias);
+    __m256i vmax = _mm256_xor_si256(_mm256_set1_epi64x((long long)m->max), bias);
+    ullong lmin[4], lmax[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)(p + i * 8)), bias);
+        vmin = _mm256_blendv_epi8(vmin, v, _mm256_cmpgt_epi64(vmin, v));
+        vmax = _mm256_blendv_epi8(vmax, v, _mm256_cmpgt_epi64(v, vmax));
+    }
+    _mm256_storeu_si256((__m256i*)lmin, _mm256_xor_si256(vmin, bias));
+    _mm256_storeu_si256((__m256i*)lmax, _mm256_xor_si256(vmax, bias));
+    for (int j = 0; j < 4; j++) {
+        if (lmin[j] < m->min) m->min = lmin[j];
+        if (lmax[j] > m->max) m->max = lmax[j];
+    }
+    io_simd_minmax_u64_scalar(p + i * 8, n - i, state);
+}
+
+/* minps and maxps return the second operand if either is NaN */
+IO_SIMD_TARGET("sse2")
+static void io_simd_minmax_f32_sse2(char *p, size_t n, void *state)
+{
+    io_simd_minmax_f32 *m = (io_simd_minmax_f32*)state;
+    __m128 vmin = _mm_set1_ps(m->min), vmax = _mm_set1_ps(m->max);
+    float lmin[4], lmax[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps((const float*)(p + i * 4));
+        vmin = _mm_min_ps(v, vmin);
+        vmax = _mm_max_ps(v, vmax);
+    }
+    _mm_storeu_ps(lmin, vmin);
+    _mm_storeu_ps(lmax, vmax);
+    for (int j = 0; j < 4; j++) {
+        if (lmin[j] < m->min) m->min = lmin[j];
+        if (lmax[j] > m->max) m->max = lmax[j];
+    }
+    io_simd_minmax_f32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_minmax_f32_avx2(char *p, size_t n, void *state)
+{
+    io_simd_minmax_f32 *m = (io_simd_minmax_f32*)state;
+    __m256 vmin = _mm256_set1_ps(m->min), vmax = _mm256_set1_ps(m->max);
+    float lmin[8], lmax[8];
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps((const float*)(p + i * 4));
+        vmin = _mm256_min_ps(v, vmin);
+        vmax = _mm256_max_ps(v, vmax);
+    }
+    _mm256_storeu_ps(lmin, vmin);
+    _mm256_storeu_ps(lmax, vmax);
+    for (int j = 0; j < 8; j++) {
+        if (lmin[j] < m->min) m->min = lmin[j];
+        if (lmax[j] > m->max) m->max = lmax[j];
+    }
+    io_simd_minmax_f32_scalar(p + i * 4, n - i, state);
+}
+#endif
+
+/* min and max of the elements. returns the number of elements. */
+static size_t io_span_minmax_u32(io_span *t, size_t nspan, uint *min, uint *max)
+{
+    io_simd_minmax_u32 m = { ~0u, 0 };
+    uint f = io_simd_features();
+    size_t n = io_simd_walk(t, nspan, 4, 0,
+        io_simd_select(f, io_simd_minmax_u32), &m);
+    *min = m.min;
+    *max = m.max;
+    return n;
+}
+
+static size_t io_span_minmax_u64(io_span *t, size_t nspan,
+    ullong *min, ullong *max)
+{
+    io_simd_minmax_u64 m = { ~0ull, 0 };
+    uint f = io_simd_features();
+    size_t n = io_simd_walk(t, nspan, 8, 0,
+        io_simd_select(f, io_simd_minmax_u64), &m);
+    *min = m.min;
+    *max = m.max;
+    return n;
+}
+
+static size_t io_span_minmax_f32(io_span *t, size_t nspan,
+    float *min, float *max)
+{
+    io_simd_minmax_f32 m = { FLT_MAX, -FLT_MAX };
+    uint f = io_simd_features();
+    size_t n = io_simd_walk(t, nspan, 4, 0,
+        io_simd_select(f, io_simd_minmax_f32), &m);
+    *min = m.min;
+    *max = m.max;
+    return n;
+}
+
+/*
+ * byte swap
+ */
+
+static void io_simd_bswap16_scalar(char *p, size_t n, void *state)
+{
+    for (size_t i = 0; i < n; i++) {
+        ushort v;
+        memcpy(&v, p + i * 2, 2);
+        v = io_simd_bswap16(v);
+        memcpy(p + i * 2, &v, 2);
+    }
+}
+
+static void io_simd_bswap32_scalar(char *p, size_t n, void *state)
+{
+    for (size_t i = 0; i < n; i++) {
+        io_simd_st_u32(p + i * 4, io_simd_bswap32(io_simd_ld_u32(p + i * 4)));
+    }
+}
+
+static void io_simd_bswap64_scalar(char *p, size_t n, void *state)
+{
+    for (size_t i = 0; i < n; i++) {
+        io_simd_st_u64(p + i * 8, io_simd_bswap64(io_simd_ld_u64(p + i * 8)));
+    }
+}
+
+#if IO_SIMD_X86
+IO_SIMD_TARGET("sse2")
+static __m128i io_simd_bswap16_v(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+IO_SIMD_TARGET("sse2")
+static __m128i io_simd_bswap32_v(__m128i v)
+{
+    v = _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+    return io_simd_bswap16_v(v);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_bswap16_sse2(char *p, size_t n, void *state)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i *q = (__m128i*)(p + i * 2);
+        _mm_storeu_si128(q, io_simd_bswap16_v(_mm_loadu_si128(q)));
+    }
+    io_simd_bswap16_scalar(p + i * 2, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_bswap32_sse2(char *p, size_t n, void *state)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i *q = (__m128i*)(p + i * 4);
+        _mm_storeu_si128(q, io_simd_bswap32_v(_mm_loadu_si128(q)));
+    }
+    io_simd_bswap32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_bswap64_sse2(char *p, size_t n, void *state)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i *q = (__m128i*)(p + i * 8);
+        __m128i v = _mm_shuffle_epi32(_mm_loadu_si128(q), 0xb1);
+        _mm_storeu_si128(q, io_simd_bswap32_v(v));
+    }
+    io_simd_bswap64_scalar(p + i * 8, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_shuffle_avx2(char *p, size_t n, size_t esize,
+    __m256i mask)
+{
+    for (size_t i = 0; i + 32 / esize <= n; i += 32 / esize) {
+        __m256i *q = (__m256i*)(p + i * esize);
+        _mm256_storeu_si256(q, _mm256_shuffle_epi8(_mm256_loadu_si256(q), mask));
+    }
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_bswap16_avx2(char *p, size_t n, void *state)
+{
+    size_t i = n & ~(size_t)15;
+    io_simd_shuffle_avx2(p, i, 2, _mm256_setr_epi8(
+        1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+        1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14));
+    io_simd_bswap16_scalar(p + i * 2, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_bswap32_avx2(char *p, size_t n, void *state)
+{
+    size_t i = n & ~(size_t)7;
+    io_simd_shuffle_avx2(p, i, 4, _mm256_setr_epi8(
+        3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+        3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12));
+    io_simd_bswap32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("avx2")
+static void io_simd_bswap64_avx2(char *p, size_t n, void *state)
+{
+    size_t i = n & ~(size_t)3;
+    io_simd_shuffle_avx2(p, i, 8, _mm256_setr_epi8(
+        7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+        7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+    io_simd_bswap64_scalar(p + i * 8, n - i, state);
+}
+#endif
+
+/* reverse the bytes of each element in place. returns the element count. */
+static size_t io_span_bswap16(io_span *t, size_t nspan)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 2, 1, io_simd_select(f, io_simd_bswap16), NULL);
+}
+
+static size_t io_span_bswap32(io_span *t, size_t nspan)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 4, 1, io_simd_select(f, io_simd_bswap32), NULL);
+}
+
+static size_t io_span_bswap64(io_span *t, size_t nspan)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 8, 1, io_simd_select(f, io_simd_bswap64), NULL);
+}
+
+/*
+ * delta encode and decode
+ *
+ * encode replaces each element with its difference from the previous
+ * element and decode computes the running sum. prev holds the element
+ * before the span on entry and the last element on return, so a stream
+ * can be processed one span at a time starting from zero.
+ */
+
+static void io_simd_delta_enc_u32_scalar(char *p, size_t n, void *state)
+{
+    uint prev = *(uint*)state;
+    for (size_t i = 0; i < n; i++) {
+        uint v = io_simd_ld_u32(p + i * 4);
+        io_simd_st_u32(p + i * 4, v - prev);
+        prev = v;
+    }
+    *(uint*)state = prev;
+}
+
+static void io_simd_delta_dec_u32_scalar(char *p, size_t n, void *state)
+{
+    uint prev = *(uint*)state;
+    for (size_t i = 0; i < n; i++) {
+        prev += io_simd_ld_u32(p + i * 4);
+        io_simd_st_u32(p + i * 4, prev);
+    }
+    *(uint*)state = prev;
+}
+
+static void io_simd_delta_enc_u64_scalar(char *p, size_t n, void *state)
+{
+    ullong prev = *(ullong*)state;
+    for (size_t i = 0; i < n; i++) {
+        ullong v = io_simd_ld_u64(p + i * 8);
+        io_simd_st_u64(p + i * 8, v - prev);
+        prev = v;
+    }
+    *(ullong*)state = prev;
+}
+
+static void io_simd_delta_dec_u64_scalar(char *p, size_t n, void *state)
+{
+    ullong prev = *(ullong*)state;
+    for (size_t i = 0; i < n; i++) {
+        prev += io_simd_ld_u64(p + i * 8);
+        io_simd_st_u64(p + i * 8, prev);
+    }
+    *(ullong*)state = prev;
+}
+
+#if IO_SIMD_X86
+/*
+ * the vector kernels shift the previous vector's last lane into the first
+ * lane. decode is a prefix sum computed with log2(lanes) shifted adds.
+ * lane crossing shifts are costly in AVX2, so these are SSE2 only.
+ */
+IO_SIMD_TARGET("sse2")
+static void io_simd_delta_enc_u32_sse2(char *p, size_t n, void *state)
+{
+    __m128i prev = _mm_set1_epi32((int)*(uint*)state);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i *q = (__m128i*)(p + i * 4);
+        __m128i v = _mm_loadu_si128(q);
+        __m128i s = _mm_or_si128(_mm_slli_si128(v, 4), _mm_srli_si128(prev, 12));
+        _mm_storeu_si128(q, _mm_sub_epi32(v, s));
+        prev = v;
+    }
+    *(uint*)state = (uint)_mm_cvtsi128_si32(_mm_shuffle_epi32(prev, 0xff));
+    io_simd_delta_enc_u32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_delta_dec_u32_sse2(char *p, size_t n, void *state)
+{
+    __m128i prev = _mm_set1_epi32((int)*(uint*)state);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i *q = (__m128i*)(p + i * 4);
+        __m128i v = _mm_loadu_si128(q);
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, prev);
+        _mm_storeu_si128(q, v);
+        prev = _mm_shuffle_epi32(v, 0xff);
+    }
+    *(uint*)state = (uint)_mm_cvtsi128_si32(prev);
+    io_simd_delta_dec_u32_scalar(p + i * 4, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_delta_enc_u64_sse2(char *p, size_t n, void *state)
+{
+    __m128i prev = _mm_set1_epi64x((long long)*(ullong*)state);
+    ullong last[2];
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i *q = (__m128i*)(p + i * 8);
+        __m128i v = _mm_loadu_si128(q);
+        __m128i s = _mm_or_si128(_mm_slli_si128(v, 8), _mm_srli_si128(prev, 8));
+        _mm_storeu_si128(q, _mm_sub_epi64(v, s));
+        prev = v;
+    }
+    _mm_storeu_si128((__m128i*)last, prev);
+    *(ullong*)state = last[1];
+    io_simd_delta_enc_u64_scalar(p + i * 8, n - i, state);
+}
+
+IO_SIMD_TARGET("sse2")
+static void io_simd_delta_dec_u64_sse2(char *p, size_t n, void *state)
+{
+    __m128i prev = _mm_set1_epi64x((long long)*(ullong*)state);
+    ullong last[2];
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i *q = (__m128i*)(p + i * 8);
+        __m128i v = _mm_loadu_si128(q);
+        v = _mm_add_epi64(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi64(v, prev);
+        _mm_storeu_si128(q, v);
+        prev = _mm_shuffle_epi32(v, 0xee);
+    }
+    _mm_storeu_si128((__m128i*)last, prev);
+    *(ullong*)state = last[0];
+    io_simd_delta_dec_u64_scalar(p + i * 8, n - i, state);
+}
+
+#define io_simd_delta_enc_u32_avx2 io_simd_delta_enc_u32_sse2
+#define io_simd_delta_dec_u32_avx2 io_simd_delta_dec_u32_sse2
+#define io_simd_delta_enc_u64_avx2 io_simd_delta_enc_u64_sse2
+#define io_simd_delta_dec_u64_avx2 io_simd_delta_dec_u64_sse2
+#endif
+
+static size_t io_span_delta_encode_u32(io_span *t, size_t nspan, uint *prev)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 4, 1,
+        io_simd_select(f, io_simd_delta_enc_u32), prev);
+}
+
+static size_t io_span_delta_decode_u32(io_span *t, size_t nspan, uint *prev)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 4, 1,
+        io_simd_select(f, io_simd_delta_dec_u32), prev);
+}
+
+static size_t io_span_delta_encode_u64(io_span *t, size_t nspan, ullong *prev)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 8, 1,
+        io_simd_select(f, io_simd_delta_enc_u64), prev);
+}
+
+static size_t io_span_delta_decode_u64(io_span *t, size_t nspan, ullong *prev)
+{
+    uint f = io_simd_features();
+    return io_simd_walk(t, nspan, 8, 1,
+        io_simd_select(f, io_simd_delta_dec_u64), prev);
+}
+
+/*
+ * crc32c (castagnoli, reflected polynomial 0x82f63b78)
+ *
+ * the table is constant so concurrent first calls do not race to fill
+ * it. entry i is the crc of the byte i, eight rounds of
+ * c = (c >> 1) ^ (0x82f63b78 & -(c & 1)).
+ */
+
+static const uint io_simd_crc32c_table[256] = {
+    0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u, 0xc79a971fu, 0x35f1141cu,
+    0x26a1e7e8u, 0xd4ca64ebu, 0x8ad958cfu, 0x78b2dbccu, 0x6be22838u, 0x9989ab3bu,
+    0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u, 0x5e133c24u, 0x105ec76fu, 0xe235446cu,
+    0xf165b798u, 0x030e349bu, 0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u,
+    0x9a879fa0u, 0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u, 0x5d1d08bfu, 0xaf768bbcu,
+    0xbc267848u, 0x4e4dfb4bu, 0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u, 0x33ed7d2au,
+    0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u, 0xaa64d611u, 0x580f5512u,
+    0x4b5fa6e6u, 0xb93425e5u, 0x6dfe410eu, 0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau,
+    0x30e349b1u, 0xc288cab2u, 0xd1d83946u, 0x23b3ba45u, 0xf779deaeu, 0x05125dadu,
+    0x1642ae59u, 0xe4292d5au, 0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au,
+    0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u, 0x417b1dbcu, 0xb3109ebfu,
+    0xa0406d4bu, 0x522bee48u, 0x86e18aa3u, 0x748a09a0u, 0x67dafa54u, 0x95b17957u,
+    0xcba24573u, 0x39c9c670u, 0x2a993584u, 0xd8f2b687u, 0x0c38d26cu, 0xfe53516fu,
+    0xed03a29bu, 0x1f682198u, 0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u,
+    0x96bf4dccu, 0x64d4cecfu, 0x77843d3bu, 0x85efbe38u, 0xdbfc821cu, 0x2997011fu,
+    0x3ac7f2ebu, 0xc8ac71e8u, 0x1c661503u, 0xee0d9600u, 0xfd5d65f4u, 0x0f36e6f7u,
+    0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u, 0xa65c047du, 0x5437877eu,
+    0x4767748au, 0xb50cf789u, 0xeb1fcbadu, 0x197448aeu, 0x0a24bb5au, 0xf84f3859u,
+    0x2c855cb2u, 0xdeeedfb1u, 0xcdbe2c45u, 0x3fd5af46u, 0x7198540du, 0x83f3d70eu,
+    0x90a324fau, 0x62c8a7f9u, 0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+    0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u, 0x3cdb9bddu, 0xceb018deu,
+    0xdde0eb2au, 0x2f8b6829u, 0x82f63b78u, 0x709db87bu, 0x63cd4b8fu, 0x91a6c88cu,
+    0x456cac67u, 0xb7072f64u, 0xa457dc90u, 0x563c5f93u, 0x082f63b7u, 0xfa44e0b4u,
+    0xe9141340u, 0x1b7f9043u, 0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu,
+    0x92a8fc17u, 0x60c37f14u, 0x73938ce0u, 0x81f80fe3u, 0x55326b08u, 0xa759e80bu,
+    0xb4091bffu, 0x466298fcu, 0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu, 0x0b21572cu,
+    0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u, 0xa24bb5a6u, 0x502036a5u,
+    0x4370c551u, 0xb11b4652u, 0x65d122b9u, 0x97baa1bau, 0x84ea524eu, 0x7681d14du,
+    0x2892ed69u, 0xdaf96e6au, 0xc9a99d9eu, 0x3bc21e9du, 0xef087a76u, 0x1d63f975u,
+    0x0e330a81u, 0xfc588982u, 0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du,
+    0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u, 0x38cc2a06u, 0xcaa7a905u,
+    0xd9f75af1u, 0x2b9cd9f2u, 0xff56bd19u, 0x0d3d3e1au, 0x1e6dcdeeu, 0xec064eedu,
+    0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u, 0xd0ddd530u, 0x0417b1dbu, 0xf67c32d8u,
+    0xe52cc12cu, 0x1747422fu, 0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu,
+    0x8ecee914u, 0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u, 0xd3d3e1abu, 0x21b862a8u,
+    0x32e8915cu, 0xc083125fu, 0x144976b4u, 0xe622f5b7u, 0xf5720643u, 0x07198540u,
+    0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u, 0x9e902e7bu, 0x6cfbad78u,
+    0x7fab5e8cu, 0x8dc0dd8fu, 0xe330a81au, 0x115b2b19u, 0x020bd8edu, 0xf0605beeu,
+    0x24aa3f05u, 0xd6c1bc06u, 0xc5914ff2u, 0x37faccf1u, 0x69e9f0d5u, 0x9b8273d6u,
+    0x88d28022u, 0x7ab90321u, 0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+    0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u, 0x34f4f86au, 0xc69f7b69u,
+    0xd5cf889du, 0x27a40b9eu, 0x79b737bau, 0x8bdcb4b9u, 0x988c474du, 0x6ae7c44eu,
+    0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u, 0xad7d5351u
+};
+
+static void io_simd_crc32c_scalar(char *p, size_t n, void *state)
+{
+    uint crc = *(uint*)state;
+    for (size_t i = 0; i < n; i++) {
+        crc = (crc >> 8) ^ io_simd_crc32c_table[(crc ^ (uchar)p[i]) & 0xff];
+    }
+    *(uint*)state = crc;
+}
+
+#if IO_SIMD_X86 && defined __x86_64__
+IO_SIMD_TARGET("sse4.2")
+static void io_simd_crc32c_sse42(char *p, size_t n, void *state)
+{
+    ullong crc = *(uint*)state;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) crc = _mm_crc32_u64(crc, io_simd_ld_u64(p + i));
+    for (; i < n; i++) crc = _mm_crc32_u8((uint)crc, (uchar)p[i]);
+    *(uint*)state = (uint)crc;
+}
+#endif
+
+/* crc32c of the stream continuing from crc, which is 0 for a new stream */
+static uint io_span_crc32c(io_span *t, size_t nspan, uint crc)
+{
+    io_simd_fn *fn = io_simd_crc32c_scalar;
+#if IO_SIMD_X86 && defined __x86_64__
+    if (io_simd_features() & IO_SIMD_SSE42) fn = io_simd_crc32c_sse42;
+#endif
+    crc = ~crc;
+    for (size_t s = 0; s < nspan; s++) fn(t[s].buf, t[s].length, &crc);
+    return ~crc;
+}
@@ -0,0 +1,229 @@
+/*
+ * pipe buffer slab payloads
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include "buffer.h"
+
+/*
+ * handle mode with a slab payload allocator
+ *
+ * large messages are written once into a slab slot and the ring carries
+ * an 8-byte io_slab_ref naming the slot, so the payload is not copied
+ * into the ring and out again. the producer owns a slot from allocation
+ * until the commit that publishes its reference, and the consumer owns
+ * it from the read until it calls io_slab_free.
+ *
+ *   char *p = io_slab_alloc(&cache);
+ *   fill(p, len);
+ *   io_slab_send(io, &slab, p, len);
+ *   ...
+ *   p = io_slab_recv(io, &slab, &len);
+ *   process(p, len);
+ *   io_slab_free(&slab, p);
+ *
+ * the slab is divided into pages of 64 power of two sized slots, each
+ * with a 64-bit bitmap where a set bit is a free slot. every producer
+ * thread allocates through its own io_slab_cache, which claims pages from
+ * the slab and is the only allocator for them, so allocation clears bits
+ * with a fetch and and finds free slots with ctz. frees from any thread
+ * set the bit with a fetch or, which returns the slot to the cache of
+ * the thread that allocated it without locks.
+ *
+ * the ring must only carry references, so reads and writes of a whole
+ * io_slab_ref never split on a buffer whose capacity is a multiple of
+ * its size.
+ */
+
+#define IO_SLAB_PAGE_SLOTS 64
+#define IO_SLAB_CACHE_PAGES 64
+
+typedef struct io_slab io_slab;
+typedef struct io_slab_page io_slab_page;
+typedef struct io_slab_cache io_slab_cache;
+typedef struct io_slab_ref io_slab_ref;
+
+struct io_slab_ref
+{
+    uint slot;
+    uint length;
+};
+
+struct io_slab_page
+{
+    atomic_ullong free;
+    char _pad[64 - sizeof(atomic_ullong)];
+};
+
+struct io_slab
+{
+    char *data;
+    size_t slot_size;
+    uint slot_shift;
+    size_t npages;
+    atomic_size_t next_page;
+    io_slab_page *pages;
+};
+
+struct io_slab_cache
+{
+    io_slab *slab;
+    size_t npages;
+    size_t cursor;
+    size_t pages[IO_SLAB_CACHE_PAGES];
+};
+
+/* nslots is rounded up to a whole number of pages */
+static int io_slab_init(io_slab *slab, size_t slot_size, size_t nslots)
+{
+    assert(ispow2(slot_size));
+    slab->slot_size = slot_size;
+    slab->slot_shift = ctz(slot_size);
+    slab->npages = (nslots + IO_SLAB_PAGE_SLOTS - 1) / IO_SLAB_PAGE_SLOTS;
+    slab->next_page = 0;
+    slab->data = (char*)malloc(slab->npages * IO_SLAB_PAGE_SLOTS * slot_size);
+    slab->pages = (io_slab_page*)malloc(slab->npages * sizeof(io_slab_page));
+    if (!slab->data || !slab->pages) return -1;
+    for (size_t i = 0; i < slab->npages; i++) {
+        slab->pages[i].free = ~0ull;
+    }
+    return 0;
+}
+
+static void io_slab_destroy(io_slab *slab)
+{
+    free(slab->pages);
+    free(slab->data);
+    slab->pages = NULL;
+    slab->data = NULL;
+}
+
+static void io_slab_cache_init(io_slab_cache *cache, io_slab *slab)
+{
+    cache->slab = slab;
+    cache->npages = 0;
+    cache->cursor = 0;
+}
+
+/* claim another page for this cache from the slab */
+static int io_slab_cache_grow(io_slab_cache *cache)
+{
+    io_slab *slab = cache->slab;
+    size_t page;
+
+    if (cache->npages == IO_SLAB_CACHE_PAGES) return 0;
+    page = atomic_fetch_add_explicit(&slab->next_page, 1, memory_order_relaxed);
+    if (page >= slab->npages) {
+        atomic_fetch_sub_explicit(&slab->next_page, 1, memory_order_relaxed);
+        return 0;
+    }
+    cache->cursor = cache->npages;
+    cache->pages[cache->npages++] = page;
+    return 1;
+}
+
+/*
+ * allocate a slot. returns NULL if every page of the cache is in use
+ * and no more pages can be claimed, in which case the caller retries
+ * once consumers have freed slots.
+ */
+static char *io_slab_alloc(io_slab_cache *cache)
+{
+    io_slab *slab = cache->slab;
+
+    for (;;) {
+        for (size_t i = 0; i < cache->npages; i++) {
+            size_t c = cache->cursor + i;
+            size_t page = cache->pages[c < cache->npages ? c : c - cache->npages];
+            io_slab_page *p = &slab->pages[page];
+            ullong bits = atomic_load_explicit(&p->free, memory_order_acquire);
+            if (bits) {
+                uint bit = ctz(bits);
+                atomic_fetch_and_explicit(&p->free, ~(1ull << bit),
+                    memory_order_relaxed);
+                cache->cursor = c < cache->npages ? c : c - cache->npages;
+                return slab->data + ((page * IO_SLAB_PAGE_SLOTS + bit)
+                    << slab->slot_shift);
+            }
+        }
+        if (!io_slab_cache_grow(cache)) return NULL;
+    }
+}
+
+/* return a slot to the cache that allocated it. any thread. */
+static void io_slab_free(io_slab *slab, char *ptr)
+{
+    size_t slot = (size_t)(ptr - slab->data) >> slab->slot_shift;
+    io_slab_page *p = &slab->pages[slot / IO_SLAB_PAGE_SLOTS];
+
+    atomic_fetch_or_explicit(&p->free, 1ull << (slot % IO_SLAB_PAGE_SLOTS),
+        memory_order_release);
+}
+
+/* number of free slots in the pages owned by the cache */
+static size_t io_slab_cache_avail(io_slab_cache *cache)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < cache->npages; i++) {
+        n += popcnt(atomic_load_explicit(
+            &cache->slab->pages[cache->pages[i]].free, memory_order_relaxed));
+    }
+    return n;
+}
+
+static io_slab_ref io_slab_make_ref(io_slab *slab, char *ptr, size_t len)
+{
+    io_slab_ref ref;
+
+    assert(len <= slab->slot_size);
+    ref.slot = (uint)((size_t)(ptr - slab->data) >> slab->slot_shift);
+    ref.length = (uint)len;
+    return ref;
+}
+
+static char *io_slab_ptr(io_slab *slab, io_slab_ref ref)
+{
+    return slab->data + ((size_t)ref.slot << slab->slot_shift);
+}
+
+/*
+ * publish a payload. returns 0 when the reference is committed, after
+ * which the slot belongs to the consumer, or -1 if the ring is full.
+ */
+static int io_slab_send(io_buffer *io, io_slab *slab, char *ptr, size_t len)
+{
+    io_slab_ref ref = io_slab_make_ref(slab, ptr, len);
+    size_t r = io_buffer_write(io, (char*)&ref, sizeof(ref));
+
+    assert(r == 0 || r == sizeof(ref));
+    return r == sizeof(ref) ? 0 : -1;
+}
+
+/* receive a payload, or NULL if the ring is empty */
+static char *io_slab_recv(io_buffer *io, io_slab *slab, size_t *len)
+{
+    io_slab_ref ref;
+    size_t r = io_buffer_read(io, (char*)&ref, sizeof(ref));
+
+    assert(r == 0 || r == sizeof(ref));
+    if (r == 0) return NULL;
+    *len = ref.length;
+    return io_slab_ptr(slab, ref);
+}
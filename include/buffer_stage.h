@@ -0,0 +1,332 @@
+/*
+ * pipe buffer transform stages
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <threads.h>
+
+#include "buffer.h"
+
+/*
+ * ring to ring transform stages
+ *
+ * an io_stage binds an input io_buffer to an output io_buffer and a
+ * transform function that maps fixed size input records to fixed size
+ * output records. each worker takes a read_lock ticket on the input and
+ * a write_lock ticket on the output, calls the transform directly from
+ * one span to the other and commits both, so records are not copied
+ * through an intermediate buffer.
+ *
+ * the two tickets are taken together under a small per stage lock, so
+ * the order of output tickets matches the order of input tickets. with
+ * pbm_buffer on both sides the in-order retirement of commits preserves
+ * the order of records across any number of workers, while the transform
+ * itself runs concurrently. pbs_buffer may be used with one worker.
+ *
+ * the stage sizes its tickets from read_avail and write_avail. the input
+ * is locked first, and when other producers sharing the output leave
+ * less space than write_avail promised, the input reservation is shrunk
+ * to the output span that was actually reserved, so a pbm_buffer ticket
+ * is always committed at its reserved length. this requires the stage
+ * to be the only consumer of its input, that record sizes are powers of
+ * two no larger than the buffer capacities, and that producers, and any
+ * other stages writing to the same output, only commit whole records of
+ * the same size. a ticket that crosses
+ * the end of a buffer is split into two spans and the transform is
+ * called once for each contiguous run of records.
+ *
+ * a stage without an output is a sink. its transform is called with a
+ * NULL output pointer.
+ *
+ *   io_pipeline_init(&pl);
+ *   io_stage_init(&decode, &in.io, &mid.io, decode_fn, NULL, 4, 8);
+ *   io_pipeline_add(&pl, &decode, 4);
+ *   io_pipeline_chain(&pl, &publish, &decode, NULL, publish_fn, s, 0, 1);
+ *   io_pipeline_start(&pl);
+ *   ...
+ *   io_pipeline_stop(&pl);
+ *
+ * io_pipeline chains stages into a graph. stages are added upstream
+ * first, and a pipeline stops each stage only after every stage added
+ * before it has stopped, so a stage drains its input only once all of
+ * its producers have finished. stages may fan in to a shared pbm_buffer
+ * or fan out from a pbb_buffer through pbb_reader inputs.
+ */
+
+#define IO_STAGE_MAX_THREADS 16
+#define IO_STAGE_CHUNK 256
+#define IO_PIPELINE_MAX_STAGES 16
+
+typedef void (io_stage_fn)(void *arg, const char *in, char *out, size_t count);
+
+typedef struct io_stage io_stage;
+typedef struct io_pipeline io_pipeline;
+
+struct io_stage
+{
+    io_buffer *in;
+    io_buffer *out;
+    io_stage_fn *fn;
+    void *arg;
+    size_t isize;
+    size_t osize;
+    size_t chunk;
+    size_t nthreads;
+    atomic_flag lock;
+    atomic_int stop;
+    thrd_t threads[IO_STAGE_MAX_THREADS];
+};
+
+struct io_pipeline
+{
+    size_t nstages;
+    io_stage *stages[IO_PIPELINE_MAX_STAGES];
+    size_t nthreads[IO_PIPELINE_MAX_STAGES];
+};
+
+static void io_stage_init(io_stage *st, io_buffer *in, io_buffer *out,
+    io_stage_fn *fn, void *arg, size_t isize, size_t osize)
+{
+    assert(ispow2(isize));
+    assert(out == NULL || ispow2(osize));
+    memset(st, 0, sizeof(io_stage));
+    st->in = in;
+    st->out = out;
+    st->fn = fn;
+    st->arg = arg;
+    st->isize = isize;
+    st->osize = out ? osize : 0;
+    st->chunk = IO_STAGE_CHUNK;
+    atomic_flag_clear(&st->lock);
+}
+
+/* maximum number of records transferred by one worker step */
+static void io_stage_set_chunk(io_stage *st, size_t chunk)
+{
+    assert(chunk > 0);
+    st->chunk = chunk;
+}
+
+/*
+ * take one or two tickets covering len bytes. a pbs_buffer returns the
+ * same span when locked twice, in which case only the first is used.
+ */
+static size_t io_stage_lock2(io_span t[2], io_read_lock_fn *lock,
+    io_buffer *io, size_t len)
+{
+    t[0] = lock(io, len);
+    t[1].buf = NULL;
+    t[1].length = t[1].sequence = 0;
+    if (t[0].length == 0 || t[0].length == len) return t[0].length;
+    t[1] = lock(io, len - t[0].length);
+    if (t[1].sequence == t[0].sequence) t[1].length = 0;
+    return t[0].length + t[1].length;
+}
+
+/*
+ * shrink the input tickets to len bytes before they are committed. this
+ * is done under the stage lock, where no later input reservation can
+ * exist. the other buffers do not move their markers on lock and commit
+ * at the shorter length.
+ */
+static void io_stage_shrink2(io_span t[2], io_buffer *io, size_t len)
+{
+    for (int i = 1; i >= 0; i--) {
+        size_t keep = len > t[0].length * i ? len - t[0].length * i : 0;
+        if (keep >= t[i].length) continue;
+        if (io->ops == pbm_buffer_ops()) {
+            int ret = pbm_buffer_read_shrink((pbm_buffer*)io, &t[i], keep);
+            assert(ret == 0);
+            (void)ret;
+        } else {
+            t[i].length = keep;
+        }
+    }
+}
+
+static void io_stage_commit2(io_span t[2], io_read_commit_fn *commit,
+    io_buffer *io, size_t len)
+{
+    for (int i = 0; i < 2; i++) {
+        if (t[i].length > len) t[i].length = len;
+        len -= t[i].length;
+        commit(io, t[i]);
+    }
+}
+
+/* call the transform once for each contiguous run of records */
+static void io_stage_apply(io_stage *st, io_span in[2], io_span out[2],
+    size_t count)
+{
+    size_t ii = 0, oi = 0, io = 0, oo = 0, n;
+
+    while (count > 0) {
+        n = (in[ii].length - io) / st->isize;
+        if (st->out) {
+            size_t on = (out[oi].length - oo) / st->osize;
+            if (on < n) n = on;
+        }
+        if (count < n) n = count;
+        assert(n > 0);
+        st->fn(st->arg, in[ii].buf + io, st->out ? out[oi].buf + oo : NULL, n);
+        io += n * st->isize;
+        if (io == in[ii].length) { ii++; io = 0; }
+        if (st->out) {
+            oo += n * st->osize;
+            if (oo == out[oi].length) { oi++; oo = 0; }
+        }
+        count -= n;
+    }
+}
+
+/*
+ * transform up to chunk records. returns the number of records processed,
+ * which is zero when the input is empty or the output is full.
+ */
+static size_t io_stage_step(io_stage *st)
+{
+    io_span in[2], out[2] = { { 0, 0, 0 }, { 0, 0, 0 } };
+    size_t count, n;
+
+    while (atomic_flag_test_and_set_explicit(&st->lock, memory_order_acquire)) {
+        thrd_yield();
+    }
+
+    count = io_buffer_read_avail(st->in) / st->isize;
+    if (st->out) {
+        n = io_buffer_write_avail(st->out) / st->osize;
+        if (n < count) count = n;
+    }
+    if (count > st->chunk) count = st->chunk;
+    if (count == 0) {
+        atomic_flag_clear_explicit(&st->lock, memory_order_release);
+        return 0;
+    }
+
+    n = io_stage_lock2(in, st->in->ops->read_lock, st->in,
+        count * st->isize) / st->isize;
+    if (n < count) count = n;
+    if (st->out && count > 0) {
+        n = io_stage_lock2(out, st->out->ops->write_lock, st->out,
+            count * st->osize);
+        assert(n % st->osize == 0);
+        n /= st->osize;
+        if (n < count) {
+            count = n;
+            io_stage_shrink2(in, st->in, count * st->isize);
+        }
+    }
+
+    atomic_flag_clear_explicit(&st->lock, memory_order_release);
+
+    if (count > 0) io_stage_apply(st, in, out, count);
+
+    if (st->out) {
+        io_stage_commit2(out, st->out->ops->write_commit, st->out,
+            count * st->osize);
+    }
+    io_stage_commit2(in, st->in->ops->read_commit, st->in,
+        count * st->isize);
+
+    return count;
+}
+
+/*
+ * workers run until the stage is stopped and its input is empty. stop is
+ * loaded before the input is checked, so records committed by producers
+ * that finished before the stop are always transformed.
+ */
+static int io_stage_worker(void *arg)
+{
+    io_stage *st = (io_stage*)arg;
+
+    for (;;) {
+        int stop = atomic_load_explicit(&st->stop, memory_order_acquire);
+        if (io_stage_step(st) > 0) continue;
+        if (stop && io_buffer_read_avail(st->in) == 0) break;
+        thrd_yield();
+    }
+
+    return 0;
+}
+
+static int io_stage_start(io_stage *st, size_t nthreads)
+{
+    assert(nthreads > 0 && nthreads <= IO_STAGE_MAX_THREADS);
+    atomic_store_explicit(&st->stop, 0, memory_order_relaxed);
+    for (st->nthreads = 0; st->nthreads < nthreads; st->nthreads++) {
+        if (thrd_create(&st->threads[st->nthreads], io_stage_worker, st)
+            != thrd_success) return -1;
+    }
+    return 0;
+}
+
+/* drain the input and join the workers */
+static void io_stage_stop(io_stage *st)
+{
+    int res;
+
+    atomic_store_explicit(&st->stop, 1, memory_order_release);
+    for (size_t i = 0; i < st->nthreads; i++) {
+        thrd_join(st->threads[i], &res);
+    }
+    st->nthreads = 0;
+}
+
+static void io_pipeline_init(io_pipeline *pl)
+{
+    memset(pl, 0, sizeof(io_pipeline));
+}
+
+/* stages are added in dependency order, producers before consumers */
+static int io_pipeline_add(io_pipeline *pl, io_stage *st, size_t nthreads)
+{
+    if (pl->nstages == IO_PIPELINE_MAX_STAGES) return -1;
+    pl->nthreads[pl->nstages] = nthreads;
+    pl->stages[pl->nstages++] = st;
+    return 0;
+}
+
+/* add a stage that consumes the output of an existing stage */
+static int io_pipeline_chain(io_pipeline *pl, io_stage *st, io_stage *prev,
+    io_buffer *out, io_stage_fn *fn, void *arg, size_t osize,
+    size_t nthreads)
+{
+    assert(prev->out != NULL);
+    io_stage_init(st, prev->out, out, fn, arg, prev->osize, osize);
+    return io_pipeline_add(pl, st, nthreads);
+}
+
+static int io_pipeline_start(io_pipeline *pl)
+{
+    for (size_t i = 0; i < pl->nstages; i++) {
+        if (io_stage_start(pl->stages[i], pl->nthreads[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * stop the stages in the order they were added. called once the external
+ * producers of the first stages have finished.
+ */
+static void io_pipeline_stop(io_pipeline *pl)
+{
+    for (size_t i = 0; i < pl->nstages; i++) {
+        io_stage_stop(pl->stages[i]);
+    }
+}
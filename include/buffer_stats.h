@@ -0,0 +1,437 @@
+/*
+ * pipe buffer telemetry
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer.h"
+
+/*
+ * occupancy sampler and prometheus exporter
+ *
+ * io_stats is a registry of named pbs_buffer and pbm_buffer instances. a
+ * sampler thread started by io_stats_start reads the markers of every
+ * registered buffer each interval and keeps the last IO_STATS_WINDOW
+ * samples per buffer. every export_every samples it writes the registry
+ * in the prometheus text exposition format to a file, which is written
+ * to a temporary name and renamed into place so a collector never reads
+ * a partial file, or to stdout when the path is NULL.
+ *
+ *   io_stats st;
+ *   io_stats_init(&st, 10000000, 100, "/var/lib/node_exporter/cpipe.prom");
+ *   io_stats_add_pbs(&st, "ingest", &ingest);
+ *   io_stats_add_pbm(&st, "work", &work);
+ *   io_stats_start(&st);
+ *   ...
+ *   io_stats_destroy(&st);
+ *
+ * sampling only loads the markers and capacity with relaxed atomics. it
+ * takes no locks and never writes to the buffers, so the only cost to
+ * readers and writers is the line being shared with the sampler. the
+ * samples are a snapshot and markers may move between the loads:
+ *
+ *   - used: committed unread bytes, end - start.
+ *   - in flight: bytes reserved by locks that are not yet committed,
+ *     start_mark - start and end_mark - end. only pbm_buffer publishes
+ *     its reservations, pbs_buffer reports zero.
+ *   - read and written totals and rates: bytes committed since
+ *     registration, from the 64-bit markers of pbs_buffer. pbm_buffer
+ *     markers are 16-bit and wrap between samples whenever 64KiB passes,
+ *     so they cannot give a total, and pbm sources leave the totals and
+ *     rates out of the export.
+ *   - full and empty: the fraction of samples in the window where
+ *     write_avail or read_avail was zero, which approximates the time
+ *     writers or readers spend waiting.
+ *
+ * sources are added from one thread, before or after the sampler starts,
+ * and stay registered until io_stats_destroy. io_stats_sample and
+ * io_stats_write may be called directly when no sampler thread runs.
+ */
+
+#define IO_STATS_MAX 64
+#define IO_STATS_WINDOW 64
+#define IO_STATS_NAME 48
+
+enum { IO_STATS_PBS, IO_STATS_PBM };
+
+typedef struct io_stats io_stats;
+typedef struct io_stats_src io_stats_src;
+typedef struct io_stats_point io_stats_point;
+
+struct io_stats_point
+{
+    llong time_ns;
+    ullong read;
+    ullong written;
+    size_t capacity;
+    size_t used;
+    size_t read_inflight;
+    size_t write_inflight;
+    int full;
+    int empty;
+};
+
+struct io_stats_src
+{
+    char name[IO_STATS_NAME];
+    int type;
+    void *pb;
+    ullong start;
+    ullong end;
+    ullong read;
+    ullong written;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    ullong nsamples;
+    io_stats_point window[IO_STATS_WINDOW];
+};
+
+struct io_stats
+{
+    llong interval_ns;
+    size_t export_every;
+    const char *path;
+    atomic_size_t nsrcs;
+    atomic_int stop;
+    int running;
+    thrd_t thread;
+    io_stats_src srcs[IO_STATS_MAX];
+};
+
+static llong io_stats_now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/*
+ * path is kept by reference and may be NULL for stdout. export_every is
+ * the number of samples between exports, zero disables exporting.
+ */
+static void io_stats_init(io_stats *st, llong interval_ns,
+    size_t export_every, const char *path)
+{
+    memset(st, 0, sizeof(io_stats));
+    st->interval_ns = interval_ns;
+    st->export_every = export_every;
+    st->path = path;
+}
+
+/* load the markers of a source without writing to the buffer */
+static void io_stats_load(io_stats_src *src, ullong *start, ullong *end,
+    io_stats_point *s)
+{
+    if (src->type == IO_STATS_PBS) {
+        pbs_buffer *pb = (pbs_buffer*)src->pb;
+        size_t cap = atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+        *start = atomic_load_explicit(&pb->start, memory_order_relaxed);
+        *end = atomic_load_explicit(&pb->end, memory_order_relaxed);
+        /* capacity is zero while the producer resizes the buffer */
+        s->capacity = cap ? cap : src->capacity;
+        s->used = (size_t)(*end - *start);
+        s->read_inflight = 0;
+        s->write_inflight = 0;
+    } else {
+        pbm_buffer *pb = (pbm_buffer*)src->pb;
+        size_t cap = atomic_load_explicit(&pb->capacity, memory_order_relaxed);
+        pbm_offsets pof = pbm_unpack_offsets(atomic_load_explicit(&pb->pof,
+            memory_order_relaxed));
+        *start = pof.start;
+        *end = pof.end;
+        s->capacity = cap ? cap : src->capacity;
+        s->used = (pbm_uoffset)(pof.end - pof.start);
+        s->read_inflight = (pbm_uoffset)(pof.start_mark - pof.start);
+        s->write_inflight = (pbm_uoffset)(pof.end_mark - pof.end);
+    }
+    /* markers loaded apart may briefly disagree with each other */
+    if (s->used > s->capacity) s->used = s->capacity;
+    s->full = s->used + s->write_inflight >= s->capacity;
+    s->empty = s->used <= s->read_inflight;
+}
+
+static int io_stats_add(io_stats *st, const char *name, int type, void *pb)
+{
+    size_t idx = atomic_load_explicit(&st->nsrcs, memory_order_relaxed);
+    io_stats_src *src = &st->srcs[idx];
+    io_stats_point s;
+
+    if (idx == IO_STATS_MAX) return -1;
+
+    memset(src, 0, sizeof(io_stats_src));
+    snprintf(src->name, sizeof(src->name), "%s", name);
+    src->type = type;
+    src->pb = pb;
+    io_stats_load(src, &src->start, &src->end, &s);
+    src->capacity = s.capacity;
+
+    /* publish the source to the sampler */
+    atomic_store_explicit(&st->nsrcs, idx + 1, memory_order_release);
+
+    return (int)idx;
+}
+
+static int io_stats_add_pbs(io_stats *st, const char *name, pbs_buffer *pb)
+{
+    return io_stats_add(st, name, IO_STATS_PBS, pb);
+}
+
+static int io_stats_add_pbm(io_stats *st, const char *name, pbm_buffer *pb)
+{
+    return io_stats_add(st, name, IO_STATS_PBM, pb);
+}
+
+/* take one sample of every source */
+static void io_stats_sample(io_stats *st)
+{
+    size_t n = atomic_load_explicit(&st->nsrcs, memory_order_acquire);
+    llong now = io_stats_now();
+
+    for (size_t i = 0; i < n; i++) {
+        io_stats_src *src = &st->srcs[i];
+        io_stats_point s;
+        ullong start, end;
+
+        io_stats_load(src, &start, &end, &s);
+        if (src->type == IO_STATS_PBS) {
+            src->read += start - src->start;
+            src->written += end - src->end;
+        }
+        src->start = start;
+        src->end = end;
+        src->capacity = s.capacity;
+
+        s.time_ns = now;
+        s.read = src->read;
+        s.written = src->written;
+        src->window[src->head] = s;
+        src->head = (src->head + 1) % IO_STATS_WINDOW;
+        if (src->count < IO_STATS_WINDOW) src->count++;
+        src->nsamples++;
+    }
+}
+
+/* the sample i places before the latest */
+static io_stats_point *io_stats_at(io_stats_src *src, size_t i)
+{
+    return &src->window[(src->head + IO_STATS_WINDOW - 1 - i) %
+        IO_STATS_WINDOW];
+}
+
+/* bytes per second over the window */
+static double io_stats_rate(io_stats_src *src, int written)
+{
+    io_stats_point *last, *first;
+    double secs;
+
+    if (src->count < 2) return 0;
+    last = io_stats_at(src, 0);
+    first = io_stats_at(src, src->count - 1);
+    secs = (last->time_ns - first->time_ns) / 1e9;
+    if (secs <= 0) return 0;
+    return written ? (last->written - first->written) / secs :
+        (last->read - first->read) / secs;
+}
+
+enum {
+    IO_STATS_CAPACITY, IO_STATS_USED, IO_STATS_USED_AVG, IO_STATS_USED_MAX,
+    IO_STATS_READ_INFLIGHT, IO_STATS_WRITE_INFLIGHT, IO_STATS_READ_TOTAL,
+    IO_STATS_WRITTEN_TOTAL, IO_STATS_READ_RATE, IO_STATS_WRITE_RATE,
+    IO_STATS_FULL, IO_STATS_EMPTY, IO_STATS_SAMPLES, IO_STATS_NMETRICS
+};
+
+static const char *io_stats_metrics[IO_STATS_NMETRICS][3] =
+{
+    { "cpipe_capacity_bytes", "gauge", "ring capacity" },
+    { "cpipe_used_bytes", "gauge", "committed unread bytes" },
+    { "cpipe_used_bytes_avg", "gauge", "mean of used bytes over the window" },
+    { "cpipe_used_bytes_max", "gauge", "max of used bytes over the window" },
+    { "cpipe_read_inflight_bytes", "gauge", "bytes held by read locks" },
+    { "cpipe_write_inflight_bytes", "gauge", "bytes held by write locks" },
+    { "cpipe_read_bytes_total", "counter", "bytes read since registration" },
+    { "cpipe_written_bytes_total", "counter", "bytes written since registration" },
+    { "cpipe_read_bytes_per_second", "gauge", "read rate over the window" },
+    { "cpipe_written_bytes_per_second", "gauge", "write rate over the window" },
+    { "cpipe_full_ratio", "gauge", "fraction of the window with no space to write" },
+    { "cpipe_empty_ratio", "gauge", "fraction of the window with nothing to read" },
+    { "cpipe_samples_total", "counter", "samples taken" },
+};
+
+/* pbm markers are too narrow to count totals, see above */
+static int io_stats_exported(io_stats_src *src, int metric)
+{
+    switch (metric) {
+    case IO_STATS_READ_TOTAL:
+    case IO_STATS_WRITTEN_TOTAL:
+    case IO_STATS_READ_RATE:
+    case IO_STATS_WRITE_RATE:
+        return src->type == IO_STATS_PBS;
+    }
+    return 1;
+}
+
+static double io_stats_value(io_stats_src *src, int metric)
+{
+    io_stats_point *last = io_stats_at(src, 0);
+    double sum = 0, max = 0;
+
+    switch (metric) {
+    case IO_STATS_CAPACITY: return (double)src->capacity;
+    case IO_STATS_USED: return (double)last->used;
+    case IO_STATS_READ_INFLIGHT: return (double)last->read_inflight;
+    case IO_STATS_WRITE_INFLIGHT: return (double)last->write_inflight;
+    case IO_STATS_READ_TOTAL: return (double)src->read;
+    case IO_STATS_WRITTEN_TOTAL: return (double)src->written;
+    case IO_STATS_READ_RATE: return io_stats_rate(src, 0);
+    case IO_STATS_WRITE_RATE: return io_stats_rate(src, 1);
+    case IO_STATS_SAMPLES: return (double)src->nsamples;
+    }
+
+    for (size_t i = 0; i < src->count; i++) {
+        io_stats_point *s = io_stats_at(src, i);
+        switch (metric) {
+        case IO_STATS_USED_AVG: sum += s->used; break;
+        case IO_STATS_USED_MAX: if (s->used > max) max = s->used; break;
+        case IO_STATS_FULL: sum += s->full; break;
+        case IO_STATS_EMPTY: sum += s->empty; break;
+        }
+    }
+    if (metric == IO_STATS_USED_MAX) return max;
+    return src->count ? sum / src->count : 0;
+}
+
+/* label values escape backslash, double quote and newline */
+static void io_stats_label(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        switch (*s) {
+        case '\\': fputs("\\\\", f); break;
+        case '"': fputs("\\\"", f); break;
+        case '\n': fputs("\\n", f); break;
+        default: fputc(*s, f); break;
+        }
+    }
+}
+
+/* write every sampled source in the prometheus text format */
+static int io_stats_write(io_stats *st, FILE *f)
+{
+    size_t n = atomic_load_explicit(&st->nsrcs, memory_order_acquire);
+
+    for (int m = 0; m < IO_STATS_NMETRICS; m++) {
+        fprintf(f, "# HELP %s %s\n", io_stats_metrics[m][0],
+            io_stats_metrics[m][2]);
+        fprintf(f, "# TYPE %s %s\n", io_stats_metrics[m][0],
+            io_stats_metrics[m][1]);
+        for (size_t i = 0; i < n; i++) {
+            io_stats_src *src = &st->srcs[i];
+            if (src->count == 0 || !io_stats_exported(src, m)) continue;
+            fprintf(f, "%s{pipe=\"", io_stats_metrics[m][0]);
+            io_stats_label(f, src->name);
+            fprintf(f, "\",type=\"%s\"} %.17g\n",
+                src->type == IO_STATS_PBS ? "pbs" : "pbm",
+                io_stats_value(src, m));
+        }
+    }
+
+    return ferror(f) ? -1 : 0;
+}
+
+/* write to path by way of a temporary file, or to stdout */
+static int io_stats_export(io_stats *st)
+{
+    char tmp[1024];
+    FILE *f;
+    int ret;
+
+    if (!st->path) {
+        ret = io_stats_write(st, stdout);
+        fflush(stdout);
+        return ret;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", st->path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    if (!(f = fopen(tmp, "w"))) return -1;
+    ret = io_stats_write(st, f);
+    if (fclose(f) != 0) ret = -1;
+#if defined _WIN32
+    remove(st->path);
+#endif
+    if (ret == 0 && rename(tmp, st->path) != 0) ret = -1;
+    if (ret != 0) remove(tmp);
+
+    return ret;
+}
+
+static int io_stats_thread(void *arg)
+{
+    io_stats *st = (io_stats*)arg;
+    struct timespec d;
+    size_t k = 0;
+
+    d.tv_sec = (time_t)(st->interval_ns / 1000000000);
+    d.tv_nsec = (long)(st->interval_ns % 1000000000);
+
+    while (!atomic_load_explicit(&st->stop, memory_order_acquire)) {
+        io_stats_sample(st);
+        if (st->export_every && ++k == st->export_every) {
+            io_stats_export(st);
+            k = 0;
+        }
+        thrd_sleep(&d, NULL);
+    }
+
+    return 0;
+}
+
+static int io_stats_start(io_stats *st)
+{
+    assert(!st->running);
+    atomic_store_explicit(&st->stop, 0, memory_order_relaxed);
+    if (thrd_create(&st->thread, io_stats_thread, st) != thrd_success) {
+        return -1;
+    }
+    st->running = 1;
+    return 0;
+}
+
+/* stop the sampler, which returns within one interval */
+static void io_stats_stop(io_stats *st)
+{
+    int res;
+
+    if (!st->running) return;
+    atomic_store_explicit(&st->stop, 1, memory_order_release);
+    thrd_join(st->thread, &res);
+    st->running = 0;
+}
+
+/* stop the sampler and write a final export */
+static void io_stats_destroy(io_stats *st)
+{
+    int running = st->running;
+
+    io_stats_stop(st);
+    if (running && st->export_every) io_stats_export(st);
+}
@@ -0,0 +1,242 @@
+/*
+ * pipe buffer timed operations
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <time.h>
+#include <limits.h>
+#include <threads.h>
+
+#include "buffer.h"
+
+#if defined __linux__
+#include <poll.h>
+#include "buffer_notify.h"
+#define IO_TIMED_NOTIFY 1
+#else
+#define IO_TIMED_NOTIFY 0
+#endif
+
+/*
+ * deadline-bounded operations
+ *
+ * the timed operations retry an io_buffer operation until it succeeds or
+ * an absolute deadline passes, and a NULL deadline waits indefinitely.
+ * deadlines come from io_deadline_after, which uses CLOCK_MONOTONIC where
+ * it exists, the clock of the futex waits, and otherwise the portable
+ * C11 timespec_get.
+ *
+ * a buffer whose commits wake waiters is waited on without polling:
+ *
+ * - io_notify, on Linux, arms its eventfd and sleeps in poll until the
+ *   peer's commit signals it. poll has millisecond timeouts, so the
+ *   last millisecond before the deadline is waited as for other buffers.
+ * - pbp_buffer has futex timed waits in buffer_shm.h.
+ *
+ * other buffers have no wakeup on commit, so the wait polls read_avail or
+ * write_avail, which have no side effects:
+ *
+ * - spin for IO_TIMED_SPIN polls, which covers a peer that is mid-commit.
+ * - sleep with exponential backoff from IO_TIMED_SLEEP_MIN nanoseconds to
+ *   IO_TIMED_SLEEP_MAX, never past the deadline. the final sleep may
+ *   overshoot the deadline by the kernel timer slack.
+ *
+ * an operation that fails while avail is non-zero, such as a reader
+ * behind another reader's ticket, backs off with the same sleeps instead
+ * of retrying at once.
+ *
+ *   struct timespec deadline;
+ *   io_deadline_after(&deadline, 50000);
+ *   io_span t = io_buffer_read_lock_timed(io, len, &deadline);
+ *   if (t.length == 0) ... timed out ...
+ */
+
+#define IO_TIMED_SPIN 256
+#define IO_TIMED_SLEEP_MIN 1000
+#define IO_TIMED_SLEEP_MAX 1000000
+
+static void io_clock_now(struct timespec *ts)
+{
+#if defined CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+    timespec_get(ts, TIME_UTC);
+#endif
+}
+
+/* set ts to ns nanoseconds from now on the deadline clock */
+static void io_deadline_after(struct timespec *ts, llong ns)
+{
+    io_clock_now(ts);
+    ts->tv_sec += (time_t)(ns / 1000000000);
+    ts->tv_nsec += (long)(ns % 1000000000);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* nanoseconds from now until the deadline, negative once it has passed */
+static llong io_deadline_left(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    if (!deadline) return LLONG_MAX;
+    io_clock_now(&now);
+    return (llong)(deadline->tv_sec - now.tv_sec) * 1000000000ll +
+        (deadline->tv_nsec - now.tv_nsec);
+}
+
+/* sleep for the backoff, no longer than left, and double the backoff */
+static void io_timed_sleep(llong *backoff, llong left)
+{
+    llong ns = *backoff < left ? *backoff : left;
+    struct timespec d = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+
+    thrd_sleep(&d, NULL);
+    if (*backoff < IO_TIMED_SLEEP_MAX) *backoff <<= 1;
+}
+
+#if IO_TIMED_NOTIFY
+/* sleep until the peer's commit signals the eventfd or the deadline */
+static void io_timed_notify_wait(io_notify *n, int writer, llong left)
+{
+    struct pollfd p = { writer ? n->write_fd : n->read_fd, POLLIN, 0 };
+    int timeout = left == LLONG_MAX ? -1 : left > INT_MAX * 1000000ll ?
+        INT_MAX : (int)(left / 1000000);
+
+    if ((writer ? io_notify_arm_write(n) : io_notify_arm_read(n)) == 0) {
+        poll(&p, 1, timeout);
+    }
+    if (writer) io_notify_ack_write(n);
+    else io_notify_ack_read(n);
+}
+#endif
+
+/*
+ * wait until the read or write side may proceed. returns 0, or -1 if the
+ * deadline passed. backoff is zero for the first wait of an operation and
+ * carries the sleep length across its retries. the deadline is checked
+ * first so callers whose operation keeps failing still time out.
+ */
+static int io_timed_wait(io_buffer *io, int writer,
+    const struct timespec *deadline, llong *backoff)
+{
+    io_read_avail_fn *avail = writer ? io->ops->write_avail :
+        io->ops->read_avail;
+    llong left;
+
+    if ((left = io_deadline_left(deadline)) <= 0) return -1;
+
+    if (*backoff == 0) {
+        *backoff = IO_TIMED_SLEEP_MIN;
+        for (int i = 0; i < IO_TIMED_SPIN; i++) {
+            if (avail(io) > 0) return 0;
+        }
+    } else if (avail(io) > 0) {
+        io_timed_sleep(backoff, left);
+        return 0;
+    }
+
+#if IO_TIMED_NOTIFY
+    if (io->ops == &io_notify_ops && left >= 1000000) {
+        io_timed_notify_wait((io_notify*)io, writer, left);
+        return 0;
+    }
+#endif
+
+    for (;;) {
+        io_timed_sleep(backoff, left);
+        if (avail(io) > 0) return 0;
+        if ((left = io_deadline_left(deadline)) <= 0) return -1;
+    }
+}
+
+/* returns once at least one byte has been read, or 0 at the deadline */
+static size_t io_buffer_read_timed(io_buffer *io, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    llong backoff = 0;
+    size_t r;
+
+    if (len == 0) return 0;
+
+    while ((r = io_buffer_read(io, buf, len)) == 0) {
+        if (io_timed_wait(io, 0, deadline, &backoff) < 0) {
+            return io_buffer_read(io, buf, len);
+        }
+    }
+
+    return r;
+}
+
+/* returns once all bytes are written, or the bytes written by the deadline */
+static size_t io_buffer_write_timed(io_buffer *io, char *buf, size_t len,
+    const struct timespec *deadline)
+{
+    llong backoff = 0;
+    size_t w = 0;
+
+    while (w < len) {
+        size_t r = io_buffer_write(io, buf + w, len - w);
+        if (r == 0 && io_timed_wait(io, 1, deadline, &backoff) < 0) {
+            return w + io_buffer_write(io, buf + w, len - w);
+        }
+        w += r;
+    }
+
+    return w;
+}
+
+/* returns a non-empty read ticket, or an empty ticket at the deadline */
+static io_span io_buffer_read_lock_timed(io_buffer *io, size_t len,
+    const struct timespec *deadline)
+{
+    io_span ticket = { 0, 0, 0 };
+    llong backoff = 0;
+
+    if (len == 0) return ticket;
+
+    while ((ticket = io_buffer_read_lock(io, len)).length == 0) {
+        if (io_timed_wait(io, 0, deadline, &backoff) < 0) {
+            return io_buffer_read_lock(io, len);
+        }
+    }
+
+    return ticket;
+}
+
+/*
+ * returns a non-empty write ticket, which like io_buffer_write_lock may
+ * be shorter than len, or an empty ticket at the deadline.
+ */
+static io_span io_buffer_write_lock_timed(io_buffer *io, size_t len,
+    const struct timespec *deadline)
+{
+    io_span ticket = { 0, 0, 0 };
+    llong backoff = 0;
+
+    if (len == 0) return ticket;
+
+    while ((ticket = io_buffer_write_lock(io, len)).length == 0) {
+        if (io_timed_wait(io, 1, deadline, &backoff) < 0) {
+            return io_buffer_write_lock(io, len);
+        }
+    }
+
+    return ticket;
+}
@@ -0,0 +1,456 @@
+/*
+ * pipe buffer io_uring stages
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "buffer.h"
+
+/*
+ * io_uring drain and fill stages
+ *
+ * an iou_stage drains a pbm_buffer to a file or fills a pbm_buffer from
+ * a file with many IOs in flight. a drain stage takes read_lock spans and
+ * submits them as registered buffer writes, and a fill stage takes
+ * write_lock spans and submits them as registered buffer reads. spans
+ * are committed only when their completion arrives, in the order they
+ * were locked, so the buffer keeps its in-order retirement while the
+ * kernel overlaps the IOs. a consumer thread is no longer stalled by a
+ * slow write, and the buffer keeps accepting data until the in-flight
+ * spans have been retired.
+ *
+ * the pbm_buffer data array is registered once with the ring using
+ * IORING_REGISTER_BUFFERS so each IO avoids pinning pages. the stage
+ * requires pbm_buffer because it relies on the read ahead and write
+ * ahead marks to hold several tickets at once. the stage is used from
+ * a single thread and the ring is driven with raw system calls so there
+ * is no dependency on liburing.
+ *
+ * a fill that hits end of file or an error stops the stage from issuing
+ * further fills. once the IOs after it have completed, the spans from
+ * the failed one onwards are handed back past its valid bytes when they
+ * are still the last reservation. otherwise they are committed zero
+ * filled. iou_stage_filled counts the valid bytes committed and
+ * iou_stage_padded the zero bytes that follow them, so consumers can
+ * stop at the short count.
+ */
+
+#define IOU_DRAIN 0
+#define IOU_FILL 1
+
+typedef struct iou_ring iou_ring;
+typedef struct iou_slot iou_slot;
+typedef struct iou_stage iou_stage;
+
+struct iou_ring
+{
+    int fd;
+    uint sq_entries;
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    uint *sq_mask;
+    uint *sq_array;
+    struct io_uring_sqe *sqes;
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    uint *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+struct iou_slot
+{
+    io_span ticket;
+    size_t done;
+    ullong offset;
+    int failed;
+};
+
+struct iou_stage
+{
+    iou_ring ring;
+    pbm_buffer *pb;
+    int mode;
+    int fd;
+    ullong offset;
+    ullong limit;
+    size_t chunk;
+    uint depth;
+    uint head;
+    uint tail;
+    int error;
+    int stopped;
+    ullong filled;
+    ullong padded;
+    iou_slot *slots;
+};
+
+static int iou_ring_init(iou_ring *r, uint entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) goto err;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto err;
+
+    r->sq_head = (atomic_uint*)((char*)r->sq_map + p.sq_off.head);
+    r->sq_tail = (atomic_uint*)((char*)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (uint*)((char*)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (uint*)((char*)r->sq_map + p.sq_off.array);
+    r->cq_head = (atomic_uint*)((char*)r->cq_map + p.cq_off.head);
+    r->cq_tail = (atomic_uint*)((char*)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (uint*)((char*)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_map + p.cq_off.cqes);
+
+    return 0;
+
+err:
+    if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    if (r->sq_map && r->sq_map != MAP_FAILED) {
+        munmap(r->sq_map, r->sq_map_size);
+    }
+    close(r->fd);
+    return -1;
+}
+
+static void iou_ring_destroy(iou_ring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+}
+
+static int iou_ring_enter(iou_ring *r, uint submit, uint wait)
+{
+    long ret;
+    do {
+        ret = syscall(SYS_io_uring_enter, r->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return (int)ret;
+}
+
+/*
+ * initialize a drain or fill stage with up to depth IOs of at most chunk
+ * bytes in flight. a drain stage appends to fd starting at offset. a fill
+ * stage reads from fd starting at offset up to the size of the file.
+ */
+static int iou_stage_init(iou_stage *st, pbm_buffer *pb, int mode, int fd,
+    ullong offset, uint depth, size_t chunk)
+{
+    struct iovec iov = { pb->data, pbm_buffer_capacity(pb) };
+    struct stat s;
+
+    memset(st, 0, sizeof(*st));
+    st->pb = pb;
+    st->mode = mode;
+    st->fd = fd;
+    st->offset = offset;
+    st->limit = ~0ull;
+    st->chunk = chunk;
+    st->depth = depth;
+
+    if (mode == IOU_FILL) {
+        if (fstat(fd, &s) < 0) return -1;
+        st->limit = (ullong)s.st_size;
+    }
+
+    st->slots = (iou_slot*)calloc(depth, sizeof(iou_slot));
+    if (!st->slots) return -1;
+
+    if (iou_ring_init(&st->ring, depth) < 0) goto err;
+
+    if (syscall(SYS_io_uring_register, st->ring.fd,
+        IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        iou_ring_destroy(&st->ring);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    free(st->slots);
+    st->slots = NULL;
+    return -1;
+}
+
+static void iou_stage_destroy(iou_stage *st)
+{
+    iou_ring_destroy(&st->ring);
+    free(st->slots);
+    st->slots = NULL;
+}
+
+static void iou_stage_prep(iou_stage *st, uint idx)
+{
+    iou_ring *r = &st->ring;
+    iou_slot *slot = &st->slots[idx % st->depth];
+    uint tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    uint si = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[si];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = st->mode == IOU_DRAIN ? IORING_OP_WRITE_FIXED :
+        IORING_OP_READ_FIXED;
+    sqe->fd = st->fd;
+    sqe->addr = (ullong)(uintptr_t)(slot->ticket.buf + slot->done);
+    sqe->len = (uint)(slot->ticket.length - slot->done);
+    sqe->off = slot->offset + slot->done;
+    sqe->buf_index = 0;
+    sqe->user_data = idx;
+
+    r->sq_array[si] = si;
+    atomic_store_explicit(r->sq_tail, tail + 1, memory_order_release);
+}
+
+/*
+ * lock spans until the ring is full or the buffer has no more data or
+ * space, then submit them. returns the number of IOs submitted.
+ */
+static uint iou_stage_submit(iou_stage *st)
+{
+    uint n = 0;
+
+    while (st->tail - st->head < st->depth) {
+        size_t len = st->chunk;
+        io_span t;
+
+        if (st->mode == IOU_FILL) {
+            if (st->stopped || st->offset >= st->limit) break;
+            if (st->limit - st->offset < len) {
+                len = (size_t)(st->limit - st->offset);
+            }
+            t = pbm_buffer_write_lock(st->pb, len);
+        } else {
+            t = pbm_buffer_read_lock(st->pb, len);
+        }
+        if (t.length == 0) break;
+
+        iou_slot *slot = &st->slots[st->tail % st->depth];
+        slot->ticket = t;
+        slot->done = 0;
+        slot->offset = st->offset;
+        slot->failed = 0;
+        st->offset += t.length;
+        iou_stage_prep(st, st->tail++);
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * retire the spans from a failed fill onwards, once the IOs after it have
+ * completed so the kernel no longer writes to them. the spans are handed
+ * back past the valid bytes if they are contiguous and still the last
+ * reservation, otherwise they are committed with everything past the
+ * valid bytes zero filled. returns -1 while IOs are still in flight.
+ */
+static int iou_stage_cut(iou_stage *st)
+{
+    iou_slot *first = &st->slots[st->head % st->depth];
+    io_span all = first->ticket;
+    int contiguous = 1;
+
+    for (uint i = st->head + 1; i != st->tail; i++) {
+        iou_slot *slot = &st->slots[i % st->depth];
+        if (!slot->failed && slot->done < slot->ticket.length) return -1;
+        if ((pbm_uoffset)(all.sequence + all.length) !=
+            (pbm_uoffset)slot->ticket.sequence) contiguous = 0;
+        all.length += slot->ticket.length;
+    }
+
+    if (contiguous &&
+        pbm_buffer_write_truncate(st->pb, all, first->done) == 0) {
+        st->filled += first->done;
+    } else {
+        for (uint i = st->head; i != st->tail; i++) {
+            iou_slot *slot = &st->slots[i % st->depth];
+            size_t valid = i == st->head ? slot->done : 0;
+            memset(slot->ticket.buf + valid, 0, slot->ticket.length - valid);
+            pbm_buffer_write_commit(st->pb, slot->ticket);
+            st->filled += valid;
+            st->padded += slot->ticket.length - valid;
+        }
+    }
+    st->head = st->tail;
+
+    return 0;
+}
+
+/*
+ * reap completions and commit the in-order prefix of completed spans.
+ * short transfers are resubmitted for the remainder of the span.
+ * returns the number of valid bytes committed.
+ */
+static size_t iou_stage_reap(iou_stage *st, uint *resubmit)
+{
+    iou_ring *r = &st->ring;
+    uint head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    uint tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    size_t bytes = 0;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        uint idx = (uint)cqe->user_data;
+        iou_slot *slot = &st->slots[idx % st->depth];
+        if (cqe->res < 0 || (cqe->res == 0 && st->mode == IOU_FILL)) {
+            st->error = cqe->res < 0 ? -cqe->res : EIO;
+            slot->failed = 1;
+            if (st->mode == IOU_FILL) st->stopped = 1;
+            continue;
+        }
+        slot->done += (size_t)cqe->res;
+        if (slot->done < slot->ticket.length) {
+            iou_stage_prep(st, idx);
+            (*resubmit)++;
+        }
+    }
+    atomic_store_explicit(r->cq_head, head, memory_order_release);
+
+    while (st->head != st->tail) {
+        iou_slot *slot = &st->slots[st->head % st->depth];
+        if (!slot->failed && slot->done < slot->ticket.length) break;
+        if (st->mode == IOU_FILL && slot->failed) {
+            ullong filled = st->filled;
+            if (iou_stage_cut(st) < 0) break;
+            bytes += (size_t)(st->filled - filled);
+            break;
+        }
+        if (st->mode == IOU_FILL) {
+            pbm_buffer_write_commit(st->pb, slot->ticket);
+            st->filled += slot->ticket.length;
+        } else {
+            pbm_buffer_read_commit(st->pb, slot->ticket);
+        }
+        bytes += slot->ticket.length;
+        st->head++;
+    }
+
+    return bytes;
+}
+
+/*
+ * run one iteration of the stage: submit new spans, then reap and commit
+ * completions. when wait is set and IOs are in flight, blocks until at
+ * least one completes. returns bytes committed or -1 with errno set if
+ * an IO failed. a failed drain span is committed so the buffer keeps
+ * moving, and a failed fill stops the stage as described above.
+ */
+static ssize_t iou_stage_poll(iou_stage *st, int wait)
+{
+    uint submit = iou_stage_submit(st), resubmit = 0;
+    uint inflight = st->tail - st->head;
+    size_t bytes;
+
+    if (submit || (wait && inflight)) {
+        if (iou_ring_enter(&st->ring, submit, wait && inflight) < 0) {
+            return -1;
+        }
+    }
+
+    bytes = iou_stage_reap(st, &resubmit);
+    if (resubmit && iou_ring_enter(&st->ring, resubmit, 0) < 0) return -1;
+
+    if (st->error) {
+        errno = st->error;
+        st->error = 0;
+        return -1;
+    }
+
+    return (ssize_t)bytes;
+}
+
+static size_t iou_stage_inflight(iou_stage *st)
+{
+    return st->tail - st->head;
+}
+
+static ullong iou_stage_filled(iou_stage *st)
+{
+    return st->filled;
+}
+
+static ullong iou_stage_padded(iou_stage *st)
+{
+    return st->padded;
+}
+
+static int iou_stage_stopped(iou_stage *st)
+{
+    return st->stopped;
+}
+
+/* wait for all in-flight IOs to complete and commit them */
+static int iou_stage_flush(iou_stage *st)
+{
+    int ret = 0;
+    while (st->tail != st->head) {
+        uint resubmit = 0;
+        if (iou_ring_enter(&st->ring, 0, 1) < 0) return -1;
+        iou_stage_reap(st, &resubmit);
+        if (resubmit && iou_ring_enter(&st->ring, resubmit, 0) < 0) return -1;
+        if (st->error) {
+            errno = st->error;
+            st->error = 0;
+            ret = -1;
+        }
+    }
+    return ret;
+}
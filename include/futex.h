@@ -0,0 +1,102 @@
+/*
+ * futex wait and wake primitives
+ *
+ * PLEASE LICENSE, (C) 2024, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <time.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "types.h"
+
+/*
+ * futex wait and wake
+ *
+ * futex_wait sleeps while the 32-bit word at addr equals val. the optional
+ * deadline is an absolute CLOCK_MONOTONIC time. shared selects process
+ * shared futexes for words that live in memory mapped by more than one
+ * process, otherwise the cheaper process private futexes are used.
+ *
+ * futex_wait returns 0 when woken or when the word did not match, and
+ * -1 when the deadline expired. spurious wakeups are possible so callers
+ * must recheck their condition in a loop.
+ */
+
+#if defined __linux__
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define HAS_FUTEX 1
+
+static int futex_wait(atomic_uint *addr, uint val,
+    const struct timespec *deadline, int shared)
+{
+    int op = FUTEX_WAIT_BITSET | (shared ? 0 : FUTEX_PRIVATE_FLAG);
+    long r = syscall(SYS_futex, (uint*)addr, op, val, deadline,
+        NULL, FUTEX_BITSET_MATCH_ANY);
+    return r < 0 && errno == ETIMEDOUT ? -1 : 0;
+}
+
+static int futex_wake(atomic_uint *addr, int count, int shared)
+{
+    int op = FUTEX_WAKE | (shared ? 0 : FUTEX_PRIVATE_FLAG);
+    return (int)syscall(SYS_futex, (uint*)addr, op, count, NULL, NULL, 0);
+}
+
+/*
+ * futex_wait_any sleeps until any of n 32-bit futexes described by w is
+ * woken, or one of them no longer holds its expected value. it returns
+ * the index of the woken futex, n if a word did not match, and -1 when
+ * the deadline expired. futex_waitv is only present from Linux 5.16, so
+ * callers probe for it with futex_waitv_supported.
+ */
+#if defined SYS_futex_waitv && defined FUTEX_32
+#define HAS_FUTEX_WAITV 1
+
+static void futex_waitv_set(struct futex_waitv *w, atomic_uint *addr,
+    uint val, int shared)
+{
+    w->val = val;
+    w->uaddr = (ullong)(uintptr_t)addr;
+    w->flags = FUTEX_32 | (shared ? 0 : FUTEX_PRIVATE_FLAG);
+    w->__reserved = 0;
+}
+
+static int futex_wait_any(struct futex_waitv *w, uint n,
+    const struct timespec *deadline)
+{
+    long r = syscall(SYS_futex_waitv, w, n, 0, deadline, CLOCK_MONOTONIC);
+    if (r >= 0) return (int)r;
+    return errno == ETIMEDOUT ? -1 : (int)n;
+}
+
+/* an empty vector is rejected with EINVAL by kernels that have the call */
+static int futex_waitv_supported()
+{
+    long r = syscall(SYS_futex_waitv, NULL, 0, 0, NULL, CLOCK_MONOTONIC);
+    return r < 0 && errno == EINVAL;
+}
+#else
+#define HAS_FUTEX_WAITV 0
+#endif
+#else
+#define HAS_FUTEX 0
+#define HAS_FUTEX_WAITV 0
+#endif
@@ -54,6 +54,24 @@ static inline const char* get_cpu_name()
 static inline const char* get_cpu_name() { return "unknown"; }
 #endif
 
+#if defined __unix__ || defined __APPLE__
+#include <unistd.h>
+static inline size_t get_cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+#elif defined _WIN32
+static inline size_t get_cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+#else
+static inline size_t get_cpu_count() { return 1; }
+#endif
+
 static void io_print_results(test_state s, int nloop)
 {
     double s1, s2, s3, s4;
@@ -0,0 +1,264 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sched.h>
+
+#include "buffer_shm.h"
+#include "common.h"
+
+#define NLOOP 64
+#define COUNT ((1<<17) - 11)
+#define MPMC_PROCS 2
+#define MPMC_COUNT (1 << 20)
+
+typedef struct mpmc_state mpmc_state;
+struct mpmc_state
+{
+    atomic_ullong read;
+    atomic_ullong wsum;
+    atomic_ullong rsum;
+};
+
+static size_t io_write_proc(pbp_buffer *pb, size_t bufsize)
+{
+    size_t sum = 0;
+    uint *arr = (uint*)malloc(COUNT * sizeof(uint));
+    for (size_t j = 0; j < NLOOP; j++) {
+        uint seq = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            seq = seq * 793517 + (int)i;
+            sum += (arr[i] = seq);
+        }
+        for (size_t i = 0; i < COUNT;) {
+            size_t n = (COUNT - i) * sizeof(uint);
+            if (n > bufsize) n = bufsize;
+            i += pbp_buffer_write_wait(pb, (char*)&arr[i], n) >> 2;
+        }
+    }
+    free(arr);
+    return sum;
+}
+
+static size_t io_read_proc(pbp_buffer *pb)
+{
+    size_t sum = 0;
+    uint *arr = (uint*)malloc(COUNT * sizeof(uint));
+    for (size_t j = 0; j < NLOOP; j++) {
+        for (size_t i = 0, o = 0; i < COUNT; i = o >> 2) {
+            o += pbp_buffer_read_wait(pb, (char*)arr + o,
+                COUNT * sizeof(uint) - o);
+        }
+        for (size_t i = 0; i < COUNT; i++) {
+            sum += arr[i];
+        }
+    }
+    free(arr);
+    return sum;
+}
+
+static void test_attach(const char *name)
+{
+    pbp_buffer pb1, pb2;
+    char buf1[384], buf2[384];
+
+    for (size_t i = 0; i < sizeof(buf1); i++) buf1[i] = (char)i;
+
+    /* two mappings of the same region at different addresses */
+    assert(pbp_buffer_create(&pb1, name, 4096) == 0);
+    if (name) {
+        assert(pbp_buffer_open(&pb2, name) == 0);
+    } else {
+        assert(pbp_buffer_attach(&pb2, dup(pbp_buffer_fd(&pb1))) == 0);
+    }
+    assert(pb1.data != pb2.data);
+    assert(pbp_buffer_capacity(&pb2) == 4096);
+
+    for (int i = 0; i < 172; i++) {
+        assert(pbp_buffer_write(&pb1, buf1, sizeof(buf1)) == sizeof(buf1));
+        memset(buf2, 0, sizeof(buf2));
+        assert(pbp_buffer_read(&pb2, buf2, sizeof(buf2)) == sizeof(buf2));
+        assert(memcmp(buf1, buf2, sizeof(buf1)) == 0);
+    }
+
+    pbp_buffer_destroy(&pb2);
+    pbp_buffer_destroy(&pb1);
+    if (name) pbp_buffer_unlink(name);
+}
+
+static void test_attach_mpmc()
+{
+    pbp_buffer pb;
+    pbpm_buffer pm1, pm2;
+    io_span t1, t2;
+    char buf[64];
+
+    /* a region is only attached with the layout it was created with */
+    assert(pbpm_buffer_create(&pm1, NULL, 64) == 0);
+    assert(pbp_buffer_attach(&pb, dup(pbpm_buffer_fd(&pm1))) == -1);
+    assert(pbpm_buffer_attach(&pm2, dup(pbpm_buffer_fd(&pm1))) == 0);
+    assert(pm1.pb.data != pm2.pb.data);
+
+    /* tickets from two mappings retire in order */
+    memset(buf, 'a', sizeof(buf));
+    assert(pbpm_buffer_write(&pm1, buf, 48) == 48);
+    assert(pbpm_buffer_read(&pm2, buf, 48) == 48);
+    t1 = pbpm_buffer_write_lock(&pm1, 32);
+    t2 = pbpm_buffer_write_lock(&pm2, 32);
+    assert(t1.length == 16 && t1.sequence == 48);
+    assert(t2.length == 32 && t2.sequence == 64 && t2.buf == pm2.pb.data);
+    memset(t2.buf, 'c', 32);
+    assert(pbpm_buffer_write_avail(&pm1) == 16);
+    memset(t1.buf, 'b', 16);
+    pbpm_buffer_write_commit(&pm1, t1);
+    assert(pbpm_buffer_read_avail(&pm2) == 16);
+    pbpm_buffer_write_commit(&pm2, t2);
+    assert(pbpm_buffer_read_avail(&pm2) == 48);
+    assert(pbpm_buffer_write(&pm2, buf, 64) == 16);
+    assert(pbpm_buffer_read(&pm1, buf, 64) == 64);
+    assert(buf[0] == 'b' && buf[16] == 'c' && buf[47] == 'c');
+
+    pbpm_buffer_destroy(&pm2);
+    pbpm_buffer_destroy(&pm1);
+}
+
+/*
+ * forked producers and consumers share one pbpm_buffer. uint records
+ * stay whole because every read and write is a multiple of their size.
+ */
+static void io_mpmc_write_proc(pbpm_buffer *pb, mpmc_state *st, uint id)
+{
+    uint arr[256];
+    ullong sum = 0;
+
+    for (uint i = 0; i < MPMC_COUNT; i += 256) {
+        for (uint j = 0; j < 256; j++) sum += (arr[j] = (id << 24) ^ (i + j));
+        pbpm_buffer_write_wait(pb, (char*)arr, sizeof(arr));
+    }
+    atomic_fetch_add(&st->wsum, sum);
+}
+
+static void io_mpmc_read_proc(pbpm_buffer *pb, mpmc_state *st)
+{
+    ullong total = (ullong)MPMC_COUNT * MPMC_PROCS, sum = 0;
+    uint arr[384];
+    size_t n;
+
+    while (atomic_load(&st->read) < total) {
+        if ((n = pbpm_buffer_read(pb, (char*)arr, sizeof(arr))) == 0) {
+            sched_yield();
+            continue;
+        }
+        assert(n % sizeof(uint) == 0);
+        for (size_t i = 0; i < n / sizeof(uint); i++) sum += arr[i];
+        atomic_fetch_add(&st->read, n / sizeof(uint));
+    }
+    atomic_fetch_add(&st->rsum, sum);
+}
+
+static void test_mpmc(size_t bufsize)
+{
+    pbpm_buffer pb;
+    mpmc_state *st;
+    pid_t pid[MPMC_PROCS * 2];
+    int status;
+
+    st = (mpmc_state*)mmap(NULL, sizeof(mpmc_state), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(st != MAP_FAILED);
+    memset(st, 0, sizeof(mpmc_state));
+    assert(pbpm_buffer_create(&pb, NULL, bufsize) == 0);
+
+    for (size_t i = 0; i < MPMC_PROCS * 2; i++) {
+        pid[i] = fork();
+        assert(pid[i] >= 0);
+        if (pid[i] == 0) {
+            pbpm_buffer cb;
+            assert(pbpm_buffer_attach(&cb, dup(pbpm_buffer_fd(&pb))) == 0);
+            if (i < MPMC_PROCS) io_mpmc_write_proc(&cb, st, (uint)i);
+            else io_mpmc_read_proc(&cb, st);
+            pbpm_buffer_destroy(&cb);
+            _exit(0);
+        }
+    }
+    for (size_t i = 0; i < MPMC_PROCS * 2; i++) {
+        assert(waitpid(pid[i], &status, 0) == pid[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    assert(st->read == (ullong)MPMC_COUNT * MPMC_PROCS);
+    assert(st->wsum == st->rsum);
+    assert(pbpm_buffer_read_avail(&pb) == 0);
+
+    pbpm_buffer_destroy(&pb);
+    munmap(st, sizeof(mpmc_state));
+}
+
+static void io_run_test(size_t bufsize)
+{
+    pbp_buffer pb;
+    struct timespec t0, t1;
+    size_t wsum = 0, rsum, count = (size_t)COUNT * NLOOP;
+    int status;
+    pid_t pid;
+    double ns;
+
+    assert(pbp_buffer_create(&pb, NULL, bufsize) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        /* child maps the inherited memfd again at a new address */
+        pbp_buffer cb;
+        assert(pbp_buffer_attach(&cb, dup(pbp_buffer_fd(&pb))) == 0);
+        wsum = io_write_proc(&cb, bufsize);
+        pbp_buffer_destroy(&cb);
+        _exit(pbp_buffer_write_wait(&pb, (char*)&wsum,
+            sizeof(wsum)) == sizeof(wsum) ? 0 : 1);
+    }
+
+    rsum = io_read_proc(&pb);
+    for (size_t o = 0; o < sizeof(wsum);) {
+        o += pbp_buffer_read_wait(&pb, (char*)&wsum + o, sizeof(wsum) - o);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10zu %016zx %016zx %10.2fns %10.2f\n", bufsize, wsum, rsum,
+        ns / count, (count * sizeof(uint)) / (ns / 1e9) / (1024*1024));
+
+    pbp_buffer_destroy(&pb);
+
+    assert(wsum == rsum);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: 1 write process(es) 1 read process(es)\n",
+        "test_006_pbp_buffer");
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_attach(NULL);
+    test_attach("/cpipe-test-006");
+    test_attach_mpmc();
+    test_mpmc(4096);
+    test_mpmc(32768);
+
+    printf("\n%10s %16s %16s %12s %10s\n", "bufsize", "wsum", "rsum",
+        "time/uint", "MB/sec");
+    printf("%10s %16s %16s %12s %10s\n", "----------", "----------------",
+        "----------------", "------------", "----------");
+
+    io_run_test(4096);
+    io_run_test(32768);
+    io_run_test(1 << 20);
+
+    printf("\n");
+}
@@ -0,0 +1,178 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+#include <sys/epoll.h>
+
+#include "buffer_notify.h"
+#include "common.h"
+
+#define NMSG (1 << 20)
+#define MSGSIZE 16
+
+typedef struct notify_state notify_state;
+struct notify_state
+{
+    io_notify *n;
+    int armed;
+    size_t wsum, rsum, rwaits, wwaits;
+};
+
+static void wait_fd(int fd)
+{
+    int ep = epoll_create1(0);
+    struct epoll_event ev = { EPOLLIN }, out;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    epoll_wait(ep, &out, 1, -1);
+    close(ep);
+}
+
+static int io_write_thread(void* arg)
+{
+    notify_state *s = (notify_state*)arg;
+    ullong msg[MSGSIZE / sizeof(ullong)] = { 0 };
+    size_t sum = 0;
+    for (size_t i = 0; i < NMSG; i++) {
+        msg[0] = i * 793517;
+        sum += msg[0];
+        while (io_buffer_write(&s->n->io, (char*)msg, MSGSIZE) == 0) {
+            if (!s->armed) {
+                thrd_yield();
+            } else if (io_notify_arm_write(s->n) == 0) {
+                wait_fd(io_notify_write_fd(s->n));
+                io_notify_ack_write(s->n);
+                s->wwaits++;
+            }
+        }
+    }
+    s->wsum = sum;
+    return 0;
+}
+
+static int io_read_thread(void* arg)
+{
+    notify_state *s = (notify_state*)arg;
+    ullong msg[MSGSIZE / sizeof(ullong)];
+    size_t sum = 0;
+    for (size_t i = 0; i < NMSG; i++) {
+        while (io_buffer_read(&s->n->io, (char*)msg, MSGSIZE) == 0) {
+            if (!s->armed) {
+                thrd_yield();
+            } else if (io_notify_arm_read(s->n) == 0) {
+                wait_fd(io_notify_read_fd(s->n));
+                io_notify_ack_read(s->n);
+                s->rwaits++;
+            }
+        }
+        sum += msg[0];
+    }
+    s->rsum = sum;
+    return 0;
+}
+
+static void io_run_test(const char *name, io_buffer *io, int armed)
+{
+    io_notify n;
+    notify_state s;
+    thrd_t w_tid, r_tid;
+    struct timespec t0, t1;
+    clock_t c0, c1;
+    double ns, cpu;
+    int r, res;
+
+    assert(io_notify_init(&n, io) == 0);
+    memset(&s, 0, sizeof(s));
+    s.n = &n;
+    s.armed = armed;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = clock();
+
+    r = thrd_create(&r_tid, io_read_thread, &s);
+    assert(r == 0);
+    r = thrd_create(&w_tid, io_write_thread, &s);
+    assert(r == 0);
+    r = thrd_join(w_tid, &res);
+    assert(r == 0);
+    r = thrd_join(r_tid, &res);
+    assert(r == 0);
+
+    c1 = clock();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    cpu = (1e9 * (c1 - c0)) / CLOCKS_PER_SEC;
+
+    printf("%10s %10s %10.2fns %10.2fns %10zu %10zu\n", name,
+        armed ? "armed" : "unarmed", ns / NMSG, cpu / NMSG,
+        s.rwaits, s.wwaits);
+
+    io_notify_destroy(&n);
+
+    assert(s.wsum == s.rsum);
+}
+
+static void test_edge()
+{
+    pbs_buffer pb;
+    io_notify n;
+    ullong val;
+    char buf[64] = { 0 };
+
+    pbs_buffer_init(&pb, 64);
+    assert(io_notify_init(&n, &pb.io) == 0);
+
+    /* unarmed commits do not signal */
+    assert(io_buffer_write(&n.io, buf, 16) == 16);
+    assert(read(io_notify_read_fd(&n), &val, sizeof(val)) < 0);
+
+    /* arming a readable buffer returns 1 and does not arm */
+    assert(io_notify_arm_read(&n) == 1);
+    assert(io_buffer_read(&n.io, buf, 16) == 16);
+
+    /* armed empty buffer signals once on the next commit only */
+    assert(io_notify_arm_read(&n) == 0);
+    assert(io_buffer_write(&n.io, buf, 16) == 16);
+    assert(io_buffer_write(&n.io, buf, 16) == 16);
+    assert(read(io_notify_read_fd(&n), &val, sizeof(val)) == sizeof(val));
+    assert(val == 1);
+
+    /* full to has-space transition */
+    assert(io_buffer_write(&n.io, buf, 32) == 32);
+    assert(io_notify_arm_write(&n) == 0);
+    assert(io_buffer_read(&n.io, buf, 16) == 16);
+    assert(read(io_notify_write_fd(&n), &val, sizeof(val)) == sizeof(val));
+    assert(val == 1);
+
+    io_notify_destroy(&n);
+    pbs_buffer_destroy(&pb);
+}
+
+int main(int argc, const char **argv)
+{
+    pbs_buffer pbs;
+    pbm_buffer pbm;
+
+    printf("\n# %s: 1 write thread(s) 1 read thread(s)\n",
+        "test_007_io_notify");
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_edge();
+
+    printf("\n%10s %10s %12s %12s %10s %10s\n", "buffer", "mode",
+        "wall/msg", "cpu/msg", "rwaits", "wwaits");
+    printf("%10s %10s %12s %12s %10s %10s\n", "----------", "----------",
+        "------------", "------------", "----------", "----------");
+
+    pbs_buffer_init(&pbs, 4096);
+    io_run_test("pbs", &pbs.io, 0);
+    io_run_test("pbs", &pbs.io, 1);
+    pbs_buffer_destroy(&pbs);
+
+    pbm_buffer_init(&pbm, 4096);
+    io_run_test("pbm", &pbm.io, 0);
+    io_run_test("pbm", &pbm.io, 1);
+    pbm_buffer_destroy(&pbm);
+
+    printf("\n");
+}
@@ -0,0 +1,348 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "buffer_fd.h"
+#include "common.h"
+
+#define TOTAL (64 << 20)
+#define CHUNK 16384
+
+typedef struct fd_state fd_state;
+struct fd_state
+{
+    int fd;
+    size_t sum;
+};
+
+static void gen(uint *arr, size_t count, size_t o)
+{
+    for (size_t i = 0; i < count; i++) {
+        arr[i] = (uint)((o + i) * 793517);
+    }
+}
+
+static size_t sum_span(io_span t)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < t.length; i++) sum += (uchar)t.buf[i];
+    return sum;
+}
+
+static size_t sum_buf(char *buf, size_t len)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < len; i++) sum += (uchar)buf[i];
+    return sum;
+}
+
+/* feeder and sink threads for the socket end that is not under test */
+
+static int feed_thread(void *arg)
+{
+    fd_state *s = (fd_state*)arg;
+    uint arr[CHUNK / sizeof(uint)];
+    for (size_t o = 0; o < TOTAL; o += CHUNK) {
+        gen(arr, CHUNK / sizeof(uint), o / sizeof(uint));
+        s->sum += sum_buf((char*)arr, CHUNK);
+        for (size_t w = 0; w < CHUNK;) {
+            ssize_t r = write(s->fd, (char*)arr + w, CHUNK - w);
+            assert(r > 0);
+            w += r;
+        }
+    }
+    shutdown(s->fd, SHUT_WR);
+    return 0;
+}
+
+static int sink_thread(void *arg)
+{
+    fd_state *s = (fd_state*)arg;
+    char buf[CHUNK];
+    ssize_t r;
+    while ((r = read(s->fd, buf, sizeof(buf))) > 0) {
+        s->sum += sum_buf(buf, r);
+    }
+    return 0;
+}
+
+/* fd to buffer to consumer, either direct or through a stack buffer */
+
+static size_t ingest(io_buffer *io, int fd, int direct)
+{
+    char buf[CHUNK];
+    size_t sum = 0;
+    io_fd_xfer x;
+    int eof = 0;
+
+    io_fd_xfer_init(&x, io, fd, 1);
+    while (!eof || io_buffer_read_avail(io)) {
+        if (!eof) {
+            if (direct) {
+                ssize_t r = io_fd_fill(&x, CHUNK);
+                assert(r >= 0 || errno == ENOSPC);
+                if (r == 0) eof = 1;
+                assert(io_fd_xfer_pending(&x) == 0);
+            } else if (io_buffer_write_avail(io) >= CHUNK) {
+                ssize_t r = read(fd, buf, CHUNK);
+                assert(r >= 0);
+                if (r == 0) eof = 1;
+                for (ssize_t w = 0; w < r;) {
+                    w += io_buffer_write(io, buf + w, r - w);
+                }
+            }
+        }
+        io_span t = io_buffer_read_lock(io, CHUNK);
+        sum += sum_span(t);
+        io_buffer_read_commit(io, t);
+    }
+
+    return sum;
+}
+
+/* producer to buffer to fd, either direct or through a stack buffer */
+
+static size_t egress(io_buffer *io, int fd, int direct)
+{
+    char buf[CHUNK];
+    size_t sum = 0, o = 0;
+    io_fd_xfer x;
+
+    io_fd_xfer_init(&x, io, fd, 0);
+    while (o < TOTAL || io_buffer_read_avail(io)) {
+        if (o < TOTAL) {
+            io_span t = io_buffer_write_lock(io, CHUNK);
+            gen((uint*)t.buf, t.length / sizeof(uint), o / sizeof(uint));
+            sum += sum_span(t);
+            o += t.length;
+            io_buffer_write_commit(io, t);
+        }
+        if (direct) {
+            ssize_t r = io_fd_drain(&x, CHUNK);
+            assert(r >= 0);
+            assert(io_fd_xfer_pending(&x) == 0);
+        } else {
+            size_t r = io_buffer_read(io, buf, CHUNK);
+            for (size_t w = 0; w < r;) {
+                ssize_t n = write(fd, buf + w, r - w);
+                assert(n > 0);
+                w += n;
+            }
+        }
+    }
+
+    return sum;
+}
+
+/*
+ * one call moves both sides of the wrap, and a transfer that ends early
+ * hands the rest of a pbm_buffer reservation back.
+ */
+static void test_wrap(io_buffer *io)
+{
+    io_fd_xfer rx, wx;
+    char buf[64];
+    int p[2], nul;
+
+    assert(pipe(p) == 0);
+    memset(buf, 'a', sizeof(buf));
+    assert(io_buffer_write(io, buf, 48) == 48);
+    assert(io_buffer_read(io, buf, 48) == 48);
+
+    for (int i = 0; i < 40; i++) buf[i] = (char)i;
+    assert(write(p[1], buf, 40) == 40);
+    io_fd_xfer_init(&wx, io, p[0], 1);
+    io_fd_xfer_init(&rx, io, p[1], 0);
+    assert(io_fd_fill(&wx, 64) == 40);
+    assert(io_buffer_read_avail(io) == 40);
+    assert(io_fd_drain(&rx, 64) == 40);
+    assert(io_buffer_read_avail(io) == 0);
+    memset(buf, 0, sizeof(buf));
+    assert(read(p[0], buf, 64) == 40);
+    for (int i = 0; i < 40; i++) assert(buf[i] == (char)i);
+
+    /* /dev/null has no FIONREAD, so the whole reservation is unused */
+    nul = open("/dev/null", O_RDONLY);
+    assert(nul >= 0);
+    io_fd_xfer_init(&wx, io, nul, 1);
+    assert(io_fd_fill(&wx, 64) == 0);
+    assert(io_fd_xfer_pending(&wx) == 0);
+    assert(io_buffer_write_avail(io) == 64);
+    close(nul);
+
+    /* a failed drain leaves the data in the buffer */
+    assert(io_buffer_write(io, buf, 16) == 16);
+    close(p[0]);
+    assert(io_fd_drain(&rx, 64) == -1 && errno == EPIPE);
+    assert(io_fd_xfer_pending(&rx) == 0);
+    assert(io_buffer_read_avail(io) == 16);
+    assert(io_buffer_read(io, buf, 16) == 16);
+    assert(io_buffer_write(io, buf, 64) == 64);
+    assert(io_buffer_read(io, buf, 64) == 64);
+    close(p[1]);
+}
+
+/*
+ * a non blocking pipe fails with EAGAIN while it is empty or full and
+ * hands the reservation back, and reports end of file once the other end
+ * is closed.
+ */
+static void test_nonblock(io_buffer *io)
+{
+    io_fd_xfer rx, wx;
+    char buf[64];
+    int p[2];
+
+    assert(pipe(p) == 0);
+    assert(fcntl(p[0], F_SETFL, O_NONBLOCK) == 0);
+    assert(fcntl(p[1], F_SETFL, O_NONBLOCK) == 0);
+    io_fd_xfer_init(&wx, io, p[0], 1);
+    io_fd_xfer_init(&rx, io, p[1], 0);
+
+    assert(io_fd_fill(&wx, 64) == -1 && errno == EAGAIN);
+    assert(io_fd_xfer_pending(&wx) == 0);
+    assert(io_buffer_write_avail(io) == 64);
+
+    memset(buf, 'b', sizeof(buf));
+    assert(write(p[1], buf, 24) == 24);
+    assert(io_fd_fill(&wx, 64) == 24);
+    assert(io_buffer_read_avail(io) == 24);
+    assert(io_fd_drain(&rx, 64) == 24);
+
+    /* fill the pipe so the drain cannot start */
+    while (write(p[1], buf, sizeof(buf)) > 0);
+    assert(errno == EAGAIN);
+    assert(io_buffer_write(io, buf, 32) == 32);
+    assert(io_fd_drain(&rx, 64) == -1 && errno == EAGAIN);
+    assert(io_fd_xfer_pending(&rx) == 0);
+    assert(io_buffer_read_avail(io) == 32);
+    assert(io_buffer_read(io, buf, 32) == 32);
+
+    /* empty the pipe, then close the write end for end of file */
+    while (read(p[0], buf, sizeof(buf)) > 0);
+    assert(errno == EAGAIN);
+    close(p[1]);
+    assert(io_fd_fill(&wx, 64) == 0);
+    assert(io_fd_xfer_pending(&wx) == 0);
+    assert(io_buffer_read_avail(io) == 0);
+    assert(io_buffer_write_avail(io) == 64);
+    close(p[0]);
+}
+
+static void print_result(const char *buf, const char *path, const char *dir,
+    int direct, struct timespec t0, struct timespec t1)
+{
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%10s %10s %10s %10s %10.2f\n", buf, path, dir,
+        direct ? "direct" : "copy", TOTAL / (ns / 1e9) / (1024*1024));
+}
+
+static void test_file(const char *name, io_buffer *io, int direct)
+{
+    char path[] = "/tmp/cpipe-test-008-XXXXXX";
+    struct timespec t0, t1;
+    size_t wsum, rsum;
+    int fd;
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    wsum = egress(io, fd, direct);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result(name, "file", "egress", direct, t0, t1);
+    assert(lseek(fd, 0, SEEK_CUR) == TOTAL);
+
+    lseek(fd, 0, SEEK_SET);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    rsum = ingest(io, fd, direct);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result(name, "file", "ingest", direct, t0, t1);
+
+    close(fd);
+
+    assert(wsum == rsum);
+}
+
+static void test_socket(const char *name, io_buffer *io, int direct)
+{
+    struct timespec t0, t1;
+    fd_state s;
+    thrd_t tid;
+    size_t sum;
+    int sv[2], res;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    s.fd = sv[1];
+    s.sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, sink_thread, &s) == 0);
+    sum = egress(io, sv[0], direct);
+    shutdown(sv[0], SHUT_WR);
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result(name, "socket", "egress", direct, t0, t1);
+    close(sv[0]);
+    close(sv[1]);
+    assert(sum == s.sum);
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    s.fd = sv[0];
+    s.sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, feed_thread, &s) == 0);
+    sum = ingest(io, sv[1], direct);
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result(name, "socket", "ingest", direct, t0, t1);
+    close(sv[0]);
+    close(sv[1]);
+    assert(sum == s.sum);
+}
+
+int main(int argc, const char **argv)
+{
+    pbs_buffer pbs;
+    pbm_buffer pbm;
+
+    printf("\n# %s: 1 thread(s) %d MiB per run\n",
+        "test_008_io_buffer_fd", TOTAL >> 20);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    signal(SIGPIPE, SIG_IGN);
+    pbs_buffer_init(&pbs, 64);
+    test_wrap(&pbs.io);
+    test_nonblock(&pbs.io);
+    pbs_buffer_destroy(&pbs);
+    pbm_buffer_init(&pbm, 64);
+    test_wrap(&pbm.io);
+    test_nonblock(&pbm.io);
+    pbm_buffer_destroy(&pbm);
+
+    printf("\n%10s %10s %10s %10s %10s\n", "buffer", "fd", "direction",
+        "path", "MB/sec");
+    printf("%10s %10s %10s %10s %10s\n", "----------", "----------",
+        "----------", "----------", "----------");
+
+    pbs_buffer_init(&pbs, 32768);
+    for (int direct = 0; direct < 2; direct++) {
+        test_file("pbs", &pbs.io, direct);
+        test_socket("pbs", &pbs.io, direct);
+    }
+    pbs_buffer_destroy(&pbs);
+
+    pbm_buffer_init(&pbm, 32768);
+    for (int direct = 0; direct < 2; direct++) {
+        test_file("pbm", &pbm.io, direct);
+        test_socket("pbm", &pbm.io, direct);
+    }
+    pbm_buffer_destroy(&pbm);
+
+    printf("\n");
+}
@@ -0,0 +1,241 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_fd.h"
+#include "buffer_uring.h"
+#include "common.h"
+
+#define TOTAL (64 << 20)
+#define CHUNK 4096
+#define DEPTH 8
+
+typedef struct uring_state uring_state;
+struct uring_state
+{
+    pbm_buffer *pb;
+    size_t sum;
+};
+
+static size_t sum_span(io_span t)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < t.length; i++) sum += (uchar)t.buf[i];
+    return sum;
+}
+
+static int io_write_thread(void *arg)
+{
+    uring_state *s = (uring_state*)arg;
+    size_t o = 0;
+    while (o < TOTAL) {
+        size_t len = TOTAL - o < CHUNK ? TOTAL - o : CHUNK;
+        io_span t = pbm_buffer_write_lock(s->pb, len);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        for (size_t i = 0; i < t.length; i++) {
+            t.buf[i] = (char)((o + i) * 793517 >> 7);
+        }
+        s->sum += sum_span(t);
+        o += t.length;
+        pbm_buffer_write_commit(s->pb, t);
+    }
+    return 0;
+}
+
+static int io_read_thread(void *arg)
+{
+    uring_state *s = (uring_state*)arg;
+    size_t o = 0;
+    while (o < TOTAL) {
+        io_span t = pbm_buffer_read_lock(s->pb, CHUNK);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        s->sum += sum_span(t);
+        o += t.length;
+        pbm_buffer_read_commit(s->pb, t);
+    }
+    return 0;
+}
+
+/*
+ * a file that shrinks after the stage sized its fill stops the stage at
+ * the short count, handing back the rest or zero filling it when another
+ * writer reserved after the stage.
+ */
+static void test_short_fill(int fd, int other)
+{
+    char buf[10000], out[10000];
+    pbm_buffer pb;
+    iou_stage st;
+    io_span t = { 0, 0, 0 };
+    uint n;
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (char)(i * 7 + 1);
+    assert(ftruncate(fd, 0) == 0);
+    assert(pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf));
+
+    pbm_buffer_init(&pb, 32768);
+    assert(iou_stage_init(&st, &pb, IOU_FILL, fd, 0, DEPTH, CHUNK) == 0);
+    assert(ftruncate(fd, 5000) == 0);
+
+    n = iou_stage_submit(&st);
+    assert(n == 3);
+    if (other) t = pbm_buffer_write_lock(&pb, 16);
+    assert(iou_ring_enter(&st.ring, n, 0) == (int)n);
+    assert(iou_stage_flush(&st) == -1 && errno == EIO);
+    assert(iou_stage_stopped(&st));
+    assert(iou_stage_filled(&st) == 5000);
+    assert(iou_stage_padded(&st) == (other ? 5000 : 0));
+    if (other) pbm_buffer_write_commit(&pb, t);
+
+    /* a stopped stage issues no further fills */
+    assert(iou_stage_poll(&st, 0) == 0);
+    assert(pbm_buffer_read_avail(&pb) == (other ? 10016 : 5000));
+    assert(pbm_buffer_read(&pb, out, sizeof(out)) ==
+        (other ? sizeof(out) : 5000));
+    assert(memcmp(buf, out, 5000) == 0);
+    for (size_t i = 5000; other && i < sizeof(out); i++) assert(out[i] == 0);
+
+    iou_stage_destroy(&st);
+    pbm_buffer_destroy(&pb);
+}
+
+static double elapsed(struct timespec t0, struct timespec t1)
+{
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static void print_result(const char *dir, const char *path, double sec)
+{
+    printf("%10s %10s %10.2f\n", dir, path, TOTAL / sec / (1024*1024));
+}
+
+static void test_drain(int fd, int uring, size_t *sum)
+{
+    pbm_buffer pb;
+    uring_state s = { &pb, 0 };
+    struct timespec t0, t1;
+    iou_stage st;
+    io_fd_xfer x;
+    thrd_t tid;
+    size_t done = 0;
+    int res;
+
+    pbm_buffer_init(&pb, 32768);
+    io_fd_xfer_init(&x, &pb.io, fd, 0);
+    assert(ftruncate(fd, 0) == 0);
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    if (uring) {
+        assert(iou_stage_init(&st, &pb, IOU_DRAIN, fd, 0, DEPTH, CHUNK) == 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, io_write_thread, &s) == 0);
+    while (done < TOTAL) {
+        ssize_t r;
+        if (uring) {
+            r = iou_stage_poll(&st, iou_stage_inflight(&st) > 0);
+        } else {
+            r = io_fd_drain(&x, CHUNK);
+        }
+        assert(r >= 0);
+        if (r == 0) thrd_yield();
+        done += (size_t)r;
+    }
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (uring) iou_stage_destroy(&st);
+    pbm_buffer_destroy(&pb);
+
+    print_result("drain", uring ? "io_uring" : "writev", elapsed(t0, t1));
+    *sum = s.sum;
+}
+
+static void test_fill(int fd, int uring, size_t *sum)
+{
+    pbm_buffer pb;
+    uring_state s = { &pb, 0 };
+    struct timespec t0, t1;
+    iou_stage st;
+    io_fd_xfer x;
+    thrd_t tid;
+    size_t done = 0;
+    int res;
+
+    pbm_buffer_init(&pb, 32768);
+    io_fd_xfer_init(&x, &pb.io, fd, 1);
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    if (uring) {
+        assert(iou_stage_init(&st, &pb, IOU_FILL, fd, 0, DEPTH, CHUNK) == 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, io_read_thread, &s) == 0);
+    while (done < TOTAL) {
+        ssize_t r;
+        if (uring) {
+            r = iou_stage_poll(&st, iou_stage_inflight(&st) > 0);
+        } else {
+            r = io_fd_fill(&x, CHUNK);
+            if (r < 0 && errno == ENOSPC) r = 0;
+        }
+        assert(r >= 0);
+        if (r == 0) thrd_yield();
+        done += (size_t)r;
+    }
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (uring) iou_stage_destroy(&st);
+    pbm_buffer_destroy(&pb);
+
+    print_result("fill", uring ? "io_uring" : "readv", elapsed(t0, t1));
+    *sum = s.sum;
+}
+
+int main(int argc, const char **argv)
+{
+    char path[] = "/tmp/cpipe-test-009-XXXXXX";
+    size_t wsum, rsum;
+    iou_ring r;
+    int fd;
+
+    printf("\n# %s: 1 producer thread 1 io thread %d MiB per run\n",
+        "test_009_iou_stage", TOTAL >> 20);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    if (iou_ring_init(&r, 1) < 0) {
+        printf("\nio_uring unavailable, skipping\n\n");
+        return 0;
+    }
+    iou_ring_destroy(&r);
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    test_short_fill(fd, 0);
+    test_short_fill(fd, 1);
+
+    printf("\n%10s %10s %10s\n", "direction", "path", "MB/sec");
+    printf("%10s %10s %10s\n", "----------", "----------", "----------");
+
+    for (int uring = 0; uring < 2; uring++) {
+        test_drain(fd, uring, &wsum);
+        test_fill(fd, uring, &rsum);
+        assert(wsum == rsum);
+    }
+
+    close(fd);
+
+    printf("\n");
+}
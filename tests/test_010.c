@@ -0,0 +1,205 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_bcast.h"
+#include "common.h"
+
+#define NLOOP 64
+#define NREADER 3
+#define COUNT ((1<<17) - 11)
+
+typedef struct bcast_state bcast_state;
+struct bcast_state
+{
+    io_buffer *io[NREADER];
+    size_t nio, bufsize, wsum, rsum;
+};
+
+static int io_write_thread(void* arg)
+{
+    bcast_state *s = (bcast_state*)arg;
+    size_t bufsize = s->bufsize, sum = 0;
+    uint *arr = (uint*)malloc(COUNT * sizeof(uint));
+    for (size_t j = 0; j < NLOOP; j++) {
+        uint seq = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            seq = seq * 793517 + (int)i;
+            sum += (arr[i] = seq);
+        }
+        /* write the message once to each io buffer */
+        for (size_t i = 0; i < COUNT;) {
+            size_t n = (COUNT - i) * sizeof(uint);
+            if (n > bufsize) n = bufsize;
+            n &= ~(size_t)3;
+            for (size_t k = 0; k < s->nio; k++) {
+                for (size_t o = 0; o < n;) {
+                    size_t r = io_buffer_write(s->io[k], (char*)&arr[i] + o, n - o);
+                    if (r == 0) thrd_yield();
+                    o += r;
+                }
+            }
+            i += n >> 2;
+        }
+    }
+    free(arr);
+    s->wsum = sum;
+    return 0;
+}
+
+static int io_read_thread(void* arg)
+{
+    bcast_state *s = (bcast_state*)arg;
+    size_t sum = 0;
+    uint *arr = (uint*)malloc(COUNT * sizeof(uint));
+    for (size_t j = 0; j < NLOOP; j++) {
+        for (size_t o = 0; o < COUNT * sizeof(uint);) {
+            size_t r = io_buffer_read(s->io[0], (char*)arr + o,
+                COUNT * sizeof(uint) - o);
+            if (r == 0) thrd_yield();
+            o += r;
+        }
+        for (size_t i = 0; i < COUNT; i++) {
+            sum += arr[i];
+        }
+    }
+    free(arr);
+    s->rsum = sum;
+    return 0;
+}
+
+static void io_run(const char *name, bcast_state *w, bcast_state *r,
+    size_t bufsize)
+{
+    thrd_t w_tid, r_tid[NREADER];
+    struct timespec t0, t1;
+    double ns;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < NREADER; i++) {
+        assert(thrd_create(&r_tid[i], io_read_thread, &r[i]) == 0);
+    }
+    assert(thrd_create(&w_tid, io_write_thread, w) == 0);
+    assert(thrd_join(w_tid, &res) == 0);
+    for (size_t i = 0; i < NREADER; i++) {
+        assert(thrd_join(r_tid[i], &res) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10s %10zu %10.2fns %10.2f\n", name, bufsize,
+        ns / ((double)COUNT * NLOOP),
+        (double)COUNT * NLOOP * sizeof(uint) / (ns / 1e9) / (1024*1024));
+
+    for (size_t i = 0; i < NREADER; i++) {
+        assert(w->wsum == r[i].rsum);
+    }
+}
+
+static void io_run_bcast(size_t bufsize)
+{
+    pbb_buffer pb;
+    pbb_reader rd[NREADER];
+    bcast_state w, r[NREADER];
+
+    pbb_buffer_init(&pb, bufsize);
+    memset(&w, 0, sizeof(w));
+    w.io[0] = &pb.io;
+    w.nio = 1;
+    w.bufsize = bufsize;
+    for (size_t i = 0; i < NREADER; i++) {
+        assert(pbb_buffer_join(&pb, &rd[i]) == 0);
+        memset(&r[i], 0, sizeof(r[i]));
+        r[i].io[0] = &rd[i].io;
+    }
+
+    io_run("pbb", &w, r, bufsize);
+
+    for (size_t i = 0; i < NREADER; i++) pbb_buffer_leave(&rd[i]);
+    pbb_buffer_destroy(&pb);
+}
+
+static void io_run_copy(size_t bufsize)
+{
+    pbs_buffer pb[NREADER];
+    bcast_state w, r[NREADER];
+
+    memset(&w, 0, sizeof(w));
+    w.bufsize = bufsize;
+    for (size_t i = 0; i < NREADER; i++) {
+        pbs_buffer_init(&pb[i], bufsize);
+        w.io[w.nio++] = &pb[i].io;
+        memset(&r[i], 0, sizeof(r[i]));
+        r[i].io[0] = &pb[i].io;
+    }
+
+    io_run("pbs x3", &w, r, bufsize);
+
+    for (size_t i = 0; i < NREADER; i++) pbs_buffer_destroy(&pb[i]);
+}
+
+static void test_join()
+{
+    pbb_buffer pb;
+    pbb_reader r1, r2;
+    char buf1[64], buf2[64];
+
+    for (size_t i = 0; i < sizeof(buf1); i++) buf1[i] = (char)i;
+
+    pbb_buffer_init(&pb, 64);
+
+    /* no readers, writes are discarded */
+    assert(pbb_buffer_write(&pb, buf1, 64) == 64);
+    assert(pbb_buffer_write(&pb, buf1, 64) == 64);
+
+    /* first reader joins at the head and limits the producer */
+    assert(pbb_buffer_join(&pb, &r1) == 0);
+    assert(io_buffer_read_avail(&r1.io) == 0);
+    assert(pbb_buffer_write(&pb, buf1, 48) == 48);
+    assert(pbb_buffer_write(&pb, buf1 + 48, 48) == 16);
+
+    /* second reader joins at the head and sees only new data */
+    assert(pbb_buffer_join(&pb, &r2) == 0);
+    assert(io_buffer_read_avail(&r2.io) == 0);
+    assert(io_buffer_read(&r1.io, buf2, 64) == 64);
+    assert(memcmp(buf1, buf2, 64) == 0);
+
+    /* producer is limited by the slowest reader */
+    assert(pbb_buffer_write(&pb, buf1, 64) == 64);
+    assert(io_buffer_read(&r2.io, buf2, 32) == 32);
+    assert(memcmp(buf1, buf2, 32) == 0);
+    assert(pbb_buffer_write(&pb, buf1, 64) == 0);
+    assert(io_buffer_read(&r1.io, buf2, 64) == 64);
+    assert(pbb_buffer_write(&pb, buf1, 64) == 32);
+
+    /* after the second reader leaves only the first limits the producer */
+    pbb_buffer_leave(&r2);
+    assert(pbb_buffer_write(&pb, buf1, 64) == 32);
+
+    pbb_buffer_leave(&r1);
+    pbb_buffer_destroy(&pb);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: 1 write thread(s) %d read thread(s)\n",
+        "test_010_pbb_buffer", NREADER);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_join();
+
+    printf("\n%10s %10s %12s %10s\n", "buffer", "bufsize", "time/uint",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    io_run_copy(4096);
+    io_run_bcast(4096);
+    io_run_copy(32768);
+    io_run_bcast(32768);
+
+    printf("\n");
+}
@@ -0,0 +1,293 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_bcast.h"
+#include "common.h"
+
+#define NLOOP 64
+#define NSTAGE 3
+#define COUNT ((1<<17) - 11)
+#define TOTAL ((size_t)COUNT * NLOOP * sizeof(uint))
+
+enum { stage_decode, stage_enrich, stage_publish };
+
+typedef struct stage_state stage_state;
+struct stage_state
+{
+    io_buffer *in, *out;
+    size_t bufsize, sum;
+    int op;
+};
+
+static void stage_apply(int op, uint *arr, size_t count, size_t *sum)
+{
+    switch (op) {
+    case stage_decode:
+        for (size_t i = 0; i < count; i++) arr[i] = arr[i] + 1;
+        break;
+    case stage_enrich:
+        for (size_t i = 0; i < count; i++) arr[i] = arr[i] * 3;
+        break;
+    case stage_publish:
+        for (size_t i = 0; i < count; i++) *sum += arr[i];
+        break;
+    }
+}
+
+static void io_write_all(io_buffer *io, char *buf, size_t len)
+{
+    for (size_t o = 0; o < len;) {
+        size_t r = io_buffer_write(io, buf + o, len - o);
+        if (r == 0) thrd_yield();
+        o += r;
+    }
+}
+
+static int io_write_thread(void* arg)
+{
+    stage_state *s = (stage_state*)arg;
+    size_t bufsize = s->bufsize, sum = 0;
+    uint *arr = (uint*)malloc(COUNT * sizeof(uint));
+    for (size_t j = 0; j < NLOOP; j++) {
+        uint seq = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            seq = seq * 793517 + (int)i;
+            arr[i] = seq;
+            sum += (uint)((seq + 1) * 3);
+        }
+        for (size_t i = 0; i < COUNT;) {
+            size_t n = (COUNT - i) * sizeof(uint);
+            if (n > bufsize) n = bufsize;
+            n &= ~(size_t)3;
+            io_write_all(s->out, (char*)&arr[i], n);
+            i += n >> 2;
+        }
+    }
+    free(arr);
+    s->sum = sum;
+    return 0;
+}
+
+/* stage that modifies records in place in the shared buffer */
+static int io_stage_thread(void* arg)
+{
+    stage_state *s = (stage_state*)arg;
+    size_t sum = 0;
+    for (size_t o = 0; o < TOTAL;) {
+        io_span t = io_buffer_read_lock(s->in, s->bufsize);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        stage_apply(s->op, (uint*)t.buf, t.length >> 2, &sum);
+        io_buffer_read_commit(s->in, t);
+        o += t.length;
+    }
+    s->sum = sum;
+    return 0;
+}
+
+/* stage that copies records from its input buffer to its output buffer */
+static int io_copy_thread(void* arg)
+{
+    stage_state *s = (stage_state*)arg;
+    size_t sum = 0;
+    uint *arr = (uint*)malloc(s->bufsize);
+    for (size_t o = 0; o < TOTAL;) {
+        size_t r = io_buffer_read(s->in, (char*)arr, s->bufsize);
+        if (r == 0) {
+            thrd_yield();
+            continue;
+        }
+        stage_apply(s->op, arr, r >> 2, &sum);
+        if (s->out) io_write_all(s->out, (char*)arr, r);
+        o += r;
+    }
+    free(arr);
+    s->sum = sum;
+    return 0;
+}
+
+static void io_run(const char *name, thrd_start_t fn, stage_state *w,
+    stage_state *st, size_t bufsize)
+{
+    thrd_t w_tid, s_tid[NSTAGE];
+    struct timespec t0, t1;
+    double ns;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < NSTAGE; i++) {
+        assert(thrd_create(&s_tid[i], fn, &st[i]) == 0);
+    }
+    assert(thrd_create(&w_tid, io_write_thread, w) == 0);
+    assert(thrd_join(w_tid, &res) == 0);
+    for (size_t i = 0; i < NSTAGE; i++) {
+        assert(thrd_join(s_tid[i], &res) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10s %10zu %10.2fns %10.2f\n", name, bufsize,
+        ns / ((double)COUNT * NLOOP), TOTAL / (ns / 1e9) / (1024*1024));
+
+    assert(w->sum == st[stage_publish].sum);
+}
+
+static void io_run_stage(size_t bufsize)
+{
+    pbb_buffer pb;
+    pbb_reader rd[NSTAGE];
+    stage_state w, st[NSTAGE];
+
+    pbb_buffer_init(&pb, bufsize);
+    memset(&w, 0, sizeof(w));
+    w.out = &pb.io;
+    w.bufsize = bufsize;
+    for (size_t i = 0; i < NSTAGE; i++) {
+        if (i == 0) {
+            assert(pbb_buffer_join(&pb, &rd[i]) == 0);
+        } else {
+            assert(pbb_buffer_stage(&pb, &rd[i], &rd[i - 1]) == 0);
+        }
+        memset(&st[i], 0, sizeof(st[i]));
+        st[i].in = &rd[i].io;
+        st[i].bufsize = bufsize;
+        st[i].op = (int)i;
+    }
+
+    io_run("pbb stage", io_stage_thread, &w, st, bufsize);
+
+    for (size_t i = NSTAGE; i > 0; i--) pbb_buffer_leave(&rd[i - 1]);
+    pbb_buffer_destroy(&pb);
+}
+
+static void io_run_copy(size_t bufsize)
+{
+    pbs_buffer pb[NSTAGE];
+    stage_state w, st[NSTAGE];
+
+    memset(&w, 0, sizeof(w));
+    w.out = &pb[0].io;
+    w.bufsize = bufsize;
+    for (size_t i = 0; i < NSTAGE; i++) {
+        pbs_buffer_init(&pb[i], bufsize);
+        memset(&st[i], 0, sizeof(st[i]));
+        st[i].in = &pb[i].io;
+        st[i].out = i + 1 < NSTAGE ? &pb[i + 1].io : NULL;
+        st[i].bufsize = bufsize;
+        st[i].op = (int)i;
+    }
+
+    io_run("pbs x3", io_copy_thread, &w, st, bufsize);
+
+    for (size_t i = 0; i < NSTAGE; i++) pbs_buffer_destroy(&pb[i]);
+}
+
+static void test_stage()
+{
+    pbb_buffer pb;
+    pbb_reader r1, r2;
+    char buf1[64], buf2[64];
+
+    for (size_t i = 0; i < sizeof(buf1); i++) buf1[i] = (char)i;
+
+    pbb_buffer_init(&pb, 64);
+    assert(pbb_buffer_join(&pb, &r1) == 0);
+    assert(pbb_buffer_stage(&pb, &r2, &r1) == 0);
+
+    /* the second stage sees only what the first stage has committed */
+    assert(pbb_buffer_write(&pb, buf1, 64) == 64);
+    assert(io_buffer_read_avail(&r1.io) == 64);
+    assert(io_buffer_read_avail(&r2.io) == 0);
+    io_span t = io_buffer_read_lock(&r1.io, 32);
+    assert(t.length == 32);
+    for (size_t i = 0; i < t.length; i++) t.buf[i] ^= 0x40;
+    io_buffer_read_commit(&r1.io, t);
+    assert(io_buffer_read_avail(&r2.io) == 32);
+
+    /* the producer is limited by the last stage */
+    assert(pbb_buffer_write(&pb, buf1, 64) == 0);
+    assert(io_buffer_read(&r2.io, buf2, 64) == 32);
+    for (size_t i = 0; i < 32; i++) assert(buf2[i] == (buf1[i] ^ 0x40));
+    assert(pbb_buffer_write(&pb, buf1, 64) == 32);
+
+    /* a stage joining after the last stage starts at its cursor */
+    pbb_buffer_leave(&r2);
+    assert(pbb_buffer_stage(&pb, &r2, &r1) == 0);
+    assert(io_buffer_read_avail(&r2.io) == 0);
+    assert(io_buffer_read(&r1.io, buf2, 64) == 64);
+    assert(io_buffer_read_avail(&r2.io) == 64);
+
+    pbb_buffer_leave(&r2);
+    pbb_buffer_leave(&r1);
+    pbb_buffer_destroy(&pb);
+}
+
+static void test_diamond()
+{
+    pbb_buffer pb;
+    pbb_reader r1, r2, r3, r4, *deps[2] = { &r2, &r3 };
+    char buf[64];
+    io_span t;
+
+    memset(buf, 0, sizeof(buf));
+    pbb_buffer_init(&pb, 64);
+    assert(pbb_buffer_join(&pb, &r1) == 0);
+    assert(pbb_buffer_stage(&pb, &r2, &r1) == 0);
+    assert(pbb_buffer_stage(&pb, &r3, &r1) == 0);
+    assert(pbb_buffer_stage_after(&pb, &r4, deps, 2) == 0);
+
+    /* two stages after the first run side by side on the same records */
+    assert(pbb_buffer_write(&pb, buf, 64) == 64);
+    assert(io_buffer_read(&r1.io, buf, 48) == 48);
+    assert(io_buffer_read_avail(&r2.io) == 48);
+    assert(io_buffer_read_avail(&r3.io) == 48);
+    t = io_buffer_read_lock(&r2.io, 32);
+    t.buf[0] = 'x';
+    io_buffer_read_commit(&r2.io, t);
+    t = io_buffer_read_lock(&r3.io, 16);
+    t.buf[1] = 'y';
+    io_buffer_read_commit(&r3.io, t);
+
+    /* the stage after both is limited by the slower of them */
+    assert(io_buffer_read_avail(&r4.io) == 16);
+    assert(io_buffer_read(&r3.io, buf, 32) == 32);
+    assert(io_buffer_read_avail(&r4.io) == 32);
+    assert(io_buffer_read(&r4.io, buf, 64) == 32);
+    assert(buf[0] == 'x' && buf[1] == 'y');
+
+    /* and the producer by the last stage */
+    assert(pbb_buffer_write(&pb, buf, 64) == 32);
+
+    pbb_buffer_leave(&r4);
+    pbb_buffer_leave(&r3);
+    pbb_buffer_leave(&r2);
+    pbb_buffer_leave(&r1);
+    pbb_buffer_destroy(&pb);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: 1 write thread(s) %d stage thread(s)\n",
+        "test_011_pbb_stage", NSTAGE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_stage();
+    test_diamond();
+
+    printf("\n%10s %10s %12s %10s\n", "buffer", "bufsize", "time/uint",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    io_run_copy(4096);
+    io_run_stage(4096);
+    io_run_copy(32768);
+    io_run_stage(32768);
+
+    printf("\n");
+}
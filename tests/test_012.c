@@ -0,0 +1,296 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_stage.h"
+#include "common.h"
+
+#define COUNT (1 << 22)
+#define BUFSIZE 16384
+#define FAN_COUNT (1 << 18)
+
+typedef struct sink_state sink_state;
+struct sink_state
+{
+    ullong next;
+    size_t sum;
+};
+
+typedef struct copy_state copy_state;
+struct copy_state
+{
+    io_buffer *in, *out;
+};
+
+static void scale_fn(void *arg, const char *in, char *out, size_t count)
+{
+    const uint *src = (const uint*)in;
+    ullong *dst = (ullong*)out;
+    for (size_t i = 0; i < count; i++) dst[i] = (ullong)src[i] * 3 + 1;
+}
+
+/* the sink checks that records arrive in order */
+static void sink_fn(void *arg, const char *in, char *out, size_t count)
+{
+    sink_state *s = (sink_state*)arg;
+    const ullong *src = (const ullong*)in;
+    for (size_t i = 0; i < count; i++) {
+        assert(src[i] == s->next * 3 + 1);
+        s->sum += src[i];
+        s->next++;
+    }
+}
+
+typedef struct fan_state fan_state;
+struct fan_state
+{
+    ullong next[2];
+};
+
+/* records carry their source in the top bit of the input */
+static void tag_fn(void *arg, const char *in, char *out, size_t count)
+{
+    const uint *src = (const uint*)in;
+    ullong *dst = (ullong*)out;
+    for (size_t i = 0; i < count; i++) dst[i] = src[i];
+}
+
+static void fan_sink_fn(void *arg, const char *in, char *out, size_t count)
+{
+    fan_state *s = (fan_state*)arg;
+    const ullong *src = (const ullong*)in;
+    for (size_t i = 0; i < count; i++) {
+        size_t k = src[i] >> 31;
+        assert((src[i] & 0x7fffffff) == s->next[k]);
+        s->next[k]++;
+    }
+}
+
+static void io_write_all(io_buffer *io, char *buf, size_t len)
+{
+    for (size_t o = 0; o < len;) {
+        size_t r = io_buffer_write(io, buf + o, len - o);
+        if (r == 0) thrd_yield();
+        o += r;
+    }
+}
+
+static void io_produce(io_buffer *io)
+{
+    uint arr[1024];
+    for (size_t i = 0; i < COUNT; i += 1024) {
+        for (size_t j = 0; j < 1024; j++) arr[j] = (uint)(i + j);
+        io_write_all(io, (char*)arr, sizeof(arr));
+    }
+}
+
+static int io_produce_thread(void *arg)
+{
+    io_produce((io_buffer*)arg);
+    return 0;
+}
+
+/* the same transform through an intermediate buffer */
+static int io_copy_thread(void *arg)
+{
+    copy_state *s = (copy_state*)arg;
+    uint in[IO_STAGE_CHUNK];
+    ullong out[IO_STAGE_CHUNK];
+    for (size_t o = 0; o < COUNT;) {
+        size_t r = io_buffer_read(s->in, (char*)in, sizeof(in)) >> 2;
+        if (r == 0) {
+            thrd_yield();
+            continue;
+        }
+        scale_fn(NULL, (char*)in, (char*)out, r);
+        io_write_all(s->out, (char*)out, r * sizeof(ullong));
+        o += r;
+    }
+    return 0;
+}
+
+static void print_result(const char *name, size_t nthreads,
+    struct timespec t0, struct timespec t1)
+{
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%10s %10zu %10.2fns %10.2f\n", name, nthreads, ns / COUNT,
+        COUNT / (ns / 1e9) / 1e6);
+}
+
+static void io_run_stage(size_t nthreads)
+{
+    pbm_buffer a, b;
+    io_pipeline pl;
+    io_stage scale, sink;
+    sink_state s = { 0, 0 };
+    struct timespec t0, t1;
+
+    pbm_buffer_init(&a, BUFSIZE);
+    pbm_buffer_init(&b, BUFSIZE);
+
+    io_pipeline_init(&pl);
+    io_stage_init(&scale, &a.io, &b.io, scale_fn, NULL,
+        sizeof(uint), sizeof(ullong));
+    assert(io_pipeline_add(&pl, &scale, nthreads) == 0);
+    assert(io_pipeline_chain(&pl, &sink, &scale, NULL, sink_fn, &s,
+        0, 1) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(io_pipeline_start(&pl) == 0);
+    io_produce(&a.io);
+    io_pipeline_stop(&pl);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("stage", nthreads, t0, t1);
+
+    assert(s.next == COUNT);
+    assert(io_buffer_read_avail(&a.io) == 0);
+    assert(io_buffer_read_avail(&b.io) == 0);
+
+    pbm_buffer_destroy(&b);
+    pbm_buffer_destroy(&a);
+}
+
+static void io_run_copy()
+{
+    pbm_buffer a, b;
+    copy_state c;
+    sink_state s = { 0, 0 };
+    struct timespec t0, t1;
+    thrd_t tid, w_tid;
+    ullong arr[IO_STAGE_CHUNK];
+    int res;
+
+    pbm_buffer_init(&a, BUFSIZE);
+    pbm_buffer_init(&b, BUFSIZE);
+    c.in = &a.io;
+    c.out = &b.io;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, io_copy_thread, &c) == 0);
+    assert(thrd_create(&w_tid, io_produce_thread, &a.io) == 0);
+    while (s.next < COUNT) {
+        size_t r = io_buffer_read(&b.io, (char*)arr, sizeof(arr)) >> 3;
+        if (r == 0) thrd_yield();
+        sink_fn(&s, (char*)arr, NULL, r);
+    }
+    assert(thrd_join(w_tid, &res) == 0);
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("copy", 1, t0, t1);
+
+    pbm_buffer_destroy(&b);
+    pbm_buffer_destroy(&a);
+}
+
+static void test_wrap()
+{
+    pbm_buffer a, b;
+    io_stage scale, sink;
+    sink_state s = { 0, 0 };
+    uint arr[16];
+
+    /* output records are twice the size so the spans wrap at different
+     * points and the transform is called once per contiguous run */
+    pbm_buffer_init(&a, 64);
+    pbm_buffer_init(&b, 64);
+    io_stage_init(&scale, &a.io, &b.io, scale_fn, NULL, 4, 8);
+    io_stage_init(&sink, &b.io, NULL, sink_fn, &s, 8, 0);
+    io_stage_set_chunk(&sink, 3);
+
+    for (uint i = 0; i < 16; i++) arr[i] = i;
+    assert(io_buffer_write(&a.io, (char*)arr, 20) == 20);
+    assert(io_stage_step(&scale) == 5);
+    assert(io_stage_step(&sink) == 3);
+    assert(io_buffer_write(&a.io, (char*)&arr[5], 44) == 44);
+    assert(io_stage_step(&scale) == 6);
+    assert(io_stage_step(&scale) == 0);
+    while (io_stage_step(&sink) > 0 || io_stage_step(&scale) > 0);
+    assert(s.next == 16);
+
+    pbm_buffer_destroy(&b);
+    pbm_buffer_destroy(&a);
+}
+
+typedef struct fan_source fan_source;
+struct fan_source
+{
+    io_buffer *io;
+    uint tag;
+};
+
+static int io_fan_thread(void *arg)
+{
+    fan_source *f = (fan_source*)arg;
+    uint arr[16];
+    for (uint i = 0; i < FAN_COUNT; i += 16) {
+        for (uint j = 0; j < 16; j++) arr[j] = f->tag | (i + j);
+        io_write_all(f->io, (char*)arr, sizeof(arr));
+    }
+    return 0;
+}
+
+static void test_fan_in()
+{
+    pbm_buffer a[2], b;
+    io_pipeline pl;
+    io_stage st[2], sink;
+    fan_state s = { { 0, 0 } };
+    fan_source f[2];
+    thrd_t tid[2];
+    int res;
+
+    /* two stages with two workers each share a small output, so output
+     * locks come back short of write_avail and the input is shrunk */
+    pbm_buffer_init(&b, 128);
+    io_pipeline_init(&pl);
+    for (size_t i = 0; i < 2; i++) {
+        pbm_buffer_init(&a[i], 256);
+        io_stage_init(&st[i], &a[i].io, &b.io, tag_fn, NULL, 4, 8);
+        io_stage_set_chunk(&st[i], 5);
+        assert(io_pipeline_add(&pl, &st[i], 2) == 0);
+        f[i].io = &a[i].io;
+        f[i].tag = (uint)i << 31;
+    }
+    io_stage_init(&sink, &b.io, NULL, fan_sink_fn, &s, 8, 0);
+    io_stage_set_chunk(&sink, 3);
+    assert(io_pipeline_add(&pl, &sink, 1) == 0);
+
+    assert(io_pipeline_start(&pl) == 0);
+    for (size_t i = 0; i < 2; i++) {
+        assert(thrd_create(&tid[i], io_fan_thread, &f[i]) == 0);
+    }
+    for (size_t i = 0; i < 2; i++) assert(thrd_join(tid[i], &res) == 0);
+    io_pipeline_stop(&pl);
+
+    assert(s.next[0] == FAN_COUNT && s.next[1] == FAN_COUNT);
+    for (size_t i = 0; i < 2; i++) {
+        assert(io_buffer_read_avail(&a[i].io) == 0);
+        pbm_buffer_destroy(&a[i]);
+    }
+    assert(io_buffer_read_avail(&b.io) == 0);
+    pbm_buffer_destroy(&b);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: 1 write thread(s) %d record(s)\n",
+        "test_012_io_stage", COUNT);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_wrap();
+    test_fan_in();
+
+    printf("\n%10s %10s %12s %10s\n", "mode", "threads", "time/rec",
+        "Mrec/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    io_run_copy();
+    io_run_stage(1);
+    io_run_stage(2);
+    io_run_stage(4);
+
+    printf("\n");
+}
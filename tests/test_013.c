@@ -0,0 +1,138 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_pool.h"
+#include "common.h"
+
+#define NLOOP 256
+#define BUFSIZE 32768
+#define CHUNK 4096
+
+static void sum_fn(void *arg, const char *buf, size_t len, void *acc)
+{
+    const uint *arr = (const uint*)buf;
+    size_t sum = 0;
+    for (size_t i = 0; i < len >> 2; i++) sum += arr[i];
+    *(size_t*)acc += sum;
+}
+
+static void add_fn(void *arg, void *acc, const void *other)
+{
+    *(size_t*)acc += *(const size_t*)other;
+}
+
+static void scale_fn(void *arg, char *buf, size_t len)
+{
+    uint *arr = (uint*)buf;
+    for (size_t i = 0; i < len >> 2; i++) arr[i] = arr[i] * 3;
+}
+
+/* byte checksum over spans that are not aligned to a cache line */
+static void bsum_fn(void *arg, const char *buf, size_t len, void *acc)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < len; i++) sum += (uchar)buf[i];
+    *(size_t*)acc += sum;
+}
+
+static void fill(pbs_buffer *pb, size_t o)
+{
+    io_span t = pbs_buffer_write_lock(pb, BUFSIZE);
+    uint *arr = (uint*)t.buf;
+    assert(t.length == BUFSIZE);
+    for (size_t i = 0; i < BUFSIZE >> 2; i++) {
+        arr[i] = (uint)((o + i) * 793517);
+    }
+    pbs_buffer_write_commit(pb, t);
+}
+
+static void test_reduce(io_pool *pool)
+{
+    char *buf = (char*)malloc(10000);
+    size_t expect = 0, zero = 0, sum;
+    io_span t;
+
+    for (size_t i = 0; i < 10000; i++) {
+        buf[i] = (char)(i * 7);
+        expect += (uchar)buf[i];
+    }
+
+    /* unaligned start and end with chunks smaller than a line */
+    t.buf = buf + 3;
+    t.length = 9990;
+    expect -= (uchar)buf[0] + (uchar)buf[1] + (uchar)buf[2];
+    expect -= (uchar)buf[9993] + (uchar)buf[9994] + (uchar)buf[9995] +
+        (uchar)buf[9996] + (uchar)buf[9997] + (uchar)buf[9998] +
+        (uchar)buf[9999];
+    io_span_parallel_reduce(pool, t, 10, bsum_fn, add_fn, NULL,
+        &zero, &sum, sizeof(sum));
+    assert(sum == expect);
+
+    /* a span smaller than one chunk */
+    t.length = 1;
+    io_span_parallel_reduce(pool, t, CHUNK, bsum_fn, add_fn, NULL,
+        &zero, &sum, sizeof(sum));
+    assert(sum == (uchar)buf[3]);
+
+    free(buf);
+}
+
+static void io_run(size_t nthreads)
+{
+    io_pool pool;
+    pbs_buffer pb;
+    struct timespec t0, t1;
+    size_t expect = 0, zero = 0, sum = 0, part;
+    double ns;
+
+    assert(io_pool_init(&pool, nthreads) == 0);
+    test_reduce(&pool);
+
+    pbs_buffer_init(&pb, BUFSIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) {
+        fill(&pb, j);
+        io_span t = pbs_buffer_read_lock(&pb, BUFSIZE);
+        uint *arr = (uint*)t.buf;
+        for (size_t i = 0; i < BUFSIZE >> 2; i++) {
+            expect += (uint)(arr[i] * 3);
+        }
+        io_span_parallel_for(&pool, t, CHUNK, scale_fn, NULL);
+        io_span_parallel_reduce(&pool, t, CHUNK, sum_fn, add_fn, NULL,
+            &zero, &part, sizeof(part));
+        sum += part;
+        pbs_buffer_read_commit(&pb, t);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10zu %10d %10.2fus %10.2f\n", nthreads, CHUNK,
+        ns / NLOOP / 1e3, (double)NLOOP * BUFSIZE / (ns / 1e9) / (1024*1024));
+
+    assert(sum == expect);
+
+    pbs_buffer_destroy(&pb);
+    io_pool_destroy(&pool);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: %d byte span(s)\n", "test_013_io_pool", BUFSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    printf("\n%10s %10s %12s %10s\n", "threads", "chunk", "time/span",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    io_run(1);
+    io_run(2);
+    io_run(4);
+    io_run(8);
+
+    printf("\n");
+}
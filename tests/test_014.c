@@ -0,0 +1,249 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "buffer_simd.h"
+#include "common.h"
+
+#define NLOOP 2048
+#define BUFSIZE 32768
+
+static const uint levels[] = {
+    0, IO_SIMD_SSE2, IO_SIMD_SSE2 | IO_SIMD_SSE42 | IO_SIMD_AVX2
+};
+static const char *level_names[] = { "scalar", "sse2", "avx2" };
+
+static uint rnd_state = 1;
+
+static uint rnd()
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state ^ (rnd_state >> 16);
+}
+
+/* split buf at cut into two spans to emulate a ticket across the wrap */
+static void split(io_span t[2], char *buf, size_t len, size_t cut)
+{
+    t[0].buf = buf;
+    t[0].length = cut;
+    t[1].buf = buf + cut;
+    t[1].length = len - cut;
+    t[0].sequence = t[1].sequence = 0;
+}
+
+static void test_kernels(uint level)
+{
+    char *buf = (char*)malloc(BUFSIZE + 64), *ref = (char*)malloc(BUFSIZE);
+    size_t len = 4093 * 4, n;
+    io_span t[2], w;
+    uint umin, umax, p32, q32;
+    ullong lmin, lmax, p64, sum;
+    float fmin, fmax;
+
+    io_simd_set_features(level);
+
+    for (size_t i = 0; i < BUFSIZE; i++) ref[i] = (char)rnd();
+
+    /* odd head offset, odd lengths and a cut inside an element */
+    for (size_t off = 0; off < 3; off++) {
+        for (size_t cut = 0; cut < 16; cut += 3) {
+            char *p = buf + off;
+            memcpy(p, ref, len);
+            split(t, p, len, len / 2 + cut);
+
+            sum = 0;
+            for (size_t i = 0; i < len / 4; i++) sum += io_simd_ld_u32(ref + i * 4);
+            assert(io_span_sum_u32(t, 2) == sum);
+
+            sum = 0;
+            for (size_t i = 0; i < len / 8; i++) sum += io_simd_ld_u64(ref + i * 8);
+            assert(io_span_sum_u64(t, 2) == sum);
+
+            umin = ~0u; umax = 0;
+            for (size_t i = 0; i < len / 4; i++) {
+                uint v = io_simd_ld_u32(ref + i * 4);
+                if (v < umin) umin = v;
+                if (v > umax) umax = v;
+            }
+            n = io_span_minmax_u32(t, 2, &p32, &q32);
+            assert(n == len / 4 && p32 == umin && q32 == umax);
+
+            lmin = ~0ull; lmax = 0;
+            for (size_t i = 0; i < len / 8; i++) {
+                ullong v = io_simd_ld_u64(ref + i * 8);
+                if (v < lmin) lmin = v;
+                if (v > lmax) lmax = v;
+            }
+            n = io_span_minmax_u64(t, 2, &p64, &sum);
+            assert(n == len / 8 && p64 == lmin && sum == lmax);
+
+            /* swapping twice restores the data */
+            assert(io_span_bswap16(t, 2) == len / 2);
+            assert(io_simd_bswap16(*(ushort*)(ref + 2)) ==
+                io_simd_ld_u32(p) >> 16);
+            io_span_bswap16(t, 2);
+            assert(memcmp(p, ref, len) == 0);
+            io_span_bswap32(t, 2);
+            assert(io_simd_ld_u32(p + 4092) == io_simd_bswap32(io_simd_ld_u32(ref + 4092)));
+            io_span_bswap32(t, 2);
+            io_span_bswap64(t, 2);
+            assert(io_simd_ld_u64(p + 4088) == io_simd_bswap64(io_simd_ld_u64(ref + 4088)));
+            io_span_bswap64(t, 2);
+            assert(memcmp(p, ref, len) == 0);
+
+            /* delta round trips and matches the scalar encoding */
+            p32 = 0;
+            io_span_delta_encode_u32(t, 2, &p32);
+            assert(p32 == io_simd_ld_u32(ref + len - 4));
+            assert(io_simd_ld_u32(p + 8) == io_simd_ld_u32(ref + 8) - io_simd_ld_u32(ref + 4));
+            p32 = 0;
+            io_span_delta_decode_u32(t, 2, &p32);
+            assert(memcmp(p, ref, len) == 0);
+            p64 = 0;
+            io_span_delta_encode_u64(t, 2, &p64);
+            assert(io_simd_ld_u64(p + 16) == io_simd_ld_u64(ref + 16) - io_simd_ld_u64(ref + 8));
+            p64 = 0;
+            io_span_delta_decode_u64(t, 2, &p64);
+            assert(memcmp(p, ref, len) == 0);
+
+            /* crc is independent of the split */
+            w.buf = p;
+            w.length = len;
+            assert(io_span_crc32c(t, 2, 0) == io_span_crc32c(&w, 1, 0));
+        }
+    }
+
+    /* floats */
+    for (size_t i = 0; i < 1000; i++) ((float*)ref)[i] = (float)((int)i - 500) * 0.5f;
+    memcpy(buf + 1, ref, 4000);
+    split(t, buf + 1, 4000, 1998);
+    assert(io_span_sum_f32(t, 2) == -250.0);
+    n = io_span_minmax_f32(t, 2, &fmin, &fmax);
+    assert(n == 1000 && fmin == -250.0f && fmax == 249.5f);
+
+    /* crc32c check value */
+    memcpy(buf, "123456789", 9);
+    split(t, buf, 9, 4);
+    assert(io_span_crc32c(t, 2, 0) == 0xe3069283);
+    assert(io_span_crc32c(t + 1, 1, io_span_crc32c(t, 1, 0)) == 0xe3069283);
+
+    free(ref);
+    free(buf);
+    io_simd_set_features(~0u);
+}
+
+static double elapsed(struct timespec t0, struct timespec t1)
+{
+    return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+static void print_result(const char *name, const char *level, double ns)
+{
+    printf("%10s %10s %10.2fus %10.2f\n", name, level, ns / NLOOP / 1e3,
+        (double)NLOOP * BUFSIZE / (ns / 1e9) / (1024*1024));
+}
+
+/* the reader loop from test_002 */
+static void bench_loop(io_span t)
+{
+    struct timespec t0, t1;
+    volatile size_t out;
+    size_t sum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) {
+        uint *arr = (uint*)t.buf;
+        for (size_t i = 0; i < t.length >> 2; i++) {
+            sum += arr[i];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    out = sum;
+    (void)out;
+    print_result("sum_u32", "loop", elapsed(t0, t1));
+}
+
+static void bench_kernels(io_span t, size_t l)
+{
+    struct timespec t0, t1;
+    volatile ullong out = 0;
+    uint prev, min, max;
+
+    io_simd_set_features(levels[l]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) out += io_span_sum_u32(&t, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("sum_u32", level_names[l], elapsed(t0, t1));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) out += (ullong)io_span_sum_f32(&t, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("sum_f32", level_names[l], elapsed(t0, t1));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) {
+        io_span_minmax_u32(&t, 1, &min, &max);
+        out += min;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("minmax_u32", level_names[l], elapsed(t0, t1));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) io_span_bswap32(&t, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("bswap32", level_names[l], elapsed(t0, t1));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) {
+        prev = 0;
+        io_span_delta_encode_u32(&t, 1, &prev);
+        prev = 0;
+        io_span_delta_decode_u32(&t, 1, &prev);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("delta_u32", level_names[l], elapsed(t0, t1) / 2);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = 0; j < NLOOP; j++) out += io_span_crc32c(&t, 1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_result("crc32c", level_names[l], elapsed(t0, t1));
+
+    io_simd_set_features(~0u);
+}
+
+int main(int argc, const char **argv)
+{
+    pbs_buffer pb;
+    io_span t;
+
+    printf("\n# %s: %d byte span(s) features %#x\n", "test_014_io_simd",
+        BUFSIZE, io_simd_features());
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    for (size_t l = 0; l < 3; l++) {
+        if ((io_simd_detect() & levels[l]) == levels[l]) test_kernels(levels[l]);
+    }
+
+    pbs_buffer_init(&pb, BUFSIZE);
+    t = pbs_buffer_write_lock(&pb, BUFSIZE);
+    for (size_t i = 0; i < BUFSIZE >> 2; i++) ((uint*)t.buf)[i] = rnd() & 0xffff;
+    pbs_buffer_write_commit(&pb, t);
+    t = pbs_buffer_read_lock(&pb, BUFSIZE);
+
+    printf("\n%10s %10s %12s %10s\n", "kernel", "level", "time/span",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    bench_loop(t);
+    for (size_t l = 0; l < 3; l++) {
+        if ((io_simd_detect() & levels[l]) == levels[l]) bench_kernels(t, l);
+    }
+
+    pbs_buffer_read_commit(&pb, t);
+    pbs_buffer_destroy(&pb);
+
+    printf("\n");
+}
@@ -0,0 +1,251 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer.h"
+#include "common.h"
+
+#define COUNT (1 << 24)
+#define CHUNK 1024
+#define NRESIZE 64
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    pbs_buffer *pbs;
+    pbm_buffer *pbm;
+    int resize;
+    atomic_int done;
+    size_t resizes;
+};
+
+static uchar pattern(size_t o)
+{
+    return (uchar)(o * 7 + (o >> 12));
+}
+
+static void test_pbs()
+{
+    pbs_buffer pb;
+    char buf[256], out[256];
+    io_span t;
+
+    pbs_buffer_init(&pb, 64);
+    for (size_t i = 0; i < 256; i++) buf[i] = (char)pattern(i);
+
+    /* unread bytes wrap in the old array */
+    assert(pbs_buffer_write(&pb, buf, 48) == 48);
+    assert(pbs_buffer_read(&pb, out, 40) == 40);
+    assert(pbs_buffer_write(&pb, buf + 48, 40) == 40);
+
+    /* a read ticket on the old array stays valid across the swap */
+    t = pbs_buffer_read_lock(&pb, 4);
+    assert(pbs_buffer_resize(&pb, 256) == 0);
+    assert(pbs_buffer_capacity(&pb) == 256);
+    assert(t.length == 4 && memcmp(t.buf, buf + 40, 4) == 0);
+    pbs_buffer_read_commit(&pb, t);
+
+    /* the old array is retired once the consumer passes the swap point */
+    assert(pbs_buffer_resize(&pb, 128) == -1);
+    assert(pbs_buffer_write(&pb, buf + 88, 160) == 160);
+    assert(pbs_buffer_read(&pb, out, 44) == 44);
+    assert(memcmp(out, buf + 44, 44) == 0);
+    assert(pbs_buffer_retire(&pb) == -1);
+    assert(pbs_buffer_read(&pb, out, 1) == 1);
+    assert(pbs_buffer_retire(&pb) == 0);
+
+    /* cannot shrink below the unread bytes */
+    assert(pbs_buffer_read_avail(&pb) == 159);
+    assert(pbs_buffer_resize(&pb, 128) == -1);
+    assert(pbs_buffer_read(&pb, out, 64) == 64);
+    assert(memcmp(out, buf + 89, 64) == 0);
+    assert(pbs_buffer_resize(&pb, 128) == 0);
+    assert(pbs_buffer_write_avail(&pb) == 128 - 95);
+    assert(pbs_buffer_read(&pb, out, 95) == 95);
+    assert(memcmp(out, buf + 153, 95) == 0);
+
+    pbs_buffer_destroy(&pb);
+}
+
+static void test_pbm()
+{
+    pbm_buffer pb;
+    char buf[256], out[256];
+    io_span t;
+
+    pbm_buffer_init(&pb, 64);
+    for (size_t i = 0; i < 256; i++) buf[i] = (char)pattern(i);
+
+    assert(pbm_buffer_write(&pb, buf, 48) == 48);
+    assert(pbm_buffer_read(&pb, out, 40) == 40);
+    assert(pbm_buffer_write(&pb, buf + 48, 40) == 40);
+    assert(pbm_buffer_resize(&pb, 256) == 0);
+    assert(pbm_buffer_capacity(&pb) == 256);
+    assert(pbm_buffer_read_avail(&pb) == 48);
+    assert(pbm_buffer_write_avail(&pb) == 208);
+
+    /* markers are renumbered by the new capacity, keeping alignment */
+    t = pbm_buffer_read_lock(&pb, 8);
+    assert(t.length == 8 && (t.sequence & 7) == 0);
+    assert(memcmp(t.buf, buf + 40, 8) == 0);
+    pbm_buffer_read_commit(&pb, t);
+
+    assert(pbm_buffer_resize(&pb, 32) == -1);
+    assert(pbm_buffer_read(&pb, out, 8) == 8);
+    assert(memcmp(out, buf + 48, 8) == 0);
+    assert(pbm_buffer_resize(&pb, 32) == 0);
+    assert(pbm_buffer_write_avail(&pb) == 0);
+    assert(pbm_buffer_read(&pb, out, 64) == 32);
+    assert(memcmp(out, buf + 56, 32) == 0);
+
+    /* automatic growth when writes stay short */
+    pbm_buffer_set_max_capacity(&pb, 128);
+    assert(pbm_buffer_write(&pb, buf, 32) == 32);
+    for (size_t i = 0; i < PB_GROW_THRESHOLD / PB_GROW_SHORT - 1; i++) {
+        assert(pbm_buffer_write(&pb, buf, 1) == 0);
+    }
+    assert(pbm_buffer_write(&pb, buf + 32, 1) == 1);
+    assert(pbm_buffer_capacity(&pb) == 64);
+    assert(pbm_buffer_read(&pb, out, 64) == 33);
+    assert(memcmp(out, buf, 33) == 0);
+
+    /* growth gives up while the writer holds a read ticket */
+    assert(pbm_buffer_write(&pb, buf, 64) == 64);
+    t = pbm_buffer_read_lock(&pb, 8);
+    assert(t.length == 8);
+    for (size_t i = 0; i < PB_GROW_THRESHOLD / PB_GROW_SHORT; i++) {
+        assert(pbm_buffer_write(&pb, buf, 1) == 0);
+    }
+    assert(pbm_buffer_capacity(&pb) == 64);
+    pbm_buffer_read_commit(&pb, t);
+    assert(pbm_buffer_resize(&pb, 128) == 0);
+    assert(pbm_buffer_read(&pb, out, 128) == 56);
+    assert(memcmp(out, buf + 8, 56) == 0);
+
+    pbm_buffer_destroy(&pb);
+}
+
+static int io_produce_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    uchar buf[CHUNK];
+    size_t n = 0;
+
+    for (size_t o = 0; o < COUNT;) {
+        for (size_t i = 0; i < CHUNK; i++) buf[i] = pattern(o + i);
+        for (size_t p = 0; p < CHUNK;) {
+            size_t r = io_buffer_write(s->io, (char*)buf + p, CHUNK - p);
+            if (r == 0) thrd_yield();
+            p += r;
+        }
+        o += CHUNK;
+
+        /* the single producer resizes a pbs buffer itself */
+        if (s->pbs && s->resize && (o & (COUNT / NRESIZE - 1)) == 0) {
+            size_t cap = (n++ & 1) ? 4096 : 16384;
+            if (pbs_buffer_resize(s->pbs, cap) == 0) s->resizes++;
+        }
+    }
+    atomic_store(&s->done, 1);
+    return 0;
+}
+
+/* resize a pbm buffer from a thread that is neither reader nor writer */
+static int io_resize_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t n = 0;
+
+    while (!atomic_load(&s->done)) {
+        size_t cap = (n++ & 1) ? 4096 : 16384;
+        if (pbm_buffer_resize(s->pbm, cap) == 0) s->resizes++;
+        for (size_t i = 0; i < 64; i++) thrd_yield();
+    }
+    return 0;
+}
+
+static void io_consume(run_state *s)
+{
+    uchar buf[CHUNK];
+
+    for (size_t o = 0; o < COUNT;) {
+        size_t r = io_buffer_read(s->io, (char*)buf, CHUNK);
+        if (r == 0) thrd_yield();
+        for (size_t i = 0; i < r; i++) assert(buf[i] == pattern(o + i));
+        o += r;
+    }
+}
+
+static void print_result(const char *name, const char *mode, size_t cap,
+    size_t resizes, struct timespec t0, struct timespec t1)
+{
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%10s %10s %10zu %10zu %10.2f\n", name, mode, cap, resizes,
+        (double)COUNT / (ns / 1e9) / (1024*1024));
+}
+
+static void io_run(const char *name, io_buffer *io, pbs_buffer *pbs,
+    pbm_buffer *pbm, const char *mode, int resize)
+{
+    run_state s = { io, pbs, pbm, resize, 0, 0 };
+    struct timespec t0, t1;
+    thrd_t w_tid, r_tid;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&w_tid, io_produce_thread, &s) == 0);
+    if (pbm && resize) assert(thrd_create(&r_tid, io_resize_thread, &s) == 0);
+    io_consume(&s);
+    assert(thrd_join(w_tid, &res) == 0);
+    if (pbm && resize) assert(thrd_join(r_tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    assert(io_buffer_read_avail(io) == 0);
+    print_result(name, mode, pbs ? pbs_buffer_capacity(pbs) :
+        pbm_buffer_capacity(pbm), s.resizes, t0, t1);
+}
+
+int main(int argc, const char **argv)
+{
+    pbs_buffer pbs;
+    pbm_buffer pbm;
+
+    printf("\n# %s: 1 write thread(s) %d byte(s)\n", "test_015_resize",
+        COUNT);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_pbs();
+    test_pbm();
+
+    printf("\n%10s %10s %10s %10s %10s\n", "buffer", "mode", "capacity",
+        "resizes", "MB/sec");
+    printf("%10s %10s %10s %10s %10s\n", "----------", "----------",
+        "----------", "----------", "----------");
+
+    pbs_buffer_init(&pbs, 4096);
+    io_run("pbs", &pbs.io, &pbs, NULL, "fixed", 0);
+    io_run("pbs", &pbs.io, &pbs, NULL, "resize", 1);
+    pbs_buffer_destroy(&pbs);
+
+    pbs_buffer_init(&pbs, 1024);
+    pbs_buffer_set_max_capacity(&pbs, 65536);
+    io_run("pbs", &pbs.io, &pbs, NULL, "autogrow", 0);
+    assert(pbs_buffer_capacity(&pbs) > 1024);
+    pbs_buffer_destroy(&pbs);
+
+    pbm_buffer_init(&pbm, 4096);
+    io_run("pbm", &pbm.io, NULL, &pbm, "fixed", 0);
+    io_run("pbm", &pbm.io, NULL, &pbm, "resize", 1);
+    pbm_buffer_destroy(&pbm);
+
+    pbm_buffer_init(&pbm, 1024);
+    pbm_buffer_set_max_capacity(&pbm, 32768);
+    io_run("pbm", &pbm.io, NULL, &pbm, "autogrow", 0);
+    assert(pbm_buffer_capacity(&pbm) > 1024);
+    pbm_buffer_destroy(&pbm);
+
+    printf("\n");
+}
@@ -0,0 +1,182 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_seg.h"
+#include "common.h"
+
+#define COUNT (1 << 26)
+#define BURST (1 << 22)
+#define CHUNK 4096
+#define SEGSIZE 65536
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+};
+
+static uchar pattern(size_t o)
+{
+    return (uchar)(o * 7 + (o >> 12));
+}
+
+static void test_segments()
+{
+    pbu_buffer pb;
+    char buf[256], out[256];
+    io_span t, u;
+
+    assert(pbu_buffer_init(&pb, 64) == 0);
+    for (size_t i = 0; i < 256; i++) buf[i] = (char)pattern(i);
+
+    /* wrap within the first segment while the consumer keeps up */
+    assert(pbu_buffer_write(&pb, buf, 48) == 48);
+    assert(pbu_buffer_read(&pb, out, 40) == 40);
+    assert(pbu_buffer_write(&pb, buf + 48, 40) == 40);
+    t = pbu_buffer_read_lock(&pb, 64);
+    assert(t.length == 24 && memcmp(t.buf, buf + 40, 24) == 0);
+    pbu_buffer_read_commit(&pb, t);
+    assert(pbu_buffer_footprint(&pb) == sizeof(pbu_segment) + 64);
+
+    /* a full segment makes the producer link new ones */
+    assert(pbu_buffer_write(&pb, buf + 88, 168) == 168);
+    assert(pbu_buffer_read_avail(&pb) == 192);
+    assert(pbu_buffer_footprint(&pb) == 3 * (sizeof(pbu_segment) + 64));
+
+    /* locking twice returns the same sequence */
+    t = pbu_buffer_read_lock(&pb, 256);
+    u = pbu_buffer_read_lock(&pb, 256);
+    assert(t.sequence == u.sequence && t.length == 64);
+    assert(memcmp(t.buf, buf + 64, 64) == 0);
+    pbu_buffer_read_commit(&pb, t);
+    assert(pbu_buffer_read(&pb, out, 256) == 128);
+    assert(memcmp(out, buf + 128, 128) == 0);
+
+    /* drained segments are recycled */
+    assert(pbu_buffer_write(&pb, buf, 192) == 192);
+    assert(pbu_buffer_footprint(&pb) == 3 * (sizeof(pbu_segment) + 64));
+    assert(pbu_buffer_read(&pb, out, 256) == 192);
+    assert(memcmp(out, buf, 192) == 0);
+    pbu_buffer_trim(&pb);
+    assert(pbu_buffer_footprint(&pb) == sizeof(pbu_segment) + 64);
+
+    t = pbu_buffer_write_lock(&pb, 256);
+    assert(t.length > 0 && t.length <= 64);
+    assert(pbu_buffer_write_avail(&pb) == SIZE_MAX);
+
+    pbu_buffer_destroy(&pb);
+}
+
+/*
+ * bursts of 64KiB with every sixteenth burst BURST bytes. the producer
+ * waits for the consumer to drain the buffer between bursts.
+ */
+static int io_produce_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    uchar buf[CHUNK];
+    size_t n = 0, burst = 0;
+
+    for (size_t o = 0; o < COUNT; o += CHUNK) {
+        for (size_t i = 0; i < CHUNK; i++) buf[i] = pattern(o + i);
+        for (size_t p = 0; p < CHUNK;) {
+            size_t r = io_buffer_write(s->io, (char*)buf + p, CHUNK - p);
+            if (r == 0) thrd_yield();
+            p += r;
+        }
+        if ((burst += CHUNK) == ((n & 15) == 15 ? BURST : 65536)) {
+            while (io_buffer_read_avail(s->io) > 0) thrd_yield();
+            burst = 0;
+            n++;
+        }
+    }
+    return 0;
+}
+
+static void io_consume(run_state *s)
+{
+    for (size_t o = 0; o < COUNT;) {
+        io_span t = io_buffer_read_lock(s->io, CHUNK);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        for (size_t i = 0; i < t.length; i++) {
+            assert((uchar)t.buf[i] == pattern(o + i));
+        }
+        io_buffer_read_commit(s->io, t);
+        o += t.length;
+    }
+}
+
+static void io_run(const char *name, io_buffer *io, size_t (*footprint)(void*),
+    void (*trim)(void*), void *pb)
+{
+    run_state s = { io };
+    struct timespec t0, t1;
+    thrd_t w_tid;
+    size_t peak;
+    double ns;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&w_tid, io_produce_thread, &s) == 0);
+    io_consume(&s);
+    assert(thrd_join(w_tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    assert(io_buffer_read_avail(io) == 0);
+    peak = footprint(pb);
+    trim(pb);
+    printf("%10s %10zu %10zu %10.2f\n", name, peak >> 10, footprint(pb) >> 10,
+        (double)COUNT / (ns / 1e9) / (1024*1024));
+}
+
+static size_t pbs_footprint(void *pb)
+{
+    return pbs_buffer_capacity((pbs_buffer*)pb);
+}
+
+static size_t pbu_footprint(void *pb)
+{
+    return pbu_buffer_footprint((pbu_buffer*)pb);
+}
+
+static void pbs_trim(void *pb) {}
+
+static void pbu_trim(void *pb)
+{
+    pbu_buffer_trim((pbu_buffer*)pb);
+}
+
+int main(int argc, const char **argv)
+{
+    pbs_buffer pbs;
+    pbu_buffer pbu;
+
+    printf("\n# %s: 1 write thread(s) %d byte(s) %d byte max burst\n",
+        "test_016_pbu_buffer", COUNT, BURST);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_segments();
+
+    printf("\n%10s %10s %10s %10s\n", "buffer", "peak KiB", "trim KiB",
+        "MB/sec");
+    printf("%10s %10s %10s %10s\n", "----------", "----------", "----------",
+        "----------");
+
+    /* a fixed buffer must be sized for the largest burst */
+    pbs_buffer_init(&pbs, BURST);
+    io_run("pbs", &pbs.io, pbs_footprint, pbs_trim, &pbs);
+    pbs_buffer_destroy(&pbs);
+
+    assert(pbu_buffer_init(&pbu, SEGSIZE) == 0);
+    io_run("pbu", &pbu.io, pbu_footprint, pbu_trim, &pbu);
+    pbu_buffer_destroy(&pbu);
+
+    printf("\n");
+}
@@ -0,0 +1,201 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_slab.h"
+#include "common.h"
+
+#define TOTAL (1 << 28)
+#define BUFSIZE 32768
+#define NSLOTS 256
+
+typedef struct run_state run_state;
+struct run_state
+{
+    pbm_buffer *pb;
+    io_slab *slab;
+    size_t msg_size;
+    size_t count;
+};
+
+static void test_slab()
+{
+    io_slab slab;
+    io_slab_cache a, b;
+    char *p[130], *q;
+    size_t len;
+    pbm_buffer pb;
+
+    assert(io_slab_init(&slab, 256, 100) == 0);
+    assert(slab.npages == 2);
+    io_slab_cache_init(&a, &slab);
+    io_slab_cache_init(&b, &slab);
+
+    /* each cache claims its own page */
+    p[0] = io_slab_alloc(&a);
+    p[1] = io_slab_alloc(&b);
+    assert(p[0] == slab.data && p[1] == slab.data + 64 * 256);
+    assert(io_slab_cache_avail(&a) == 63 && io_slab_cache_avail(&b) == 63);
+
+    /* slots are handed out lowest first and the slab can be exhausted */
+    for (size_t i = 2; i < 65; i++) {
+        p[i] = io_slab_alloc(&a);
+        assert(p[i] == slab.data + (i - 1) * 256);
+    }
+    assert(io_slab_alloc(&a) == NULL);
+    assert(io_slab_cache_avail(&a) == 0);
+
+    /* a free from any thread returns the slot to the owning cache */
+    io_slab_free(&slab, p[7]);
+    assert(io_slab_cache_avail(&a) == 1);
+    assert(io_slab_alloc(&a) == p[7]);
+
+    /* references pass through the ring and ownership moves on commit */
+    pbm_buffer_init(&pb, 64);
+    memcpy(p[3], "payload", 8);
+    assert(io_slab_send(&pb.io, &slab, p[3], 8) == 0);
+    q = io_slab_recv(&pb.io, &slab, &len);
+    assert(q == p[3] && len == 8 && strcmp(q, "payload") == 0);
+    io_slab_free(&slab, q);
+    assert(io_slab_recv(&pb.io, &slab, &len) == NULL);
+    for (size_t i = 0; i < 8; i++) {
+        assert(io_slab_send(&pb.io, &slab, p[i], 0) == 0);
+    }
+    assert(io_slab_send(&pb.io, &slab, p[8], 0) == -1);
+    pbm_buffer_destroy(&pb);
+
+    io_slab_destroy(&slab);
+}
+
+/* stamp the sequence at both ends in place of the payload */
+static void stamp(char *p, size_t len, size_t seq)
+{
+    assert(len >= sizeof(seq));
+    memcpy(p, &seq, sizeof(seq));
+    memcpy(p + len - sizeof(seq), &seq, sizeof(seq));
+}
+
+static void check(char *p, size_t len, size_t seq)
+{
+    size_t a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, p + len - sizeof(b), sizeof(b));
+    assert(a == seq && b == seq);
+}
+
+static int io_copy_produce(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    char *msg = (char*)malloc(s->msg_size);
+
+    memset(msg, 0, s->msg_size);
+    for (size_t i = 0; i < s->count; i++) {
+        stamp(msg, s->msg_size, i);
+        for (size_t o = 0; o < s->msg_size;) {
+            size_t r = io_buffer_write(&s->pb->io, msg + o, s->msg_size - o);
+            if (r == 0) thrd_yield();
+            o += r;
+        }
+    }
+    free(msg);
+    return 0;
+}
+
+static void io_copy_consume(run_state *s)
+{
+    char *msg = (char*)malloc(s->msg_size);
+
+    for (size_t i = 0; i < s->count; i++) {
+        for (size_t o = 0; o < s->msg_size;) {
+            size_t r = io_buffer_read(&s->pb->io, msg + o, s->msg_size - o);
+            if (r == 0) thrd_yield();
+            o += r;
+        }
+        check(msg, s->msg_size, i);
+    }
+    free(msg);
+}
+
+static int io_slab_produce(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    io_slab_cache cache;
+    char *p;
+
+    io_slab_cache_init(&cache, s->slab);
+    for (size_t i = 0; i < s->count; i++) {
+        while (!(p = io_slab_alloc(&cache))) thrd_yield();
+        stamp(p, s->msg_size, i);
+        while (io_slab_send(&s->pb->io, s->slab, p, s->msg_size) < 0) {
+            thrd_yield();
+        }
+    }
+    return 0;
+}
+
+static void io_slab_consume(run_state *s)
+{
+    size_t len;
+    char *p;
+
+    for (size_t i = 0; i < s->count; i++) {
+        while (!(p = io_slab_recv(&s->pb->io, s->slab, &len))) thrd_yield();
+        assert(len == s->msg_size);
+        check(p, len, i);
+        io_slab_free(s->slab, p);
+    }
+}
+
+static void io_run(const char *mode, size_t msg_size, int slab_mode)
+{
+    pbm_buffer pb;
+    io_slab slab;
+    run_state s = { &pb, &slab, msg_size, TOTAL / msg_size };
+    struct timespec t0, t1;
+    thrd_t tid;
+    double ns;
+    int res;
+
+    pbm_buffer_init(&pb, BUFSIZE);
+    assert(io_slab_init(&slab, msg_size, NSLOTS) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&tid, slab_mode ? io_slab_produce : io_copy_produce,
+        &s) == 0);
+    if (slab_mode) io_slab_consume(&s);
+    else io_copy_consume(&s);
+    assert(thrd_join(tid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10s %10zu %10.2fns %10.2f\n", mode, msg_size, ns / s.count,
+        (double)TOTAL / (ns / 1e9) / (1024*1024));
+
+    io_slab_destroy(&slab);
+    pbm_buffer_destroy(&pb);
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t sizes[] = { 4096, 16384, 65536 };
+
+    printf("\n# %s: 1 write thread(s) %d byte(s)\n", "test_017_io_slab",
+        TOTAL);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_slab();
+
+    printf("\n%10s %10s %12s %10s\n", "mode", "msg size", "time/msg",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        io_run("copy", sizes[i], 0);
+        io_run("slab", sizes[i], 1);
+    }
+
+    printf("\n");
+}
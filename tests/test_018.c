@@ -0,0 +1,217 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_prio.h"
+#include "common.h"
+
+#define RECSIZE 64
+#define BUFSIZE 32768
+#define NPING 1024
+#define NBULK (1 << 24)
+
+enum { rec_bulk, rec_ping, rec_stop };
+
+typedef struct rec rec;
+struct rec
+{
+    uint type;
+    uint seq;
+    ullong stamp;
+    char payload[RECSIZE - 16];
+};
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    io_prio *pr;
+    atomic_int done;
+};
+
+static ullong now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ullong)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    ullong x = *(const ullong*)a, y = *(const ullong*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint read_type(io_buffer *io)
+{
+    io_span t = io_buffer_read_lock(io, RECSIZE);
+    uint type;
+    assert(t.length == RECSIZE);
+    type = ((rec*)t.buf)->type;
+    io_buffer_read_commit(io, t);
+    return type;
+}
+
+static void test_lanes()
+{
+    io_prio pr;
+    rec r = { 0 };
+    uint order[16];
+
+    io_prio_init(&pr, 3, 1024);
+
+    /* strict priority returns the lowest non-empty lane first */
+    r.type = 2;
+    assert(io_buffer_write(&pr.io, (char*)&r, RECSIZE) == RECSIZE);
+    r.type = 0;
+    assert(io_prio_write(&pr, 0, (char*)&r, RECSIZE) == RECSIZE);
+    r.type = 1;
+    io_span t = io_prio_write_lock(&pr, 1, RECSIZE);
+    memcpy(t.buf, &r, RECSIZE);
+    io_prio_write_commit(&pr, t);
+    assert(io_buffer_read_avail(&pr.io) == 3 * RECSIZE);
+    assert(read_type(&pr.io) == 0);
+    assert(read_type(&pr.io) == 1);
+    assert(read_type(&pr.io) == 2);
+    assert(io_buffer_read_lock(&pr.io, RECSIZE).length == 0);
+    assert(atomic_load(&pr.nonempty) == 0);
+
+    /* weights 3:1 interleave two lanes ahead of strict lane 2 */
+    io_prio_set_weight(&pr, 0, 3);
+    io_prio_set_weight(&pr, 1, 1);
+    for (uint i = 0; i < 8; i++) {
+        r.type = 0;
+        io_prio_write(&pr, 0, (char*)&r, RECSIZE);
+        r.type = 1;
+        io_prio_write(&pr, 1, (char*)&r, RECSIZE);
+    }
+    for (uint i = 0; i < 8; i++) order[i] = read_type(&pr.io);
+    assert(order[0] == 0 && order[1] == 0 && order[2] == 0 && order[3] == 1);
+    assert(order[4] == 0 && order[5] == 0 && order[6] == 0 && order[7] == 1);
+    r.type = 2;
+    io_prio_write(&pr, 2, (char*)&r, RECSIZE);
+    assert(read_type(&pr.io) == 0);
+    assert(read_type(&pr.io) == 0);
+    for (uint i = 0; i < 6; i++) assert(read_type(&pr.io) == 1);
+    assert(read_type(&pr.io) == 2);
+    assert(io_buffer_read_avail(&pr.io) == 0);
+
+    io_prio_destroy(&pr);
+}
+
+static void io_write_rec(io_buffer *io, rec *r)
+{
+    while (io_buffer_write(io, (char*)r, RECSIZE) == 0) thrd_yield();
+}
+
+static int io_bulk_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    rec r = { rec_bulk };
+
+    /* bounded so pings starved behind a shared ring still complete */
+    while (!atomic_load_explicit(&s->done, memory_order_relaxed)) {
+        if (r.seq == NBULK) thrd_yield();
+        else if (io_buffer_write(s->io, (char*)&r, RECSIZE)) r.seq++;
+        else thrd_yield();
+    }
+    r.type = rec_stop;
+    io_write_rec(s->io, &r);
+    return 0;
+}
+
+static int io_ping_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    rec r = { rec_ping };
+
+    for (uint i = 0; i < NPING; i++) {
+        r.seq = i;
+        r.stamp = now_ns();
+        if (s->pr) {
+            while (io_prio_write(s->pr, 0, (char*)&r, RECSIZE) == 0) {
+                thrd_yield();
+            }
+        } else {
+            io_write_rec(s->io, &r);
+        }
+        for (uint j = 0; j < 16; j++) thrd_yield();
+    }
+    atomic_store(&s->done, 1);
+    return 0;
+}
+
+static void io_run(const char *name, io_buffer *io, io_prio *pr)
+{
+    run_state s = { io, pr, 0 };
+    ullong *lat = (ullong*)malloc(NPING * sizeof(ullong)), sum = 0;
+    size_t nping = 0, nbulk = 0;
+    thrd_t b_tid, p_tid;
+    int res, stop = 0;
+
+    assert(thrd_create(&b_tid, io_bulk_thread, &s) == 0);
+    assert(thrd_create(&p_tid, io_ping_thread, &s) == 0);
+    while (!stop) {
+        io_span t = io_buffer_read_lock(io, RECSIZE);
+        rec *r = (rec*)t.buf;
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        assert(t.length == RECSIZE);
+        switch (r->type) {
+        case rec_ping:
+            assert(r->seq == nping);
+            lat[nping++] = now_ns() - r->stamp;
+            break;
+        case rec_bulk: nbulk++; break;
+        case rec_stop: stop = 1; break;
+        }
+        io_buffer_read_commit(io, t);
+    }
+    assert(thrd_join(b_tid, &res) == 0);
+    assert(thrd_join(p_tid, &res) == 0);
+    assert(nping == NPING);
+
+    qsort(lat, NPING, sizeof(ullong), cmp_ull);
+    for (size_t i = 0; i < NPING; i++) sum += lat[i];
+    printf("%10s %10zu %10.2fus %10.2fus %10.2fus\n", name, nbulk,
+        sum / (double)NPING / 1e3, lat[NPING * 99 / 100] / 1e3,
+        lat[NPING - 1] / 1e3);
+    free(lat);
+}
+
+int main(int argc, const char **argv)
+{
+    pbm_buffer pb;
+    io_prio pr;
+
+    printf("\n# %s: 1 bulk thread(s) 1 ping thread(s) %d ping(s)\n",
+        "test_018_io_prio", NPING);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_lanes();
+
+    printf("\n%10s %10s %12s %12s %12s\n", "channel", "bulk recs",
+        "ping mean", "ping p99", "ping max");
+    printf("%10s %10s %12s %12s %12s\n", "----------", "----------",
+        "------------", "------------", "------------");
+
+    pbm_buffer_init(&pb, BUFSIZE);
+    io_run("pbm", &pb.io, NULL);
+    pbm_buffer_destroy(&pb);
+
+    io_prio_init(&pr, 2, BUFSIZE);
+    io_run("prio", &pr.io, &pr);
+    io_prio_destroy(&pr);
+
+    io_prio_init(&pr, 2, BUFSIZE);
+    io_prio_set_weight(&pr, 0, 4);
+    io_prio_set_weight(&pr, 1, 1);
+    io_run("weighted", &pr.io, &pr);
+    io_prio_destroy(&pr);
+
+    printf("\n");
+}
@@ -0,0 +1,215 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_poll.h"
+#include "common.h"
+
+#define COUNT (1 << 26)
+#define RECSIZE 64
+#define BUFSIZE 32768
+#define MAX_THREADS 32
+
+typedef struct rec rec;
+struct rec
+{
+    size_t producer;
+    size_t seq;
+    char payload[RECSIZE - 2 * sizeof(size_t)];
+};
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    io_poll *ps;
+    size_t nthreads;
+    size_t count;
+};
+
+typedef struct thread_arg thread_arg;
+struct thread_arg
+{
+    run_state *s;
+    size_t id;
+};
+
+static size_t read_one(io_poll *ps)
+{
+    size_t v;
+    io_span t = io_buffer_read_lock(&ps->io, sizeof(v));
+    if (t.length == 0) return SIZE_MAX;
+    assert(t.length == sizeof(v));
+    memcpy(&v, t.buf, sizeof(v));
+    io_buffer_read_commit(&ps->io, t);
+    return v;
+}
+
+static void test_poll()
+{
+    pbs_buffer pb[3];
+    io_poll ps;
+    struct timespec deadline;
+    size_t v;
+
+    io_poll_init(&ps);
+    for (size_t i = 0; i < 3; i++) {
+        pbs_buffer_init(&pb[i], 64);
+        assert(io_poll_add(&ps, &pb[i]) == (int)i);
+    }
+
+    /* producers mark the ready bitmap only on the first write */
+    v = 0;
+    assert(io_poll_write(&ps, 0, (char*)&v, sizeof(v)) == sizeof(v));
+    v = 1;
+    assert(io_poll_write(&ps, 0, (char*)&v, sizeof(v)) == sizeof(v));
+    v = 2;
+    io_span t = io_poll_write_lock(&ps, 2, sizeof(v));
+    memcpy(t.buf, &v, sizeof(v));
+    io_poll_write_commit(&ps, 2, t);
+    assert(atomic_load(&ps.ready) == 5);
+    assert(io_buffer_read_avail(&ps.io) == 3 * sizeof(v));
+
+    /* ready rings are served round robin */
+    assert(read_one(&ps) == 0);
+    assert(read_one(&ps) == 2);
+    assert(read_one(&ps) == 1);
+    assert(read_one(&ps) == SIZE_MAX);
+    assert(atomic_load(&ps.ready) == 0);
+    assert(io_buffer_write(&ps.io, (char*)&v, sizeof(v)) == 0);
+
+    /* a wait with everything empty times out, and returns when ready */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+#if HAS_FUTEX
+    assert(io_poll_wait(&ps, &deadline) == -1);
+#endif
+    io_poll_write(&ps, 1, (char*)&v, sizeof(v));
+    assert(io_poll_wait(&ps, &deadline) == 0);
+    assert(read_one(&ps) == 2);
+
+    for (size_t i = 0; i < 3; i++) pbs_buffer_destroy(&pb[i]);
+}
+
+static void io_write_rec(run_state *s, size_t id, rec *r)
+{
+    for (;;) {
+        size_t w = s->ps ? io_poll_write(s->ps, (uint)id, (char*)r, RECSIZE)
+            : io_buffer_write(s->io, (char*)r, RECSIZE);
+        if (w) break;
+        thrd_yield();
+    }
+}
+
+static int io_produce_thread(void *arg)
+{
+    thread_arg *a = (thread_arg*)arg;
+    run_state *s = a->s;
+    rec r;
+
+    memset(&r, 0, sizeof(r));
+    r.producer = a->id;
+    for (size_t i = 0; i < s->count; i++) {
+        r.seq = i;
+        io_write_rec(s, a->id, &r);
+    }
+    return 0;
+}
+
+static void io_consume(run_state *s)
+{
+    size_t seq[MAX_THREADS] = { 0 };
+    size_t total = s->nthreads * s->count;
+
+    for (size_t n = 0; n < total;) {
+        io_span t = io_buffer_read_lock(s->io, RECSIZE);
+        if (t.length == 0) {
+            if (s->ps) io_poll_wait(s->ps, NULL);
+            else thrd_yield();
+            continue;
+        }
+        assert(t.length == RECSIZE);
+        rec *r = (rec*)t.buf;
+        assert(r->producer < s->nthreads && r->seq == seq[r->producer]);
+        seq[r->producer]++;
+        io_buffer_read_commit(s->io, t);
+        n++;
+    }
+}
+
+static void io_run(const char *name, io_buffer *io, io_poll *ps,
+    size_t nthreads)
+{
+    run_state s = { io, ps, nthreads, COUNT / RECSIZE / nthreads };
+    thread_arg args[MAX_THREADS];
+    thrd_t tid[MAX_THREADS];
+    struct timespec t0, t1;
+    double ns;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < nthreads; i++) {
+        args[i].s = &s;
+        args[i].id = i;
+        assert(thrd_create(&tid[i], io_produce_thread, &args[i]) == 0);
+    }
+    io_consume(&s);
+    for (size_t i = 0; i < nthreads; i++) {
+        assert(thrd_join(tid[i], &res) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    printf("%10s %10zu %10.2fns %10.2f\n", name, nthreads,
+        ns / (s.count * nthreads),
+        (double)(s.count * nthreads * RECSIZE) / (ns / 1e9) / (1024*1024));
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t threads[] = { 1, 8, 16, 32 };
+    pbs_buffer pbs[MAX_THREADS];
+    pbm_buffer pbm;
+    io_poll ps;
+
+    printf("\n# %s: %d byte(s) %d byte record(s)\n", "test_019_io_poll",
+        COUNT, RECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_poll();
+
+    printf("\n%10s %10s %12s %10s\n", "buffer", "producers", "time/rec",
+        "MB/sec");
+    printf("%10s %10s %12s %10s\n", "----------", "----------",
+        "------------", "----------");
+
+    for (size_t i = 0; i < 4; i++) {
+        /* pbm writers spin in commit for earlier writers, which can take
+         * whole time slices once producers outnumber the processors */
+        if (threads[i] == 1 || threads[i] < get_cpu_count()) {
+            pbm_buffer_init(&pbm, BUFSIZE);
+            io_run("pbm", &pbm.io, NULL, threads[i]);
+            pbm_buffer_destroy(&pbm);
+        } else {
+            printf("%10s %10zu %12s %10s\n", "pbm", threads[i], "skipped",
+                "-");
+        }
+
+        io_poll_init(&ps);
+        for (size_t j = 0; j < threads[i]; j++) {
+            pbs_buffer_init(&pbs[j], BUFSIZE);
+            io_poll_add(&ps, &pbs[j]);
+        }
+        io_run("poll", &ps.io, &ps, threads[i]);
+        for (size_t j = 0; j < threads[i]; j++) pbs_buffer_destroy(&pbs[j]);
+    }
+
+    printf("\n");
+}
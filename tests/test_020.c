@@ -0,0 +1,286 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_shard.h"
+#include "common.h"
+
+#define COUNT (1 << 24)
+#define RECSIZE 64
+#define BUFSIZE 32768
+#define NKEYS 1024
+#define WORK 16
+#define MAX_THREADS 16
+
+typedef struct rec rec;
+struct rec
+{
+    size_t key;
+    size_t seq;
+    char payload[RECSIZE - 2 * sizeof(size_t)];
+};
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    io_shard *sh;
+    size_t nthreads;
+    size_t count;
+    int ordered;
+};
+
+typedef struct thread_arg thread_arg;
+struct thread_arg
+{
+    run_state *s;
+    size_t id;
+    size_t nrecs;
+    ullong sum;
+};
+
+static size_t key_ring(io_shard *sh, size_t key)
+{
+    return io_shard_hash(key) % sh->nrings;
+}
+
+static void test_shard()
+{
+    io_shard sh;
+    rec r = { 0 };
+    size_t k0, k1;
+
+    /* round robin takes rings in turn and passes over full rings */
+    io_shard_init(&sh, 3, 64, IO_SHARD_ROUND_ROBIN);
+    for (size_t i = 0; i < 4; i++) {
+        assert(io_shard_write(&sh, 0, (char*)&r, 16) == 16);
+    }
+    assert(pbs_buffer_read_avail(&sh.rings[0]) == 32);
+    assert(pbs_buffer_read_avail(&sh.rings[1]) == 16);
+    assert(pbs_buffer_read_avail(&sh.rings[2]) == 16);
+    assert(io_buffer_write(io_shard_ring(&sh, 1), (char*)&r, 48) == 48);
+    assert(io_shard_write(&sh, 0, (char*)&r, 16) == 16);
+    assert(io_shard_write(&sh, 0, (char*)&r, 16) == 16);
+    assert(pbs_buffer_read_avail(&sh.rings[1]) == 64);
+    assert(pbs_buffer_read_avail(&sh.rings[2]) == 32);
+    assert(pbs_buffer_read_avail(&sh.rings[0]) == 48);
+
+    /* records are not split across rings */
+    assert(io_shard_write(&sh, 0, (char*)&r, 48) == 0);
+    assert(io_shard_write_lock(&sh, 0, 64).length == 0);
+    assert(io_shard_write_lock(&sh, 0, 24).length == 0);
+    assert(io_shard_write_lock(&sh, 0, 128).length == 0);
+    assert(io_shard_write_avail(&sh) == 32);
+    assert(io_buffer_read_avail(&sh.io) == 144);
+    io_shard_destroy(&sh);
+
+    /* join shortest queue picks the emptiest ring */
+    io_shard_init(&sh, 3, 64, IO_SHARD_SHORTEST);
+    assert(io_buffer_write(io_shard_ring(&sh, 0), (char*)&r, 32) == 32);
+    assert(io_buffer_write(io_shard_ring(&sh, 2), (char*)&r, 16) == 16);
+    io_span t = io_shard_write_lock(&sh, 0, 32);
+    assert(t.length == 32);
+    io_shard_write_commit(&sh, t);
+    assert(pbs_buffer_read_avail(&sh.rings[1]) == 32);
+    assert(io_shard_write(&sh, 0, (char*)&r, 16) == 16);
+    assert(pbs_buffer_read_avail(&sh.rings[2]) == 32);
+    io_shard_destroy(&sh);
+
+    /* reservations pass over rings whose free space crosses the wrap */
+    io_shard_init(&sh, 2, 64, IO_SHARD_ROUND_ROBIN);
+    assert(io_buffer_write(io_shard_ring(&sh, 0), (char*)&r, 48) == 48);
+    assert(io_buffer_read(io_shard_ring(&sh, 0), (char*)&r, 48) == 48);
+    assert(pbs_buffer_write_avail(&sh.rings[0]) == 64);
+    t = io_shard_write_lock(&sh, 0, 32);
+    assert(t.length == 32);
+    io_shard_write_commit(&sh, t);
+    assert(pbs_buffer_read_avail(&sh.rings[1]) == 32);
+    t = io_shard_write_lock(&sh, 0, 16);
+    assert(t.length == 16);
+    io_shard_write_commit(&sh, t);
+    assert(pbs_buffer_read_avail(&sh.rings[0]) == 16);
+
+    /* copied records may cross the wrap */
+    assert(io_shard_write(&sh, 0, (char*)&r, 48) == 48);
+    assert(pbs_buffer_read_avail(&sh.rings[0]) == 64);
+    io_shard_destroy(&sh);
+
+    /* records of one size reserved in place never stall at the wrap */
+    io_shard_init(&sh, 1, 64, IO_SHARD_ROUND_ROBIN);
+    for (size_t i = 0; i < 64; i++) {
+        t = io_shard_write_lock(&sh, 0, 16);
+        assert(t.length == 16);
+        io_shard_write_commit(&sh, t);
+        assert(io_buffer_read(io_shard_ring(&sh, 0), (char*)&r, 16) == 16);
+    }
+    io_shard_destroy(&sh);
+
+    /* hashing sends a key to one ring, keyed on the record prefix */
+    io_shard_init(&sh, 4, 64, IO_SHARD_HASH);
+    for (k1 = 1; key_ring(&sh, k1) == key_ring(&sh, 0); k1++);
+    k0 = key_ring(&sh, 0);
+    r.key = 0;
+    assert(io_buffer_write(&sh.io, (char*)&r, 16) == 16);
+    assert(io_shard_write(&sh, 0, (char*)&r, 16) == 16);
+    r.key = k1;
+    assert(io_buffer_write(&sh.io, (char*)&r, 16) == 16);
+    assert(pbs_buffer_read_avail(&sh.rings[k0]) == 32);
+    assert(pbs_buffer_read_avail(&sh.rings[key_ring(&sh, k1)]) == 16);
+    assert(io_shard_write(&sh, 0, (char*)&r, 48) == 0);
+    assert(io_buffer_write_lock(&sh.io, 16).length == 0);
+    io_shard_destroy(&sh);
+}
+
+static ullong io_work(rec *r)
+{
+    ullong h = r->key;
+    for (size_t i = 0; i < WORK; i++) {
+        for (size_t j = 0; j < sizeof(r->payload); j += 8) {
+            h = (h ^ (uchar)r->payload[j]) * 0x100000001b3ull;
+        }
+    }
+    return h;
+}
+
+static int io_consume_thread(void *arg)
+{
+    thread_arg *a = (thread_arg*)arg;
+    run_state *s = a->s;
+    io_buffer *io = s->sh ? io_shard_ring(s->sh, a->id) : s->io;
+    size_t *seq = (size_t*)calloc(NKEYS, sizeof(size_t));
+
+    for (;;) {
+        io_span t = io_buffer_read_lock(io, RECSIZE);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        assert(t.length == RECSIZE);
+        rec *r = (rec*)t.buf;
+        if (r->key == SIZE_MAX) {
+            io_buffer_read_commit(io, t);
+            break;
+        }
+        if (s->ordered) {
+            assert(r->seq == seq[r->key]);
+            seq[r->key]++;
+        }
+        a->sum += io_work(r);
+        a->nrecs++;
+        io_buffer_read_commit(io, t);
+    }
+    free(seq);
+    return 0;
+}
+
+static void io_put(run_state *s, rec *r)
+{
+    for (;;) {
+        size_t w = s->sh ? io_shard_write(s->sh, r->key, (char*)r, RECSIZE)
+            : io_buffer_write(s->io, (char*)r, RECSIZE);
+        if (w) break;
+        thrd_yield();
+    }
+}
+
+static void io_produce(run_state *s)
+{
+    rec r;
+
+    memset(&r, 0, sizeof(r));
+    for (size_t i = 0; i < s->count; i++) {
+        r.key = i % NKEYS;
+        r.seq = i / NKEYS;
+        r.payload[0] = (char)i;
+        io_put(s, &r);
+    }
+    r.key = SIZE_MAX;
+    for (size_t i = 0; i < s->nthreads; i++) {
+        if (!s->sh) {
+            io_put(s, &r);
+            continue;
+        }
+        while (io_buffer_write(io_shard_ring(s->sh, i), (char*)&r,
+            RECSIZE) == 0) thrd_yield();
+    }
+}
+
+static void io_run(const char *name, io_buffer *io, io_shard *sh,
+    size_t nthreads, int ordered)
+{
+    run_state s = { io, sh, nthreads, COUNT / RECSIZE, ordered };
+    thread_arg args[MAX_THREADS];
+    thrd_t tid[MAX_THREADS];
+    struct timespec t0, t1;
+    size_t total = 0, most = 0;
+    double ns;
+    int res;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < nthreads; i++) {
+        memset(&args[i], 0, sizeof(args[i]));
+        args[i].s = &s;
+        args[i].id = i;
+        assert(thrd_create(&tid[i], io_consume_thread, &args[i]) == 0);
+    }
+    io_produce(&s);
+    for (size_t i = 0; i < nthreads; i++) {
+        assert(thrd_join(tid[i], &res) == 0);
+        total += args[i].nrecs;
+        if (args[i].nrecs > most) most = args[i].nrecs;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    assert(total == s.count);
+
+    printf("%10s %10zu %10.2fns %10.2f %10.2f\n", name, nthreads,
+        ns / s.count, (double)COUNT / (ns / 1e9) / (1024*1024),
+        most * (double)nthreads / total);
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t threads[] = { 4, 8, 16 };
+    pbm_buffer pbm;
+    io_shard sh;
+
+    printf("\n# %s: 1 write thread(s) %d byte(s) %d byte record(s)\n",
+        "test_020_io_shard", COUNT, RECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_shard();
+
+    printf("\n%10s %10s %12s %10s %10s\n", "buffer", "consumers",
+        "time/rec", "MB/sec", "max/mean");
+    printf("%10s %10s %12s %10s %10s\n", "----------", "----------",
+        "------------", "----------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        /* pbm readers spin in commit for earlier readers, which can take
+         * whole time slices once consumers outnumber the processors */
+        if (threads[i] < get_cpu_count()) {
+            pbm_buffer_init(&pbm, BUFSIZE);
+            io_run("pbm", &pbm.io, NULL, threads[i], 0);
+            pbm_buffer_destroy(&pbm);
+        } else {
+            printf("%10s %10zu %12s %10s %10s\n", "pbm", threads[i],
+                "skipped", "-", "-");
+        }
+
+        io_shard_init(&sh, threads[i], BUFSIZE, IO_SHARD_HASH);
+        io_run("hash", NULL, &sh, threads[i], 1);
+        io_shard_destroy(&sh);
+
+        io_shard_init(&sh, threads[i], BUFSIZE, IO_SHARD_ROUND_ROBIN);
+        io_run("rr", NULL, &sh, threads[i], 0);
+        io_shard_destroy(&sh);
+
+        io_shard_init(&sh, threads[i], BUFSIZE, IO_SHARD_SHORTEST);
+        io_run("shortest", NULL, &sh, threads[i], 0);
+        io_shard_destroy(&sh);
+    }
+
+    printf("\n");
+}
@@ -0,0 +1,168 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_timed.h"
+#include "buffer_shm.h"
+#include "common.h"
+
+#define NSAMPLE 200
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    llong delay;
+};
+
+static int cmp_ll(const void *a, const void *b)
+{
+    llong x = *(const llong*)a, y = *(const llong*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int io_late_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    struct timespec d = { 0, (long)s->delay };
+    char c = 'x';
+
+    thrd_sleep(&d, NULL);
+    assert(io_buffer_write(s->io, &c, 1) == 1);
+    return 0;
+}
+
+static void test_timed()
+{
+    pbs_buffer pb;
+    struct timespec deadline;
+    char buf[128] = { 0 };
+    run_state s = { &pb.io, 2000000 };
+    thrd_t tid;
+    io_span t;
+    int res;
+
+    pbs_buffer_init(&pb, 64);
+
+    /* empty and full buffers time out no earlier than the deadline */
+    io_deadline_after(&deadline, 1000000);
+    assert(io_buffer_read_timed(&pb.io, buf, 8, &deadline) == 0);
+    assert(io_deadline_left(&deadline) <= 0);
+    assert(io_buffer_read_lock_timed(&pb.io, 8, &deadline).length == 0);
+
+    io_deadline_after(&deadline, 1000000);
+    assert(io_buffer_write_timed(&pb.io, buf, 100, &deadline) == 64);
+    assert(io_deadline_left(&deadline) <= 0);
+    assert(io_buffer_write_lock_timed(&pb.io, 8, &deadline).length == 0);
+
+    /* operations that can proceed return at once, even without deadline */
+    t = io_buffer_read_lock_timed(&pb.io, 16, NULL);
+    assert(t.length == 16);
+    io_buffer_read_commit(&pb.io, t);
+    assert(io_buffer_read_timed(&pb.io, buf, 128, NULL) == 48);
+    t = io_buffer_write_lock_timed(&pb.io, 8, NULL);
+    assert(t.length == 8);
+    io_buffer_write_commit(&pb.io, t);
+    assert(io_buffer_read_timed(&pb.io, buf, 128, NULL) == 8);
+
+    /* a write before the deadline wakes the reader */
+    io_deadline_after(&deadline, 1000000000);
+    assert(thrd_create(&tid, io_late_write_thread, &s) == 0);
+    assert(io_buffer_read_timed(&pb.io, buf, 8, &deadline) == 1);
+    assert(io_deadline_left(&deadline) > 0);
+    assert(thrd_join(tid, &res) == 0);
+
+    pbs_buffer_destroy(&pb);
+}
+
+static void test_notify()
+{
+    pbs_buffer pb;
+    io_notify n;
+    struct timespec deadline;
+    char buf[128] = { 0 };
+    run_state s = { &n.io, 2000000 };
+    thrd_t tid;
+    int res;
+
+    pbs_buffer_init(&pb, 64);
+    assert(io_notify_init(&n, &pb.io) == 0);
+
+    /* an io_notify buffer sleeps on its eventfd until the deadline */
+    io_deadline_after(&deadline, 2000000);
+    assert(io_buffer_read_timed(&n.io, buf, 8, &deadline) == 0);
+    assert(io_deadline_left(&deadline) <= 0);
+    io_deadline_after(&deadline, 2000000);
+    assert(io_buffer_write_timed(&n.io, buf, 100, &deadline) == 64);
+    assert(io_deadline_left(&deadline) <= 0);
+    assert(io_buffer_read_timed(&n.io, buf, 128, NULL) == 64);
+
+    /* and the peer's commit wakes it */
+    io_deadline_after(&deadline, 1000000000);
+    assert(thrd_create(&tid, io_late_write_thread, &s) == 0);
+    assert(io_buffer_read_lock_timed(&n.io, 8, &deadline).length == 1);
+    assert(io_deadline_left(&deadline) > 0);
+    assert(thrd_join(tid, &res) == 0);
+
+    io_notify_destroy(&n);
+    pbs_buffer_destroy(&pb);
+}
+
+/* overshoot of reads from an empty buffer past their deadline in ns */
+static void io_overshoot(const char *name, io_buffer *io, pbp_buffer *pbp,
+    llong timeout)
+{
+    llong late[NSAMPLE], sum = 0;
+    struct timespec deadline;
+    char buf[8];
+
+    for (size_t i = 0; i < NSAMPLE; i++) {
+        io_deadline_after(&deadline, timeout);
+        if (io) assert(io_buffer_read_timed(io, buf, 8, &deadline) == 0);
+        else assert(pbp_buffer_read_timed(pbp, buf, 8, &deadline) == 0);
+        late[i] = -io_deadline_left(&deadline);
+        assert(late[i] >= 0);
+        sum += late[i];
+    }
+    qsort(late, NSAMPLE, sizeof(llong), cmp_ll);
+
+    printf("%10s %10.0fus %10.2fus %10.2fus %10.2fus %10.2fus\n", name,
+        timeout / 1e3, sum / (double)NSAMPLE / 1e3, late[NSAMPLE / 2] / 1e3,
+        late[NSAMPLE * 99 / 100] / 1e3, late[NSAMPLE - 1] / 1e3);
+}
+
+int main(int argc, const char **argv)
+{
+    static const llong timeouts[] = { 50000, 200000, 1000000 };
+    pbs_buffer pbs;
+    pbp_buffer pbp;
+    io_notify n;
+
+    printf("\n# %s: %d sample(s)\n", "test_021_io_timed", NSAMPLE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_timed();
+    test_notify();
+
+    printf("\n%10s %12s %12s %12s %12s %12s\n", "wait", "timeout",
+        "late mean", "late p50", "late p99", "late max");
+    printf("%10s %12s %12s %12s %12s %12s\n", "----------",
+        "------------", "------------", "------------", "------------",
+        "------------");
+
+    pbs_buffer_init(&pbs, 4096);
+    assert(pbp_buffer_create(&pbp, NULL, 4096) == 0);
+    assert(io_notify_init(&n, &pbs.io) == 0);
+    for (size_t i = 0; i < 3; i++) {
+        io_overshoot("poll", &pbs.io, NULL, timeouts[i]);
+        io_overshoot("eventfd", &n.io, NULL, timeouts[i]);
+        io_overshoot("futex", NULL, &pbp, timeouts[i]);
+    }
+    io_notify_destroy(&n);
+    pbp_buffer_destroy(&pbp);
+    pbs_buffer_destroy(&pbs);
+
+    printf("\n");
+}
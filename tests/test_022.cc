@@ -0,0 +1,243 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <new>
+#include <latch>
+#include <exception>
+
+#include "buffer_coro.h"
+#include "common.h"
+
+#define COUNT (1 << 24)
+#define RECSIZE 64
+#define NCOROS 2048
+
+/* count allocations to check that awaits which do not suspend are free */
+static std::atomic<size_t> nalloc;
+
+void *operator new(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    nalloc.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/* detached coroutine, started by io_spawn and freed when it returns */
+struct io_task
+{
+    struct promise_type
+    {
+        io_task get_return_object()
+        {
+            return io_task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+static void io_spawn(io_co_executor *ex, io_task t)
+{
+    ex->post(t.h);
+}
+
+static io_task fast_path(io_co_channel *ch, size_t *allocs, std::latch *done)
+{
+    char buf[8] = { 0 };
+    size_t n0 = nalloc.load();
+
+    for (size_t i = 0; i < 1000; i++) {
+        io_span t = co_await ch->write_lock(sizeof(buf));
+        assert(t.length == sizeof(buf));
+        memcpy(t.buf, buf, sizeof(buf));
+        ch->write_commit(t);
+        t = co_await ch->read_lock(sizeof(buf));
+        assert(t.length == sizeof(buf));
+        ch->read_commit(t);
+    }
+    *allocs = nalloc.load() - n0;
+    done->count_down();
+}
+
+static io_task read_one(io_co_channel *ch, char *out, std::latch *done)
+{
+    io_span t = co_await ch->read_lock(1);
+    *out = t.buf[0];
+    ch->read_commit(t);
+    done->count_down();
+}
+
+static io_task write_bytes(io_co_channel *ch, size_t len, std::latch *done)
+{
+    while (len > 0) {
+        io_span t = co_await ch->write_lock(len);
+        memset(t.buf, 'x', t.length);
+        len -= t.length;
+        ch->write_commit(t);
+    }
+    done->count_down();
+}
+
+static void io_wait_queued(io_co_waitq *q)
+{
+    while (q->count.load() == 0) std::this_thread::yield();
+}
+
+static void test_coro()
+{
+    pbs_buffer pb;
+    size_t allocs = 0;
+    char c = 0;
+
+    pbs_buffer_init(&pb, 64);
+    {
+        io_co_pool pool(1);
+        io_co_channel ch(&pb.io);
+
+        /* awaits that do not suspend do not allocate */
+        std::latch d1(1);
+        io_spawn(&pool, fast_path(&ch, &allocs, &d1));
+        d1.wait();
+        assert(allocs == 0);
+        assert(ch.readers.waits == 0 && ch.writers.waits == 0);
+
+        /* a reader on an empty buffer is resumed by the writer's commit */
+        std::latch d2(2);
+        io_spawn(&pool, read_one(&ch, &c, &d2));
+        io_wait_queued(&ch.readers);
+        io_spawn(&pool, write_bytes(&ch, 1, &d2));
+        d2.wait();
+        assert(c == 'x');
+        assert(ch.readers.waits == 1);
+
+        /* a writer on a full buffer is resumed by the reader's commit */
+        std::latch d3(2);
+        io_spawn(&pool, write_bytes(&ch, 65, &d3));
+        io_wait_queued(&ch.writers);
+        assert(io_buffer_read_avail(&pb.io) == 64);
+        io_spawn(&pool, read_one(&ch, &c, &d3));
+        d3.wait();
+        assert(io_buffer_read_avail(&pb.io) == 64);
+        assert(ch.writers.waits >= 1);
+    }
+    pbs_buffer_destroy(&pb);
+}
+
+static io_task io_produce(io_co_channel *ch, size_t id, size_t nrecs,
+    std::latch *done)
+{
+    for (size_t i = 0; i < nrecs; i++) {
+        io_span t = co_await ch->write_lock(RECSIZE);
+        assert(t.length == RECSIZE);
+        memcpy(t.buf, &id, sizeof(id));
+        memcpy(t.buf + sizeof(id), &i, sizeof(i));
+        ch->write_commit(t);
+    }
+    done->count_down();
+}
+
+static io_task io_consume(io_co_channel *ch, size_t nrecs, int ordered,
+    std::latch *done)
+{
+    for (size_t i = 0; i < nrecs; i++) {
+        io_span t = co_await ch->read_lock(RECSIZE);
+        size_t seq;
+        assert(t.length == RECSIZE);
+        memcpy(&seq, t.buf + sizeof(size_t), sizeof(seq));
+        assert(!ordered || seq == i);
+        ch->read_commit(t);
+    }
+    done->count_down();
+}
+
+/*
+ * NCOROS coroutines share nchan channels, with an equal number of
+ * producers and consumers on each. pbs channels have one of each.
+ */
+static void io_run(const char *name, int mpmc, size_t nthreads,
+    size_t bufsize)
+{
+    size_t nchan = mpmc ? 16 : NCOROS / 2;
+    size_t per_side = NCOROS / 2 / nchan;
+    size_t nrecs = COUNT / RECSIZE / (NCOROS / 2);
+    std::vector<pbs_buffer> pbs(mpmc ? 0 : nchan);
+    std::vector<pbm_buffer> pbm(mpmc ? nchan : 0);
+    std::vector<io_co_channel*> ch(nchan);
+    std::latch done(NCOROS);
+    struct timespec t0, t1;
+    size_t waits = 0;
+    double ns;
+
+    for (size_t i = 0; i < nchan; i++) {
+        if (mpmc) pbm_buffer_init(&pbm[i], bufsize);
+        else pbs_buffer_init(&pbs[i], bufsize);
+        ch[i] = new io_co_channel(mpmc ? &pbm[i].io : &pbs[i].io);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    {
+        io_co_pool pool(nthreads);
+        for (size_t i = 0; i < nchan; i++) {
+            for (size_t j = 0; j < per_side; j++) {
+                io_spawn(&pool, io_consume(ch[i], nrecs, !mpmc, &done));
+                io_spawn(&pool, io_produce(ch[i], j, nrecs, &done));
+            }
+        }
+        done.wait();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    for (size_t i = 0; i < nchan; i++) {
+        assert(io_buffer_read_avail(ch[i]->io) == 0);
+        waits += ch[i]->readers.waits + ch[i]->writers.waits;
+        delete ch[i];
+        if (mpmc) pbm_buffer_destroy(&pbm[i]);
+        else pbs_buffer_destroy(&pbs[i]);
+    }
+
+    printf("%10s %10zu %10d %10zu %10.2fns %10.2f %10.3f\n", name, nthreads,
+        NCOROS, nchan, ns / (COUNT / RECSIZE),
+        (double)COUNT / (ns / 1e9) / (1024*1024),
+        waits / (double)(2 * (COUNT / RECSIZE)));
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t threads[] = { 1, 2, 4 };
+
+    printf("\n# %s: %d coroutine(s) %d byte(s) %d byte record(s)\n",
+        "test_022_io_coro", NCOROS, COUNT, RECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_coro();
+
+    printf("\n%10s %10s %10s %10s %12s %10s %10s\n", "buffer", "threads",
+        "coroutines", "channels", "time/rec", "MB/sec", "waits/op");
+    printf("%10s %10s %10s %10s %12s %10s %10s\n", "----------",
+        "----------", "----------", "----------", "------------",
+        "----------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        io_run("pbs", 0, threads[i], 4096);
+        /* pbm commits spin for earlier tickets, which can take whole time
+         * slices when the thread holding one is preempted */
+        if (threads[i] == 1 || threads[i] < get_cpu_count()) {
+            io_run("pbm", 1, threads[i], 4096);
+        } else {
+            printf("%10s %10zu %10d %10s %12s %10s %10s\n", "pbm",
+                threads[i], NCOROS, "-", "skipped", "-", "-");
+        }
+    }
+
+    printf("\n");
+}
@@ -0,0 +1,304 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_reactor.h"
+#include "common.h"
+
+#define COUNT (1 << 24)
+#define RECSIZE 64
+#define BUFSIZE 4096
+#define NRINGS 64
+#define NPROD 4
+#define IDLE_NS 200000000
+
+enum { MODE_SPIN, MODE_FUTEX, MODE_EPOLL };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    int mode;
+    io_reactor r;
+    pbs_buffer rings[NRINGS];
+    io_buffer *io[NRINGS];
+    size_t expect;
+    size_t total;
+    ullong sum;
+    atomic_uint stop;
+    llong cpu_ns;
+};
+
+typedef struct prod_arg prod_arg;
+struct prod_arg
+{
+    run_state *s;
+    size_t id;
+};
+
+static llong thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+typedef struct cb_state cb_state;
+struct cb_state
+{
+    io_reactor *r;
+    size_t bytes;
+    char last;
+    int stop;
+};
+
+static void cb_read(void *arg, io_span t)
+{
+    cb_state *c = (cb_state*)arg;
+    c->bytes += t.length;
+    c->last = t.buf[t.length - 1];
+    if (c->stop) io_reactor_stop(c->r);
+}
+
+static void cb_fill(void *arg, io_span t)
+{
+    cb_state *c = (cb_state*)arg;
+    memset(t.buf, 'w', t.length);
+    c->bytes += t.length;
+}
+
+static int io_late_write_thread(void *arg)
+{
+    io_buffer *io = (io_buffer*)arg;
+    struct timespec d = { 0, 5000000 };
+    char c = 'x';
+
+    thrd_sleep(&d, NULL);
+    assert(io_buffer_write(io, &c, 1) == 1);
+    return 0;
+}
+
+static int io_reactor_thread(void *arg)
+{
+    io_reactor_run((io_reactor*)arg);
+    return 0;
+}
+
+static void test_reactor(int backend)
+{
+    io_reactor r, w;
+    pbs_buffer pa, pb;
+    struct timespec deadline;
+    cb_state ca = { &r, 0, 0, 0 }, cb = { &r, 0, 0, 0 };
+    char buf[64] = { 0 };
+    thrd_t tid, wid;
+    int ia, ib, res;
+
+    assert(io_reactor_init(&r, backend) == 0);
+    assert(io_reactor_init(&w, backend) == 0);
+    pbs_buffer_init(&pa, 64);
+    pbs_buffer_init(&pb, 64);
+    ia = io_reactor_add(&r, &pa.io, IO_REACTOR_READ, 32, cb_read, &ca);
+    ib = io_reactor_add(&w, &pb.io, IO_REACTOR_WRITE, 16, cb_fill, &cb);
+    assert(ia == 0 && ib == 0);
+
+    /* readable sources are drained and writable sources are filled */
+    assert(io_buffer_write(io_reactor_io(&r, ia), buf, 48) == 48);
+    assert(io_reactor_poll(&r, NULL) == 48);
+    assert(ca.bytes == 48);
+    assert(io_buffer_read_avail(&pa.io) == 0);
+    assert(io_reactor_poll(&w, NULL) == 64);
+    assert(cb.bytes == 64);
+    assert(io_buffer_read(io_reactor_io(&w, ib), buf, 64) == 64);
+    assert(buf[0] == 'w' && buf[63] == 'w');
+
+    /* an idle reactor sleeps until the deadline */
+    io_deadline_after(&deadline, 2000000);
+    assert(io_reactor_poll(&r, &deadline) == 0);
+    assert(io_deadline_left(&deadline) <= 0);
+    assert(r.sleeps == 1);
+
+    /* a commit through the source interface wakes a sleeping reactor */
+    ca.stop = 1;
+    assert(thrd_create(&tid, io_reactor_thread, &r) == 0);
+    assert(thrd_create(&wid, io_late_write_thread, io_reactor_io(&r, ia)) == 0);
+    assert(thrd_join(wid, &res) == 0);
+    assert(thrd_join(tid, &res) == 0);
+    assert(ca.bytes == 49 && ca.last == 'x');
+
+    io_reactor_destroy(&r);
+    io_reactor_destroy(&w);
+    pbs_buffer_destroy(&pa);
+    pbs_buffer_destroy(&pb);
+}
+
+static void io_consume_rec(run_state *s, io_span t)
+{
+    for (size_t i = 0; i < t.length; i += RECSIZE) {
+        s->sum += (uchar)t.buf[i];
+    }
+    s->total += t.length;
+}
+
+static void cb_consume(void *arg, io_span t)
+{
+    run_state *s = (run_state*)arg;
+    io_consume_rec(s, t);
+    if (s->total == s->expect) io_reactor_stop(&s->r);
+}
+
+/* polls every ring, yielding when all are empty */
+static void io_spin(run_state *s)
+{
+    while (!atomic_load_explicit(&s->stop, memory_order_acquire) &&
+        s->total < s->expect) {
+        size_t n = 0;
+        for (size_t i = 0; i < NRINGS; i++) {
+            io_span t = io_buffer_read_lock(s->io[i], BUFSIZE);
+            if (t.length == 0) continue;
+            io_consume_rec(s, t);
+            io_buffer_read_commit(s->io[i], t);
+            n += t.length;
+        }
+        if (n == 0) thrd_yield();
+    }
+}
+
+static int io_consume_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    llong t0 = thread_cpu_ns();
+
+    if (s->mode == MODE_SPIN) io_spin(s);
+    else io_reactor_run(&s->r);
+    s->cpu_ns = thread_cpu_ns() - t0;
+    return 0;
+}
+
+static int io_produce_thread(void *arg)
+{
+    prod_arg *a = (prod_arg*)arg;
+    run_state *s = a->s;
+    size_t per = NRINGS / NPROD, nrecs = s->expect / RECSIZE / NPROD;
+    char rec[RECSIZE];
+
+    memset(rec, 0, sizeof(rec));
+    for (size_t i = 0; i < nrecs; i++) {
+        io_buffer *io = s->io[a->id * per + i % per];
+        rec[0] = (char)i;
+        while (io_buffer_write(io, rec, RECSIZE) == 0) thrd_yield();
+    }
+    return 0;
+}
+
+static void io_setup(run_state *s, int mode)
+{
+    memset(s, 0, sizeof(*s));
+    s->mode = mode;
+    if (mode != MODE_SPIN) {
+        assert(io_reactor_init(&s->r, mode == MODE_FUTEX ?
+            IO_REACTOR_FUTEX : IO_REACTOR_EPOLL) == 0);
+    }
+    for (size_t i = 0; i < NRINGS; i++) {
+        pbs_buffer_init(&s->rings[i], BUFSIZE);
+        if (mode == MODE_SPIN) {
+            s->io[i] = &s->rings[i].io;
+        } else {
+            int idx = io_reactor_add(&s->r, &s->rings[i].io,
+                IO_REACTOR_READ, BUFSIZE, cb_consume, s);
+            assert(idx >= 0);
+            s->io[i] = io_reactor_io(&s->r, idx);
+        }
+    }
+}
+
+static void io_teardown(run_state *s)
+{
+    if (s->mode != MODE_SPIN) io_reactor_destroy(&s->r);
+    for (size_t i = 0; i < NRINGS; i++) pbs_buffer_destroy(&s->rings[i]);
+}
+
+static void io_stop(run_state *s)
+{
+    if (s->mode == MODE_SPIN) {
+        atomic_store_explicit(&s->stop, 1, memory_order_release);
+    } else {
+        io_reactor_stop(&s->r);
+    }
+}
+
+static void io_run(const char *name, int mode)
+{
+    static run_state s;
+    prod_arg args[NPROD];
+    thrd_t cid, pid[NPROD];
+    struct timespec t0, t1, d = { 0, IDLE_NS };
+    llong busy_cpu, sleeps;
+    double ns;
+    int res;
+
+    /* busy: producers stream records into every ring */
+    io_setup(&s, mode);
+    s.expect = COUNT;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&cid, io_consume_thread, &s) == 0);
+    for (size_t i = 0; i < NPROD; i++) {
+        args[i].s = &s;
+        args[i].id = i;
+        assert(thrd_create(&pid[i], io_produce_thread, &args[i]) == 0);
+    }
+    for (size_t i = 0; i < NPROD; i++) assert(thrd_join(pid[i], &res) == 0);
+    assert(thrd_join(cid, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    assert(s.total == COUNT);
+    busy_cpu = s.cpu_ns;
+    sleeps = mode == MODE_SPIN ? 0 : (llong)s.r.sleeps;
+    io_teardown(&s);
+
+    /* idle: nothing is written until the consumer is stopped */
+    io_setup(&s, mode);
+    s.expect = SIZE_MAX;
+    assert(thrd_create(&cid, io_consume_thread, &s) == 0);
+    thrd_sleep(&d, NULL);
+    io_stop(&s);
+    assert(thrd_join(cid, &res) == 0);
+
+    printf("%10s %10.2fns %10.2f %9.1f%% %9.1f%% %10lld\n", name,
+        ns / (COUNT / RECSIZE), (double)COUNT / (ns / 1e9) / (1024*1024),
+        busy_cpu * 100.0 / ns, s.cpu_ns * 100.0 / IDLE_NS, sleeps);
+    io_teardown(&s);
+}
+
+int main(int argc, const char **argv)
+{
+    int has_futex = 0;
+    io_reactor r;
+
+    printf("\n# %s: %d ring(s) %d write thread(s) %d byte(s) "
+        "%d byte record(s)\n", "test_023_io_reactor", NRINGS, NPROD,
+        COUNT, RECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    if (io_reactor_init(&r, IO_REACTOR_FUTEX) == 0) {
+        io_reactor_destroy(&r);
+        has_futex = 1;
+        test_reactor(IO_REACTOR_FUTEX);
+    }
+    test_reactor(IO_REACTOR_EPOLL);
+
+    printf("\n%10s %12s %10s %10s %10s %10s\n", "wait", "time/rec",
+        "MB/sec", "busy cpu", "idle cpu", "sleeps");
+    printf("%10s %12s %10s %10s %10s %10s\n", "----------",
+        "------------", "----------", "----------", "----------",
+        "----------");
+
+    io_run("spin", MODE_SPIN);
+    if (has_futex) io_run("futex", MODE_FUTEX);
+    else printf("%10s %12s %10s %10s %10s %10s\n", "futex", "unsupported",
+        "-", "-", "-", "-");
+    io_run("epoll", MODE_EPOLL);
+
+    printf("\n");
+}
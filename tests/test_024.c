@@ -0,0 +1,286 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_batch.h"
+#include "common.h"
+
+#define COUNT (1 << 24)
+#define RECSIZE 64
+#define BUFSIZE 32768
+#define BATCH 16
+#define MAX_THREADS 8
+
+enum { MODE_TICKET, MODE_BATCH, MODE_CACHE };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    pbm_buffer *pb;
+    int mode;
+    size_t nwriters;
+    atomic_size_t read;
+};
+
+static pbm_offsets pbm_offsets_now(pbm_buffer *pb)
+{
+    return pbm_unpack_offsets(atomic_load(&pb->pof));
+}
+
+static void test_batch()
+{
+    pbm_buffer pb;
+    io_span t[3];
+    char buf[64] = { 0 };
+
+    pbm_buffer_init(&pb, 64);
+
+    /* tickets locked in a row retire together, including across the wrap */
+    assert(pbm_buffer_write(&pb, buf, 48) == 48);
+    assert(pbm_buffer_read(&pb, buf, 48) == 48);
+    t[0] = pbm_buffer_write_lock(&pb, 32);
+    t[1] = pbm_buffer_write_lock(&pb, 16);
+    t[2] = pbm_buffer_write_lock(&pb, 8);
+    assert(t[0].length == 16 && t[1].length == 16 && t[2].length == 8);
+    assert(t[1].sequence == 64 && t[1].buf == pb.data);
+    assert(pbm_buffer_write_commit_batch(&pb, t, 3) == 0);
+    assert(pbm_offsets_now(&pb).end == 88);
+    assert(pbm_buffer_read_avail(&pb) == 40);
+
+    t[0] = pbm_buffer_read_lock(&pb, 64);
+    t[1] = pbm_buffer_read_lock(&pb, 64);
+    assert(t[0].length == 16 && t[1].length == 24);
+    assert(pbm_buffer_read_commit_batch(&pb, t, 2) == 0);
+    assert(pbm_offsets_now(&pb).start == 88);
+
+    pbm_buffer_destroy(&pb);
+}
+
+static void test_cache()
+{
+    pbm_buffer pb;
+    pbm_cache wc, rc;
+    io_span t, u;
+    char buf[256];
+
+    pbm_buffer_init(&pb, 256);
+    pbm_cache_init(&wc, &pb, 64, 1);
+    pbm_cache_init(&rc, &pb, 64, 0);
+
+    /* spans come from one reservation which retires when fully committed */
+    for (size_t i = 0; i < 4; i++) {
+        t = pbm_cache_lock(&wc, 16);
+        assert(t.length == 16 && t.sequence == i * 16);
+        memset(t.buf, 'a' + (int)i, 16);
+        assert(pbm_buffer_read_avail(&pb) == 0);
+        pbm_cache_commit(&wc, t);
+    }
+    assert(pbm_buffer_read_avail(&pb) == 64);
+
+    /* flush hands back the tail when nothing was reserved after it */
+    t = pbm_cache_lock(&wc, 16);
+    memset(t.buf, 'e', 16);
+    pbm_cache_commit(&wc, t);
+    assert(pbm_offsets_now(&pb).end_mark == 128);
+    assert(pbm_cache_flush(&wc) == 0);
+    assert(pbm_offsets_now(&pb).end == 80);
+    assert(pbm_offsets_now(&pb).end_mark == 80);
+
+    /* and keeps the chunk when another reservation follows */
+    t = pbm_cache_lock(&wc, 16);
+    memset(t.buf, 'z', 16);
+    pbm_cache_commit(&wc, t);
+    u = pbm_buffer_write_lock(&pb, 8);
+    assert(u.sequence == 144);
+    assert(pbm_cache_flush(&wc) == 48);
+    assert(pbm_buffer_read_avail(&pb) == 80);
+    t = pbm_cache_lock(&wc, 64);
+    assert(t.length == 48 && t.sequence == 96);
+    memset(t.buf, 'y', 48);
+    pbm_cache_commit(&wc, t);
+    assert(pbm_buffer_read_avail(&pb) == 144);
+    memset(u.buf, 'u', 8);
+    pbm_buffer_write_commit(&pb, u);
+
+    /* or pads it with zeros when the writer opts in */
+    pbm_cache_set_pad(&wc, 1);
+    t = pbm_cache_lock(&wc, 16);
+    memset(t.buf, 'p', 16);
+    pbm_cache_commit(&wc, t);
+    u = pbm_buffer_write_lock(&pb, 8);
+    assert(u.sequence == 216);
+    assert(pbm_cache_flush(&wc) == 48);
+    memset(u.buf, 'v', 8);
+    pbm_buffer_write_commit(&pb, u);
+    assert(pbm_buffer_read_avail(&pb) == 224);
+
+    /* readers keep unread bytes until they are consumed */
+    t = pbm_cache_lock(&rc, 16);
+    assert(t.length == 16 && t.buf[0] == 'a');
+    pbm_cache_commit(&rc, t);
+    u = pbm_buffer_read_lock(&pb, 8);
+    assert(u.sequence == 64 && u.buf[0] == 'e');
+    assert(pbm_cache_flush(&rc) == 48);
+    t = pbm_cache_lock(&rc, 64);
+    assert(t.length == 48 && t.sequence == 16 && t.buf[0] == 'b');
+    pbm_cache_commit(&rc, t);
+    pbm_buffer_read_commit(&pb, u);
+
+    /* and hand back unread bytes when nothing was reserved after them */
+    t = pbm_cache_lock(&rc, 16);
+    assert(t.length == 16 && t.sequence == 72);
+    pbm_cache_commit(&rc, t);
+    assert(pbm_cache_flush(&rc) == 0);
+    assert(pbm_buffer_read(&pb, buf, 256) == 136);
+    assert(buf[0] == 'z' && buf[8] == 'y' && buf[55] == 'y');
+    assert(buf[56] == 'u' && buf[64] == 'p' && buf[80] == 0);
+    assert(buf[127] == 0 && buf[128] == 'v');
+
+    pbm_buffer_destroy(&pb);
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t nrecs = COUNT / RECSIZE / s->nwriters, i = 0;
+    io_span t[BATCH];
+    pbm_cache c;
+
+    pbm_cache_init(&c, s->pb, RECSIZE * BATCH, 1);
+    while (i < nrecs) {
+        size_t k = 0;
+        switch (s->mode) {
+        case MODE_TICKET:
+            t[0] = pbm_buffer_write_lock(s->pb, RECSIZE);
+            if ((k = t[0].length != 0)) {
+                t[0].buf[0] = (char)i;
+                pbm_buffer_write_commit(s->pb, t[0]);
+            }
+            break;
+        case MODE_BATCH:
+            while (k < BATCH && i + k < nrecs) {
+                t[k] = pbm_buffer_write_lock(s->pb, RECSIZE);
+                if (t[k].length == 0) break;
+                t[k].buf[0] = (char)(i + k);
+                k++;
+            }
+            pbm_buffer_write_commit_batch(s->pb, t, k);
+            break;
+        case MODE_CACHE:
+            t[0] = pbm_cache_lock(&c, RECSIZE);
+            if ((k = t[0].length != 0)) {
+                t[0].buf[0] = (char)i;
+                pbm_cache_commit(&c, t[0]);
+            }
+            break;
+        }
+        if (k == 0) thrd_yield();
+        i += k;
+    }
+    assert(pbm_cache_flush(&c) == 0);
+    return 0;
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    io_span t[BATCH];
+    pbm_cache c;
+
+    pbm_cache_init(&c, s->pb, RECSIZE * BATCH, 0);
+    while (atomic_load_explicit(&s->read, memory_order_relaxed) < COUNT) {
+        size_t k = 0, n = 0;
+        switch (s->mode) {
+        case MODE_TICKET:
+            t[0] = pbm_buffer_read_lock(s->pb, RECSIZE);
+            n = t[0].length;
+            pbm_buffer_read_commit(s->pb, t[0]);
+            break;
+        case MODE_BATCH:
+            while (k < BATCH) {
+                t[k] = pbm_buffer_read_lock(s->pb, RECSIZE);
+                if (t[k].length == 0) break;
+                n += t[k++].length;
+            }
+            pbm_buffer_read_commit_batch(s->pb, t, k);
+            break;
+        case MODE_CACHE:
+            t[0] = pbm_cache_lock(&c, RECSIZE);
+            n = t[0].length;
+            pbm_cache_commit(&c, t[0]);
+            break;
+        }
+        if (n == 0) thrd_yield();
+        else atomic_fetch_add_explicit(&s->read, n, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void io_run(const char *name, int mode, size_t nthreads)
+{
+    pbm_buffer pb;
+    run_state s;
+    thrd_t wt[MAX_THREADS], rt[MAX_THREADS];
+    struct timespec t0, t1;
+    double ns;
+    int res;
+
+    pbm_buffer_init(&pb, BUFSIZE);
+    s.pb = &pb;
+    s.mode = mode;
+    s.nwriters = nthreads;
+    s.read = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < nthreads; i++) {
+        assert(thrd_create(&rt[i], io_read_thread, &s) == 0);
+        assert(thrd_create(&wt[i], io_write_thread, &s) == 0);
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        assert(thrd_join(wt[i], &res) == 0);
+        assert(thrd_join(rt[i], &res) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    assert(s.read == COUNT);
+    assert(pbm_buffer_read_avail(&pb) == 0);
+
+    printf("%10s %10zu %10zu %10.2fns %10.2f\n", name, nthreads, nthreads,
+        ns / (COUNT / RECSIZE), (double)COUNT / (ns / 1e9) / (1024*1024));
+    pbm_buffer_destroy(&pb);
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t threads[] = { 1, 2, 4 };
+    static const char *names[] = { "ticket", "batch", "cache" };
+
+    printf("\n# %s: %d byte(s) %d byte record(s) batch %d\n",
+        "test_024_io_batch", COUNT, RECSIZE, BATCH);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_batch();
+    test_cache();
+
+    printf("\n%10s %10s %10s %12s %10s\n", "commit", "writers", "readers",
+        "time/rec", "MB/sec");
+    printf("%10s %10s %10s %12s %10s\n", "----------", "----------",
+        "----------", "------------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        for (int mode = MODE_TICKET; mode <= MODE_CACHE; mode++) {
+            /* pbm commits spin for earlier tickets, which can take whole
+             * time slices once threads outnumber the processors */
+            if (threads[i] * 2 <= get_cpu_count() || threads[i] == 1) {
+                io_run(names[mode], mode, threads[i]);
+            } else {
+                printf("%10s %10zu %10zu %12s %10s\n", names[mode],
+                    threads[i], threads[i], "skipped", "-");
+            }
+        }
+    }
+
+    printf("\n");
+}
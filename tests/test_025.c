@@ -0,0 +1,239 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer.h"
+#include "common.h"
+
+#define COUNT (1 << 26)
+#define RECSIZE 64
+#define BUFSIZE 4096
+#define BURST 48
+
+enum { MODE_LOCK, MODE_ALL };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    pbs_buffer *pbs;
+    pbm_buffer *pbm;
+    int mode;
+    size_t drains;
+    size_t commits;
+    ullong sum;
+};
+
+static void test_pbs()
+{
+    pbs_buffer pb;
+    io_span s[2];
+    char buf[64];
+
+    pbs_buffer_init(&pb, 64);
+    memset(buf, 'a', 48);
+    assert(pbs_buffer_write(&pb, buf, 48) == 48);
+    assert(pbs_buffer_read(&pb, buf, 40) == 40);
+
+    /* a fill crosses the wrap point with one reservation */
+    assert(pbs_buffer_write_lock_all(&pb, s, SIZE_MAX) == 56);
+    assert(s[0].buf == pb.data + 48 && s[0].length == 16);
+    assert(s[1].buf == pb.data && s[1].length == 40);
+    assert(s[0].sequence == 48 && s[1].sequence == 64);
+    memset(s[0].buf, 'b', s[0].length);
+    memset(s[1].buf, 'c', s[1].length);
+    assert(pbs_buffer_write_commit_all(&pb, s) == 0);
+    assert(pbs_buffer_write_avail(&pb) == 0);
+
+    /* and so does a drain, the wrapped segment is empty after the wrap */
+    assert(pbs_buffer_read_lock_all(&pb, s, 32) == 32);
+    assert(s[0].length == 24 && s[1].length == 8);
+    assert(s[0].buf[0] == 'a' && s[0].buf[8] == 'b' && s[1].buf[0] == 'c');
+    assert(pbs_buffer_read_commit_all(&pb, s) == 0);
+    assert(pbs_buffer_read_lock_all(&pb, s, SIZE_MAX) == 32);
+    assert(s[0].length == 32 && s[1].length == 0);
+    assert(pbs_buffer_read_commit_all(&pb, s) == 0);
+    assert(pbs_buffer_read_lock_all(&pb, s, SIZE_MAX) == 0);
+    assert(s[0].length == 0 && s[1].length == 0);
+
+    pbs_buffer_destroy(&pb);
+}
+
+static void test_pbm()
+{
+    pbm_buffer pb;
+    pbm_offsets pof;
+    io_span s[2], t;
+    char buf[64];
+
+    pbm_buffer_init(&pb, 64);
+    memset(buf, 'a', 48);
+    assert(pbm_buffer_write(&pb, buf, 48) == 48);
+    assert(pbm_buffer_read(&pb, buf, 40) == 40);
+
+    assert(pbm_buffer_write_lock_all(&pb, s, SIZE_MAX) == 56);
+    assert(s[0].length == 16 && s[1].length == 40 && s[1].buf == pb.data);
+    pof = pbm_unpack_offsets(atomic_load(&pb.pof));
+    assert(pof.end == 48 && pof.end_mark == 104);
+    memset(s[0].buf, 'b', s[0].length);
+    memset(s[1].buf, 'c', s[1].length);
+    assert(pbm_buffer_write_commit_all(&pb, s) == 0);
+    assert(pbm_buffer_read_avail(&pb) == 64);
+
+    /* a lock after the drain is ordered behind it */
+    assert(pbm_buffer_read_lock_all(&pb, s, 40) == 40);
+    assert(s[0].length == 24 && s[1].length == 16);
+    assert(s[0].buf[0] == 'a' && s[0].buf[8] == 'b' && s[1].buf[0] == 'c');
+    t = pbm_buffer_read_lock(&pb, 64);
+    assert(t.sequence == 80 && t.length == 24);
+    assert(pbm_buffer_read_commit_all(&pb, s) == 0);
+    assert(pbm_buffer_read_commit(&pb, t) == 0);
+    pof = pbm_unpack_offsets(atomic_load(&pb.pof));
+    assert(pof.start == 104 && pof.start_mark == 104);
+
+    pbm_buffer_destroy(&pb);
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t nrecs = COUNT / RECSIZE;
+
+    for (size_t i = 0; i < nrecs;) {
+        io_span t = io_buffer_write_lock(s->io, RECSIZE);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        assert(t.length == RECSIZE);
+        t.buf[0] = (char)i++;
+        io_buffer_write_commit(s->io, t);
+        /* bursts of 3/4 of the ring often leave the reader to drain
+         * across the wrap point */
+        if (i % BURST == 0) thrd_yield();
+    }
+    return 0;
+}
+
+static size_t io_sum(run_state *s, io_span t)
+{
+    for (size_t i = 0; i < t.length; i += RECSIZE) {
+        s->sum += (uchar)t.buf[i];
+    }
+    return t.length;
+}
+
+/* drains everything readable with lock and commit pairs */
+static size_t io_drain_lock(run_state *s)
+{
+    size_t n = 0;
+    io_span t;
+
+    while ((t = io_buffer_read_lock(s->io, SIZE_MAX)).length != 0) {
+        n += io_sum(s, t);
+        io_buffer_read_commit(s->io, t);
+        s->commits++;
+    }
+    return n;
+}
+
+/* drains everything readable with one reservation */
+static size_t io_drain_all(run_state *s)
+{
+    io_span span[2];
+    size_t n;
+
+    n = s->pbs ? pbs_buffer_read_lock_all(s->pbs, span, SIZE_MAX) :
+        pbm_buffer_read_lock_all(s->pbm, span, SIZE_MAX);
+    if (n == 0) return 0;
+    io_sum(s, span[0]);
+    io_sum(s, span[1]);
+    if (s->pbs) pbs_buffer_read_commit_all(s->pbs, span);
+    else pbm_buffer_read_commit_all(s->pbm, span);
+    s->commits++;
+    return n;
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t total = 0;
+
+    while (total < COUNT) {
+        size_t n = s->mode == MODE_ALL ? io_drain_all(s) : io_drain_lock(s);
+        if (n == 0) {
+            thrd_yield();
+            continue;
+        }
+        total += n;
+        s->drains++;
+    }
+    return 0;
+}
+
+static void io_run(const char *name, int mpmc, int mode)
+{
+    pbs_buffer pbs;
+    pbm_buffer pbm;
+    run_state s;
+    thrd_t wt, rt;
+    struct timespec t0, t1;
+    ullong expect = 0;
+    double ns;
+    int res;
+
+    memset(&s, 0, sizeof(s));
+    s.mode = mode;
+    if (mpmc) {
+        pbm_buffer_init(&pbm, BUFSIZE);
+        s.pbm = &pbm;
+        s.io = &pbm.io;
+    } else {
+        pbs_buffer_init(&pbs, BUFSIZE);
+        s.pbs = &pbs;
+        s.io = &pbs.io;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&rt, io_read_thread, &s) == 0);
+    assert(thrd_create(&wt, io_write_thread, &s) == 0);
+    assert(thrd_join(wt, &res) == 0);
+    assert(thrd_join(rt, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    for (size_t i = 0; i < COUNT / RECSIZE; i++) expect += (uchar)i;
+    assert(s.sum == expect);
+    assert(io_buffer_read_avail(s.io) == 0);
+
+    printf("%10s %10s %10.2fns %10.2f %10.2f %10.3f\n", mpmc ? "pbm" : "pbs",
+        name, ns / (COUNT / RECSIZE), (double)COUNT / (ns / 1e9) / (1024*1024),
+        (double)COUNT / s.drains, (double)s.commits / s.drains);
+
+    if (mpmc) pbm_buffer_destroy(&pbm);
+    else pbs_buffer_destroy(&pbs);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: %d byte(s) %d byte record(s) buffer %d\n",
+        "test_025_io_drain", COUNT, RECSIZE, BUFSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_pbs();
+    test_pbm();
+
+    printf("\n%10s %10s %12s %10s %10s %10s\n", "buffer", "drain",
+        "time/rec", "MB/sec", "bytes/drn", "commit/drn");
+    printf("%10s %10s %12s %10s %10s %10s\n", "----------", "----------",
+        "------------", "----------", "----------", "----------");
+
+    for (int mpmc = 0; mpmc < 2; mpmc++) {
+        io_run("lock", mpmc, MODE_LOCK);
+        io_run("lock_all", mpmc, MODE_ALL);
+    }
+
+    printf("\n");
+}
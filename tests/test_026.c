@@ -0,0 +1,261 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer.h"
+#include "common.h"
+
+#define COUNT (1 << 26)
+#define BUFSIZE 4096
+#define WRSIZE 1004
+#define RDSIZE 1002
+#define VECSIZE 16
+
+enum { MODE_LOCK, MODE_ELEM };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_buffer *io;
+    pbs_buffer *pbs;
+    pbm_buffer *pbm;
+    int mode;
+    ullong sum;
+    size_t spans;
+    size_t fixups;
+};
+
+static int is_aligned(const void *p, size_t align)
+{
+    return ((uintptr_t)p & (align - 1)) == 0;
+}
+
+static void test_pbs()
+{
+    pbs_buffer pb;
+    io_span t;
+    char buf[64] = { 0 };
+
+    pbs_buffer_init(&pb, 64);
+    assert(is_aligned(pb.data, PB_DATA_ALIGN));
+
+    /* lengths are whole elements and the wrap falls between elements */
+    t = pbs_buffer_write_lock_elem(&pb, 40, 16);
+    assert(t.length == 32);
+    pbs_buffer_write_commit(&pb, t);
+    t = pbs_buffer_write_lock_elem(&pb, 64, 16);
+    assert(t.length == 32 && is_aligned(t.buf, 16));
+    pbs_buffer_write_commit(&pb, t);
+    t = pbs_buffer_read_lock_elem(&pb, 56, 16);
+    assert(t.length == 48);
+    pbs_buffer_read_commit(&pb, t);
+    t = pbs_buffer_write_lock_elem(&pb, 64, 16);
+    assert(t.length == 48 && t.buf == pb.data);
+    pbs_buffer_write_commit(&pb, t);
+
+    /* a reader sees whole elements only, a partial one is left behind */
+    assert(pbs_buffer_read(&pb, buf, 64) == 64);
+    assert(pbs_buffer_write(&pb, buf, 20) == 20);
+    t = pbs_buffer_read_lock_elem(&pb, 64, 8);
+    assert(t.length == 16 && t.sequence == 112);
+    pbs_buffer_read_commit(&pb, t);
+    t = pbs_buffer_read_lock_elem(&pb, 64, 8);
+    assert(t.length == 0);
+    assert(pbs_buffer_read_avail(&pb) == 4);
+
+    /* resized arrays are aligned too */
+    assert(pbs_buffer_resize(&pb, 128) == 0);
+    assert(is_aligned(pb.data, PB_DATA_ALIGN));
+
+    pbs_buffer_destroy(&pb);
+}
+
+static void test_pbm()
+{
+    pbm_buffer pb;
+    io_span t, u;
+
+    pbm_buffer_init(&pb, 64);
+    assert(is_aligned(pb.data, PB_DATA_ALIGN));
+
+    t = pbm_buffer_write_lock_elem(&pb, 24, 8);
+    u = pbm_buffer_write_lock_elem(&pb, 64, 8);
+    assert(t.length == 24 && u.length == 40 && u.sequence == 24);
+    assert(is_aligned(u.buf, 8));
+    pbm_buffer_write_commit(&pb, t);
+    pbm_buffer_write_commit(&pb, u);
+
+    t = pbm_buffer_read_lock_elem(&pb, 40, 32);
+    assert(t.length == 32 && is_aligned(t.buf, 32));
+    pbm_buffer_read_commit(&pb, t);
+    t = pbm_buffer_read_lock_elem(&pb, 64, 32);
+    assert(t.length == 32 && t.sequence == 32);
+    pbm_buffer_read_commit(&pb, t);
+
+    pbm_buffer_destroy(&pb);
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t left = COUNT;
+    uint v = 0;
+
+    while (left > 0) {
+        io_span t = s->pbs ?
+            pbs_buffer_write_lock_elem(s->pbs, left < WRSIZE ? left : WRSIZE,
+                sizeof(uint)) :
+            pbm_buffer_write_lock_elem(s->pbm, left < WRSIZE ? left : WRSIZE,
+                sizeof(uint));
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        for (size_t i = 0; i < t.length; i += sizeof(uint), v++) {
+            memcpy(t.buf + i, &v, sizeof(uint));
+        }
+        io_buffer_write_commit(s->io, t);
+        left -= t.length;
+    }
+    return 0;
+}
+
+/* sums vectors of four elements, loaded directly from aligned spans */
+static void io_sum_aligned(run_state *s, io_span t)
+{
+    const uint *p = (const uint*)t.buf;
+    ullong acc[4] = { 0, 0, 0, 0 };
+
+    assert(is_aligned(p, VECSIZE) && t.length % VECSIZE == 0);
+    for (size_t i = 0; i < t.length / sizeof(uint); i += 4) {
+        acc[0] += p[i + 0];
+        acc[1] += p[i + 1];
+        acc[2] += p[i + 2];
+        acc[3] += p[i + 3];
+    }
+    s->sum += acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+/* sums a byte stream, carrying an element split between spans */
+static void io_sum_unaligned(run_state *s, io_span t, char *carry,
+    size_t *ncarry)
+{
+    size_t i = 0;
+    uint v;
+    int fixup = *ncarry != 0 || !is_aligned(t.buf, VECSIZE);
+
+    if (*ncarry) {
+        while (*ncarry < sizeof(uint) && i < t.length) {
+            carry[(*ncarry)++] = t.buf[i++];
+        }
+        if (*ncarry < sizeof(uint)) goto out;
+        memcpy(&v, carry, sizeof(uint));
+        s->sum += v;
+        *ncarry = 0;
+    }
+    for (; i + sizeof(uint) <= t.length; i += sizeof(uint)) {
+        memcpy(&v, t.buf + i, sizeof(uint));
+        s->sum += v;
+    }
+    while (i < t.length) {
+        carry[(*ncarry)++] = t.buf[i++];
+        fixup = 1;
+    }
+out:
+    s->fixups += fixup;
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    size_t total = 0, ncarry = 0;
+    char carry[sizeof(uint)];
+
+    while (total < COUNT) {
+        io_span t;
+        if (s->mode == MODE_ELEM) {
+            t = s->pbs ? pbs_buffer_read_lock_elem(s->pbs, RDSIZE, VECSIZE) :
+                pbm_buffer_read_lock_elem(s->pbm, RDSIZE, VECSIZE);
+        } else {
+            t = io_buffer_read_lock(s->io, RDSIZE);
+        }
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        if (s->mode == MODE_ELEM) io_sum_aligned(s, t);
+        else io_sum_unaligned(s, t, carry, &ncarry);
+        io_buffer_read_commit(s->io, t);
+        total += t.length;
+        s->spans++;
+    }
+    assert(ncarry == 0);
+    return 0;
+}
+
+static void io_run(const char *name, int mpmc, int mode)
+{
+    pbs_buffer pbs;
+    pbm_buffer pbm;
+    run_state s;
+    thrd_t wt, rt;
+    struct timespec t0, t1;
+    ullong n = COUNT / sizeof(uint);
+    double ns;
+    int res;
+
+    memset(&s, 0, sizeof(s));
+    s.mode = mode;
+    if (mpmc) {
+        pbm_buffer_init(&pbm, BUFSIZE);
+        s.pbm = &pbm;
+        s.io = &pbm.io;
+    } else {
+        pbs_buffer_init(&pbs, BUFSIZE);
+        s.pbs = &pbs;
+        s.io = &pbs.io;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&rt, io_read_thread, &s) == 0);
+    assert(thrd_create(&wt, io_write_thread, &s) == 0);
+    assert(thrd_join(wt, &res) == 0);
+    assert(thrd_join(rt, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    assert(s.sum == n * (n - 1) / 2);
+    assert(io_buffer_read_avail(s.io) == 0);
+
+    printf("%10s %10s %10.2fns %10.2f %10zu %10.3f\n", mpmc ? "pbm" : "pbs",
+        name, ns / n, (double)COUNT / (ns / 1e9) / (1024*1024), s.spans,
+        (double)s.fixups / s.spans);
+
+    if (mpmc) pbm_buffer_destroy(&pbm);
+    else pbs_buffer_destroy(&pbs);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: %d byte(s) read %d byte(s) vector %d byte(s)\n",
+        "test_026_io_elem", COUNT, RDSIZE, VECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_pbs();
+    test_pbm();
+
+    printf("\n%10s %10s %12s %10s %10s %10s\n", "buffer", "lock",
+        "time/elem", "MB/sec", "spans", "fixup/span");
+    printf("%10s %10s %12s %10s %10s %10s\n", "----------", "----------",
+        "------------", "----------", "----------", "----------");
+
+    for (int mpmc = 0; mpmc < 2; mpmc++) {
+        io_run("lock", mpmc, MODE_LOCK);
+        io_run("lock_elem", mpmc, MODE_ELEM);
+    }
+
+    printf("\n");
+}
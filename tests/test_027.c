@@ -0,0 +1,201 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_stats.h"
+#include "common.h"
+
+#define COUNT (1 << 28)
+#define RECSIZE 64
+#define BUFSIZE 4096
+
+typedef struct run_state run_state;
+struct run_state
+{
+    pbs_buffer pb;
+    size_t read;
+};
+
+/* value of the line for metric and pipe in the text, or -1 */
+static double find_metric(const char *text, const char *metric,
+    const char *pipe)
+{
+    char key[256];
+    const char *p;
+
+    snprintf(key, sizeof(key), "\n%s{pipe=\"%s\"", metric, pipe);
+    if (!(p = strstr(text, key))) return -1;
+    p = strchr(p, '}');
+    return atof(p + 1);
+}
+
+static void test_stats()
+{
+    io_stats st;
+    pbs_buffer pa;
+    pbm_buffer pb;
+    io_span t, u;
+    char buf[256] = { 0 }, text[8192];
+    FILE *f;
+    size_t len;
+
+    pbs_buffer_init(&pa, 256);
+    pbm_buffer_init(&pb, 256);
+    assert(pbs_buffer_write(&pa, buf, 32) == 32);
+
+    io_stats_init(&st, 1000000, 0, NULL);
+    assert(io_stats_add_pbs(&st, "a", &pa) == 0);
+    assert(io_stats_add_pbm(&st, "b \"q\"", &pb) == 1);
+
+    /* totals count from registration, in flight bytes are reported */
+    assert(pbs_buffer_write(&pa, buf, 192) == 192);
+    assert(pbs_buffer_read(&pa, buf, 64) == 64);
+    assert(pbm_buffer_write(&pb, buf, 200) == 200);
+    t = pbm_buffer_read_lock(&pb, 50);
+    u = pbm_buffer_write_lock(&pb, 56);
+    io_stats_sample(&st);
+    assert(st.srcs[0].written == 192 && st.srcs[0].read == 64);
+    assert(io_stats_at(&st.srcs[0], 0)->used == 160);
+    assert(st.srcs[1].written == 0 && st.srcs[1].read == 0);
+    assert(io_stats_at(&st.srcs[1], 0)->read_inflight == 50);
+    assert(io_stats_at(&st.srcs[1], 0)->write_inflight == 56);
+    assert(io_stats_at(&st.srcs[1], 0)->full);
+
+    /* 16-bit pbm markers wrap between samples and give no totals */
+    pbm_buffer_read_commit(&pb, t);
+    pbm_buffer_write_commit(&pb, u);
+    assert(pbm_buffer_read(&pb, buf, 256) == 206);
+    for (size_t i = 0; i < 300; i++) {
+        assert(pbm_buffer_write(&pb, buf, 256) == 256);
+        assert(pbm_buffer_read(&pb, buf, 256) == 256);
+        io_stats_sample(&st);
+    }
+    assert(st.srcs[1].written == 0 && st.srcs[1].read == 0);
+    assert(st.srcs[1].count == IO_STATS_WINDOW);
+    assert(io_stats_value(&st.srcs[1], IO_STATS_FULL) == 0.0);
+    assert(io_stats_value(&st.srcs[1], IO_STATS_EMPTY) == 1.0);
+    assert(io_stats_value(&st.srcs[0], IO_STATS_USED_AVG) == 160.0);
+    assert(io_stats_value(&st.srcs[0], IO_STATS_EMPTY) == 0.0);
+
+    /* the exposition has one family per metric and escapes labels */
+    assert((f = tmpfile()) != NULL);
+    assert(io_stats_write(&st, f) == 0);
+    rewind(f);
+    len = fread(text + 1, 1, sizeof(text) - 2, f);
+    text[0] = '\n';
+    text[len + 1] = 0;
+    fclose(f);
+    assert(strstr(text, "# TYPE cpipe_used_bytes gauge\n"));
+    assert(strstr(text, "# TYPE cpipe_read_bytes_total counter\n"));
+    assert(find_metric(text, "cpipe_capacity_bytes", "a") == 256);
+    assert(find_metric(text, "cpipe_used_bytes", "a") == 160);
+    assert(find_metric(text, "cpipe_written_bytes_total", "a") == 192);
+    assert(find_metric(text, "cpipe_used_bytes", "b \\\"q\\\"") == 0);
+    assert(find_metric(text, "cpipe_read_bytes_total", "b \\\"q\\\"") == -1);
+    assert(find_metric(text, "cpipe_written_bytes_per_second",
+        "b \\\"q\\\"") == -1);
+    assert(find_metric(text, "cpipe_samples_total", "a") == 301);
+
+    /* exports replace the file whole */
+    st.path = "test_027.prom";
+    assert(io_stats_export(&st) == 0);
+    assert((f = fopen(st.path, "r")) != NULL);
+    assert(fread(text, 1, sizeof(text) - 1, f) == len);
+    fclose(f);
+    assert(remove(st.path) == 0);
+
+    pbs_buffer_destroy(&pa);
+    pbm_buffer_destroy(&pb);
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    char rec[RECSIZE] = { 0 };
+
+    for (size_t i = 0; i < COUNT / RECSIZE;) {
+        if (pbs_buffer_write(&s->pb, rec, RECSIZE) == RECSIZE) i++;
+        else thrd_yield();
+    }
+    return 0;
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+
+    while (s->read < COUNT) {
+        io_span t = pbs_buffer_read_lock(&s->pb, BUFSIZE);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        s->read += t.length;
+        pbs_buffer_read_commit(&s->pb, t);
+    }
+    return 0;
+}
+
+static void io_run(llong interval_ns)
+{
+    static run_state s;
+    io_stats st;
+    thrd_t wt, rt;
+    struct timespec t0, t1;
+    ullong samples = 0;
+    double ns;
+    int res;
+
+    pbs_buffer_init(&s.pb, BUFSIZE);
+    s.read = 0;
+    io_stats_init(&st, interval_ns, 0, NULL);
+    io_stats_add_pbs(&st, "bench", &s.pb);
+    if (interval_ns) assert(io_stats_start(&st) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(thrd_create(&rt, io_read_thread, &s) == 0);
+    assert(thrd_create(&wt, io_write_thread, &s) == 0);
+    assert(thrd_join(wt, &res) == 0);
+    assert(thrd_join(rt, &res) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    io_stats_stop(&st);
+    samples = st.srcs[0].nsamples;
+    io_stats_sample(&st);
+    assert(st.srcs[0].written == COUNT && st.srcs[0].read == COUNT);
+    io_stats_destroy(&st);
+
+    if (interval_ns) {
+        printf("%10lldus %10.2fns %10.2f %10llu\n", interval_ns / 1000,
+            ns / (COUNT / RECSIZE), (double)COUNT / (ns / 1e9) / (1024*1024),
+            samples);
+    } else {
+        printf("%12s %10.2fns %10.2f %10s\n", "off",
+            ns / (COUNT / RECSIZE), (double)COUNT / (ns / 1e9) / (1024*1024),
+            "-");
+    }
+    pbs_buffer_destroy(&s.pb);
+}
+
+int main(int argc, const char **argv)
+{
+    static const llong intervals[] = { 0, 10000000, 1000000, 100000 };
+
+    printf("\n# %s: %d byte(s) %d byte record(s)\n",
+        "test_027_io_stats", COUNT, RECSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_stats();
+
+    printf("\n%12s %12s %10s %10s\n", "interval", "time/rec", "MB/sec",
+        "samples");
+    printf("%12s %12s %10s %10s\n", "------------", "------------",
+        "----------", "----------");
+
+    for (size_t i = 0; i < 4; i++) io_run(intervals[i]);
+
+    printf("\n");
+}
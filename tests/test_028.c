@@ -0,0 +1,190 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_flight.h"
+#include "common.h"
+
+#define COUNT (1 << 27)
+#define RECSIZE 64
+#define BUFSIZE 65536
+
+enum { MODE_PBS, MODE_PBF, MODE_PBF_NOREAD };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    int mode;
+    pbs_buffer pbs;
+    pbf_buffer pbf;
+    pbf_reader rd;
+    atomic_int done;
+    llong write_ns;
+    size_t records;
+    size_t torn;
+    ullong lost;
+};
+
+static llong now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void test_flight()
+{
+    pbf_buffer pb;
+    pbf_reader rd, late;
+    io_span t;
+    char buf[128];
+
+    pbf_buffer_init(&pb, 64, 16);
+    pbf_reader_init(&rd, &pb);
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (char)i;
+
+    /* writes never return short and keep the most recent bytes */
+    assert(pbf_buffer_write(&pb, buf, 48) == 48);
+    assert(pbf_buffer_write(&pb, buf + 48, 64) == 64);
+    assert(pbf_reader_read_avail(&rd) == 64);
+
+    /* a lapped reader resumes at the oldest record with a sequence gap */
+    t = pbf_reader_read_lock(&rd, 128);
+    assert(t.sequence == 48 && t.length == 16 && t.buf[0] == 48);
+    assert(rd.lost == 48);
+    assert(pbf_reader_read_commit(&rd, t) == 0);
+
+    /* a span overwritten while held fails to commit */
+    t = pbf_reader_read_lock(&rd, 16);
+    assert(t.sequence == 64 && t.length == 16);
+    assert(pbf_buffer_write(&pb, buf, 32) == 32);
+    assert(pbf_reader_read_commit(&rd, t) == -1);
+    assert(rd.start == 80 && rd.lost == 64);
+
+    /* copies stop at the gap and readers joining later see the history */
+    assert(pbf_reader_read(&rd, buf, 128) == 64);
+    assert(buf[0] == 80 && buf[31] == 111 && buf[32] == 0);
+    pbf_reader_init(&late, &pb);
+    assert(late.start == 80);
+    pbf_reader_seek_end(&late);
+    assert(pbf_reader_read_avail(&late) == 0);
+
+    pbf_buffer_destroy(&pb);
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    llong t0 = now_ns();
+
+    for (ullong i = 0; i < COUNT / RECSIZE;) {
+        io_span t = s->mode == MODE_PBS ?
+            pbs_buffer_write_lock(&s->pbs, RECSIZE) :
+            pbf_buffer_write_lock(&s->pbf, RECSIZE);
+        if (t.length == 0) {
+            thrd_yield();
+            continue;
+        }
+        memcpy(t.buf, &i, sizeof(i));
+        if (s->mode == MODE_PBS) pbs_buffer_write_commit(&s->pbs, t);
+        else pbf_buffer_write_commit(&s->pbf, t);
+        i++;
+    }
+    s->write_ns = now_ns() - t0;
+    atomic_store_explicit(&s->done, 1, memory_order_release);
+    return 0;
+}
+
+/* records carry their index, which must match the span sequence */
+static int io_check(io_span t)
+{
+    for (size_t i = 0; i < t.length; i += RECSIZE) {
+        ullong idx;
+        memcpy(&idx, t.buf + i, sizeof(idx));
+        if (idx != (t.sequence + i) / RECSIZE) return 0;
+    }
+    return 1;
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    pbf_reader *rd = &s->rd;
+
+    for (;;) {
+        int done = atomic_load_explicit(&s->done, memory_order_acquire);
+        io_span t = s->mode == MODE_PBS ?
+            pbs_buffer_read_lock(&s->pbs, BUFSIZE) :
+            pbf_reader_read_lock(rd, BUFSIZE);
+        if (t.length == 0) {
+            if (done) break;
+            thrd_yield();
+            continue;
+        }
+        int ok = io_check(t);
+        if (s->mode == MODE_PBS) {
+            pbs_buffer_read_commit(&s->pbs, t);
+        } else if (pbf_reader_read_commit(rd, t) < 0) {
+            s->torn++;
+            continue;
+        }
+        assert(ok);
+        s->records += t.length / RECSIZE;
+    }
+    s->lost = rd->lost;
+    return 0;
+}
+
+static void io_run(const char *name, int mode)
+{
+    static run_state s;
+    thrd_t wt, rt;
+    double recs = COUNT / RECSIZE;
+    int res;
+
+    memset(&s, 0, sizeof(s));
+    s.mode = mode;
+    pbs_buffer_init(&s.pbs, BUFSIZE);
+    pbf_buffer_init(&s.pbf, BUFSIZE, RECSIZE);
+    pbf_reader_init(&s.rd, &s.pbf);
+
+    if (mode != MODE_PBF_NOREAD) {
+        assert(thrd_create(&rt, io_read_thread, &s) == 0);
+    }
+    assert(thrd_create(&wt, io_write_thread, &s) == 0);
+    assert(thrd_join(wt, &res) == 0);
+    if (mode != MODE_PBF_NOREAD) {
+        assert(thrd_join(rt, &res) == 0);
+        assert(mode != MODE_PBS || s.records == recs);
+        assert(s.records * RECSIZE + s.lost == COUNT);
+    }
+
+    printf("%10s %10.2fns %10.2f %9.1f%% %10zu\n", name, s.write_ns / recs,
+        (double)COUNT / (s.write_ns / 1e9) / (1024*1024),
+        s.records * 100.0 / recs, s.torn);
+
+    pbs_buffer_destroy(&s.pbs);
+    pbf_buffer_destroy(&s.pbf);
+}
+
+int main(int argc, const char **argv)
+{
+    printf("\n# %s: %d byte(s) %d byte record(s) buffer %d\n",
+        "test_028_io_flight", COUNT, RECSIZE, BUFSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_flight();
+
+    printf("\n%10s %12s %10s %10s %10s\n", "buffer", "write/rec",
+        "MB/sec", "read", "torn");
+    printf("%10s %12s %10s %10s %10s\n", "----------", "------------",
+        "----------", "----------", "----------");
+
+    io_run("pbs", MODE_PBS);
+    io_run("pbf", MODE_PBF);
+    io_run("pbf-alone", MODE_PBF_NOREAD);
+
+    printf("\n");
+}
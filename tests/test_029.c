@@ -0,0 +1,216 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_log.h"
+#include "common.h"
+
+#define NCALLS (1 << 12)
+#define NBURSTS 256
+#define RINGSIZE (1 << 18)
+#define MAX_THREADS 4
+
+enum { MODE_SNPRINTF, MODE_LOG };
+
+typedef struct run_state run_state;
+struct run_state
+{
+    io_log *lg;
+    io_log_writer w;
+    int mode;
+    llong ns;
+    atomic_int *go;
+};
+
+/* thread cpu time, so time the logger thread takes is not counted */
+static llong thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* read the log and return the number of lines, keeping the messages */
+static size_t read_lines(FILE *f, char lines[][320], size_t max)
+{
+    char buf[512];
+    size_t n = 0;
+
+    rewind(f);
+    while (fgets(buf, sizeof(buf), f)) {
+        char *msg = strstr(buf, "] ");
+        assert(msg);
+        if (n < max) {
+            snprintf(lines[n], sizeof(lines[n]), "%s", msg + 2);
+            lines[n][strcspn(lines[n], "\n")] = 0;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void test_log()
+{
+    static char lines[128][320];
+    char big[400];
+    io_log lg;
+    io_log_writer a, b, c;
+    FILE *f = tmpfile();
+    size_t n, ok = 0;
+    /* hidden from the compiler, which warns on a literal NULL for %s */
+    char *volatile nil = NULL;
+
+    assert(f);
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+
+    assert(io_log_init(&lg, f) == 0);
+    assert(io_log_attach(&lg, &a, 4096) == 0);
+    assert(io_log_attach(&lg, &b, 4096) == 1);
+    assert(io_log_attach(&lg, &c, 256) == 2);
+
+    /* arguments are captured raw and formatted later, in time order */
+    io_log(&a, "int %d uint %u hex %#x char %c", -5, 7u, 255, 'q');
+    io_log(&b, "long %ld ulong %lu llong %lld size %zu", -1l, 2ul, -3ll,
+        (size_t)4);
+    io_log(&a, "double %.3f %e %g 100%%", 3.14159, 1e10, 0.5);
+    io_log(&b, "str [%s] [%5s] [%-4s|] [%.2s] %s", "abc", "de", "f",
+        "ghij", nil);
+    io_log(&a, "%s", big);
+    io_log(&b, "no arguments");
+    assert(io_log_drain(&lg, 1) == 6);
+
+    n = read_lines(f, lines, 128);
+    assert(n == 6);
+    assert(strcmp(lines[0], "int -5 uint 7 hex 0xff char q") == 0);
+    assert(strcmp(lines[1], "long -1 ulong 2 llong -3 size 4") == 0);
+    assert(strcmp(lines[2], "double 3.142 1.000000e+10 0.5 100%") == 0);
+    assert(strcmp(lines[3], "str [abc] [   de] [f   |] [gh] (null)") == 0);
+    assert(strlen(lines[4]) == IO_LOG_MAX_STRING);
+    assert(strcmp(lines[5], "no arguments") == 0);
+
+    /* a full ring drops calls, and records pad past the end of the ring */
+    for (int i = 0; i < 16; i++) {
+        io_log(&c, "record %d", i);
+        ok += io_log_dropped(&c) == 0;
+    }
+    assert(io_log_dropped(&c) == 16 - ok && ok < 16);
+    assert(io_log_drain(&lg, 1) == ok);
+    for (int i = 0; i < 64; i++) {
+        io_log(&c, "wrapped %d %s", i, "abcdefghijklmno");
+        assert(io_log_drain(&lg, 1) == 1);
+    }
+    n = read_lines(f, lines, 128);
+    assert(n == 6 + ok + 64);
+    assert(strcmp(lines[6 + ok + 63], "wrapped 63 abcdefghijklmno") == 0);
+
+    io_log_destroy(&lg);
+    fclose(f);
+}
+
+static int io_log_producer(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    char buf[128];
+    llong t0;
+
+    while (!atomic_load_explicit(s->go, memory_order_acquire)) thrd_yield();
+
+    t0 = thread_cpu_ns();
+    for (ullong i = 0; i < NCALLS; i++) {
+        if (s->mode == MODE_LOG) {
+            io_log(&s->w, "order %llu side %c qty %d px %.2f", i, 'B', 100,
+                101.25);
+        } else {
+            snprintf(buf, sizeof(buf), "order %llu side %c qty %d px %.2f",
+                i, 'B', 100, 101.25);
+        }
+    }
+    s->ns += thread_cpu_ns() - t0;
+    return 0;
+}
+
+/* wait for the background thread to drain every ring */
+static void io_wait_drained(run_state *s, size_t nthreads)
+{
+    for (size_t i = 0; i < nthreads; i++) {
+        while (pbs_buffer_read_avail(&s[i].w.pb) != 0) {
+            struct timespec d = { 0, 1000000 };
+            thrd_sleep(&d, NULL);
+        }
+    }
+}
+
+static void io_run(const char *name, int mode, size_t nthreads)
+{
+    static run_state s[MAX_THREADS];
+    io_log lg;
+    thrd_t tid[MAX_THREADS];
+    atomic_int go;
+    FILE *f = tmpfile();
+    ullong dropped = 0;
+    llong ns = 0;
+    int res;
+
+    assert(f);
+    assert(io_log_init(&lg, f) == 0);
+    for (size_t i = 0; i < nthreads; i++) {
+        s[i].lg = &lg;
+        s[i].mode = mode;
+        s[i].ns = 0;
+        s[i].go = &go;
+        assert(io_log_attach(&lg, &s[i].w, RINGSIZE) >= 0);
+    }
+    assert(io_log_start(&lg) == 0);
+
+    /* bursts that fit in the rings, timing the calls only */
+    for (size_t b = 0; b < NBURSTS; b++) {
+        atomic_store(&go, 0);
+        for (size_t i = 0; i < nthreads; i++) {
+            assert(thrd_create(&tid[i], io_log_producer, &s[i]) == 0);
+        }
+        atomic_store_explicit(&go, 1, memory_order_release);
+        for (size_t i = 0; i < nthreads; i++) {
+            assert(thrd_join(tid[i], &res) == 0);
+        }
+        io_wait_drained(s, nthreads);
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        ns += s[i].ns;
+        dropped += io_log_dropped(&s[i].w);
+    }
+    io_log_destroy(&lg);
+    assert(mode != MODE_LOG ||
+        lg.records + dropped == (ullong)NCALLS * NBURSTS * nthreads);
+    fclose(f);
+
+    printf("%10s %10zu %10.2fns %10.2f %10llu\n", name, nthreads,
+        (double)ns / ((double)NCALLS * NBURSTS * nthreads),
+        (double)NCALLS * NBURSTS * nthreads / (ns / 1e3 / nthreads), dropped);
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t threads[] = { 1, 2, 4 };
+
+    printf("\n# %s: %d call(s) x %d burst(s) ring %d\n",
+        "test_029_io_log", NCALLS, NBURSTS, RINGSIZE);
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_log();
+
+    printf("\n%10s %10s %12s %10s %10s\n", "call", "threads", "cpu/call",
+        "Mcalls/sec", "dropped");
+    printf("%10s %10s %12s %10s %10s\n", "----------", "----------",
+        "------------", "----------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        io_run("snprintf", MODE_SNPRINTF, threads[i]);
+        io_run("io_log", MODE_LOG, threads[i]);
+    }
+
+    printf("\n");
+}
@@ -0,0 +1,292 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <threads.h>
+
+#include "buffer_lvc.h"
+#include "common.h"
+
+#define COUNT (1 << 22)
+#define BUFSIZE 32768
+#define READSIZE 4096
+#define MAX_KEYS 16384
+
+enum { MODE_QUEUE, MODE_LVC };
+
+typedef struct quote quote;
+struct quote
+{
+    ullong key;
+    ullong n;
+    llong t;
+    ullong check;
+};
+
+typedef struct run_state run_state;
+struct run_state
+{
+    int mode;
+    size_t nkeys;
+    pbm_buffer pb;
+    io_lvc ch;
+    io_lvc_reader rd;
+    atomic_uint done;
+    ullong last_written[MAX_KEYS];
+    ullong last_read[MAX_KEYS];
+    llong now;
+    size_t delivered;
+    double age_sum;
+    llong age_max;
+    double write_ns;
+};
+
+static llong mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (llong)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void cb_count(void *arg, size_t key, const void *value, uint seq)
+{
+    size_t *count = (size_t*)arg;
+    count[key] += *(const uint*)value;
+}
+
+static void test_lvc()
+{
+    io_lvc ch;
+    io_lvc_reader rd, rd2, all[IO_LVC_MAX_READERS];
+    size_t count[130] = { 0 };
+    uint v;
+
+    assert(io_lvc_init(&ch, 130, sizeof(uint)) == 0);
+    assert(ch.stride == 64 && ch.nwords == 3);
+
+    /* unwritten keys read as sequence zero */
+    assert(io_lvc_read(&ch, 7, &v) == 0);
+    v = 1;
+    io_lvc_write(&ch, 7, &v);
+    io_lvc_write(&ch, 129, &v);
+    v = 0;
+    assert(io_lvc_read(&ch, 7, &v) == 2 && v == 1);
+
+    /* a reader joining sees keys already written as changed */
+    assert(io_lvc_join(&ch, &rd) == 0);
+    assert(io_lvc_poll(&rd, cb_count, count) == 2);
+    assert(count[7] == 1 && count[129] == 1);
+    assert(io_lvc_poll(&rd, cb_count, count) == 0);
+
+    /* updates to one key between polls conflate to the last value */
+    for (v = 1; v <= 3; v++) io_lvc_write(&ch, 64, &v);
+    assert(ch.changed[rd.id][1] == 1);
+    assert(io_lvc_poll(&rd, cb_count, count) == 1);
+    assert(count[64] == 3);
+    assert(io_lvc_read(&ch, 64, &v) == 6 && v == 3);
+
+    /* every reader gets its own notification */
+    assert(io_lvc_join(&ch, &rd2) == 0);
+    assert(io_lvc_poll(&rd2, cb_count, count) == 3);
+    v = 10;
+    io_lvc_write(&ch, 0, &v);
+    assert(io_lvc_poll(&rd, cb_count, count) == 1);
+    assert(io_lvc_poll(&rd2, cb_count, count) == 1);
+    assert(count[0] == 20);
+
+    /* a bit set for a key already seen is skipped by sequence */
+    atomic_fetch_or(&ch.changed[rd.id][0], 1);
+    assert(io_lvc_poll(&rd, cb_count, count) == 0);
+
+    /* reader slots are reused after leaving */
+    io_lvc_leave(&rd2);
+    for (size_t i = 0; i < IO_LVC_MAX_READERS - 1; i++) {
+        assert(io_lvc_join(&ch, &all[i]) == 0);
+    }
+    assert(io_lvc_join(&ch, &rd2) == -1);
+    for (size_t i = 0; i < IO_LVC_MAX_READERS - 1; i++) io_lvc_leave(&all[i]);
+    io_lvc_leave(&rd);
+    assert(ch.active == 0);
+
+    io_lvc_destroy(&ch);
+}
+
+typedef struct torn_state torn_state;
+struct torn_state
+{
+    io_lvc ch;
+};
+
+static int io_torn_write_thread(void *arg)
+{
+    torn_state *s = (torn_state*)arg;
+    ullong v[16];
+
+    for (ullong i = 0; i < 200000; i++) {
+        for (size_t j = 0; j < 16; j++) v[j] = i;
+        io_lvc_write(&s->ch, i & 3, v);
+    }
+    return 0;
+}
+
+static void test_torn()
+{
+    static torn_state s;
+    thrd_t wt[2];
+    ullong v[16];
+    int res;
+
+    /* two writers of the same keys and a reader never see a torn value */
+    assert(io_lvc_init(&s.ch, 4, sizeof(v)) == 0);
+    assert(s.ch.stride == 192);
+    for (size_t i = 0; i < 2; i++) {
+        assert(thrd_create(&wt[i], io_torn_write_thread, &s) == 0);
+    }
+    for (size_t n = 0; n < 100000; n++) {
+        if (io_lvc_read(&s.ch, n & 3, v) == 0) continue;
+        for (size_t j = 1; j < 16; j++) assert(v[j] == v[0]);
+        assert((v[0] & 3) == (n & 3));
+    }
+    for (size_t i = 0; i < 2; i++) assert(thrd_join(wt[i], &res) == 0);
+    assert(io_lvc_read(&s.ch, 3, v) == 2 * 2 * 50000);
+    io_lvc_destroy(&s.ch);
+}
+
+static void io_consume(run_state *s, const quote *q)
+{
+    llong age = s->now - q->t;
+
+    assert(q->check == (q->key ^ q->n ^ (ullong)q->t));
+    assert(q->n > s->last_read[q->key]);
+    s->last_read[q->key] = q->n;
+    s->delivered++;
+    s->age_sum += (double)age;
+    if (age > s->age_max) s->age_max = age;
+}
+
+static void cb_consume(void *arg, size_t key, const void *value, uint seq)
+{
+    run_state *s = (run_state*)arg;
+    s->now = mono_ns();
+    io_consume(s, (const quote*)value);
+}
+
+static size_t io_drain(run_state *s)
+{
+    if (s->mode == MODE_LVC) {
+        return io_lvc_poll(&s->rd, cb_consume, s);
+    } else {
+        quote buf[READSIZE / sizeof(quote)];
+        size_t n = pbm_buffer_read(&s->pb, (char*)buf, sizeof(buf));
+        s->now = mono_ns();
+        for (size_t i = 0; i < n / sizeof(quote); i++) io_consume(s, &buf[i]);
+        return n;
+    }
+}
+
+static int io_read_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+
+    for (;;) {
+        int done = atomic_load_explicit(&s->done, memory_order_acquire);
+        size_t n = io_drain(s);
+        if (done && n == 0) break;
+        if (n == 0) thrd_yield();
+    }
+    return 0;
+}
+
+static int io_write_thread(void *arg)
+{
+    run_state *s = (run_state*)arg;
+    llong t0 = mono_ns();
+    quote q;
+
+    for (ullong i = 1; i <= COUNT; i++) {
+        /* a skewed key stream: half the updates go to one key in eight */
+        ullong h = i * 0x9e3779b97f4a7c15ull;
+        q.key = (h >> 40) % s->nkeys;
+        if ((h >> 20) & 1) q.key &= ~(ullong)7;
+        q.n = i;
+        q.t = mono_ns();
+        q.check = q.key ^ q.n ^ (ullong)q.t;
+        s->last_written[q.key] = i;
+        if (s->mode == MODE_LVC) {
+            io_lvc_write(&s->ch, q.key, &q);
+        } else {
+            while (pbm_buffer_write(&s->pb, (char*)&q, sizeof(q)) == 0) {
+                thrd_yield();
+            }
+        }
+    }
+    s->write_ns = (double)(mono_ns() - t0);
+    atomic_store_explicit(&s->done, 1, memory_order_release);
+    return 0;
+}
+
+static void io_run(const char *name, int mode, size_t nkeys)
+{
+    static run_state s;
+    thrd_t rt, wt;
+    int res;
+
+    memset(&s, 0, sizeof(s));
+    s.mode = mode;
+    s.nkeys = nkeys;
+    if (mode == MODE_LVC) {
+        assert(io_lvc_init(&s.ch, nkeys, sizeof(quote)) == 0);
+        assert(io_lvc_join(&s.ch, &s.rd) == 0);
+    } else {
+        pbm_buffer_init(&s.pb, BUFSIZE);
+    }
+
+    assert(thrd_create(&rt, io_read_thread, &s) == 0);
+    assert(thrd_create(&wt, io_write_thread, &s) == 0);
+    assert(thrd_join(wt, &res) == 0);
+    assert(thrd_join(rt, &res) == 0);
+
+    /* whatever was conflated, the reader ends with every latest value */
+    for (size_t k = 0; k < nkeys; k++) {
+        assert(s.last_read[k] == s.last_written[k]);
+    }
+    if (mode == MODE_QUEUE) assert(s.delivered == COUNT);
+
+    printf("%10s %10zu %10.2fns %10.2f %10zu %9.1f%% %10.2f %10.2f\n",
+        name, nkeys, s.write_ns / COUNT, COUNT / (s.write_ns / 1e3),
+        s.delivered, (1.0 - (double)s.delivered / COUNT) * 100.0,
+        s.age_sum / s.delivered / 1e3, s.age_max / 1e3);
+
+    if (mode == MODE_LVC) {
+        io_lvc_leave(&s.rd);
+        io_lvc_destroy(&s.ch);
+    } else {
+        pbm_buffer_destroy(&s.pb);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    static const size_t keys[] = { 16, 1024, MAX_KEYS };
+
+    printf("\n# %s: %d update(s) %zu byte value(s)\n",
+        "test_030_io_lvc", COUNT, sizeof(quote));
+    printf("# os: %s cpu: %s\n", get_os_name(), get_cpu_name());
+
+    test_lvc();
+    test_torn();
+
+    printf("\n%10s %10s %12s %10s %10s %10s %10s %10s\n", "channel", "keys",
+        "time/upd", "Mupd/sec", "delivered", "conflated", "age(us)",
+        "max(us)");
+    printf("%10s %10s %12s %10s %10s %10s %10s %10s\n", "----------",
+        "----------", "------------", "----------", "----------",
+        "----------", "----------", "----------");
+
+    for (size_t i = 0; i < 3; i++) {
+        io_run("queue", MODE_QUEUE, keys[i]);
+        io_run("lvc", MODE_LVC, keys[i]);
+    }
+
+    printf("\n");
+}